@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include "arena.h"
+
+/* starts an empty arena, no memory is taken until
+   the first allocation */
+void arena_init(struct arena *a){
+    a->head = NULL;
+    a->cur = NULL;
+    a->table_size = 0;
+    a->num_tables = 0;
+}
+
+/* returns "size" bytes from the arena, moving on to the next
+   kept block (or a new one) once the current one is full.
+   On error returns NULL */
+void *arena_alloc(struct arena *a, size_t size){
+    struct arena_block *block, *prev;
+    size_t block_size;
+    uintptr_t res;
+
+    size = (size + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1);
+
+    /* find a block with enough room, starting from the current
+       one. Blocks past the current one are left over from before
+       the last reset, so they are emptied as they are reached */
+    prev = NULL;
+    for(block = a->cur; block != NULL; block = block->next){
+        if(block != a->cur){
+            block->used = 0;
+        }
+        if(block->size - block->used >= size){
+            break;
+        }
+        prev = block;
+    }
+
+    if(block == NULL){
+        block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(struct arena_block) + ARENA_ALIGN + block_size);
+        if(block == NULL){
+            return NULL;
+        }
+        block->size = block_size;
+        block->used = 0;
+        block->next = NULL;
+        if(prev != NULL){
+            prev->next = block;
+        }else if(a->head == NULL){
+            a->head = block;
+        }
+    }
+    a->cur = block;
+
+    /* data starts after the header, aligned */
+    res = ((uintptr_t)(block + 1) + ARENA_ALIGN - 1) &
+          ~((uintptr_t)ARENA_ALIGN - 1);
+    res += block->used;
+    block->used += size;
+    return (void*)res;
+}
+
+/* releases everything allocated since the last reset in O(1),
+   only the first block is emptied now and the rest are emptied
+   as "arena_alloc" reaches them again */
+void arena_reset(struct arena *a){
+    a->cur = a->head;
+    if(a->head != NULL){
+        a->head->used = 0;
+    }
+}
+
+/* remembers where the arena is now */
+void arena_save(struct arena *a, struct arena_mark *mark){
+    mark->block = a->cur;
+    mark->used = a->cur != NULL ? a->cur->used : 0;
+}
+
+/* releases everything allocated since "mark" was saved,
+   which must not be older than the last reset */
+void arena_restore(struct arena *a, struct arena_mark *mark){
+    if(mark->block == NULL){
+        arena_reset(a);
+        return;
+    }
+    a->cur = mark->block;
+    a->cur->used = mark->used;
+}
+
+/* gives every block and pooled table back to the system */
+void arena_destroy(struct arena *a){
+    struct arena_block *block, *next;
+    int i;
+
+    for(block = a->head; block != NULL; block = next){
+        next = block->next;
+        free(block);
+    }
+    for(i = 0; i < a->num_tables; i++){
+        free(a->tables[i]);
+    }
+    arena_init(a);
+}
+
+/* returns a buffer for one indirect zone table, reusing a
+   pooled one of the same size when there is one. Without an
+   arena the table comes from the heap */
+void *arena_get_table(struct arena *a, size_t size){
+    if(a != NULL && a->num_tables > 0 && a->table_size == size){
+        return a->tables[--a->num_tables];
+    }
+    return malloc(size);
+}
+
+/* puts a table from "arena_get_table" back in the pool,
+   freeing it if the pool is full or holds another size */
+void arena_put_table(struct arena *a, void *table, size_t size){
+    if(table == NULL) return;
+    if(a != NULL && a->num_tables == 0){
+        a->table_size = size;
+    }
+    if(a != NULL && a->table_size == size &&
+       a->num_tables < ARENA_TABLES){
+        a->tables[a->num_tables++] = table;
+        return;
+    }
+    free(table);
+}
+
+/* allocates from the arena if one is given, otherwise from
+   the heap so callers without an arena free the result */
+void *op_alloc(struct arena *a, size_t size){
+    if(a == NULL){
+        return malloc(size);
+    }
+    return arena_alloc(a, size);
+}
+
+/* frees heap memory from "op_alloc", arena memory is
+   only released by resetting the arena */
+void op_free(struct arena *a, void *p){
+    if(a == NULL){
+        free(p);
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+#define ARENA_TABLES 4
+
+/* one chunk of arena memory, chunks are kept
+   in a list and reused after every reset */
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+};
+
+/* a saved position in an arena, so a recursive walk can
+   drop what one level allocated without a full reset */
+struct arena_mark {
+    struct arena_block *block;
+    size_t used;
+};
+
+/* bump allocator tied to one operation (a lookup, a listing,
+   one item of a batch). Everything allocated from it is
+   released at once by "arena_reset" in O(1), without giving
+   memory back, so the next operation reuses the same pages.
+   Indirect zone tables have their own small pool since
+   they are the same size every time */
+struct arena {
+    struct arena_block *head;
+    struct arena_block *cur;
+    void *tables[ARENA_TABLES];
+    size_t table_size;
+    int num_tables;
+};
+
+void arena_init(struct arena *);
+void *arena_alloc(struct arena *, size_t);
+void arena_reset(struct arena *);
+void arena_save(struct arena *, struct arena_mark *);
+void arena_restore(struct arena *, struct arena_mark *);
+void arena_destroy(struct arena *);
+void *arena_get_table(struct arena *, size_t);
+void arena_put_table(struct arena *, void *, size_t);
+void *op_alloc(struct arena *, size_t);
+void op_free(struct arena *, void *);
+
+#endif
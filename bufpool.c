@@ -0,0 +1,124 @@
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "bufpool.h"
+
+#define POOLERR "buffer pool error"
+#define POOL_PRINT "buffer pool: peak %zu bytes in use, %zu mapped, " \
+                   "%d on explicit huge pages\n"
+
+static struct bufpool pool;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* size every buffer is really mapped with */
+static size_t map_size(size_t size){
+    if(size <= BUFPOOL_SIZE){
+        return BUFPOOL_SIZE;
+    }
+    return (size + BUFPOOL_SIZE - 1) & ~((size_t)BUFPOOL_SIZE - 1);
+}
+
+/* maps "size" bytes, a multiple of BUFPOOL_SIZE, on explicit
+   huge pages if possible and otherwise on a huge page boundary
+   so transparent huge pages can back it, then faults every page
+   in. Returns NULL on error */
+static void *map_buffer(size_t size, int *huge){
+    uintptr_t start, aligned;
+    char *buf;
+    size_t i;
+
+    buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE,
+               -1, 0);
+    if(buf != MAP_FAILED){
+        *huge = 1;
+        return buf;
+    }
+    *huge = 0;
+
+    /* map an extra huge page worth then trim both
+       ends so what's left starts on a boundary */
+    buf = mmap(NULL, size + BUFPOOL_SIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(buf == MAP_FAILED){
+        return NULL;
+    }
+    start = (uintptr_t)buf;
+    aligned = (start + BUFPOOL_SIZE - 1) & ~((uintptr_t)BUFPOOL_SIZE - 1);
+    if(aligned > start){
+        munmap(buf, aligned - start);
+    }
+    munmap((void*)(aligned + size), BUFPOOL_SIZE - (aligned - start));
+    buf = (char*)aligned;
+
+    /* only a hint, the buffer works the same without it */
+    madvise(buf, size, MADV_HUGEPAGE);
+    for(i = 0; i < size; i += BUFPOOL_PAGE){
+        buf[i] = 0;
+    }
+    return buf;
+}
+
+/* returns a buffer of at least "size" bytes aligned to a page,
+   reusing a kept one when there is one. On error returns NULL */
+void *bufpool_get(size_t size){
+    size_t mapped = map_size(size);
+    void *buf = NULL;
+    int huge;
+
+    pthread_mutex_lock(&pool_lock);
+    if(mapped == BUFPOOL_SIZE && pool.num_free > 0){
+        buf = pool.free[--pool.num_free];
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    /* map outside the lock, faulting pages in takes a while */
+    if(buf == NULL){
+        buf = map_buffer(mapped, &huge);
+        if(buf == NULL){
+            perror(POOLERR);
+            return NULL;
+        }
+        pthread_mutex_lock(&pool_lock);
+        pool.mapped += mapped;
+        pool.huge_buffers += huge;
+        pthread_mutex_unlock(&pool_lock);
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    pool.in_use += mapped;
+    if(pool.in_use > pool.peak){
+        pool.peak = pool.in_use;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return buf;
+}
+
+/* gives back a buffer from "bufpool_get" of the same "size" */
+void bufpool_put(void *buf, size_t size){
+    size_t mapped = map_size(size);
+
+    if(buf == NULL) return;
+
+    pthread_mutex_lock(&pool_lock);
+    pool.in_use -= mapped;
+    if(mapped == BUFPOOL_SIZE && pool.num_free < BUFPOOL_KEEP){
+        pool.free[pool.num_free++] = buf;
+        buf = NULL;
+    }else{
+        pool.mapped -= mapped;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if(buf != NULL){
+        munmap(buf, mapped);
+    }
+}
+
+/* prints how much of the pool was ever in use at once */
+void bufpool_report(FILE *out){
+    pthread_mutex_lock(&pool_lock);
+    fprintf(out, POOL_PRINT, pool.peak, pool.mapped, pool.huge_buffers);
+    pthread_mutex_unlock(&pool_lock);
+}
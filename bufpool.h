@@ -0,0 +1,31 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BUFPOOL_SIZE (2 * 1024 * 1024)
+#define BUFPOOL_KEEP 16
+#define BUFPOOL_PAGE 4096
+
+/* large read buffers shared by the whole process. Buffers are
+   mapped straight from the kernel, backed by explicit huge
+   pages when some are reserved and otherwise aligned and
+   marked for transparent huge pages, then touched once so the
+   page faults all happen up front. Buffers of up to
+   BUFPOOL_SIZE bytes are kept for reuse once put back, bigger
+   ones are unmapped. Safe to use from many threads */
+struct bufpool {
+    void *free[BUFPOOL_KEEP];
+    int num_free;
+    size_t in_use;     /* bytes handed out right now */
+    size_t peak;       /* most bytes ever handed out at once */
+    size_t mapped;     /* bytes mapped right now */
+    int huge_buffers;  /* buffers ever mapped on explicit huge pages */
+};
+
+void *bufpool_get(size_t);
+void bufpool_put(void *, size_t);
+void bufpool_report(FILE *);
+
+#endif
@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "cimg.h"
+
+/* the compressed image open on each descriptor, if any.
+   Only changed under "cimgs_lock", a descriptor is never
+   read before the open that set it up has returned it */
+static struct cimg *cimgs[CIMG_MAX_FDS];
+static pthread_mutex_t cimgs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct cimg *cimg_get(int fd){
+    if(fd < 0 || fd >= CIMG_MAX_FDS){
+        return NULL;
+    }
+    return cimgs[fd];
+}
+
+static void cimg_free(struct cimg *c){
+    uint32_t i, j;
+
+    if(c->shards != NULL){
+        for(i = 0; i < CIMG_SHARDS; i++){
+            for(j = 0; j < CIMG_SHARD_SLOTS; j++){
+                free(c->shards[i].slots[j].data);
+            }
+            pthread_mutex_destroy(&c->shards[i].lock);
+        }
+    }
+    free(c->shards);
+    free(c->index);
+    free(c);
+}
+
+/* checks the header against the size of the file before
+   anything it gives a size for is allocated. Every sum is
+   kept from wrapping, they come from the file */
+static int cimg_check_header(struct cimg_header *h, off_t file_size){
+    uint64_t index_size;
+
+    if(h->version != CIMG_VERSION || h->chunk_size < CIMG_MIN_CHUNK ||
+       h->chunk_size > CIMG_MAX_CHUNK){
+        return EXIT_FAILURE;
+    }
+    /* the last chunk holds between 1 and "chunk_size" bytes */
+    if(h->num_chunks == 0){
+        if(h->image_size != 0){
+            return EXIT_FAILURE;
+        }
+    }else if(h->image_size >
+             (uint64_t)h->num_chunks * h->chunk_size ||
+             h->image_size <=
+             (uint64_t)(h->num_chunks - 1) * h->chunk_size){
+        return EXIT_FAILURE;
+    }
+    index_size = (uint64_t)h->num_chunks * sizeof(struct cimg_chunk);
+    if(h->index_offset > (uint64_t)file_size ||
+       index_size > (uint64_t)file_size - h->index_offset){
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* checks every index entry against the size of the file,
+   so a read never has to. A stored chunk holds exactly the
+   bytes of the image it covers */
+static int cimg_check_index(struct cimg *c, off_t file_size){
+    struct cimg_header *h = &c->header;
+    struct cimg_chunk *entry;
+    uint64_t expect;
+    uint32_t i;
+
+    for(i = 0; i < h->num_chunks; i++){
+        entry = &c->index[i];
+        expect = h->image_size - (uint64_t)i * h->chunk_size;
+        if(expect > h->chunk_size){
+            expect = h->chunk_size;
+        }
+        if(entry->kind > CIMG_ZLIB ||
+           entry->offset > (uint64_t)file_size ||
+           entry->len > (uint64_t)file_size - entry->offset ||
+           entry->len > compressBound(h->chunk_size) ||
+           (entry->kind == CIMG_RAW && entry->len != expect)){
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/* opens the image at "path" read only. A compressed image is
+   set up so that "cimg_pread" on the descriptor reads it as if
+   it were the raw image, anything else is left as it is.
+   Returns the descriptor or -1 */
+int cimg_open(char *path){
+    struct cimg *c;
+    struct stat st;
+    size_t index_size;
+    uint32_t i;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0){
+        return -1;
+    }
+    c = calloc(1, sizeof(struct cimg));
+    if(c == NULL){
+        close(fd);
+        return -1;
+    }
+
+    /* anything without the magic number is a raw image */
+    if(pread(fd, &c->header, sizeof(struct cimg_header), 0) !=
+       sizeof(struct cimg_header) ||
+       memcmp(c->header.magic, CIMG_MAGIC, CIMG_MAGIC_SIZE) != 0){
+        free(c);
+        return fd;
+    }
+    if(fd >= CIMG_MAX_FDS || fstat(fd, &st) < 0){
+        free(c);
+        close(fd);
+        return -1;
+    }
+
+    if(cimg_check_header(&c->header, st.st_size) == EXIT_FAILURE){
+        fprintf(stderr, "%s\n", CIMG_CORRUPT);
+        free(c);
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    index_size = sizeof(struct cimg_chunk) * (size_t)c->header.num_chunks;
+    c->fd = fd;
+    c->index = malloc(index_size ? index_size : 1);
+    c->shards = calloc(CIMG_SHARDS, sizeof(struct cimg_shard));
+    if(c->index == NULL || c->shards == NULL){
+        cimg_free(c);
+        close(fd);
+        return -1;
+    }
+    for(i = 0; i < CIMG_SHARDS; i++){
+        pthread_mutex_init(&c->shards[i].lock, NULL);
+    }
+    if(pread(fd, c->index, index_size, c->header.index_offset) !=
+       (ssize_t)index_size ||
+       cimg_check_index(c, st.st_size) == EXIT_FAILURE){
+        fprintf(stderr, "%s\n", CIMG_CORRUPT);
+        cimg_free(c);
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&cimgs_lock);
+    cimgs[fd] = c;
+    pthread_mutex_unlock(&cimgs_lock);
+    return fd;
+}
+
+/* TRUE if "fd" was opened as a compressed image */
+int cimg_is_compressed(int fd){
+    return cimg_get(fd) != NULL;
+}
+
+/* copies "len" bytes from "at" in chunk "chunk" to "dst",
+   decompressing the chunk unless it is in the cache. Only
+   the chunk's shard is locked and never while decompressing */
+static int cimg_copy(struct cimg *c, uint32_t chunk, uint32_t at,
+                     size_t len, void *dst){
+    struct cimg_chunk *entry = &c->index[chunk];
+    struct cimg_shard *shard;
+    struct cimg_slot *slot;
+    unsigned char *comp, *data, *old;
+    uLongf data_len = c->header.chunk_size;
+    uint64_t expect;
+
+    shard = &c->shards[chunk % CIMG_SHARDS];
+    slot = &shard->slots[(chunk / CIMG_SHARDS) % CIMG_SHARD_SLOTS];
+    pthread_mutex_lock(&shard->lock);
+    if(slot->chunk == chunk + 1){
+        memcpy(dst, (unsigned char*)slot->data + at, len);
+        pthread_mutex_unlock(&shard->lock);
+        return EXIT_SUCCESS;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    /* the last chunk holds whatever is left of the image */
+    expect = c->header.image_size - (uint64_t)chunk * c->header.chunk_size;
+    if(expect > c->header.chunk_size){
+        expect = c->header.chunk_size;
+    }
+    comp = malloc(entry->len ? entry->len : 1);
+    data = malloc(c->header.chunk_size);
+    if(comp == NULL || data == NULL){
+        free(comp);
+        free(data);
+        errno = ENOMEM;
+        return EXIT_FAILURE;
+    }
+    if(pread(c->fd, comp, entry->len, entry->offset) != (ssize_t)entry->len){
+        free(comp);
+        free(data);
+        return EXIT_FAILURE;
+    }
+    if(uncompress(data, &data_len, comp, entry->len) != Z_OK ||
+       data_len != expect){
+        fprintf(stderr, "%s\n", CIMG_CORRUPT);
+        free(comp);
+        free(data);
+        errno = EIO;
+        return EXIT_FAILURE;
+    }
+    free(comp);
+    memcpy(dst, data + at, len);
+
+    pthread_mutex_lock(&shard->lock);
+    old = slot->data;
+    slot->chunk = chunk + 1;
+    slot->data = data;
+    pthread_mutex_unlock(&shard->lock);
+    free(old);
+    return EXIT_SUCCESS;
+}
+
+/* reads like pread, from the raw image a compressed image
+   holds when "fd" is one. Zero chunks cost nothing, stored
+   chunks are read in place and compressed chunks go through
+   the cache. Returns the bytes read, short at the end of the
+   image, or -1 with errno set */
+ssize_t cimg_pread(int fd, void *buf, size_t len, off_t offset){
+    struct cimg *c = cimg_get(fd);
+    struct cimg_chunk *entry;
+    unsigned char *dst = buf;
+    uint64_t pos;
+    uint32_t chunk, at;
+    size_t done, n;
+
+    if(c == NULL){
+        return pread(fd, buf, len, offset);
+    }
+    if(offset < 0){
+        errno = EINVAL;
+        return -1;
+    }
+    if((uint64_t)offset >= c->header.image_size){
+        return 0;
+    }
+    if(len > c->header.image_size - offset){
+        len = c->header.image_size - offset;
+    }
+
+    for(done = 0; done < len; done += n){
+        pos = (uint64_t)offset + done;
+        chunk = pos / c->header.chunk_size;
+        at = pos % c->header.chunk_size;
+        n = c->header.chunk_size - at;
+        if(n > len - done){
+            n = len - done;
+        }
+
+        entry = &c->index[chunk];
+        if(entry->kind == CIMG_ZERO){
+            memset(dst + done, 0, n);
+        }else if(entry->kind == CIMG_RAW){
+            if(pread(c->fd, dst + done, n, entry->offset + at) !=
+               (ssize_t)n){
+                return -1;
+            }
+        }else if(cimg_copy(c, chunk, at, n, dst + done) == EXIT_FAILURE){
+            return -1;
+        }
+    }
+    return len;
+}
+
+/* closes an image from "cimg_open" */
+int cimg_close(int fd){
+    struct cimg *c = cimg_get(fd);
+
+    if(c != NULL){
+        pthread_mutex_lock(&cimgs_lock);
+        cimgs[fd] = NULL;
+        pthread_mutex_unlock(&cimgs_lock);
+        cimg_free(c);
+    }
+    return close(fd);
+}
@@ -0,0 +1,73 @@
+#ifndef CIMG_H
+#define CIMG_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define CIMG_MAGIC "MINCIMG1"
+#define CIMG_MAGIC_SIZE 8
+#define CIMG_VERSION 1
+#define CIMG_DEF_CHUNK (64 * 1024)
+#define CIMG_MIN_CHUNK 4096
+#define CIMG_MAX_CHUNK (16 * 1024 * 1024)
+#define CIMG_MAX_FDS 4096
+#define CIMG_SLOTS 256
+#define CIMG_SHARDS 16
+#define CIMG_SHARD_SLOTS (CIMG_SLOTS / CIMG_SHARDS)
+#define CIMG_CORRUPT "compressed image is corrupt"
+
+/* how a chunk is stored */
+#define CIMG_ZERO 0 /* all zeros, nothing stored */
+#define CIMG_RAW 1  /* stored as is, it didn't compress */
+#define CIMG_ZLIB 2
+
+/* at the start of a compressed image. The chunks follow it
+   and the index of every chunk comes last, so an image can
+   be written in one pass */
+struct cimg_header {
+    char magic[CIMG_MAGIC_SIZE];
+    uint32_t version;
+    uint32_t chunk_size;   /* bytes of the image in every chunk */
+    uint64_t image_size;   /* bytes of the image uncompressed */
+    uint64_t index_offset;
+    uint32_t num_chunks;
+    uint32_t reserved;
+};
+
+/* where one chunk is in the compressed image */
+struct cimg_chunk {
+    uint64_t offset;
+    uint32_t len;
+    uint32_t kind;
+};
+
+/* one decompressed chunk, a chunk of 0 marks an empty slot.
+   Chunks are stored one more than their number */
+struct cimg_slot {
+    uint32_t chunk;
+    void *data;
+};
+
+struct cimg_shard {
+    struct cimg_slot slots[CIMG_SHARD_SLOTS];
+    pthread_mutex_t lock;
+};
+
+/* an open compressed image. The index is read once when it is
+   opened and decompressed chunks stay in a sharded direct
+   mapped cache, so reads of nearby zones only decompress once */
+struct cimg {
+    int fd;
+    struct cimg_header header;
+    struct cimg_chunk *index;
+    struct cimg_shard *shards;
+};
+
+int cimg_open(char *);
+int cimg_is_compressed(int);
+ssize_t cimg_pread(int, void *, size_t, off_t);
+int cimg_close(int);
+
+#endif
@@ -0,0 +1,137 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include "dio.h"
+#include "bufpool.h"
+#include "cimg.h"
+
+#define DIOERR "direct I/O error"
+
+/* finds the smallest block size direct reads of "fd" work
+   with, asking the device when it is one and otherwise trying
+   reads of growing size. Returns 0 if none of them work */
+static uint32_t find_align(int fd){
+    struct stat st;
+    uint32_t align;
+    int size;
+    void *buf;
+
+    if(fstat(fd, &st) == 0 && S_ISBLK(st.st_mode) &&
+       ioctl(fd, BLKSSZGET, &size) == 0 && size > 0){
+        return size;
+    }
+
+    if(posix_memalign(&buf, DIO_ALIGN_MAX, DIO_ALIGN_MAX) != 0){
+        return 0;
+    }
+    for(align = DIO_ALIGN_MIN; align <= DIO_ALIGN_MAX; align *= 2){
+        if(pread(fd, buf, align, 0) >= 0){
+            free(buf);
+            return align;
+        }
+        if(errno != EINVAL){
+            break;
+        }
+    }
+    free(buf);
+    return 0;
+}
+
+/* opens "path" for reads of up to "buf_size" bytes, with
+   O_DIRECT when the file system supports it and buffered
+   otherwise. A compressed image is always read buffered,
+   its chunks don't line up with the image's blocks */
+int dio_open(struct dio *dio, char *path, size_t buf_size){
+    int flags;
+
+    memset(dio, 0, sizeof(struct dio));
+    dio->buf_size = buf_size;
+    dio->align = 1;
+
+    dio->fd = cimg_open(path);
+    if(dio->fd < 0){
+        return EXIT_FAILURE;
+    }
+    if(cimg_is_compressed(dio->fd)){
+        return EXIT_SUCCESS;
+    }
+    close(dio->fd);
+
+    dio->fd = open(path, O_RDONLY | O_DIRECT);
+    if(dio->fd < 0 && errno == EINVAL){
+        /* O_DIRECT itself isn't supported here */
+        dio->fd = open(path, O_RDONLY);
+        return dio->fd < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    if(dio->fd < 0){
+        return EXIT_FAILURE;
+    }
+
+    /* opening can succeed where reading doesn't,
+       so turn O_DIRECT back off if no read works */
+    dio->align = find_align(dio->fd);
+    if(dio->align == 0){
+        dio->align = 1;
+        flags = fcntl(dio->fd, F_GETFL);
+        if(flags < 0 || fcntl(dio->fd, F_SETFL, flags & ~O_DIRECT) < 0){
+            perror(DIOERR);
+            close(dio->fd);
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+    dio->direct = 1;
+    return EXIT_SUCCESS;
+}
+
+/* closes the descriptor */
+void dio_close(struct dio *dio){
+    cimg_close(dio->fd);
+}
+
+/* returns a buffer big enough for any read of up to
+   "buf_size" bytes after widening, from the buffer pool
+   whose buffers are always page aligned.
+   On error returns NULL */
+void *dio_get_buf(struct dio *dio){
+    return bufpool_get(dio->buf_size + 2 * DIO_ALIGN_MAX);
+}
+
+/* puts a buffer from "dio_get_buf" back in the pool */
+void dio_put_buf(struct dio *dio, void *buf){
+    bufpool_put(buf, dio->buf_size + 2 * DIO_ALIGN_MAX);
+}
+
+/* reads "len" bytes at "offset" into "buf", a buffer from
+   "dio_get_buf", widening the read to whole blocks first when
+   reading directly. Returns where the requested bytes start
+   inside "buf", or NULL on error */
+void *dio_read(struct dio *dio, void *buf, size_t len, off_t offset){
+    off_t start, end;
+    ssize_t got;
+
+    if(!dio->direct){
+        if(cimg_pread(dio->fd, buf, len, offset) != (ssize_t)len){
+            return NULL;
+        }
+        return buf;
+    }
+
+    /* a partition that doesn't start on a block boundary
+       leaves zones unaligned, so round both ends out */
+    start = offset & ~((off_t)dio->align - 1);
+    end = (offset + len + dio->align - 1) & ~((off_t)dio->align - 1);
+    got = pread(dio->fd, buf, end - start, start);
+
+    /* the last block of the image may come back short */
+    if(got < (ssize_t)(offset + len - start)){
+        return NULL;
+    }
+    return (char*)buf + (offset - start);
+}
@@ -0,0 +1,32 @@
+#ifndef DIO_H
+#define DIO_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define DIO_ALIGN_MIN 512
+#define DIO_ALIGN_MAX 4096
+
+/* a second descriptor on the image for bulk file data, opened
+   with O_DIRECT so large extractions neither fill the page
+   cache nor pay for a copy out of it. Direct reads have to
+   start, end and land on "align" boundaries, so every read is
+   widened to whole blocks in a pooled buffer with room to
+   spare on both ends, and the data is handed on from wherever it
+   starts in that buffer. When the file system won't do direct
+   I/O the same calls fall back to plain positional reads */
+struct dio {
+    int fd;
+    int direct;       /* FALSE once fallen back to buffered reads */
+    uint32_t align;   /* logical block size reads are rounded to */
+    size_t buf_size;  /* most bytes one read may ask for */
+};
+
+int dio_open(struct dio *, char *, size_t);
+void dio_close(struct dio *);
+void *dio_get_buf(struct dio *);
+void dio_put_buf(struct dio *, void *);
+void *dio_read(struct dio *, void *, size_t, off_t);
+
+#endif
@@ -0,0 +1,253 @@
+#include "dirsort.h"
+
+/* the "PREFIX_BYTES" of a name from "offset" as a big endian
+   number, so comparing prefixes compares the names the way
+   strncmp does. Names end at a NULL or at NAME_SIZE */
+static uint64_t name_prefix(const unsigned char *name, uint32_t offset){
+    uint64_t key = 0;
+    uint32_t i, ended = FALSE;
+
+    for(i = offset; i < offset + PREFIX_BYTES; i++){
+        key <<= 8;
+        if(i >= NAME_SIZE || name[i] == '\0'){
+            ended = TRUE;
+        }
+        if(!ended){
+            key |= name[i];
+        }
+    }
+    return key;
+}
+
+/* what "sort" orders entry "index" by. Sizes and times come
+   largest first, so they are inverted, and ties between them
+   are kept in directory order by the index under them */
+static uint64_t entry_key(struct dir_entry *entry, struct inode *node,
+                          uint32_t index, int sort){
+    switch(sort){
+    case SORT_SIZE:
+        return (uint64_t)(UINT32_MAX - node->size) << 32 | index;
+    case SORT_MTIME:
+        return (uint64_t)(UINT32_MAX -
+                          ((uint32_t)node->mtime ^ 0x80000000)) << 32 | index;
+    case SORT_NAME:
+        return name_prefix(entry->name, 0);
+    default:
+        return 0;
+    }
+}
+
+/* TRUE if entry "a" comes before "b", ties kept in
+   directory order. Names are compared in full since
+   keys only hold their first "PREFIX_BYTES" */
+static int key_before(struct sort_key *a, struct sort_key *b,
+                      struct dir_entry *dir, int sort){
+    int cmp;
+
+    if(a->key != b->key){
+        return a->key < b->key;
+    }
+    if(sort == SORT_NAME){
+        cmp = strncmp((char*)dir[a->index].name,
+                      (char*)dir[b->index].name, NAME_SIZE);
+        if(cmp != 0){
+            return cmp < 0;
+        }
+    }
+    return a->index < b->index;
+}
+
+/* stable LSD radix sort of "n" keys a byte at a time,
+   using "tmp" as the other half of every pass. Bytes
+   that are the same in every key are skipped, so small
+   keys only take the passes they need. Returns which of
+   the two arrays holds the sorted keys */
+static struct sort_key *radix_sort(struct sort_key *keys,
+                                   struct sort_key *tmp, off_t n){
+    off_t count[RADIX_SIZE], i, sum, digit_count;
+    struct sort_key *swap;
+    uint32_t shift, digit;
+
+    for(shift = 0; shift < sizeof(uint64_t) * 8; shift += RADIX_BITS){
+        memset(count, 0, sizeof(count));
+        for(i = 0; i < n; i++){
+            count[(keys[i].key >> shift) & (RADIX_SIZE - 1)]++;
+        }
+        if(n == 0 || count[(keys[0].key >> shift) & (RADIX_SIZE - 1)] == n){
+            continue;
+        }
+
+        sum = 0;
+        for(digit = 0; digit < RADIX_SIZE; digit++){
+            digit_count = count[digit];
+            count[digit] = sum;
+            sum += digit_count;
+        }
+        for(i = 0; i < n; i++){
+            tmp[count[(keys[i].key >> shift) & (RADIX_SIZE - 1)]++] = keys[i];
+        }
+        swap = keys;
+        keys = tmp;
+        tmp = swap;
+    }
+    return keys;
+}
+
+/* sorts keys by name "PREFIX_BYTES" at a time, starting
+   at "offset". Names sharing a prefix that doesn't end
+   in it are sorted again on their next "PREFIX_BYTES",
+   so long shared prefixes never fall back to comparing
+   whole names. Leaves the result in "keys" */
+static void sort_names(struct sort_key *keys, struct sort_key *tmp,
+                       off_t n, struct dir_entry *dir, uint32_t offset){
+    struct sort_key *sorted;
+    off_t start, end;
+
+    if(n < 2) return;
+    for(start = 0; start < n; start++){
+        keys[start].key = name_prefix(dir[keys[start].index].name, offset);
+    }
+    sorted = radix_sort(keys, tmp, n);
+    if(sorted != keys){
+        memcpy(keys, sorted, sizeof(struct sort_key) * n);
+    }
+
+    if(offset + PREFIX_BYTES >= NAME_SIZE) return;
+    for(start = 0; start < n; start = end){
+        end = start + 1;
+        while(end < n && keys[end].key == keys[start].key){
+            end++;
+        }
+        /* a prefix ending in a NULL holds the whole name */
+        if(end - start > 1 && (keys[start].key & 0xFF) != 0){
+            sort_names(keys + start, tmp, end - start, dir,
+                       offset + PREFIX_BYTES);
+        }
+    }
+}
+
+/* moves the key at "pos" down the heap until both
+   children come before it. The root of the heap is
+   the kept key that comes last */
+static void sift_down(struct sort_key *heap, uint32_t size, uint32_t pos,
+                      struct dir_entry *dir, int sort){
+    uint32_t child;
+    struct sort_key cur = heap[pos];
+
+    while((child = pos * 2 + 1) < size){
+        if(child + 1 < size &&
+           key_before(&heap[child], &heap[child + 1], dir, sort)){
+            child++;
+        }
+        if(!key_before(&cur, &heap[child], dir, sort)) break;
+        heap[pos] = heap[child];
+        pos = child;
+    }
+    heap[pos] = cur;
+}
+
+static void sift_up(struct sort_key *heap, uint32_t pos,
+                    struct dir_entry *dir, int sort){
+    uint32_t parent;
+    struct sort_key cur = heap[pos];
+
+    while(pos > 0){
+        parent = (pos - 1) / 2;
+        if(!key_before(&heap[parent], &cur, dir, sort)) break;
+        heap[pos] = heap[parent];
+        pos = parent;
+    }
+    heap[pos] = cur;
+}
+
+/* keeps the "limit" keys that come first, replacing the
+   last of those kept whenever one comes before it, so a
+   huge directory is never sorted in full. Returns how
+   many were kept, at the front of "keys" */
+static off_t select_first(struct sort_key *keys, off_t n, uint32_t limit,
+                          struct dir_entry *dir, int sort){
+    uint32_t size = 0;
+    off_t i;
+
+    for(i = 0; i < n; i++){
+        if(size < limit){
+            keys[size] = keys[i];
+            sift_up(keys, size++, dir, sort);
+        }else if(key_before(&keys[i], &keys[0], dir, sort)){
+            keys[0] = keys[i];
+            sift_down(keys, size, 0, dir, sort);
+        }
+    }
+    return size;
+}
+
+/* gathers the regular files and directories of the "num_entries"
+   entries in "dir_data" into a compact key array, orders them by
+   "sort" and keeps the first "limit" of them (all if NO_LIMIT).
+   Entries naming an inode past the "ninodes" in the table are
+   left out. The ordered entries are copied out of "arena" into
+   "res" and their count into "num_res" */
+int dir_sort(struct dir_entry *dir_data,
+             struct inode *inode_table,
+             uint32_t ninodes,
+             off_t num_entries,
+             int sort,
+             uint32_t limit,
+             struct arena *arena,
+             struct dir_entry **res,
+             off_t *num_res){
+    struct sort_key *keys, *tmp, *sorted;
+    struct inode *node;
+    off_t i, n = 0;
+
+    keys = op_alloc(arena, sizeof(struct sort_key) * (num_entries + 1));
+    tmp = op_alloc(arena, sizeof(struct sort_key) * (num_entries + 1));
+    *res = op_alloc(arena, sizeof(struct dir_entry) * (num_entries + 1));
+    if(keys == NULL || tmp == NULL || *res == NULL){
+        perror(MALLOCERR);
+        op_free(arena, keys);
+        op_free(arena, tmp);
+        op_free(arena, *res);
+        return EXIT_FAILURE;
+    }
+
+    for(i = 0; i < num_entries; i++){
+        if(dir_data[i].inode == 0 || dir_data[i].inode > ninodes) continue;
+        node = &inode_table[dir_data[i].inode - 1];
+        if((node->mode & FILE_TYPE_MASK) != REG_MASK &&
+           (node->mode & FILE_TYPE_MASK) != DIR_MASK){
+            continue;
+        }
+        keys[n].key = entry_key(&dir_data[i], node, i, sort);
+        keys[n].index = i;
+        keys[n].pad = 0;
+        n++;
+    }
+
+    /* without an order the first "limit" are just the first
+       found, otherwise only those kept need to be sorted */
+    if(limit != NO_LIMIT && n > limit){
+        if(sort == SORT_NONE){
+            n = limit;
+        }else{
+            n = select_first(keys, n, limit, dir_data, sort);
+        }
+    }
+
+    if(sort == SORT_NAME){
+        sort_names(keys, tmp, n, dir_data, 0);
+        sorted = keys;
+    }else if(sort != SORT_NONE){
+        sorted = radix_sort(keys, tmp, n);
+    }else{
+        sorted = keys;
+    }
+
+    for(i = 0; i < n; i++){
+        (*res)[i] = dir_data[sorted[i].index];
+    }
+    *num_res = n;
+    op_free(arena, keys);
+    op_free(arena, tmp);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,26 @@
+#ifndef DIRSORT_H
+#define DIRSORT_H
+
+#include "util.h"
+
+#define SORT_NONE 0
+#define SORT_NAME 1
+#define SORT_SIZE 2
+#define SORT_MTIME 3
+#define NO_LIMIT 0
+#define PREFIX_BYTES 8
+#define RADIX_BITS 8
+#define RADIX_SIZE (1 << RADIX_BITS)
+
+/* what an entry is ordered by and where it is in the
+   directory, kept small so sorting moves little memory */
+struct sort_key {
+    uint64_t key;
+    uint32_t index;
+    uint32_t pad;
+};
+
+int dir_sort(struct dir_entry *, struct inode *, uint32_t, off_t, int,
+             uint32_t, struct arena *, struct dir_entry **, off_t *);
+
+#endif
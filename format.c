@@ -0,0 +1,303 @@
+#include "format.h"
+
+static const char *format_names[] = {"text", "ndjson", "tsv", "bin"};
+
+/* every two digit number, so integers are
+   formatted two digits per step */
+static const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233"
+    "34353637383940414243444546474849505152535455565758596061626364656667"
+    "6869707172737475767778798081828384858687888990919293949596979899";
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/* returns the FORMAT_ named "name", or -1 */
+int format_parse(char *name){
+    int i;
+
+    for(i = FORMAT_TEXT; i <= FORMAT_BIN; i++){
+        if(strcmp(name, format_names[i]) == 0){
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* sets up buffered output of "format" to "fd", writing
+   the header first for binary output */
+int fmt_init(struct fmt_out *out, int fd, int format){
+    struct ls_bin_header header;
+
+    out->fd = fd;
+    out->format = format;
+    out->len = 0;
+    out->failed = FALSE;
+    out->buf = malloc(FMT_BUF_SIZE);
+    if(out->buf == NULL){
+        perror(MALLOCERR);
+        return EXIT_FAILURE;
+    }
+
+    if(format == FORMAT_BIN){
+        memset(&header, 0, sizeof(struct ls_bin_header));
+        memcpy(header.magic, LS_BIN_MAGIC, sizeof(header.magic));
+        header.version = LS_BIN_VERSION;
+        header.record_size = sizeof(struct ls_bin_record);
+        memcpy(out->buf, &header, sizeof(struct ls_bin_header));
+        out->len = sizeof(struct ls_bin_header);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* writes out everything buffered so far */
+int fmt_flush(struct fmt_out *out){
+    size_t done = 0;
+    ssize_t r;
+
+    while(!out->failed && done < out->len){
+        r = write(out->fd, out->buf + done, out->len - done);
+        if(r <= 0){
+            perror(FILEERR);
+            out->failed = TRUE;
+        }else{
+            done += r;
+        }
+    }
+    out->len = 0;
+    return out->failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* flushes and frees the buffer, returning whether
+   all output was written */
+int fmt_free(struct fmt_out *out){
+    fmt_flush(out);
+    free(out->buf);
+    out->buf = NULL;
+    return out->failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static char *put_uint(char *p, uint64_t value){
+    char tmp[24];
+    int n = sizeof(tmp);
+
+    while(value >= 100){
+        n -= 2;
+        memcpy(tmp + n, digit_pairs + (value % 100) * 2, 2);
+        value /= 100;
+    }
+    if(value >= 10){
+        n -= 2;
+        memcpy(tmp + n, digit_pairs + value * 2, 2);
+    }else{
+        tmp[--n] = '0' + value;
+    }
+    memcpy(p, tmp + n, sizeof(tmp) - n);
+    return p + sizeof(tmp) - n;
+}
+
+static char *put_int(char *p, int64_t value){
+    if(value < 0){
+        *p++ = '-';
+        return put_uint(p, -(uint64_t)value);
+    }
+    return put_uint(p, value);
+}
+
+static char *put_str(char *p, const char *s){
+    size_t len = strlen(s);
+
+    memcpy(p, s, len);
+    return p + len;
+}
+
+/* returns how many bytes of the "len" at "s" make up one
+   well formed UTF-8 character, 0 if they don't start one.
+   Overlong forms and surrogates are not well formed */
+static size_t utf8_len(const unsigned char *s, size_t len){
+    unsigned char lo = 0x80, hi = 0xBF;
+    size_t n, i;
+
+    if(s[0] < 0x80){
+        return 1;
+    }else if(s[0] >= 0xC2 && s[0] <= 0xDF){
+        n = 2;
+    }else if(s[0] >= 0xE0 && s[0] <= 0xEF){
+        n = 3;
+        if(s[0] == 0xE0) lo = 0xA0;
+        if(s[0] == 0xED) hi = 0x9F;
+    }else if(s[0] >= 0xF0 && s[0] <= 0xF4){
+        n = 4;
+        if(s[0] == 0xF0) lo = 0x90;
+        if(s[0] == 0xF4) hi = 0x8F;
+    }else{
+        return 0;
+    }
+    if(n > len || s[1] < lo || s[1] > hi){
+        return 0;
+    }
+    for(i = 2; i < n; i++){
+        if(s[i] < 0x80 || s[i] > 0xBF) return 0;
+    }
+    return n;
+}
+
+/* a JSON string, escaping quotes, backslashes and control
+   characters. Names are only bytes, so any byte that isn't
+   part of well formed UTF-8 is escaped as the code point of
+   the same value rather than making the output invalid */
+static char *put_json_name(char *p, const char *name, size_t len){
+    const unsigned char *s = (const unsigned char*)name;
+    unsigned char c;
+    size_t i, n;
+
+    *p++ = '"';
+    for(i = 0; i < len; i += n){
+        c = s[i];
+        n = utf8_len(s + i, len - i);
+        if(c == '"' || c == '\\'){
+            *p++ = '\\';
+            *p++ = c;
+        }else if(c < 0x20 || n == 0){
+            p = put_str(p, "\\u00");
+            *p++ = hex_digits[c >> 4];
+            *p++ = hex_digits[c & 0xF];
+            n = 1;
+        }else{
+            memcpy(p, s + i, n);
+            p += n;
+        }
+    }
+    *p++ = '"';
+    return p;
+}
+
+/* a TSV field, escaping the characters that
+   would end the field or the line */
+static char *put_tsv_name(char *p, const char *name, size_t len){
+    size_t i;
+
+    for(i = 0; i < len; i++){
+        switch(name[i]){
+        case '\t':
+            p = put_str(p, "\\t");
+            break;
+        case '\n':
+            p = put_str(p, "\\n");
+            break;
+        case '\r':
+            p = put_str(p, "\\r");
+            break;
+        case '\\':
+            p = put_str(p, "\\\\");
+            break;
+        default:
+            *p++ = name[i];
+            break;
+        }
+    }
+    return p;
+}
+
+/* adds one listing entry for inode "ino" called "name".
+   Binary records only have room for a directory entry's
+   name, longer names (a path) are cut short there */
+void fmt_entry(struct fmt_out *out, uint32_t ino, struct inode *node,
+               const char *name, size_t name_len){
+    struct ls_bin_record rec;
+    char *p;
+
+    if(name_len > FMT_MAX_NAME){
+        name_len = FMT_MAX_NAME;
+    }
+    if(FMT_BUF_SIZE - out->len < FMT_MAX_RECORD){
+        fmt_flush(out);
+    }
+    p = out->buf + out->len;
+
+    switch(out->format){
+    case FORMAT_BIN:
+        memset(&rec, 0, sizeof(struct ls_bin_record));
+        rec.ino = ino;
+        rec.mode = node->mode;
+        rec.links = node->links;
+        rec.uid = node->uid;
+        rec.gid = node->gid;
+        rec.size = node->size;
+        rec.atime = node->atime;
+        rec.mtime = node->mtime;
+        rec.ctime = node->ctime;
+        rec.name_len = name_len < NAME_SIZE ? name_len : NAME_SIZE;
+        memcpy(rec.name, name, rec.name_len);
+        memcpy(p, &rec, sizeof(struct ls_bin_record));
+        p += sizeof(struct ls_bin_record);
+        break;
+    case FORMAT_TSV:
+        p = put_uint(p, ino);
+        *p++ = '\t';
+        p = put_uint(p, node->mode);
+        *p++ = '\t';
+        p = put_uint(p, node->links);
+        *p++ = '\t';
+        p = put_uint(p, node->uid);
+        *p++ = '\t';
+        p = put_uint(p, node->gid);
+        *p++ = '\t';
+        p = put_uint(p, node->size);
+        *p++ = '\t';
+        p = put_int(p, node->atime);
+        *p++ = '\t';
+        p = put_int(p, node->mtime);
+        *p++ = '\t';
+        p = put_int(p, node->ctime);
+        *p++ = '\t';
+        p = put_tsv_name(p, name, name_len);
+        *p++ = '\n';
+        break;
+    default:
+        p = put_str(p, "{\"ino\":");
+        p = put_uint(p, ino);
+        p = put_str(p, ",\"mode\":");
+        p = put_uint(p, node->mode);
+        p = put_str(p, ",\"links\":");
+        p = put_uint(p, node->links);
+        p = put_str(p, ",\"uid\":");
+        p = put_uint(p, node->uid);
+        p = put_str(p, ",\"gid\":");
+        p = put_uint(p, node->gid);
+        p = put_str(p, ",\"size\":");
+        p = put_uint(p, node->size);
+        p = put_str(p, ",\"atime\":");
+        p = put_int(p, node->atime);
+        p = put_str(p, ",\"mtime\":");
+        p = put_int(p, node->mtime);
+        p = put_str(p, ",\"ctime\":");
+        p = put_int(p, node->ctime);
+        p = put_str(p, ",\"name\":");
+        p = put_json_name(p, name, name_len);
+        p = put_str(p, "}\n");
+        break;
+    }
+    out->len = p - out->buf;
+}
+
+/* adds every regular file and directory in a directory
+   the same way "print_dir" picks them. Entries naming an
+   inode past the "ninodes" in the table are left out */
+void fmt_dir(struct fmt_out *out, struct dir_entry *dir_data,
+             struct inode *inode_table, uint32_t ninodes,
+             off_t num_entries){
+    struct inode *node;
+    off_t i;
+
+    for(i = 0; i < num_entries; i++){
+        if(dir_data[i].inode == 0 || dir_data[i].inode > ninodes) continue;
+
+        node = &inode_table[dir_data[i].inode - 1];
+        if((node->mode & FILE_TYPE_MASK) == REG_MASK ||
+           (node->mode & FILE_TYPE_MASK) == DIR_MASK){
+            fmt_entry(out, dir_data[i].inode, node,
+                      (char*)dir_data[i].name,
+                      strnlen((char*)dir_data[i].name, NAME_SIZE));
+        }
+    }
+}
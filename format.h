@@ -0,0 +1,65 @@
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include "util.h"
+
+#define FORMAT_TEXT 0
+#define FORMAT_NDJSON 1
+#define FORMAT_TSV 2
+#define FORMAT_BIN 3
+#define FORMAT_NAMES "text, ndjson, tsv or bin"
+#define FMT_BUF_SIZE (256 * 1024)
+#define FMT_MAX_NAME 4096
+/* a name where every byte needs a \u00XX escape, plus every number */
+#define FMT_MAX_RECORD (FMT_MAX_NAME * 6 + 256)
+#define LS_BIN_MAGIC "MLS1"
+#define LS_BIN_VERSION 1
+
+/* start of binary output, followed by
+   records until the end of the output */
+struct ls_bin_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t reserved;
+};
+
+/* one listed inode in binary output. Every record is the
+   same size and in host byte order so the output can be
+   mapped and indexed directly. "name" is not terminated,
+   "name_len" bytes of it are used */
+struct ls_bin_record {
+    uint32_t ino;
+    uint16_t mode;
+    uint16_t links;
+    uint16_t uid;
+    uint16_t gid;
+    uint32_t size;
+    int32_t atime;
+    int32_t mtime;
+    int32_t ctime;
+    uint32_t name_len;
+    char name[NAME_SIZE];
+    uint32_t reserved;
+};
+
+/* listing output gathered in one large buffer and
+   written to "fd" only when it fills up or is flushed */
+struct fmt_out {
+    int fd;
+    int format;
+    char *buf;
+    size_t len;
+    int failed;
+};
+
+int format_parse(char *);
+int fmt_init(struct fmt_out *, int, int);
+void fmt_entry(struct fmt_out *, uint32_t, struct inode *,
+               const char *, size_t);
+void fmt_dir(struct fmt_out *, struct dir_entry *, struct inode *, uint32_t,
+             off_t);
+int fmt_flush(struct fmt_out *);
+int fmt_free(struct fmt_out *);
+
+#endif
@@ -0,0 +1,513 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "fsalloc.h"
+
+static int bit_set(uint8_t *map, uint32_t bit){
+    return (map[bit / 8] >> (bit % 8)) & 1;
+}
+
+static void set_bit(uint8_t *map, uint32_t bit){
+    map[bit / 8] |= 1 << (bit % 8);
+}
+
+static void clear_bit(uint8_t *map, uint32_t bit){
+    map[bit / 8] &= ~(1 << (bit % 8));
+}
+
+/* returns the first bit at or after "from" and before "end"
+   that is "want", or "end" if there is none. Whole words
+   that can't hold one are skipped 64 bits at a time */
+static uint32_t next_bit(uint8_t *map, uint32_t from, uint32_t end,
+                         int want){
+    uint64_t word, skip = want ? 0 : UINT64_MAX;
+
+    while(from < end){
+        if(from % FSA_WORD_BITS == 0 && end - from >= FSA_WORD_BITS){
+            memcpy(&word, map + from / 8, sizeof(uint64_t));
+            if(word == skip){
+                from += FSA_WORD_BITS;
+                continue;
+            }
+        }
+        if(bit_set(map, from) == want){
+            return from;
+        }
+        from++;
+    }
+    return end;
+}
+
+/* the number of clear bits in "map" from 1 up to "num_bits" */
+static uint32_t count_free(uint8_t *map, uint32_t num_bits){
+    uint32_t bit, used = 0;
+    uint64_t word;
+
+    for(bit = 0; num_bits - bit >= FSA_WORD_BITS; bit += FSA_WORD_BITS){
+        memcpy(&word, map + bit / 8, sizeof(uint64_t));
+        used += __builtin_popcountll(word);
+    }
+    for(; bit < num_bits; bit++){
+        used += bit_set(map, bit);
+    }
+
+    /* bit 0 is never free, whatever it holds */
+    return num_bits - used - !bit_set(map, 0);
+}
+
+/* reads the superblock, both bitmaps and the inode table of
+   the file system at "disk_start" in "image", which has to be
+   open for writing too for anything to be written back.
+   On error returns EXIT_FAILURE */
+int fsa_open(struct fs_alloc *fsa, int image, off_t disk_start){
+    struct superblock *super;
+    size_t table_size;
+
+    memset(fsa, 0, sizeof(struct fs_alloc));
+    fsa->image = image;
+    fsa->disk_start = disk_start;
+    super = get_superblock(image, disk_start, FALSE);
+    if(super == NULL){
+        return EXIT_FAILURE;
+    }
+    fsa->super = *super;
+    free(super);
+    geom_select(&fsa->super, &fsa->geom);
+
+    fsa->imap_size = (size_t)fsa->super.blocksize * fsa->super.i_blocks;
+    fsa->zmap_size = (size_t)fsa->super.blocksize * fsa->super.z_blocks;
+    fsa->num_inode_bits = fsa->super.ninodes + 1;
+    fsa->num_zone_bits = fsa->super.zones - fsa->super.firstdata + 1;
+    if(fsa->super.firstdata == 0 ||
+       fsa->super.zones < fsa->super.firstdata ||
+       fsa->num_inode_bits > fsa->imap_size * 8 ||
+       fsa->num_zone_bits > fsa->zmap_size * 8){
+        fprintf(stderr, FSA_BADMAPS);
+        return EXIT_FAILURE;
+    }
+
+    table_size = sizeof(struct inode) * (size_t)fsa->super.ninodes;
+    fsa->num_blocks = (table_size + fsa->super.blocksize - 1) /
+                      fsa->super.blocksize;
+    fsa->imap = malloc(fsa->imap_size);
+    fsa->zmap = malloc(fsa->zmap_size);
+    fsa->dirty = calloc(fsa->num_blocks ? fsa->num_blocks : 1, 1);
+    if(fsa->imap == NULL || fsa->zmap == NULL || fsa->dirty == NULL){
+        perror(MALLOCERR);
+        fsa_close(fsa);
+        return EXIT_FAILURE;
+    }
+    if(cimg_pread(image, fsa->imap, fsa->imap_size,
+             disk_start + (off_t)fsa->super.blocksize * FIRST_BLOCKS)
+             != (ssize_t)fsa->imap_size ||
+       cimg_pread(image, fsa->zmap, fsa->zmap_size,
+             disk_start + (off_t)fsa->super.blocksize *
+                          (FIRST_BLOCKS + fsa->super.i_blocks))
+             != (ssize_t)fsa->zmap_size){
+        perror(READERR);
+        fsa_close(fsa);
+        return EXIT_FAILURE;
+    }
+    fsa->inodes = get_inode_table(image, &fsa->super, disk_start, NULL);
+    if(fsa->inodes == NULL){
+        fsa_close(fsa);
+        return EXIT_FAILURE;
+    }
+
+    fsa->free_inodes = count_free(fsa->imap, fsa->num_inode_bits);
+    fsa->free_zones = count_free(fsa->zmap, fsa->num_zone_bits);
+    fsa->inode_hint = 1;
+    fsa->zone_hint = 1;
+    return EXIT_SUCCESS;
+}
+
+void fsa_close(struct fs_alloc *fsa){
+    free(fsa->pending);
+    fsa->pending = NULL;
+    free(fsa->imap);
+    free(fsa->zmap);
+    free(fsa->dirty);
+    free(fsa->inodes);
+    fsa->imap = NULL;
+    fsa->zmap = NULL;
+    fsa->dirty = NULL;
+    fsa->inodes = NULL;
+}
+
+/* writes both bitmaps whole and every run of changed inode
+   table blocks with one write each */
+int fsa_flush(struct fs_alloc *fsa){
+    off_t table_start = get_inode_table_start(&fsa->super, fsa->disk_start);
+    size_t table_size = sizeof(struct inode) * (size_t)fsa->super.ninodes;
+    size_t start, len;
+    uint32_t i, run;
+
+    if(pwrite(fsa->image, fsa->imap, fsa->imap_size,
+              fsa->disk_start + (off_t)fsa->super.blocksize * FIRST_BLOCKS)
+              != (ssize_t)fsa->imap_size ||
+       pwrite(fsa->image, fsa->zmap, fsa->zmap_size,
+              fsa->disk_start + (off_t)fsa->super.blocksize *
+                                (FIRST_BLOCKS + fsa->super.i_blocks))
+              != (ssize_t)fsa->zmap_size){
+        perror(WRITEERR);
+        return EXIT_FAILURE;
+    }
+
+    for(i = 0; i < fsa->num_blocks; i += run){
+        run = 1;
+        if(!fsa->dirty[i]){
+            continue;
+        }
+        while(i + run < fsa->num_blocks && fsa->dirty[i + run]){
+            run++;
+        }
+
+        /* the table may end part way through its last block */
+        start = (size_t)fsa->super.blocksize * i;
+        len = (size_t)fsa->super.blocksize * run;
+        if(start + len > table_size){
+            len = table_size - start;
+        }
+        if(pwrite(fsa->image, (char*)fsa->inodes + start, len,
+                  table_start + start) != (ssize_t)len){
+            perror(WRITEERR);
+            return EXIT_FAILURE;
+        }
+    }
+    memset(fsa->dirty, 0, fsa->num_blocks);
+    return EXIT_SUCCESS;
+}
+
+/* returns inode "ino" to be changed, marking its block to be
+   written by the next flush. On error returns NULL */
+struct inode *fsa_inode(struct fs_alloc *fsa, uint32_t ino){
+    if(ino == 0 || ino > fsa->super.ninodes){
+        fprintf(stderr, "%s\n", INODEERR);
+        return NULL;
+    }
+    fsa->dirty[(sizeof(struct inode) * (size_t)(ino - 1)) /
+               fsa->super.blocksize] = TRUE;
+    return &fsa->inodes[ino - 1];
+}
+
+/* TRUE if inode "ino" is marked in use */
+int fsa_inode_used(struct fs_alloc *fsa, uint32_t ino){
+    return ino != 0 && ino < fsa->num_inode_bits && bit_set(fsa->imap, ino);
+}
+
+/* takes the first free inode, cleared, and returns its
+   number. Returns 0 when every inode is in use */
+uint32_t fsa_new_inode(struct fs_alloc *fsa){
+    uint32_t bit;
+
+    bit = next_bit(fsa->imap, fsa->inode_hint, fsa->num_inode_bits, FALSE);
+    if(bit == fsa->num_inode_bits){
+        bit = next_bit(fsa->imap, 1, fsa->inode_hint, FALSE);
+        if(bit == fsa->inode_hint){
+            fprintf(stderr, FSA_NOINODES);
+            return 0;
+        }
+    }
+    set_bit(fsa->imap, bit);
+    fsa->free_inodes--;
+    fsa->inode_hint = bit + 1;
+    memset(fsa_inode(fsa, bit), 0, sizeof(struct inode));
+    return bit;
+}
+
+/* returns how many zones of indirect tables a file of
+   "num_zones" zones needs */
+uint32_t fsa_table_count(struct fs_alloc *fsa, uint32_t num_zones){
+    uint32_t per = fsa->geom.per_table;
+
+    if(num_zones <= DIRECT_ZONES){
+        return 0;
+    }
+    num_zones -= DIRECT_ZONES;
+    if(num_zones <= per){
+        return 1;
+    }
+    num_zones -= per;
+    return 2 + (num_zones + per - 1) / per;
+}
+
+/* takes a run of free zones up to "want" long and returns
+   its first zone, with its length in "len". The first run
+   from the hint on that is long enough is taken, otherwise
+   the longest run there is. Returns 0 when no zone is free */
+uint32_t fsa_take_run(struct fs_alloc *fsa, uint32_t want, uint32_t *len){
+    uint32_t lo[2], hi[2], best = 0, best_len = 0;
+    uint32_t start, end, limit, bit;
+    int pass;
+
+    /* from the hint to the end, then wrap around */
+    lo[0] = fsa->zone_hint;
+    hi[0] = fsa->num_zone_bits;
+    lo[1] = 1;
+    hi[1] = fsa->zone_hint;
+    for(pass = 0; pass < 2 && best_len < want; pass++){
+        start = lo[pass];
+        while(start < hi[pass]){
+            start = next_bit(fsa->zmap, start, hi[pass], FALSE);
+            if(start == hi[pass]){
+                break;
+            }
+            limit = hi[pass] - start < want ? hi[pass] : start + want;
+            end = next_bit(fsa->zmap, start, limit, TRUE);
+            if(end - start > best_len){
+                best = start;
+                best_len = end - start;
+                if(best_len >= want){
+                    break;
+                }
+            }
+            start = end;
+        }
+    }
+    if(best_len == 0){
+        return 0;
+    }
+
+    for(bit = best; bit < best + best_len; bit++){
+        set_bit(fsa->zmap, bit);
+    }
+    fsa->free_zones -= best_len;
+    fsa->zone_hint = best + best_len;
+    *len = best_len;
+    return best + fsa->super.firstdata - 1;
+}
+
+/* takes "count" zones into "zones" in as few runs as it can.
+   If there aren't enough, gives back the ones it took and
+   returns EXIT_FAILURE */
+int fsa_alloc_zones(struct fs_alloc *fsa, uint32_t count, uint32_t *zones){
+    uint32_t got = 0, start, len, i;
+
+    if(count > fsa->free_zones){
+        fprintf(stderr, FSA_NOSPACE);
+        return EXIT_FAILURE;
+    }
+    while(got < count){
+        start = fsa_take_run(fsa, count - got, &len);
+        if(start == 0){
+            for(i = 0; i < got; i++){
+                fsa_free_zone(fsa, zones[i]);
+            }
+            fprintf(stderr, FSA_NOSPACE);
+            return EXIT_FAILURE;
+        }
+        for(i = 0; i < len; i++){
+            zones[got++] = start + i;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/* marks "zone" free again, or only notes it when frees are
+   deferred. Zones outside the data area are ignored. A zone
+   that can't be noted stays taken, which loses it but never
+   lets it be handed out twice */
+void fsa_free_zone(struct fs_alloc *fsa, uint32_t zone){
+    uint32_t bit, *grown;
+
+    if(zone < fsa->super.firstdata || zone >= fsa->super.zones){
+        return;
+    }
+    bit = zone - fsa->super.firstdata + 1;
+    if(!bit_set(fsa->zmap, bit)){
+        return;
+    }
+    if(fsa->defer_frees){
+        if(fsa->num_pending == fsa->pending_cap){
+            fsa->pending_cap = fsa->pending_cap ? fsa->pending_cap * 2 :
+                                                  FSA_INIT_PENDING;
+            grown = realloc(fsa->pending, sizeof(uint32_t) *
+                                          fsa->pending_cap);
+            if(grown == NULL){
+                fsa->pending_cap = fsa->num_pending;
+                return;
+            }
+            fsa->pending = grown;
+        }
+        fsa->pending[fsa->num_pending++] = bit;
+        return;
+    }
+    clear_bit(fsa->zmap, bit);
+    fsa->free_zones++;
+}
+
+/* frees every zone whose free was deferred, once
+   nothing on disk points at them any more */
+void fsa_release(struct fs_alloc *fsa){
+    uint32_t i;
+
+    for(i = 0; i < fsa->num_pending; i++){
+        if(bit_set(fsa->zmap, fsa->pending[i])){
+            clear_bit(fsa->zmap, fsa->pending[i]);
+            fsa->free_zones++;
+        }
+    }
+    fsa->num_pending = 0;
+}
+
+/* marks every data zone free, for laying
+   out a file system from scratch */
+void fsa_clear_zones(struct fs_alloc *fsa){
+    uint32_t bit, whole = fsa->num_zone_bits / 8;
+
+    /* whole bytes at once past the first, which holds
+       the reserved bit, and bit by bit at either end */
+    for(bit = 1; bit < fsa->num_zone_bits && bit < 8; bit++){
+        clear_bit(fsa->zmap, bit);
+    }
+    if(whole > 1){
+        memset(fsa->zmap + 1, 0, whole - 1);
+    }
+    for(bit = whole > 1 ? whole * 8 : 8; bit < fsa->num_zone_bits; bit++){
+        clear_bit(fsa->zmap, bit);
+    }
+    fsa->free_zones = fsa->num_zone_bits - 1;
+    fsa->num_pending = 0;
+    fsa->zone_hint = 1;
+}
+
+/* frees every data zone and indirect table of "node" and
+   clears its zone pointers. The size is left as it is */
+int fsa_free_file(struct fs_alloc *fsa, struct inode *node){
+    uint32_t *zones, *table, num_zones, num_tables, i;
+
+    zones = resolve_zones(fsa->image, node, fsa->disk_start, &fsa->geom,
+                          &num_zones, NULL);
+    if(zones == NULL){
+        return EXIT_FAILURE;
+    }
+    for(i = 0; i < num_zones; i++){
+        fsa_free_zone(fsa, zones[i]);
+    }
+    free(zones);
+
+    /* the tables the double indirect table lists */
+    num_tables = fsa_table_count(fsa, num_zones);
+    if(node->two_indirect != 0 && num_tables > 2){
+        table = malloc(fsa->geom.zone_size);
+        if(table == NULL){
+            perror(MALLOCERR);
+            return EXIT_FAILURE;
+        }
+        if(read_zone(fsa->image, fsa->disk_start, fsa->geom.zone_size,
+                     node->two_indirect, table) == EXIT_FAILURE){
+            free(table);
+            return EXIT_FAILURE;
+        }
+        for(i = 0; i < num_tables - 2; i++){
+            fsa_free_zone(fsa, table[i]);
+        }
+        free(table);
+    }
+    fsa_free_zone(fsa, node->indirect);
+    fsa_free_zone(fsa, node->two_indirect);
+
+    memset(node->zone, 0, sizeof(node->zone));
+    node->indirect = 0;
+    node->two_indirect = 0;
+    return EXIT_SUCCESS;
+}
+
+/* points "node" at "num_data" data zones. "zones" starts with
+   the "fsa_table_count" zones its indirect tables go in, the
+   indirect table, the double indirect table and then the
+   tables that one lists, and the data zones follow. Every
+   table is built in one buffer and written at once */
+int fsa_map_file(struct fs_alloc *fsa, struct inode *node,
+                 uint32_t *zones, uint32_t num_data){
+    uint32_t num_tables = fsa_table_count(fsa, num_data);
+    uint32_t per = fsa->geom.per_table;
+    uint32_t *data = zones + num_tables, *tables, *table, i, n;
+
+    memset(node->zone, 0, sizeof(node->zone));
+    node->indirect = 0;
+    node->two_indirect = 0;
+    for(i = 0; i < num_data && i < DIRECT_ZONES; i++){
+        node->zone[i] = data[i];
+    }
+    if(num_tables == 0){
+        return EXIT_SUCCESS;
+    }
+
+    tables = calloc(num_tables, fsa->geom.zone_size);
+    if(tables == NULL){
+        perror(MALLOCERR);
+        return EXIT_FAILURE;
+    }
+
+    /* the indirect table */
+    node->indirect = zones[0];
+    n = num_data - i < per ? num_data - i : per;
+    memcpy(tables, &data[i], sizeof(uint32_t) * n);
+    i += n;
+
+    /* the double indirect table, then each table it lists */
+    if(num_tables > 1){
+        node->two_indirect = zones[1];
+        memcpy((char*)tables + fsa->geom.zone_size, &zones[2],
+               sizeof(uint32_t) * (num_tables - 2));
+        table = (uint32_t*)((char*)tables + 2 * fsa->geom.zone_size);
+        while(i < num_data){
+            n = num_data - i < per ? num_data - i : per;
+            memcpy(table, &data[i], sizeof(uint32_t) * n);
+            i += n;
+            table = (uint32_t*)((char*)table + fsa->geom.zone_size);
+        }
+    }
+
+    if(fsa_write_zones(fsa, zones, num_tables, tables) == EXIT_FAILURE){
+        free(tables);
+        return EXIT_FAILURE;
+    }
+    free(tables);
+    return EXIT_SUCCESS;
+}
+
+/* writes "count" zones from "buf" to "zones", one write for
+   every run of contiguous zones. Holes are skipped */
+int fsa_write_zones(struct fs_alloc *fsa, uint32_t *zones, uint32_t count,
+                    void *buf){
+    uint32_t i, run;
+    size_t len;
+
+    for(i = 0; i < count; i += run){
+        run = 1;
+        if(zones[i] == 0){
+            continue;
+        }
+        while(i + run < count && zones[i + run] == zones[i] + run){
+            run++;
+        }
+        len = (size_t)fsa->geom.zone_size * run;
+        if(pwrite(fsa->image, (char*)buf + (size_t)fsa->geom.zone_size * i,
+                  len, fsa->disk_start + (off_t)fsa->geom.zone_size *
+                                         zones[i]) != (ssize_t)len){
+            perror(WRITEERR);
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/* returns how many runs of contiguous zones "zones" is in.
+   Holes are skipped over, zones on either side of one that
+   are next to each other on disk are still one run */
+uint32_t fsa_count_extents(uint32_t *zones, uint32_t count){
+    uint32_t i, last = 0, extents = 0;
+
+    for(i = 0; i < count; i++){
+        if(zones[i] == 0){
+            continue;
+        }
+        if(last == 0 || zones[i] != last + 1){
+            extents++;
+        }
+        last = zones[i];
+    }
+    return extents;
+}
@@ -0,0 +1,68 @@
+#ifndef FSALLOC_H
+#define FSALLOC_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include "util.h"
+
+#define FSA_WORD_BITS 64
+#define FSA_INIT_PENDING 1024
+#define FSA_NOSPACE "not enough free zones in the image\n"
+#define FSA_NOINODES "not enough free inodes in the image\n"
+#define FSA_BADMAPS "bitmaps are too small for the file system\n"
+#define WRITEERR "write error"
+
+/* an image opened for writing. Both bitmaps and the whole
+   inode table are read once and changed in memory, then
+   "fsa_flush" writes the bitmaps and the blocks of the table
+   that changed back in as few writes as it can, so adding
+   many files never reads and rewrites a block per file.
+   Zones are handed out in contiguous runs, searched for from
+   where the last run ended. Bit 0 of both bitmaps is
+   reserved, bit "n" of the zone bitmap is zone
+   "firstdata + n - 1".
+   With "defer_frees" set, freed zones stay taken until
+   "fsa_release", so nothing freed can be written over before
+   the pointers that moved off it are safely on disk */
+struct fs_alloc {
+    int image;
+    off_t disk_start;
+    struct superblock super;
+    struct zone_geom geom;
+    uint8_t *imap;
+    uint8_t *zmap;
+    size_t imap_size;       /* bytes, all the blocks each map takes up */
+    size_t zmap_size;
+    uint32_t num_inode_bits;
+    uint32_t num_zone_bits;
+    struct inode *inodes;   /* the whole inode table */
+    uint8_t *dirty;         /* per block of the inode table */
+    uint32_t num_blocks;
+    uint32_t inode_hint;    /* bits the next searches start from */
+    uint32_t zone_hint;
+    uint32_t free_inodes;
+    uint32_t free_zones;
+    int defer_frees;
+    uint32_t *pending;      /* zones freed since the last release */
+    uint32_t num_pending;
+    uint32_t pending_cap;
+};
+
+int fsa_open(struct fs_alloc *, int, off_t);
+void fsa_close(struct fs_alloc *);
+int fsa_flush(struct fs_alloc *);
+struct inode *fsa_inode(struct fs_alloc *, uint32_t);
+int fsa_inode_used(struct fs_alloc *, uint32_t);
+uint32_t fsa_new_inode(struct fs_alloc *);
+uint32_t fsa_table_count(struct fs_alloc *, uint32_t);
+uint32_t fsa_take_run(struct fs_alloc *, uint32_t, uint32_t *);
+int fsa_alloc_zones(struct fs_alloc *, uint32_t, uint32_t *);
+void fsa_free_zone(struct fs_alloc *, uint32_t);
+void fsa_release(struct fs_alloc *);
+void fsa_clear_zones(struct fs_alloc *);
+int fsa_free_file(struct fs_alloc *, struct inode *);
+int fsa_map_file(struct fs_alloc *, struct inode *, uint32_t *, uint32_t);
+int fsa_write_zones(struct fs_alloc *, uint32_t *, uint32_t, void *);
+uint32_t fsa_count_extents(uint32_t *, uint32_t);
+
+#endif
@@ -0,0 +1,243 @@
+#include <string.h>
+#include <pthread.h>
+#include "hash.h"
+
+#define CRC32C_POLY 0x82F63B78
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static int crc_hw;
+
+/* builds the tables for the software CRC, eight bytes at
+   a time, and checks once whether the CPU can do it */
+static void crc_setup(void){
+    uint32_t i, j, crc;
+
+    for(i = 0; i < 256; i++){
+        crc = i;
+        for(j = 0; j < 8; j++){
+            crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+        }
+        crc_table[0][i] = crc;
+    }
+    for(i = 0; i < 256; i++){
+        for(j = 1; j < 8; j++){
+            crc_table[j][i] = (crc_table[j - 1][i] >> 8) ^
+                              crc_table[0][crc_table[j - 1][i] & 0xFF];
+        }
+    }
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    crc_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#if defined(__x86_64__)
+/* CRC32C using the SSE 4.2 crc32 instruction */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len){
+    uint64_t crc64 = crc, word;
+
+    while(len >= sizeof(uint64_t)){
+        memcpy(&word, p, sizeof(uint64_t));
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+        p += sizeof(uint64_t);
+        len -= sizeof(uint64_t);
+    }
+    crc = (uint32_t)crc64;
+    while(len > 0){
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+        len--;
+    }
+    return crc;
+}
+#endif
+
+/* CRC32C eight bytes per step from the tables,
+   assumes a little endian host */
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len){
+    uint32_t lo, hi;
+
+    while(len >= 8){
+        memcpy(&lo, p, sizeof(uint32_t));
+        memcpy(&hi, p + 4, sizeof(uint32_t));
+        lo ^= crc;
+        crc = crc_table[7][lo & 0xFF] ^ crc_table[6][(lo >> 8) & 0xFF] ^
+              crc_table[5][(lo >> 16) & 0xFF] ^ crc_table[4][lo >> 24] ^
+              crc_table[3][hi & 0xFF] ^ crc_table[2][(hi >> 8) & 0xFF] ^
+              crc_table[1][(hi >> 16) & 0xFF] ^ crc_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while(len > 0){
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xFF];
+        len--;
+    }
+    return crc;
+}
+
+/* continues a CRC32C (Castagnoli) over "len" more bytes. Starts
+   from and returns the raw register, so callers begin with
+   0xFFFFFFFF and invert the result when done */
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t len){
+    pthread_once(&crc_once, crc_setup);
+#if defined(__x86_64__)
+    if(crc_hw){
+        return crc32c_hw(crc, data, len);
+    }
+#endif
+    return crc32c_sw(crc, data, len);
+}
+
+static uint64_t rotl64(uint64_t x, int r){
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char *p){
+    uint64_t v;
+    memcpy(&v, p, sizeof(uint64_t));
+    return v;
+}
+
+static uint32_t read32(const unsigned char *p){
+    uint32_t v;
+    memcpy(&v, p, sizeof(uint32_t));
+    return v;
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input){
+    acc += input * XXH_P2;
+    acc = rotl64(acc, 31);
+    return acc * XXH_P1;
+}
+
+static uint64_t xxh_merge(uint64_t hash, uint64_t acc){
+    hash ^= xxh_round(0, acc);
+    return hash * XXH_P1 + XXH_P4;
+}
+
+/* starts a 64 bit xxHash with a seed of 0 */
+void xxh64_init(struct xxh64_state *st){
+    memset(st, 0, sizeof(struct xxh64_state));
+    st->acc[0] = XXH_P1 + XXH_P2;
+    st->acc[1] = XXH_P2;
+    st->acc[2] = 0;
+    st->acc[3] = -XXH_P1;
+}
+
+/* feeds "len" more bytes, in whole 32 byte stripes with any
+   leftover kept until the next call */
+void xxh64_update(struct xxh64_state *st, const void *data, size_t len){
+    const unsigned char *p = data;
+    uint32_t fill;
+
+    st->total += len;
+
+    /* finish a stripe left over from last time */
+    if(st->stripe_len > 0){
+        fill = XXH_STRIPE - st->stripe_len;
+        if(len < fill){
+            memcpy(st->stripe + st->stripe_len, p, len);
+            st->stripe_len += len;
+            return;
+        }
+        memcpy(st->stripe + st->stripe_len, p, fill);
+        st->acc[0] = xxh_round(st->acc[0], read64(st->stripe));
+        st->acc[1] = xxh_round(st->acc[1], read64(st->stripe + 8));
+        st->acc[2] = xxh_round(st->acc[2], read64(st->stripe + 16));
+        st->acc[3] = xxh_round(st->acc[3], read64(st->stripe + 24));
+        p += fill;
+        len -= fill;
+        st->stripe_len = 0;
+    }
+
+    while(len >= XXH_STRIPE){
+        st->acc[0] = xxh_round(st->acc[0], read64(p));
+        st->acc[1] = xxh_round(st->acc[1], read64(p + 8));
+        st->acc[2] = xxh_round(st->acc[2], read64(p + 16));
+        st->acc[3] = xxh_round(st->acc[3], read64(p + 24));
+        p += XXH_STRIPE;
+        len -= XXH_STRIPE;
+    }
+
+    memcpy(st->stripe, p, len);
+    st->stripe_len = len;
+}
+
+/* returns the digest of everything fed so far */
+uint64_t xxh64_final(struct xxh64_state *st){
+    const unsigned char *p = st->stripe;
+    uint32_t len = st->stripe_len;
+    uint64_t hash;
+
+    if(st->total >= XXH_STRIPE){
+        hash = rotl64(st->acc[0], 1) + rotl64(st->acc[1], 7) +
+               rotl64(st->acc[2], 12) + rotl64(st->acc[3], 18);
+        hash = xxh_merge(hash, st->acc[0]);
+        hash = xxh_merge(hash, st->acc[1]);
+        hash = xxh_merge(hash, st->acc[2]);
+        hash = xxh_merge(hash, st->acc[3]);
+    }else{
+        hash = st->acc[2] + XXH_P5;
+    }
+    hash += st->total;
+
+    while(len >= 8){
+        hash ^= xxh_round(0, read64(p));
+        hash = rotl64(hash, 27) * XXH_P1 + XXH_P4;
+        p += 8;
+        len -= 8;
+    }
+    if(len >= 4){
+        hash ^= (uint64_t)read32(p) * XXH_P1;
+        hash = rotl64(hash, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+        len -= 4;
+    }
+    while(len > 0){
+        hash ^= (*p++) * XXH_P5;
+        hash = rotl64(hash, 11) * XXH_P1;
+        len--;
+    }
+
+    hash ^= hash >> 33;
+    hash *= XXH_P2;
+    hash ^= hash >> 29;
+    hash *= XXH_P3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+void hash_init(struct hasher *h, int algo){
+    h->algo = algo;
+    h->crc = 0xFFFFFFFF;
+    if(algo == HASH_XXH64){
+        xxh64_init(&h->xxh);
+    }
+}
+
+void hash_update(struct hasher *h, const void *data, size_t len){
+    if(h->algo == HASH_XXH64){
+        xxh64_update(&h->xxh, data, len);
+    }else{
+        h->crc = crc32c_update(h->crc, data, len);
+    }
+}
+
+uint64_t hash_final(struct hasher *h){
+    if(h->algo == HASH_XXH64){
+        return xxh64_final(&h->xxh);
+    }
+    return ~h->crc;
+}
+
+/* hex digits needed to print a digest of "algo" */
+int hash_digits(int algo){
+    return algo == HASH_XXH64 ? 16 : 8;
+}
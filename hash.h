@@ -0,0 +1,36 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#define HASH_CRC32C 0
+#define HASH_XXH64 1
+#define XXH_STRIPE 32
+
+/* running state of a 64 bit xxHash */
+struct xxh64_state {
+    uint64_t acc[4];
+    uint64_t total;
+    unsigned char stripe[XXH_STRIPE];
+    uint32_t stripe_len;
+};
+
+/* one digest being built, fed any number of times then
+   finished once. "algo" is HASH_CRC32C or HASH_XXH64 */
+struct hasher {
+    int algo;
+    uint32_t crc;
+    struct xxh64_state xxh;
+};
+
+uint32_t crc32c_update(uint32_t, const void *, size_t);
+void xxh64_init(struct xxh64_state *);
+void xxh64_update(struct xxh64_state *, const void *, size_t);
+uint64_t xxh64_final(struct xxh64_state *);
+void hash_init(struct hasher *, int);
+void hash_update(struct hasher *, const void *, size_t);
+uint64_t hash_final(struct hasher *);
+int hash_digits(int);
+
+#endif
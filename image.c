@@ -0,0 +1,718 @@
+#include "image.h"
+
+#define RELOADERR "image layout changed since it was opened, not reloading"
+
+/* where "image_collect" is up to */
+struct collect_state {
+    struct image_handle *img;
+    uint8_t *visited;   /* directories walked, by inode number */
+    struct image_file *files;
+    uint32_t num;
+    uint32_t cap;
+};
+
+static void image_reload(struct image_handle *);
+static void image_reclaim(struct image_handle *);
+static void retired_free(struct image_handle *, struct image_retired *);
+static int collect_tree(struct collect_state *, uint32_t, char *);
+static int collect_file(struct collect_state *, uint32_t, char *);
+
+/* opens the image at "path", finding the partition if one
+   is given, and reads its superblock and inode table.
+   Returns an allocated handle or NULL on error */
+struct image_handle *image_open(char *path, int part, int sub_part, int isV){
+    struct image_handle *img;
+    uint32_t disk_start = 0, part_size;
+    int i;
+
+    img = calloc(1, sizeof(struct image_handle));
+    if(img == NULL){
+        perror(MALLOCERR);
+        return NULL;
+    }
+
+    if((img->fd = cimg_open(path)) < 0){
+        perror(FILEERR);
+        free(img);
+        return NULL;
+    }
+    img->part = part;
+    img->sub_part = sub_part;
+
+    /* find start of disk the same way minls does,
+       reusing the descriptor that is already open */
+    if(part != NO_PART){
+        if(partition_finder_fd(img->fd, part, sub_part,
+                               &disk_start, &part_size, isV) == EXIT_FAILURE){
+            cimg_close(img->fd);
+            free(img);
+            return NULL;
+        }
+    }
+    img->disk_start = (off_t)disk_start * SECTOR_SIZE;
+
+    img->super = get_superblock(img->fd, img->disk_start, isV);
+    if(img->super == NULL){
+        cimg_close(img->fd);
+        free(img);
+        return NULL;
+    }
+    img->zone_size = img->super->blocksize << img->super->log_zone_size;
+    geom_select(img->super, &img->geom);
+    img->inode_table = get_inode_table(img->fd, img->super,
+                                       img->disk_start, NULL);
+
+    /* per inode caches are indexed by inode number */
+    img->path = strdup(path);
+    img->shards = calloc(CACHE_SHARDS, sizeof(struct cache_shard));
+    img->dirs = calloc(img->super->ninodes + 1, sizeof(struct dir_entry*));
+    img->zone_lists = calloc(img->super->ninodes + 1, sizeof(uint32_t*));
+    img->zone_counts = calloc(img->super->ninodes + 1, sizeof(uint32_t));
+    for(i = 0; i < INODE_LOCKS; i++){
+        pthread_mutex_init(&img->inode_locks[i], NULL);
+    }
+    pthread_mutex_init(&img->reload_lock, NULL);
+    if(img->shards != NULL){
+        for(i = 0; i < CACHE_SHARDS; i++){
+            pthread_mutex_init(&img->shards[i].lock, NULL);
+        }
+    }
+    if(img->inode_table == NULL || img->path == NULL ||
+       img->shards == NULL || img->dirs == NULL ||
+       img->zone_lists == NULL || img->zone_counts == NULL ||
+       pcache_init(&img->paths, img->fd, PCACHE_MAX_BYTES) == EXIT_FAILURE){
+        perror(MALLOCERR);
+        image_close(img);
+        return NULL;
+    }
+
+    return img;
+}
+
+/* closes the image and frees everything cached for it.
+   No other thread may be using the handle */
+void image_close(struct image_handle *img){
+    struct image_retired *old, *older;
+    uint32_t i, j;
+
+    if(img == NULL) return;
+
+    if(img->shards != NULL){
+        for(i = 0; i < CACHE_SHARDS; i++){
+            for(j = 0; j < SHARD_SLOTS; j++){
+                free(img->shards[i].slots[j].data);
+            }
+            pthread_mutex_destroy(&img->shards[i].lock);
+        }
+    }
+    if(img->dirs != NULL && img->zone_lists != NULL){
+        for(i = 0; i <= img->super->ninodes; i++){
+            free(img->dirs[i]);
+            free(img->zone_lists[i]);
+        }
+    }
+    for(old = img->retired; old != NULL; old = older){
+        older = old->older;
+        retired_free(img, old);
+    }
+    for(i = 0; i < INODE_LOCKS; i++){
+        pthread_mutex_destroy(&img->inode_locks[i]);
+    }
+    pthread_mutex_destroy(&img->reload_lock);
+    pcache_free(&img->paths);
+    free(img->shards);
+    free(img->dirs);
+    free(img->zone_lists);
+    free(img->zone_counts);
+    free(img->inode_table);
+    free(img->super);
+    free(img->path);
+    cimg_close(img->fd);
+    free(img);
+}
+
+/* marks the calling thread as using the handle, returning
+   the generation to give "image_leave". Until then nothing
+   the handle gives it is freed by a reload */
+uint32_t image_enter(struct image_handle *img){
+    uint32_t generation;
+
+    pthread_mutex_lock(&img->reload_lock);
+    img->readers++;
+    generation = img->generation;
+    pthread_mutex_unlock(&img->reload_lock);
+    return generation;
+}
+
+/* undoes "image_enter", freeing whatever generations
+   no reader can be holding any more */
+void image_leave(struct image_handle *img, uint32_t generation){
+    struct image_retired *old;
+
+    pthread_mutex_lock(&img->reload_lock);
+    if(generation == img->generation){
+        img->readers--;
+    }else{
+        for(old = img->retired; old != NULL &&
+                                old->generation != generation;
+            old = old->older);
+        if(old != NULL){
+            old->readers--;
+        }
+        image_reclaim(img);
+    }
+    pthread_mutex_unlock(&img->reload_lock);
+}
+
+/* reads one zone of the image into "buf" through the zone
+   cache. Only the zone's shard is locked and never while
+   reading from disk, so a miss doesn't hold up other
+   threads reading the same shard */
+int image_read_zone(struct image_handle *img, uint32_t zone, void *buf){
+    struct cache_shard *shard;
+    struct cache_slot *slot;
+    uint32_t generation;
+
+    /* holes are never cached */
+    if(zone == 0){
+        memset(buf, 0, img->zone_size);
+        return EXIT_SUCCESS;
+    }
+
+    shard = &img->shards[zone % CACHE_SHARDS];
+    slot = &shard->slots[(zone / CACHE_SHARDS) % SHARD_SLOTS];
+
+    pthread_mutex_lock(&shard->lock);
+    if(slot->zone == zone){
+        memcpy(buf, slot->data, img->zone_size);
+        pthread_mutex_unlock(&shard->lock);
+        return EXIT_SUCCESS;
+    }
+    generation = img->generation;
+    pthread_mutex_unlock(&shard->lock);
+
+    if(read_zone(img->fd, img->disk_start, img->zone_size,
+                 zone, buf) == EXIT_FAILURE){
+        return EXIT_FAILURE;
+    }
+
+    /* keep a copy, replacing whatever zone the slot held,
+       unless a reload while reading may have made it stale */
+    pthread_mutex_lock(&shard->lock);
+    if(generation != img->generation){
+        pthread_mutex_unlock(&shard->lock);
+        return EXIT_SUCCESS;
+    }
+    if(slot->data == NULL){
+        slot->data = malloc(img->zone_size);
+    }
+    if(slot->data != NULL){
+        memcpy(slot->data, buf, img->zone_size);
+        slot->zone = zone;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return EXIT_SUCCESS;
+}
+
+/* the zone list of inode "ino", resolving it on first use.
+   Its inode lock must be held */
+static uint32_t *zones_locked(struct image_handle *img, uint32_t ino,
+                              uint32_t *num_zones){
+    if(img->zone_lists[ino] == NULL){
+        img->zone_lists[ino] = resolve_zones(img->fd,
+                                             &img->inode_table[ino - 1],
+                                             img->disk_start,
+                                             &img->geom,
+                                             &img->zone_counts[ino],
+                                             NULL);
+    }
+    *num_zones = img->zone_counts[ino];
+    return img->zone_lists[ino];
+}
+
+/* the entries of directory inode "ino", reading it through
+   the zone cache on first use. Its inode lock must be held,
+   so the zones and the entries are of the same generation */
+static struct dir_entry *dir_locked(struct image_handle *img, uint32_t ino){
+    struct dir_entry *dir;
+    uint32_t *zones, num_zones, i;
+    uintptr_t dst;
+
+    if((img->inode_table[ino - 1].mode & FILE_TYPE_MASK) != DIR_MASK){
+        fprintf(stderr, "%s\n", DIRERR);
+        return NULL;
+    }
+    if(img->dirs[ino] != NULL){
+        return img->dirs[ino];
+    }
+
+    zones = zones_locked(img, ino, &num_zones);
+    if(zones == NULL){
+        return NULL;
+    }
+    dir = malloc((size_t)img->zone_size * (num_zones ? num_zones : 1));
+    if(dir == NULL){
+        perror(MALLOCERR);
+        return NULL;
+    }
+    for(i = 0; i < num_zones; i++){
+        dst = (uintptr_t)dir + (uintptr_t)img->zone_size * i;
+        if(image_read_zone(img, zones[i], (void*)dst) == EXIT_FAILURE){
+            free(dir);
+            return NULL;
+        }
+    }
+    img->dirs[ino] = dir;
+    return dir;
+}
+
+/* copies inode "ino" to "node". Returns EXIT_FAILURE
+   if there is no such inode */
+int image_get_inode(struct image_handle *img, uint32_t ino,
+                    struct inode *node){
+    pthread_mutex_t *lock;
+
+    if(ino == NO_INODE || ino > img->super->ninodes){
+        fprintf(stderr, "%s\n", INODEERR);
+        return EXIT_FAILURE;
+    }
+
+    lock = &img->inode_locks[ino % INODE_LOCKS];
+    pthread_mutex_lock(lock);
+    *node = img->inode_table[ino - 1];
+    pthread_mutex_unlock(lock);
+    return EXIT_SUCCESS;
+}
+
+/* returns the resolved zone list of inode "ino", resolving
+   and keeping it on first use, and copies the inode it was
+   resolved from to "node" unless that is NULL. The list
+   stays valid as long as the handle says. On error
+   returns NULL */
+uint32_t *image_get_zones(struct image_handle *img,
+                          uint32_t ino,
+                          uint32_t *num_zones,
+                          struct inode *node){
+    pthread_mutex_t *lock;
+    uint32_t *zones;
+
+    if(ino == NO_INODE || ino > img->super->ninodes){
+        fprintf(stderr, "%s\n", INODEERR);
+        return NULL;
+    }
+
+    lock = &img->inode_locks[ino % INODE_LOCKS];
+    pthread_mutex_lock(lock);
+    if(node != NULL){
+        *node = img->inode_table[ino - 1];
+    }
+    zones = zones_locked(img, ino, num_zones);
+    pthread_mutex_unlock(lock);
+    return zones;
+}
+
+/* returns every entry of directory inode "ino", reading it
+   through the zone cache and keeping it on first use, and
+   copies the inode to "node" unless that is NULL. Only
+   "node->size" bytes of entries are there. The entries
+   stay valid as long as the handle says. On error
+   returns NULL */
+struct dir_entry *image_get_dir(struct image_handle *img, uint32_t ino,
+                                struct inode *node){
+    pthread_mutex_t *lock;
+    struct dir_entry *dir;
+
+    if(ino == NO_INODE || ino > img->super->ninodes){
+        fprintf(stderr, "%s\n", INODEERR);
+        return NULL;
+    }
+
+    lock = &img->inode_locks[ino % INODE_LOCKS];
+    pthread_mutex_lock(lock);
+    if(node != NULL){
+        *node = img->inode_table[ino - 1];
+    }
+    dir = dir_locked(img, ino);
+    pthread_mutex_unlock(lock);
+    return dir;
+}
+
+/* finds "name" in directory inode "dir", setting "ino" to
+   what it names or NO_INODE if nothing. Returns EXIT_FAILURE
+   only if the directory can't be read */
+static int find_entry(struct image_handle *img, uint32_t dir_ino,
+                      char *name, uint32_t *ino){
+    pthread_mutex_t *lock = &img->inode_locks[dir_ino % INODE_LOCKS];
+    struct dir_entry *dir;
+    struct inode cur;
+    uint32_t num_entries, i;
+
+    *ino = NO_INODE;
+    if(strlen(name) > NAME_SIZE){
+        return EXIT_SUCCESS;
+    }
+
+    /* the inode is copied with its directory so both
+       are of the same generation */
+    pthread_mutex_lock(lock);
+    cur = img->inode_table[dir_ino - 1];
+    if((cur.mode & FILE_TYPE_MASK) != DIR_MASK){
+        pthread_mutex_unlock(lock);
+        fprintf(stderr, "%s\n", DIRERR);
+        return EXIT_SUCCESS;
+    }
+    dir = dir_locked(img, dir_ino);
+    pthread_mutex_unlock(lock);
+    if(dir == NULL){
+        return EXIT_FAILURE;
+    }
+
+    num_entries = cur.size / sizeof(struct dir_entry);
+    for(i = 0; i < num_entries; i++){
+        if(dir[i].inode != 0 && dir[i].inode <= img->super->ninodes &&
+           strncmp(name, (char*)dir[i].name, NAME_SIZE) == 0){
+            *ino = dir[i].inode;
+            break;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/* returns the inode number "path" names, or NO_INODE if any
+   part of it can't be found. The path is canonicalized
+   first and every prefix walked is remembered, names that
+   aren't there too, so a path seen before is one probe of
+   the path cache and a new one is only walked from its
+   longest prefix already known. The handle is reloaded
+   first if the image has been written to. Doesn't
+   modify "path" */
+uint32_t image_lookup(struct image_handle *img, char *path){
+    char *copy, *name, *slash;
+    uint32_t ino = ROOT_INODE, generation;
+    size_t len, end;
+
+    copy = malloc(strlen(path) + 2);
+    if(copy == NULL){
+        perror(MALLOCERR);
+        return NO_INODE;
+    }
+    strcpy(copy, path);
+    canonicalizer(copy);
+    len = strlen(copy);
+
+    /* shorten the path a name at a time until what
+       is left is known, the root always is */
+    if(pcache_check(&img->paths, img->fd)){
+        image_reload(img);
+    }
+    generation = pcache_generation(&img->paths);
+    for(end = len; end > 1 && !pcache_get(&img->paths, copy, end, &ino);){
+        while(copy[--end] != SLASH);
+        if(end == 0){
+            end = 1;
+        }
+    }
+    if(end == 1){
+        ino = ROOT_INODE;
+    }
+
+    /* then walk the rest */
+    while(end < len && ino != NO_INODE){
+        name = copy + end + (copy[end] == SLASH);
+        slash = strchr(name, SLASH);
+        if(slash != NULL){
+            *slash = '\0';
+        }
+        if(find_entry(img, ino, name, &ino) == EXIT_FAILURE){
+            free(copy);
+            return NO_INODE;
+        }
+        end = name - copy + strlen(name);
+        if(slash != NULL){
+            *slash = SLASH;
+        }
+        pcache_put(&img->paths, copy, end, ino, generation);
+    }
+
+    /* a path under a missing one is missing too */
+    if(end < len){
+        pcache_put(&img->paths, copy, len, NO_INODE, generation);
+    }
+    free(copy);
+    return ino;
+}
+
+/* rereads the inode table and starts the directory, zone
+   list, zone and path caches over, once the image file has
+   been written to. The old caches are kept for as long as
+   a reader that entered before may be using them. A compressed
+   image keeps the index it was opened with so it is read as
+   it was then, and so is an image whose superblock no
+   longer matches, every cache is sized by it */
+static void image_reload(struct image_handle *img){
+    struct image_retired *old;
+    struct superblock *super;
+    struct inode *table;
+    struct dir_entry **dirs;
+    uint32_t **zone_lists, *zone_counts, generation;
+    int i, j, same;
+
+    if(cimg_is_compressed(img->fd)){
+        return;
+    }
+    pthread_mutex_lock(&img->reload_lock);
+    super = get_superblock(img->fd, img->disk_start, FALSE);
+    same = super != NULL &&
+           memcmp(super, img->super, sizeof(struct superblock)) == 0;
+    free(super);
+    if(!same){
+        fprintf(stderr, "%s: %s\n", img->path, RELOADERR);
+        pthread_mutex_unlock(&img->reload_lock);
+        return;
+    }
+
+    old = malloc(sizeof(struct image_retired));
+    table = get_inode_table(img->fd, img->super, img->disk_start, NULL);
+    dirs = calloc(img->super->ninodes + 1, sizeof(struct dir_entry*));
+    zone_lists = calloc(img->super->ninodes + 1, sizeof(uint32_t*));
+    zone_counts = calloc(img->super->ninodes + 1, sizeof(uint32_t));
+    if(old == NULL || table == NULL || dirs == NULL ||
+       zone_lists == NULL || zone_counts == NULL){
+        perror(MALLOCERR);
+        free(old);
+        free(table);
+        free(dirs);
+        free(zone_lists);
+        free(zone_counts);
+        pthread_mutex_unlock(&img->reload_lock);
+        return;
+    }
+
+    /* inode locks are always taken before shard locks */
+    for(i = 0; i < INODE_LOCKS; i++){
+        pthread_mutex_lock(&img->inode_locks[i]);
+    }
+    for(i = 0; i < CACHE_SHARDS; i++){
+        pthread_mutex_lock(&img->shards[i].lock);
+    }
+    old->inode_table = img->inode_table;
+    old->dirs = img->dirs;
+    old->zone_lists = img->zone_lists;
+    old->zone_counts = img->zone_counts;
+    old->generation = img->generation;
+    old->readers = img->readers;
+    img->readers = 0;
+    old->older = img->retired;
+    img->retired = old;
+    img->inode_table = table;
+    img->dirs = dirs;
+    img->zone_lists = zone_lists;
+    img->zone_counts = zone_counts;
+    for(i = 0; i < CACHE_SHARDS; i++){
+        for(j = 0; j < SHARD_SLOTS; j++){
+            img->shards[i].slots[j].zone = 0;
+        }
+    }
+    generation = ++img->generation;
+    for(i = 0; i < CACHE_SHARDS; i++){
+        pthread_mutex_unlock(&img->shards[i].lock);
+    }
+    for(i = 0; i < INODE_LOCKS; i++){
+        pthread_mutex_unlock(&img->inode_locks[i]);
+    }
+
+    pcache_reset(&img->paths, generation);
+    image_reclaim(img);
+    pthread_mutex_unlock(&img->reload_lock);
+}
+
+/* frees the oldest retired generations up to the oldest
+   one a reader is still in. "reload_lock" must be held */
+static void image_reclaim(struct image_handle *img){
+    struct image_retired **cut = &img->retired, *old, *older;
+
+    for(old = img->retired; old != NULL; old = old->older){
+        if(old->readers > 0){
+            cut = &old->older;
+        }
+    }
+    for(old = *cut; old != NULL; old = older){
+        older = old->older;
+        retired_free(img, old);
+    }
+    *cut = NULL;
+}
+
+static void retired_free(struct image_handle *img, struct image_retired *old){
+    uint32_t i;
+
+    for(i = 0; i <= img->super->ninodes; i++){
+        free(old->dirs[i]);
+        free(old->zone_lists[i]);
+    }
+    free(old->dirs);
+    free(old->zone_lists);
+    free(old->zone_counts);
+    free(old->inode_table);
+    free(old);
+}
+
+/* prints what minls would for inode "ino" named "path_name"
+   to "out", listing a directory's entries when "list_dir"
+   is set */
+int image_print(struct image_handle *img, uint32_t ino,
+                char *path_name, int list_dir, FILE *out){
+    pthread_mutex_t *lock = &img->inode_locks[ino % INODE_LOCKS];
+    struct dir_entry *dir = NULL;
+    struct inode node, *table;
+
+    /* the inode, its entries and the table the entries'
+       inodes are printed from are all of one generation */
+    pthread_mutex_lock(lock);
+    node = img->inode_table[ino - 1];
+    table = img->inode_table;
+    if(list_dir && (node.mode & FILE_TYPE_MASK) == DIR_MASK){
+        dir = dir_locked(img, ino);
+    }
+    pthread_mutex_unlock(lock);
+
+    if((node.mode & FILE_TYPE_MASK) != DIR_MASK &&
+       (node.mode & FILE_TYPE_MASK) != REG_MASK){
+        fprintf(stderr, LS_TYPE_INVAL);
+        return EXIT_FAILURE;
+    }
+
+    if(list_dir && (node.mode & FILE_TYPE_MASK) == DIR_MASK){
+        if(dir == NULL){
+            return EXIT_FAILURE;
+        }
+        print_dir(out, dir, table,
+                  node.size / sizeof(struct dir_entry), path_name);
+    }else{
+        print_reg_file(out, &node, path_name);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* finds every regular file at or below inode "ino" named
+   "path_name", setting "files" to an allocated array of
+   them in directory order and "num" to how many. Other
+   file types below are skipped quietly and each directory
+   is only walked once, so one linked into itself in a
+   corrupt image can't loop. The paths are allocated too.
+   On error returns EXIT_FAILURE with nothing allocated */
+int image_collect(struct image_handle *img, uint32_t ino, char *path_name,
+                  struct image_file **files, uint32_t *num){
+    struct collect_state state;
+    uint32_t i;
+    int status;
+
+    memset(&state, 0, sizeof(struct collect_state));
+    state.img = img;
+    state.visited = calloc(img->super->ninodes + 1, 1);
+    if(state.visited == NULL){
+        perror(MALLOCERR);
+        return EXIT_FAILURE;
+    }
+    status = collect_tree(&state, ino, path_name);
+    free(state.visited);
+    if(status == EXIT_FAILURE){
+        for(i = 0; i < state.num; i++){
+            free(state.files[i].path);
+        }
+        free(state.files);
+        return EXIT_FAILURE;
+    }
+    *files = state.files;
+    *num = state.num;
+    return EXIT_SUCCESS;
+}
+
+static int collect_tree(struct collect_state *state, uint32_t ino,
+                        char *path_name){
+    struct image_handle *img = state->img;
+    struct inode node;
+    struct dir_entry *dir;
+    uint32_t num_entries, i;
+    char name[NAME_SIZE + 1], *child;
+    size_t len;
+
+    if(image_get_inode(img, ino, &node) == EXIT_FAILURE){
+        return EXIT_FAILURE;
+    }
+    if((node.mode & FILE_TYPE_MASK) == REG_MASK){
+        return collect_file(state, ino, path_name);
+    }
+    if((node.mode & FILE_TYPE_MASK) != DIR_MASK){
+        fprintf(stderr, "%s: %s\n", path_name, COLLECTERR);
+        return EXIT_FAILURE;
+    }
+    if(state->visited[ino]){
+        return EXIT_SUCCESS;
+    }
+    state->visited[ino] = TRUE;
+
+    /* sized by the inode the entries were read with */
+    dir = image_get_dir(img, ino, &node);
+    if(dir == NULL){
+        return EXIT_FAILURE;
+    }
+    num_entries = node.size / sizeof(struct dir_entry);
+    len = strlen(path_name);
+    for(i = 0; i < num_entries; i++){
+        if(dir[i].inode == 0 || dir[i].inode > img->super->ninodes){
+            continue;
+        }
+        memcpy(name, dir[i].name, NAME_SIZE);
+        name[NAME_SIZE] = '\0';
+        if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+
+        if(image_get_inode(img, dir[i].inode, &node) == EXIT_FAILURE){
+            return EXIT_FAILURE;
+        }
+        if((node.mode & FILE_TYPE_MASK) != REG_MASK &&
+           (node.mode & FILE_TYPE_MASK) != DIR_MASK){
+            continue;
+        }
+
+        child = malloc(len + strlen(name) + 2);
+        if(child == NULL){
+            perror(MALLOCERR);
+            return EXIT_FAILURE;
+        }
+        if(path_name[len - 1] == SLASH){
+            sprintf(child, "%s%s", path_name, name);
+        }else{
+            sprintf(child, "%s/%s", path_name, name);
+        }
+        if(collect_tree(state, dir[i].inode, child) == EXIT_FAILURE){
+            free(child);
+            return EXIT_FAILURE;
+        }
+        free(child);
+    }
+    return EXIT_SUCCESS;
+}
+
+static int collect_file(struct collect_state *state, uint32_t ino,
+                        char *path_name){
+    struct image_file *grown;
+
+    if(state->num == state->cap){
+        state->cap = state->cap ? state->cap * 2 : INIT_COLLECT;
+        grown = realloc(state->files, sizeof(struct image_file) * state->cap);
+        if(grown == NULL){
+            perror(MALLOCERR);
+            return EXIT_FAILURE;
+        }
+        state->files = grown;
+    }
+    state->files[state->num].path = strdup(path_name);
+    if(state->files[state->num].path == NULL){
+        perror(MALLOCERR);
+        return EXIT_FAILURE;
+    }
+    state->files[state->num].ino = ino;
+    state->num++;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,114 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <pthread.h>
+#include "util.h"
+#include "pathcache.h"
+
+#define CACHE_SLOTS 1024
+#define CACHE_SHARDS 16
+#define SHARD_SLOTS (CACHE_SLOTS / CACHE_SHARDS)
+#define INODE_LOCKS 16
+#define ROOT_INODE 1
+#define NO_INODE 0
+#define INIT_COLLECT 256
+#define COLLECTERR "not a regular file or directory"
+
+/* one cached zone, a zone number of 0 marks an empty slot */
+struct cache_slot {
+    uint32_t zone;
+    void *data;
+};
+
+/* zones are spread over shards by zone number so
+   threads reading different zones rarely wait on
+   the same lock */
+struct cache_shard {
+    struct cache_slot slots[SHARD_SLOTS];
+    pthread_mutex_t lock;
+};
+
+/* the per inode caches of a "generation" a reload replaced,
+   and how many "readers" that entered while it was current
+   are still in. Anything a reader got may be from any
+   generation since it entered, so one is freed once neither
+   it nor any older generation has a reader left */
+struct image_retired {
+    struct image_retired *older;
+    uint32_t generation;
+    uint32_t readers;
+    struct inode *inode_table;
+    struct dir_entry **dirs;
+    uint32_t **zone_lists;
+    uint32_t *zone_counts;
+};
+
+/* an image opened once and kept warm for many lookups.
+   The superblock and inode table are read when opened,
+   directories and zone lists are kept once loaded and
+   recently read zones stay in a sharded direct mapped
+   cache.
+   A handle is safe to use from many threads at once:
+   every read is positional so there is no shared file
+   offset, the superblock never changes after opening
+   (nor does the zone geometry picked then), zone cache
+   shards each have their own lock and a directory or
+   zone list is built under one of "inode_locks" (picked
+   by inode number) then never changes again. An inode is
+   only read under its lock too, copied out along with its
+   directory or zone list so both are of one generation. Paths looked
+   up are remembered in "paths", which has a lock of its own.
+   When a lookup finds the image file has been written to,
+   the handle reloads: a fresh inode table and empty
+   directory and zone list caches replace the old ones, the
+   zone cache and paths are emptied and "generation" goes
+   up. What the handle gives a thread between "image_enter"
+   and "image_leave" stays valid until it leaves, outside of
+   that it is only valid until the next "image_lookup" by
+   any thread, which may reload. The swap and
+   "generation" only change with every inode lock and shard
+   lock held, "readers" and "retired" with "reload_lock" */
+struct image_handle {
+    char *path;
+    int part;
+    int sub_part;
+    int fd;
+    off_t disk_start;
+    struct superblock *super;
+    struct inode *inode_table;
+    uint32_t zone_size;
+    struct zone_geom geom;
+    struct cache_shard *shards;
+    struct dir_entry **dirs;
+    uint32_t **zone_lists;
+    uint32_t *zone_counts;
+    pthread_mutex_t inode_locks[INODE_LOCKS];
+    uint32_t generation;
+    uint32_t readers;   /* entered in the current generation */
+    struct image_retired *retired;
+    pthread_mutex_t reload_lock;
+    struct path_cache paths;
+};
+
+/* a regular file found by "image_collect" */
+struct image_file {
+    char *path;
+    uint32_t ino;
+};
+
+struct image_handle *image_open(char *, int, int, int);
+void image_close(struct image_handle *);
+uint32_t image_enter(struct image_handle *);
+void image_leave(struct image_handle *, uint32_t);
+int image_read_zone(struct image_handle *, uint32_t, void *);
+int image_get_inode(struct image_handle *, uint32_t, struct inode *);
+struct dir_entry *image_get_dir(struct image_handle *, uint32_t,
+                                struct inode *);
+uint32_t *image_get_zones(struct image_handle *, uint32_t, uint32_t *,
+                          struct inode *);
+uint32_t image_lookup(struct image_handle *, char *);
+int image_print(struct image_handle *, uint32_t, char *, int, FILE *);
+int image_collect(struct image_handle *, uint32_t, char *,
+                  struct image_file **, uint32_t *);
+
+#endif
@@ -0,0 +1,660 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "util.h"
+
+#define OPTSTR "n:t:p:s:b:o:"
+#define USAGE "Usage: [ -n iterations | -t millis ] " \
+              "[ -p part [ -s subpart ] ] [ -b baseline.json ] " \
+              "[ -o out.json ] imagefile\n"
+#define PARTERR "partition must be between 0-3\n"
+#define SUBPARTERR "subpartition must be between 0-3\n"
+#define ITERERR "iterations and time must be at least 1\n"
+#define OPENERR "open error\n"
+#define BASEERR "couldn't read baseline"
+#define BENCHERR "benchmark failed"
+#define MAX_PART 4
+#define DEF_MILLIS 200
+#define NS_PER_SEC 1000000000LL
+#define NS_PER_MS 1000000LL
+#define MAX_DEPTH 6
+#define MAX_BENCHES 16
+#define BENCH_NAME 32
+#define NUM_COUNTERS 4
+#define COPY_BUF 65536
+#define PATH_SIZE 4096
+#define MEM_PATH "/proc/self/fd/%d"
+#define HEADER_PRINT "%-20s %10s %9s %10s %10s %9s %9s\n"
+#define ROW_PRINT "%-20s %10.1f %9.2f"
+#define COUNTER_PRINT " %10.0f"
+#define NA_PRINT " %10s"
+#define DELTA_PRINT "  %+6.1f%%"
+#define DELTA_NA_PRINT "  %7s"
+#define COMPARE_PRINT "\n%-20s %8s %9s %8s %8s %9s %8s\n"
+#define NA "-"
+#define JSON_START "{\"benchmarks\": [\n"
+#define JSON_ROW "  {\"name\": \"%s\", \"iterations\": %llu, " \
+                 "\"ns_op\": %.2f, \"allocs_op\": %.2f"
+#define JSON_END "\n]}\n"
+#define FILE_DIRECT 0
+#define FILE_INDIRECT 1
+#define FILE_DOUBLE 2
+#define FILE_CLASSES 3
+
+/* perf counters read for every benchmark, when the kernel lets us */
+static const struct {
+    const char *name;
+    uint32_t config;
+} counters[NUM_COUNTERS] = {
+    {"cycles_op", PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions_op", PERF_COUNT_HW_INSTRUCTIONS},
+    {"cache_misses_op", PERF_COUNT_HW_CACHE_MISSES},
+    {"branch_misses_op", PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+/* what was picked from the image to run against. "files"
+   are one regular file from each class of zone layout,
+   "depth_paths" one path at each depth and "wide_path"
+   the last entry of the largest directory. "visited" marks
+   the directories walked while picking, by inode number */
+struct bench_ctx {
+    int fd;
+    char mem_path[PATH_SIZE];
+    int part;
+    int sub_part;
+    off_t disk_start;
+    struct superblock *super;
+    struct zone_geom geom;
+    struct arena arena;
+    struct inode files[FILE_CLASSES];
+    int have_file[FILE_CLASSES];
+    char *depth_paths[MAX_DEPTH + 1];
+    char *wide_path;
+    uint32_t wide_entries;
+    uint8_t *visited;
+    uint32_t *zones;
+    uint32_t num_zones;
+    uint32_t next_zone;
+    int arg;
+    void *buf;
+};
+
+/* results of one benchmark, a counter below 0 wasn't available */
+struct bench_result {
+    char name[BENCH_NAME];
+    unsigned long long iters;
+    double ns_op;
+    double allocs_op;
+    double counters[NUM_COUNTERS];
+};
+
+typedef int (*bench_fn)(struct bench_ctx *);
+
+/* allocations by any object linked with --wrap */
+static unsigned long long num_allocs;
+
+void *__real_malloc(size_t);
+void *__real_calloc(size_t, size_t);
+void *__real_realloc(void *, size_t);
+
+void *__wrap_malloc(size_t size) {
+    num_allocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t num, size_t size) {
+    num_allocs++;
+    return __real_calloc(num, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    num_allocs++;
+    return __real_realloc(ptr, size);
+}
+
+int load_image(struct bench_ctx *, char *);
+int discover(struct bench_ctx *, struct inode *, char *, int);
+int run_bench(struct bench_ctx *, char *, bench_fn, int,
+              unsigned long long, long long, struct bench_result *);
+int write_json(char *, struct bench_result *, int);
+int compare_baseline(char *, struct bench_result *, int);
+void print_result(struct bench_result *);
+int bench_read_zone(struct bench_ctx *);
+int bench_read_file(struct bench_ctx *);
+int bench_find_depth(struct bench_ctx *);
+int bench_find_wide(struct bench_ctx *);
+int bench_partition(struct bench_ctx *);
+
+int main(int argc, char *argv[]) {
+    int option, i, num_results = 0, status = EXIT_SUCCESS;
+    extern int optind;
+    extern char *optarg;
+    unsigned long long iters = 0;
+    long long millis = DEF_MILLIS;
+    char *baseline = NULL, *out_json = NULL, name[BENCH_NAME];
+    static const char *class_names[FILE_CLASSES] = {
+        "read_file_direct", "read_file_indirect", "read_file_double"
+    };
+    struct bench_result results[MAX_BENCHES];
+    struct bench_ctx ctx;
+    struct inode root;
+
+    memset(&ctx, 0, sizeof(struct bench_ctx));
+    ctx.part = NO_PART;
+    ctx.sub_part = NO_PART;
+
+    while ((option = getopt(argc, argv, OPTSTR)) != EOF) {
+        switch (option)
+        {
+        case 'n':
+            iters = strtoull(optarg, NULL, 10);
+            if (iters < 1) {
+                fprintf(stderr, ITERERR);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 't':
+            millis = strtoll(optarg, NULL, 10);
+            if (millis < 1) {
+                fprintf(stderr, ITERERR);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'p':
+            ctx.part = strtol(optarg, NULL, 10);
+            if (ctx.part < 0 || ctx.part >= MAX_PART) {
+                fprintf(stderr, PARTERR);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 's':
+            ctx.sub_part = strtol(optarg, NULL, 10);
+            if (ctx.sub_part < 0 || ctx.sub_part >= MAX_PART) {
+                fprintf(stderr, SUBPARTERR);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'b':
+            baseline = optarg;
+            break;
+        case 'o':
+            out_json = optarg;
+            break;
+        default:
+            fprintf(stderr, USAGE);
+            return EXIT_FAILURE;
+            break;
+        }
+    }
+    if ((ctx.part == NO_PART && ctx.sub_part != NO_PART) || argc <= optind) {
+        fprintf(stderr, USAGE);
+        return EXIT_FAILURE;
+    }
+
+    /* everything runs against a copy in memory so the
+       disk never shows up in the numbers */
+    if (load_image(&ctx, argv[optind]) == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+    }
+    ctx.visited = calloc(ctx.super->ninodes + 1, 1);
+    if (ctx.visited == NULL) {
+        perror(MALLOCERR);
+        return EXIT_FAILURE;
+    }
+    ctx.visited[1] = TRUE;
+    if (get_inode(ctx.fd, ctx.super, ctx.disk_start, 1, &root) ==
+        EXIT_FAILURE ||
+        discover(&ctx, &root, "", 0) == EXIT_FAILURE) {
+        fprintf(stderr, "%s\n", BENCHERR);
+        return EXIT_FAILURE;
+    }
+    free(ctx.visited);
+    arena_init(&ctx.arena);
+
+    printf(HEADER_PRINT, "benchmark", "ns/op", "allocs/op", "cycles",
+           "instrs", "cache-mis", "br-mis");
+
+    if (ctx.num_zones > 0) {
+        status |= run_bench(&ctx, "read_zone", bench_read_zone, 0,
+                            iters, millis, &results[num_results++]);
+    }
+    for (i = 0; i < FILE_CLASSES; i++) {
+        if (ctx.have_file[i]) {
+            status |= run_bench(&ctx, (char*)class_names[i],
+                                bench_read_file, i, iters, millis,
+                                &results[num_results++]);
+        }
+    }
+    for (i = 1; i <= MAX_DEPTH; i++) {
+        if (ctx.depth_paths[i] != NULL) {
+            snprintf(name, BENCH_NAME, "find_file_depth%d", i);
+            status |= run_bench(&ctx, name, bench_find_depth, i,
+                                iters, millis, &results[num_results++]);
+        }
+    }
+    if (ctx.wide_path != NULL) {
+        snprintf(name, BENCH_NAME, "find_file_wide%u", ctx.wide_entries);
+        status |= run_bench(&ctx, name, bench_find_wide, 0,
+                            iters, millis, &results[num_results++]);
+    }
+    if (ctx.part != NO_PART) {
+        status |= run_bench(&ctx, "partition_finder", bench_partition, 0,
+                            iters, millis, &results[num_results++]);
+    }
+
+    if (out_json != NULL &&
+        write_json(out_json, results, num_results) == EXIT_FAILURE) {
+        status = EXIT_FAILURE;
+    }
+    if (baseline != NULL &&
+        compare_baseline(baseline, results, num_results) == EXIT_FAILURE) {
+        status = EXIT_FAILURE;
+    }
+
+    for (i = 0; i <= MAX_DEPTH; i++) {
+        free(ctx.depth_paths[i]);
+    }
+    free(ctx.wide_path);
+    free(ctx.zones);
+    free(ctx.buf);
+    free(ctx.super);
+    arena_destroy(&ctx.arena);
+    close(ctx.fd);
+    return status;
+}
+
+/* copies the image into an anonymous in memory file and
+   finds the file system in it, the same way minls does.
+   A compressed image is copied out decompressed, so the
+   benchmarks always time reads of the raw image */
+int load_image(struct bench_ctx *ctx, char *image) {
+    uint32_t disk_start = 0, part_size;
+    char buf[COPY_BUF];
+    off_t offset = 0;
+    ssize_t len;
+    int in;
+
+    if ((in = cimg_open(image)) < 0) {
+        fprintf(stderr, OPENERR);
+        return EXIT_FAILURE;
+    }
+    if ((ctx->fd = memfd_create("minbench", 0)) < 0) {
+        perror(FILEERR);
+        cimg_close(in);
+        return EXIT_FAILURE;
+    }
+    while ((len = cimg_pread(in, buf, COPY_BUF, offset)) > 0) {
+        if (write(ctx->fd, buf, len) != len) {
+            perror(FILEERR);
+            cimg_close(in);
+            return EXIT_FAILURE;
+        }
+        offset += len;
+    }
+    cimg_close(in);
+    snprintf(ctx->mem_path, PATH_SIZE, MEM_PATH, ctx->fd);
+
+    if (ctx->part != NO_PART &&
+        partition_finder(ctx->mem_path, ctx->part, ctx->sub_part,
+                         &disk_start, &part_size, FALSE) == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+    }
+    ctx->disk_start = (off_t)disk_start * SECTOR_SIZE;
+    ctx->super = get_superblock(ctx->fd, ctx->disk_start, FALSE);
+    if (ctx->super == NULL) {
+        return EXIT_FAILURE;
+    }
+    geom_select(ctx->super, &ctx->geom);
+    ctx->buf = malloc(ctx->geom.zone_size);
+    if (ctx->buf == NULL) {
+        perror(MALLOCERR);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* walks the tree under "dir", named "path_name" at "depth",
+   keeping what each benchmark needs. The largest file's
+   data zones are the ones read_zone cycles through. A
+   directory already walked, linked into itself in a
+   corrupt image, isn't walked again */
+int discover(struct bench_ctx *ctx, struct inode *dir, char *path_name,
+             int depth) {
+    struct dir_entry *entries;
+    struct inode child;
+    uint32_t num_entries, i, zones, live = 0, last = 0, j;
+    char name[NAME_SIZE + 1], *child_path;
+    int class;
+
+    entries = read_file(ctx->fd, dir, ctx->super, ctx->disk_start, NULL);
+    if (entries == NULL) {
+        return EXIT_FAILURE;
+    }
+    num_entries = dir->size / sizeof(struct dir_entry);
+
+    for (i = 0; i < num_entries; i++) {
+        if (entries[i].inode == 0 ||
+            entries[i].inode > ctx->super->ninodes) continue;
+        memcpy(name, entries[i].name, NAME_SIZE);
+        name[NAME_SIZE] = '\0';
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+        live++;
+        last = i;
+
+        if (get_inode(ctx->fd, ctx->super, ctx->disk_start,
+                      entries[i].inode, &child) == EXIT_FAILURE) {
+            free(entries);
+            return EXIT_FAILURE;
+        }
+        child_path = malloc(strlen(path_name) + strlen(name) + 2);
+        if (child_path == NULL) {
+            perror(MALLOCERR);
+            free(entries);
+            return EXIT_FAILURE;
+        }
+        sprintf(child_path, "%s/%s", path_name, name);
+
+        if (depth + 1 <= MAX_DEPTH && ctx->depth_paths[depth + 1] == NULL) {
+            ctx->depth_paths[depth + 1] = strdup(child_path);
+        }
+
+        if ((child.mode & FILE_TYPE_MASK) == DIR_MASK) {
+            if (ctx->visited[entries[i].inode]) {
+                free(child_path);
+                continue;
+            }
+            ctx->visited[entries[i].inode] = TRUE;
+            if (discover(ctx, &child, child_path, depth + 1)
+                == EXIT_FAILURE) {
+                free(child_path);
+                free(entries);
+                return EXIT_FAILURE;
+            }
+        } else if ((child.mode & FILE_TYPE_MASK) == REG_MASK &&
+                   child.size > 0) {
+            zones = geom_zone_count(&ctx->geom, child.size);
+            if (zones <= DIRECT_ZONES) {
+                class = FILE_DIRECT;
+            } else if (zones <= DIRECT_ZONES + ctx->geom.per_table) {
+                class = FILE_INDIRECT;
+            } else {
+                class = FILE_DOUBLE;
+            }
+            if (!ctx->have_file[class] ||
+                child.size > ctx->files[class].size) {
+                ctx->files[class] = child;
+                ctx->have_file[class] = TRUE;
+            }
+
+            /* keep the data zones of the largest file */
+            if (zones > ctx->num_zones) {
+                free(ctx->zones);
+                ctx->zones = resolve_zones(ctx->fd, &child, ctx->disk_start,
+                                           &ctx->geom, &ctx->num_zones,
+                                           NULL);
+                if (ctx->zones == NULL) {
+                    ctx->num_zones = 0;
+                } else {
+                    for (j = 0, zones = 0; j < ctx->num_zones; j++) {
+                        if (ctx->zones[j] != 0) {
+                            ctx->zones[zones++] = ctx->zones[j];
+                        }
+                    }
+                    ctx->num_zones = zones;
+                }
+            }
+        }
+        free(child_path);
+    }
+
+    /* the lookup that scans the most entries */
+    if (live > ctx->wide_entries) {
+        memcpy(name, entries[last].name, NAME_SIZE);
+        name[NAME_SIZE] = '\0';
+        free(ctx->wide_path);
+        ctx->wide_path = malloc(strlen(path_name) + strlen(name) + 2);
+        if (ctx->wide_path == NULL) {
+            perror(MALLOCERR);
+            free(entries);
+            return EXIT_FAILURE;
+        }
+        sprintf(ctx->wide_path, "%s/%s", path_name, name);
+        ctx->wide_entries = live;
+    }
+    free(entries);
+    return EXIT_SUCCESS;
+}
+
+static long long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+static int perf_open(uint32_t config) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(struct perf_event_attr));
+    attr.size = sizeof(struct perf_event_attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* runs "fn" "iters" times, or doubling the count until a
+   run takes "millis", then once more under the counters */
+int run_bench(struct bench_ctx *ctx, char *name, bench_fn fn, int arg,
+              unsigned long long iters, long long millis,
+              struct bench_result *res) {
+    unsigned long long n, i, allocs;
+    int fds[NUM_COUNTERS], c;
+    long long start, elapsed;
+    uint64_t count;
+
+    ctx->arg = arg;
+    if (fn(ctx) == EXIT_FAILURE) {
+        fprintf(stderr, "%s: %s\n", name, BENCHERR);
+        return EXIT_FAILURE;
+    }
+
+    /* calibrate */
+    n = iters;
+    if (n == 0) {
+        for (n = 1; ; n *= 2) {
+            start = now_ns();
+            for (i = 0; i < n; i++) {
+                fn(ctx);
+            }
+            if (now_ns() - start >= millis * NS_PER_MS) break;
+        }
+    }
+
+    for (c = 0; c < NUM_COUNTERS; c++) {
+        fds[c] = perf_open(counters[c].config);
+        if (fds[c] >= 0) {
+            ioctl(fds[c], PERF_EVENT_IOC_RESET, 0);
+            ioctl(fds[c], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+    allocs = num_allocs;
+    start = now_ns();
+    for (i = 0; i < n; i++) {
+        fn(ctx);
+    }
+    elapsed = now_ns() - start;
+    allocs = num_allocs - allocs;
+
+    memset(res, 0, sizeof(struct bench_result));
+    snprintf(res->name, BENCH_NAME, "%s", name);
+    res->iters = n;
+    res->ns_op = (double)elapsed / n;
+    res->allocs_op = (double)allocs / n;
+    for (c = 0; c < NUM_COUNTERS; c++) {
+        res->counters[c] = -1;
+        if (fds[c] < 0) continue;
+        ioctl(fds[c], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fds[c], &count, sizeof(uint64_t)) == sizeof(uint64_t)) {
+            res->counters[c] = (double)count / n;
+        }
+        close(fds[c]);
+    }
+    print_result(res);
+    return EXIT_SUCCESS;
+}
+
+void print_result(struct bench_result *res) {
+    int c;
+
+    printf(ROW_PRINT, res->name, res->ns_op, res->allocs_op);
+    for (c = 0; c < NUM_COUNTERS; c++) {
+        if (res->counters[c] < 0) {
+            printf(NA_PRINT, NA);
+        } else {
+            printf(COUNTER_PRINT, res->counters[c]);
+        }
+    }
+    printf(NEW_LINE);
+}
+
+/* writes every result one per line, which is
+   also what the baseline reader expects */
+int write_json(char *path, struct bench_result *results, int num) {
+    FILE *out;
+    int i, c;
+
+    if ((out = fopen(path, "w")) == NULL) {
+        perror(FILEERR);
+        return EXIT_FAILURE;
+    }
+    fprintf(out, JSON_START);
+    for (i = 0; i < num; i++) {
+        fprintf(out, JSON_ROW, results[i].name, results[i].iters,
+                results[i].ns_op, results[i].allocs_op);
+        for (c = 0; c < NUM_COUNTERS; c++) {
+            if (results[i].counters[c] < 0) {
+                fprintf(out, ", \"%s\": null", counters[c].name);
+            } else {
+                fprintf(out, ", \"%s\": %.2f", counters[c].name,
+                        results[i].counters[c]);
+            }
+        }
+        fprintf(out, i + 1 < num ? "},\n" : "}");
+    }
+    fprintf(out, JSON_END);
+    return fclose(out) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* returns the number after "key" in "line", or -1 if
+   the key is missing or null */
+static double json_number(char *line, const char *key) {
+    char pattern[BENCH_NAME + 8], *p;
+    double value;
+
+    snprintf(pattern, sizeof(pattern), "\"%s\": ", key);
+    p = strstr(line, pattern);
+    if (p == NULL || sscanf(p + strlen(pattern), "%lf", &value) != 1) {
+        return -1;
+    }
+    return value;
+}
+
+static void print_delta(double now, double base) {
+    if (now < 0 || base <= 0) {
+        printf(DELTA_NA_PRINT, NA);
+    } else {
+        printf(DELTA_PRINT, (now - base) * 100 / base);
+    }
+}
+
+/* prints how each result moved against the same benchmark
+   in a file written earlier by -o */
+int compare_baseline(char *path, struct bench_result *results, int num) {
+    char line[PATH_SIZE], name[BENCH_NAME], *p;
+    FILE *in;
+    int i, c;
+
+    if ((in = fopen(path, "r")) == NULL) {
+        perror(BASEERR);
+        return EXIT_FAILURE;
+    }
+    printf(COMPARE_PRINT, "vs baseline", "ns/op",
+           "allocs/op", "cycles", "instrs", "cache-mis", "br-mis");
+    while (fgets(line, PATH_SIZE, in) != NULL) {
+        p = strstr(line, "\"name\": \"");
+        if (p == NULL ||
+            sscanf(p + strlen("\"name\": \""), "%31[^\"]", name) != 1) {
+            continue;
+        }
+        for (i = 0; i < num && strcmp(results[i].name, name) != 0; i++);
+        if (i == num) continue;
+
+        printf("%-20s", name);
+        print_delta(results[i].ns_op, json_number(line, "ns_op"));
+        print_delta(results[i].allocs_op, json_number(line, "allocs_op"));
+        for (c = 0; c < NUM_COUNTERS; c++) {
+            print_delta(results[i].counters[c],
+                        json_number(line, counters[c].name));
+        }
+        printf(NEW_LINE);
+    }
+    fclose(in);
+    return EXIT_SUCCESS;
+}
+
+/* reads the next data zone of the largest file */
+int bench_read_zone(struct bench_ctx *ctx) {
+    uint32_t zone = ctx->zones[ctx->next_zone];
+
+    ctx->next_zone = (ctx->next_zone + 1) % ctx->num_zones;
+    return read_zone(ctx->fd, ctx->disk_start, ctx->geom.zone_size,
+                     zone, ctx->buf);
+}
+
+/* reads a whole file of one zone layout class into the
+   arena, the way the tools read directories */
+int bench_read_file(struct bench_ctx *ctx) {
+    void *data;
+
+    arena_reset(&ctx->arena);
+    data = read_file(ctx->fd, &ctx->files[ctx->arg], ctx->super,
+                     ctx->disk_start, &ctx->arena);
+    return data == NULL ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int find_path(struct bench_ctx *ctx, char *path_name) {
+    char path[PATH_SIZE];
+    struct inode found;
+
+    /* find_file tokenizes the path it is given */
+    snprintf(path, PATH_SIZE, "%s", path_name);
+    arena_reset(&ctx->arena);
+    return find_file(path, ctx->fd, ctx->disk_start, &found,
+                     FALSE, &ctx->arena);
+}
+
+int bench_find_depth(struct bench_ctx *ctx) {
+    return find_path(ctx, ctx->depth_paths[ctx->arg]);
+}
+
+int bench_find_wide(struct bench_ctx *ctx) {
+    return find_path(ctx, ctx->wide_path);
+}
+
+int bench_partition(struct bench_ctx *ctx) {
+    uint32_t disk_start, part_size;
+
+    return partition_finder(ctx->mem_path, ctx->part, ctx->sub_part,
+                            &disk_start, &part_size, FALSE);
+}
@@ -0,0 +1,486 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "util.h"
+#include "fsalloc.h"
+#include "bufpool.h"
+
+#define OPTSTR "vnp:s:"
+#define USAGE "Usage: [ -v ] [ -n ] [ -p part [ -s subpart ] ] " \
+              "imagefile [ outfile ]\n"
+#define PARTERR "partition must be between 0-3\n"
+#define SUBPARTERR "subpartition must be between 0-3\n"
+#define OPENERR "open error\n"
+#define COMPERR "compressed images can't be changed in place, " \
+                "give an output file\n"
+#define ROOTERR "root inode is not a directory\n"
+#define SAMEERR "the output file is the image file\n"
+#define BADENTRY "directory inode %u lists inode %u, which is out " \
+                 "of range, skipping it\n"
+#define MOVE_PRINT "inode %u: %u extents -> %u\n"
+#define DEFRAG_PRINT "%u files, %u extents before, %u after, " \
+                     "%u files moved (%u zones)\n"
+#define INITIALDISK 0
+#define MAX_PART 4
+#define ROOT_INO 1
+#define OUT_PERMS 0666
+#define COPY_BUF_SIZE BUFPOOL_SIZE
+#define CHECKPOINT_FILES 4096
+
+/* one defragmentation. Data is always read from "src" with the
+   zone numbers the file had when the run started. In place
+   that is the image itself, with frees deferred so a moved
+   file's old zones keep their data until a checkpoint has put
+   its new pointers on disk. Into a new image it is the
+   original, and the copy starts with every data zone free */
+struct defrag_state {
+    struct fs_alloc fsa;
+    int src;
+    int in_place;
+    int dry_run;
+    int isV;
+    uint8_t *visited;
+    void *buf;
+    uint32_t buf_zones;
+    uint32_t since_checkpoint;
+    uint32_t num_files;
+    uint32_t extents_before;
+    uint32_t extents_after;
+    uint32_t num_moved;
+    uint32_t zones_moved;
+};
+
+int walk_dir(struct defrag_state *, uint32_t);
+int move_file(struct defrag_state *, uint32_t);
+int read_zones(struct defrag_state *, uint32_t *, uint32_t, void *);
+int checkpoint(struct defrag_state *);
+int copy_outside(int, int, off_t, off_t, void *);
+
+int main(int argc, char *argv[]) {
+    int option, status, image_file = -1, out_file = -1;
+    extern int optind;
+    extern char *optarg;
+    int isV = FALSE, isN = FALSE, part = NO_PART, sub_part = NO_PART;
+    char *image, *out = NULL, magic[CIMG_MAGIC_SIZE];
+    uint32_t disk_start = INITIALDISK, part_size, ino;
+    off_t start, data_start, data_end;
+    struct stat in_st, out_st;
+    struct superblock *super;
+    struct defrag_state state;
+
+    while ((option = getopt(argc, argv, OPTSTR)) != EOF) {
+        switch (option)
+        {
+        case 'v':
+            isV = TRUE;
+            break;
+        case 'n':
+            isN = TRUE;
+            break;
+        case 'p':
+            part = strtol(optarg, NULL, 10);
+            if (part < 0 || part >= MAX_PART) {
+                fprintf(stderr, PARTERR);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 's':
+            sub_part = strtol(optarg, NULL, 10);
+            if (sub_part < 0 || sub_part >= MAX_PART) {
+                fprintf(stderr, SUBPARTERR);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            fprintf(stderr, USAGE);
+            return EXIT_FAILURE;
+            break;
+        }
+    }
+    if (argc < optind + 1 || argc > optind + 2 ||
+        (isN && argc > optind + 1) ||
+        (part == NO_PART && sub_part != NO_PART)) {
+        fprintf(stderr, USAGE);
+        return EXIT_FAILURE;
+    }
+    image = argv[optind];
+    if (argc > optind + 1) {
+        out = argv[optind + 1];
+    }
+
+    if (part != NO_PART &&
+        partition_finder(image, part, sub_part,
+                         &disk_start, &part_size, isV) == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+    }
+    start = (off_t)disk_start * SECTOR_SIZE;
+
+    memset(&state, 0, sizeof(struct defrag_state));
+    state.isV = isV;
+    state.dry_run = isN;
+    state.in_place = out == NULL;
+
+    /* a dry run and a copy only read the original, so
+       it may be compressed */
+    if (out == NULL && !isN) {
+        if ((image_file = open(image, O_RDWR)) < 0) {
+            fprintf(stderr, OPENERR);
+            return EXIT_FAILURE;
+        }
+        if (pread(image_file, magic, CIMG_MAGIC_SIZE, 0) == CIMG_MAGIC_SIZE &&
+            memcmp(magic, CIMG_MAGIC, CIMG_MAGIC_SIZE) == 0) {
+            fprintf(stderr, COMPERR);
+            close(image_file);
+            return EXIT_FAILURE;
+        }
+        state.src = image_file;
+    } else if ((state.src = cimg_open(image)) < 0) {
+        fprintf(stderr, OPENERR);
+        return EXIT_FAILURE;
+    }
+
+    state.buf = bufpool_get(COPY_BUF_SIZE);
+    if (state.buf == NULL) {
+        perror(MALLOCERR);
+        if (image_file < 0) cimg_close(state.src);
+        else close(image_file);
+        return EXIT_FAILURE;
+    }
+
+    /* the copy gets everything but the data zones, which
+       are all laid out again. Left unwritten they stay holes */
+    if (out != NULL) {
+        super = get_superblock(state.src, start, isV);
+        if (super == NULL) {
+            bufpool_put(state.buf, COPY_BUF_SIZE);
+            cimg_close(state.src);
+            return EXIT_FAILURE;
+        }
+        data_start = start + ((off_t)super->blocksize << super->log_zone_size) *
+                             super->firstdata;
+        data_end = start + ((off_t)super->blocksize << super->log_zone_size) *
+                           super->zones;
+        free(super);
+        /* truncating the original would lose everything
+           the copy is made from */
+        if (fstat(state.src, &in_st) < 0 ||
+            (stat(out, &out_st) == 0 && out_st.st_dev == in_st.st_dev &&
+             out_st.st_ino == in_st.st_ino)) {
+            fprintf(stderr, SAMEERR);
+            bufpool_put(state.buf, COPY_BUF_SIZE);
+            cimg_close(state.src);
+            return EXIT_FAILURE;
+        }
+        out_file = open(out, O_RDWR | O_CREAT | O_TRUNC, OUT_PERMS);
+        if (out_file < 0) {
+            fprintf(stderr, OPENERR);
+            bufpool_put(state.buf, COPY_BUF_SIZE);
+            cimg_close(state.src);
+            return EXIT_FAILURE;
+        }
+        if (copy_outside(state.src, out_file, data_start, data_end,
+                         state.buf) == EXIT_FAILURE) {
+            bufpool_put(state.buf, COPY_BUF_SIZE);
+            close(out_file);
+            cimg_close(state.src);
+            return EXIT_FAILURE;
+        }
+    }
+
+    status = fsa_open(&state.fsa, out != NULL ? out_file : state.src, start);
+    if (status == EXIT_SUCCESS) {
+        state.buf_zones = COPY_BUF_SIZE / state.fsa.geom.zone_size;
+        state.visited = calloc(state.fsa.super.ninodes + 1, 1);
+        if (state.visited == NULL) {
+            perror(MALLOCERR);
+            status = EXIT_FAILURE;
+        } else if (state.buf_zones == 0) {
+            fprintf(stderr, TOOBIG);
+            status = EXIT_FAILURE;
+        }
+    }
+    if (status == EXIT_SUCCESS && out != NULL) {
+        fsa_clear_zones(&state.fsa);
+    }
+    state.fsa.defer_frees = state.in_place;
+
+    /* directories first, each right before what is in it,
+       then whatever is in use but can't be reached */
+    if (status == EXIT_SUCCESS) {
+        if ((state.fsa.inodes[ROOT_INO - 1].mode & FILE_TYPE_MASK)
+            != DIR_MASK) {
+            fprintf(stderr, ROOTERR);
+            status = EXIT_FAILURE;
+        } else {
+            state.visited[ROOT_INO] = TRUE;
+            status = walk_dir(&state, ROOT_INO);
+        }
+    }
+    for (ino = ROOT_INO + 1; status == EXIT_SUCCESS &&
+                             ino <= state.fsa.super.ninodes; ino++) {
+        if (!state.visited[ino] && fsa_inode_used(&state.fsa, ino) &&
+            state.fsa.inodes[ino - 1].mode != 0) {
+            state.visited[ino] = TRUE;
+            status = move_file(&state, ino);
+        }
+    }
+
+    /* the last checkpoint frees the last old zones,
+       which one more flush puts on disk */
+    if (status == EXIT_SUCCESS && !isN) {
+        if (state.in_place) {
+            status = checkpoint(&state);
+        }
+        if (status == EXIT_SUCCESS) {
+            status = fsa_flush(&state.fsa);
+        }
+    }
+    if (status == EXIT_SUCCESS) {
+        printf(DEFRAG_PRINT, state.num_files, state.extents_before,
+               state.extents_after, state.num_moved, state.zones_moved);
+    }
+
+    free(state.visited);
+    fsa_close(&state.fsa);
+    bufpool_put(state.buf, COPY_BUF_SIZE);
+    if (out_file >= 0 && close(out_file) < 0) {
+        perror(WRITEERR);
+        status = EXIT_FAILURE;
+    }
+    if (image_file >= 0) {
+        if (close(image_file) < 0) {
+            perror(WRITEERR);
+            status = EXIT_FAILURE;
+        }
+    } else {
+        cimg_close(state.src);
+    }
+    return status;
+}
+
+/* moves directory "ino", then every file in it and then
+   every directory in it the same way, so each directory
+   ends up just before its contents. The entries are read
+   before it moves and kept until its children are done */
+int walk_dir(struct defrag_state *state, uint32_t ino) {
+    struct inode old = state->fsa.inodes[ino - 1];
+    struct dir_entry *entries;
+    uint32_t num_entries, i, child;
+    int pass;
+
+    entries = read_file(state->src, &old, &state->fsa.super,
+                        state->fsa.disk_start, NULL);
+    if (entries == NULL) {
+        return EXIT_FAILURE;
+    }
+    if (move_file(state, ino) == EXIT_FAILURE) {
+        free(entries);
+        return EXIT_FAILURE;
+    }
+
+    /* "." and ".." are always visited already */
+    num_entries = old.size / sizeof(struct dir_entry);
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < num_entries; i++) {
+            child = entries[i].inode;
+            if (child == 0) {
+                continue;
+            }
+            if (child > state->fsa.super.ninodes) {
+                if (pass == 0) {
+                    fprintf(stderr, BADENTRY, ino, child);
+                }
+                continue;
+            }
+            if (state->visited[child] ||
+                ((state->fsa.inodes[child - 1].mode & FILE_TYPE_MASK)
+                 == DIR_MASK) != (pass == 1)) {
+                continue;
+            }
+            state->visited[child] = TRUE;
+            if ((pass == 0 ? move_file(state, child) :
+                             walk_dir(state, child)) == EXIT_FAILURE) {
+                free(entries);
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    free(entries);
+    return EXIT_SUCCESS;
+}
+
+/* copies inode "ino" to zones taken in one run where there is
+   one, indirect tables first, and points it at them. Holes
+   stay holes. In place a file already in one piece is left
+   where it is */
+int move_file(struct defrag_state *state, uint32_t ino) {
+    struct inode old = state->fsa.inodes[ino - 1];
+    uint32_t *zones, *moved, *taken, num_data, num_used, num_tables;
+    uint32_t before, after, i, k, n;
+
+    zones = resolve_zones(state->src, &old, state->fsa.disk_start,
+                          &state->fsa.geom, &num_data, NULL);
+    if (zones == NULL) {
+        return EXIT_FAILURE;
+    }
+    before = fsa_count_extents(zones, num_data);
+    state->num_files++;
+    state->extents_before += before;
+    if (state->dry_run || (state->in_place && before <= 1)) {
+        state->extents_after += before;
+        free(zones);
+        return EXIT_SUCCESS;
+    }
+
+    for (i = 0, num_used = 0; i < num_data; i++) {
+        num_used += zones[i] != 0;
+    }
+    num_tables = fsa_table_count(&state->fsa, num_data);
+
+    /* zones freed by earlier moves come back at a checkpoint */
+    if (num_tables + num_used > state->fsa.free_zones &&
+        state->fsa.num_pending > 0 && checkpoint(state) == EXIT_FAILURE) {
+        free(zones);
+        return EXIT_FAILURE;
+    }
+
+    moved = malloc(sizeof(uint32_t) * (num_tables + num_data + 1));
+    taken = malloc(sizeof(uint32_t) * (num_tables + num_used + 1));
+    if (moved == NULL || taken == NULL) {
+        perror(MALLOCERR);
+        free(zones);
+        free(moved);
+        free(taken);
+        return EXIT_FAILURE;
+    }
+    if (fsa_alloc_zones(&state->fsa, num_tables + num_used, taken)
+        == EXIT_FAILURE) {
+        free(zones);
+        free(moved);
+        free(taken);
+        return EXIT_FAILURE;
+    }
+    memcpy(moved, taken, sizeof(uint32_t) * num_tables);
+    for (i = 0, k = num_tables; i < num_data; i++) {
+        moved[num_tables + i] = zones[i] != 0 ? taken[k++] : 0;
+    }
+    free(taken);
+
+    for (i = 0; i < num_data; i += n) {
+        n = num_data - i < state->buf_zones ? num_data - i :
+                                              state->buf_zones;
+        if (read_zones(state, &zones[i], n, state->buf) == EXIT_FAILURE ||
+            fsa_write_zones(&state->fsa, &moved[num_tables + i], n,
+                            state->buf) == EXIT_FAILURE) {
+            free(zones);
+            free(moved);
+            return EXIT_FAILURE;
+        }
+    }
+    if (fsa_map_file(&state->fsa, fsa_inode(&state->fsa, ino), moved,
+                     num_data) == EXIT_FAILURE ||
+        (state->in_place &&
+         fsa_free_file(&state->fsa, &old) == EXIT_FAILURE)) {
+        free(zones);
+        free(moved);
+        return EXIT_FAILURE;
+    }
+
+    after = fsa_count_extents(moved + num_tables, num_data);
+    state->extents_after += after;
+    state->num_moved++;
+    state->zones_moved += num_used;
+    if (state->isV) {
+        fprintf(stderr, MOVE_PRINT, ino, before, after);
+    }
+    free(zones);
+    free(moved);
+
+    if (state->in_place && ++state->since_checkpoint >= CHECKPOINT_FILES) {
+        return checkpoint(state);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* reads "count" zones at "zones" from the source into "buf",
+   one read for every run of contiguous zones. Holes read
+   as zeros */
+int read_zones(struct defrag_state *state, uint32_t *zones, uint32_t count,
+               void *buf) {
+    uint32_t zone_size = state->fsa.geom.zone_size, i, run;
+    size_t len;
+
+    for (i = 0; i < count; i += run) {
+        run = 1;
+        if (zones[i] == 0) {
+            memset((char*)buf + (size_t)zone_size * i, 0, zone_size);
+            continue;
+        }
+        while (i + run < count && zones[i + run] == zones[i] + run) {
+            run++;
+        }
+        len = (size_t)zone_size * run;
+        if (cimg_pread(state->src, (char*)buf + (size_t)zone_size * i, len,
+                       state->fsa.disk_start + (off_t)zone_size * zones[i])
+            != (ssize_t)len) {
+            perror(READERR);
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/* puts every move so far on disk, data before the pointers
+   to it, and only then lets the zones they left be reused */
+int checkpoint(struct defrag_state *state) {
+    if (fsync(state->fsa.image) < 0 ||
+        fsa_flush(&state->fsa) == EXIT_FAILURE ||
+        fsync(state->fsa.image) < 0) {
+        perror(WRITEERR);
+        return EXIT_FAILURE;
+    }
+    fsa_release(&state->fsa);
+    state->since_checkpoint = 0;
+    return EXIT_SUCCESS;
+}
+
+/* copies the whole of "src" to "dst" except the bytes from
+   "skip_start" to "skip_end". Zeros are left as holes */
+int copy_outside(int src, int dst, off_t skip_start, off_t skip_end,
+                 void *buf) {
+    off_t offset = 0;
+    ssize_t got;
+    size_t len;
+
+    while ((got = cimg_pread(src, buf, COPY_BUF_SIZE, offset)) > 0) {
+        len = got;
+        if (offset < skip_start && offset + (off_t)len > skip_start) {
+            len = skip_start - offset;
+        }
+        if ((offset < skip_start || offset >= skip_end) &&
+            !is_zero(buf, len) && pwrite(dst, buf, len, offset) !=
+                                  (ssize_t)len) {
+            perror(WRITEERR);
+            return EXIT_FAILURE;
+        }
+
+        /* jump over the data zones once they start */
+        offset += len;
+        if (offset >= skip_start && offset < skip_end) {
+            offset = skip_end;
+        }
+    }
+    if (got < 0) {
+        perror(READERR);
+        return EXIT_FAILURE;
+    }
+    if (ftruncate(dst, offset) < 0) {
+        perror(WRITEERR);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
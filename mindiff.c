@@ -0,0 +1,393 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include "image.h"
+#include "sched.h"
+#include "bufpool.h"
+
+#define OPTSTR "vcp:s:"
+#define USAGE "Usage: [ -v ] [ -c ] [ -p part [ -s subpart ] ] " \
+              "imagefile imagefile [ path ]\n" \
+              "exits 0 if the trees are the same, 1 if they differ " \
+              "and 2 on error\n"
+#define PARTERR "partition must be between 0-3\n"
+#define SUBPARTERR "subpartition must be between 0-3\n"
+#define ADDED_PRINT "A %s\n"
+#define REMOVED_PRINT "D %s\n"
+#define MODIFIED_PRINT "M %s\n"
+#define STATS_PRINT "%u files unchanged by metadata, %u compared, " \
+                    "%llu bytes read\n"
+#define MAX_PART 4
+#define DEF_PATH "/"
+#define DIFF_SAME 0   /* exit statuses, as diff(1) has them */
+#define DIFF_FOUND 1
+#define DIFF_ERROR 2
+
+/* both images and what the walk has done so far. "bufs"
+   hold the same span of one file from either image and
+   "visited" marks the directories of either that have been
+   walked, by inode number */
+struct diff_state {
+    struct image_handle *img[2];
+    void *bufs[2];
+    uint8_t *visited[2];
+    int isContent;
+    uint32_t differences;
+    uint32_t skipped;
+    uint32_t compared;
+    unsigned long long bytes_read;
+};
+
+int diff_tree(struct diff_state *, uint32_t, uint32_t, char *);
+void report(struct diff_state *, char *, char *);
+int diff_inode(struct diff_state *, uint32_t, uint32_t, char *);
+int diff_data(struct diff_state *, uint32_t, uint32_t, int *);
+int read_span(struct diff_state *, int, uint32_t *, uint32_t,
+              size_t, size_t);
+struct dir_entry **sorted_entries(struct image_handle *, uint32_t,
+                                  uint32_t *);
+
+int main(int argc, char *argv[]) {
+    int option, part = NO_PART, sub_part = NO_PART, isV = FALSE, i;
+    int status;
+    extern int optind;
+    extern char *optarg;
+    struct diff_state state;
+    uint32_t ino[2];
+    char *path_name;
+
+    memset(&state, 0, sizeof(struct diff_state));
+
+    while ((option = getopt(argc, argv, OPTSTR)) != EOF) {
+        switch (option)
+        {
+        case 'v':
+            isV = TRUE;
+            break;
+        case 'c':
+            state.isContent = TRUE;
+            break;
+        case 'p':
+            part = strtol(optarg, NULL, 10);
+            if (part < 0 || part >= MAX_PART) {
+                fprintf(stderr, PARTERR);
+                return DIFF_ERROR;
+            }
+            break;
+        case 's':
+            sub_part = strtol(optarg, NULL, 10);
+            if (sub_part < 0 || sub_part >= MAX_PART) {
+                fprintf(stderr, SUBPARTERR);
+                return DIFF_ERROR;
+            }
+            break;
+        default:
+            fprintf(stderr, USAGE);
+            return DIFF_ERROR;
+            break;
+        }
+    }
+    if (part == NO_PART && sub_part != NO_PART) {
+        fprintf(stderr, USAGE);
+        return DIFF_ERROR;
+    }
+    if (argc < optind + 2) {
+        fprintf(stderr, USAGE);
+        return DIFF_ERROR;
+    }
+
+    path_name = malloc(strlen(argc > optind + 2 ? argv[optind + 2]
+                                                : DEF_PATH) + 2);
+    if (path_name == NULL) {
+        perror(MALLOCERR);
+        return DIFF_ERROR;
+    }
+    strcpy(path_name, argc > optind + 2 ? argv[optind + 2] : DEF_PATH);
+    canonicalizer(path_name);
+
+    /* the same partition is used in both images */
+    for (i = 0; i < 2; i++) {
+        state.img[i] = image_open(argv[optind + i], part, sub_part, isV);
+        state.bufs[i] = bufpool_get(SCHED_MAX_RUN);
+        if (state.img[i] != NULL) {
+            state.visited[i] = calloc(state.img[i]->super->ninodes + 1, 1);
+        }
+    }
+    if (state.img[0] == NULL || state.img[1] == NULL ||
+        state.bufs[0] == NULL || state.bufs[1] == NULL) {
+        status = EXIT_FAILURE;
+    } else if (state.visited[0] == NULL || state.visited[1] == NULL) {
+        perror(MALLOCERR);
+        status = EXIT_FAILURE;
+    } else {
+        ino[0] = image_lookup(state.img[0], path_name);
+        ino[1] = image_lookup(state.img[1], path_name);
+        status = EXIT_SUCCESS;
+        if (ino[0] == NO_INODE && ino[1] == NO_INODE) {
+            fprintf(stderr, "%s\n", FILENOTFOUNDERR);
+            status = EXIT_FAILURE;
+        } else if (ino[0] == NO_INODE) {
+            report(&state, ADDED_PRINT, path_name);
+        } else if (ino[1] == NO_INODE) {
+            report(&state, REMOVED_PRINT, path_name);
+        } else {
+            status = diff_inode(&state, ino[0], ino[1], path_name);
+        }
+    }
+
+    if (isV) {
+        fprintf(stderr, STATS_PRINT, state.skipped, state.compared,
+                state.bytes_read);
+        bufpool_report(stderr);
+    }
+    for (i = 0; i < 2; i++) {
+        bufpool_put(state.bufs[i], SCHED_MAX_RUN);
+        free(state.visited[i]);
+        image_close(state.img[i]);
+    }
+    free(path_name);
+    if (status == EXIT_FAILURE) {
+        return DIFF_ERROR;
+    }
+    return state.differences > 0 ? DIFF_FOUND : DIFF_SAME;
+}
+
+/* compares the file or directory "path_name", inode "ino_a"
+   in the first image and "ino_b" in the second */
+int diff_inode(struct diff_state *state, uint32_t ino_a, uint32_t ino_b,
+               char *path_name) {
+    struct inode *a = &state->img[0]->inode_table[ino_a - 1];
+    struct inode *b = &state->img[1]->inode_table[ino_b - 1];
+    int isSame;
+
+    if ((a->mode & FILE_TYPE_MASK) == DIR_MASK &&
+        (b->mode & FILE_TYPE_MASK) == DIR_MASK) {
+        return diff_tree(state, ino_a, ino_b, path_name);
+    }
+
+    /* a file replaced by a directory or the
+       other way around is removed then added */
+    if ((a->mode & FILE_TYPE_MASK) != (b->mode & FILE_TYPE_MASK)) {
+        report(state, REMOVED_PRINT, path_name);
+        report(state, ADDED_PRINT, path_name);
+        return EXIT_SUCCESS;
+    }
+
+    /* a permission change is a change even if the data isn't */
+    if (a->mode != b->mode || a->size != b->size) {
+        report(state, MODIFIED_PRINT, path_name);
+        return EXIT_SUCCESS;
+    }
+
+    /* an untouched inode keeps its mtime and every zone
+       pointer, so its data can't have changed either */
+    if (!state->isContent && a->mtime == b->mtime &&
+        memcmp(a->zone, b->zone, sizeof(a->zone)) == 0 &&
+        a->indirect == b->indirect && a->two_indirect == b->two_indirect) {
+        state->skipped++;
+        return EXIT_SUCCESS;
+    }
+    if ((a->mode & FILE_TYPE_MASK) != REG_MASK) {
+        return EXIT_SUCCESS;
+    }
+
+    state->compared++;
+    if (diff_data(state, ino_a, ino_b, &isSame) == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+    }
+    if (!isSame) {
+        report(state, MODIFIED_PRINT, path_name);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* prints one difference, "what" being the kind of it */
+void report(struct diff_state *state, char *what, char *path_name) {
+    printf(what, path_name);
+    state->differences++;
+}
+
+static int entry_cmp(const void *a, const void *b){
+    const struct dir_entry *ea = *(struct dir_entry * const *)a;
+    const struct dir_entry *eb = *(struct dir_entry * const *)b;
+
+    return strncmp((char*)ea->name, (char*)eb->name, NAME_SIZE);
+}
+
+/* returns the live entries of directory "ino" other than
+   "." and "..", sorted by name so two directories can be
+   merged. The array is allocated, the entries are not */
+struct dir_entry **sorted_entries(struct image_handle *img, uint32_t ino,
+                                  uint32_t *num) {
+    struct dir_entry *dir, **entries;
+    struct inode node;
+    uint32_t num_entries, i;
+
+    dir = image_get_dir(img, ino, &node);
+    if (dir == NULL) {
+        return NULL;
+    }
+    num_entries = node.size / sizeof(struct dir_entry);
+    entries = malloc(sizeof(struct dir_entry*) *
+                     (num_entries ? num_entries : 1));
+    if (entries == NULL) {
+        perror(MALLOCERR);
+        return NULL;
+    }
+
+    *num = 0;
+    for (i = 0; i < num_entries; i++) {
+        if (dir[i].inode == 0 || dir[i].inode > img->super->ninodes ||
+            strncmp((char*)dir[i].name, ".", NAME_SIZE) == 0 ||
+            strncmp((char*)dir[i].name, "..", NAME_SIZE) == 0) {
+            continue;
+        }
+        entries[(*num)++] = &dir[i];
+    }
+    qsort(entries, *num, sizeof(struct dir_entry*), entry_cmp);
+    return entries;
+}
+
+/* walks two directories in lockstep, merging their
+   entries by name and comparing the ones both have. A
+   directory either image has already walked, linked into
+   itself in a corrupt image, isn't walked again */
+int diff_tree(struct diff_state *state, uint32_t ino_a, uint32_t ino_b,
+              char *path_name) {
+    struct dir_entry **ents[2], *ent;
+    uint32_t num[2], i = 0, j = 0;
+    char name[NAME_SIZE + 1], *child;
+    size_t len = strlen(path_name);
+    int cmp, status = EXIT_SUCCESS;
+
+    if (state->visited[0][ino_a] || state->visited[1][ino_b]) {
+        return EXIT_SUCCESS;
+    }
+    state->visited[0][ino_a] = TRUE;
+    state->visited[1][ino_b] = TRUE;
+
+    ents[0] = sorted_entries(state->img[0], ino_a, &num[0]);
+    ents[1] = ents[0] ? sorted_entries(state->img[1], ino_b, &num[1])
+                      : NULL;
+    if (ents[0] == NULL || ents[1] == NULL) {
+        free(ents[0]);
+        return EXIT_FAILURE;
+    }
+
+    while (status == EXIT_SUCCESS && (i < num[0] || j < num[1])) {
+        if (i == num[0]) {
+            cmp = 1;
+        } else if (j == num[1]) {
+            cmp = -1;
+        } else {
+            cmp = strncmp((char*)ents[0][i]->name, (char*)ents[1][j]->name,
+                          NAME_SIZE);
+        }
+        ent = cmp <= 0 ? ents[0][i] : ents[1][j];
+
+        memcpy(name, ent->name, NAME_SIZE);
+        name[NAME_SIZE] = '\0';
+        child = malloc(len + strlen(name) + 2);
+        if (child == NULL) {
+            perror(MALLOCERR);
+            status = EXIT_FAILURE;
+            break;
+        }
+        if (path_name[len - 1] == SLASH) {
+            sprintf(child, "%s%s", path_name, name);
+        } else {
+            sprintf(child, "%s/%s", path_name, name);
+        }
+
+        /* a directory only one image has is reported
+           once, not every file below it */
+        if (cmp < 0) {
+            report(state, REMOVED_PRINT, child);
+            i++;
+        } else if (cmp > 0) {
+            report(state, ADDED_PRINT, child);
+            j++;
+        } else {
+            status = diff_inode(state, ents[0][i]->inode,
+                                ents[1][j]->inode, child);
+            i++;
+            j++;
+        }
+        free(child);
+    }
+
+    free(ents[0]);
+    free(ents[1]);
+    return status;
+}
+
+/* compares the data of two regular files of the same size a
+   buffer at a time, stopping at the first difference. Holes
+   in either file are never read */
+int diff_data(struct diff_state *state, uint32_t ino_a, uint32_t ino_b,
+              int *isSame) {
+    uint32_t *zones[2], num[2], i;
+    size_t size, offset, len;
+
+    zones[0] = image_get_zones(state->img[0], ino_a, &num[0], NULL);
+    zones[1] = image_get_zones(state->img[1], ino_b, &num[1], NULL);
+    if (zones[0] == NULL || zones[1] == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    *isSame = TRUE;
+    size = state->img[0]->inode_table[ino_a - 1].size;
+    for (offset = 0; offset < size && *isSame; offset += len) {
+        len = size - offset < SCHED_MAX_RUN ? size - offset : SCHED_MAX_RUN;
+        for (i = 0; i < 2; i++) {
+            if (read_span(state, i, zones[i], num[i],
+                          offset, len) == EXIT_FAILURE) {
+                return EXIT_FAILURE;
+            }
+        }
+        if (memcmp(state->bufs[0], state->bufs[1], len) != 0) {
+            *isSame = FALSE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/* fills image "which"'s buffer with "len" bytes of a file
+   from "offset", one positional read per run of contiguous
+   zones and zeros for holes */
+int read_span(struct diff_state *state, int which, uint32_t *zones,
+              uint32_t num_zones, size_t offset, size_t len) {
+    struct image_handle *img = state->img[which];
+    uint32_t zone, run;
+    size_t done = 0, skip, part;
+    uintptr_t dst;
+
+    while (done < len) {
+        zone = (offset + done) / img->zone_size;
+        skip = (offset + done) % img->zone_size;
+        run = next_run(zones, zone, num_zones,
+                       (skip + len - done + img->zone_size - 1) /
+                       img->zone_size);
+        part = (size_t)img->zone_size * run - skip;
+        if (part > len - done) {
+            part = len - done;
+        }
+
+        dst = (uintptr_t)state->bufs[which] + done;
+        if (zone >= num_zones || zones[zone] == 0) {
+            memset((void*)dst, 0, part);
+        } else {
+            if (cimg_pread(img->fd, (void*)dst, part, img->disk_start +
+                      (off_t)img->zone_size * zones[zone] + skip)
+                      != (ssize_t)part) {
+                perror(READERR);
+                return EXIT_FAILURE;
+            }
+            state->bytes_read += part;
+        }
+        done += part;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,668 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "image.h"
+
+#define OPTSTR "vj:p:s:"
+#define USAGE "Usage: [ -v ] [ -j jobs ] [ -p part [ -s subpart ] ] " \
+              "imagefile\n"
+#define PARTERR "partition must be between 0-3\n"
+#define SUBPARTERR "subpartition must be between 0-3\n"
+#define JOBERR "number of jobs must be at least 1\n"
+#define MAX_PART 4
+#define FSCK_LOCKS 64
+#define FSCK_CHUNK 1024
+#define INIT_DIRS 1024
+#define MAX_USES 255
+#define DOT "."
+#define DOT_DOT ".."
+
+/* what was wrong with one inode, found by the workers
+   and printed in inode order once they are all done */
+#define F_TOOBIG   0x01
+#define F_BADZONE  0x02
+#define F_PASTSIZE 0x04
+#define F_BADTABLE 0x08
+#define F_BADENTRY 0x10
+#define F_BADDOT   0x20
+#define F_DIRLINK  0x40
+#define F_BADDIR   0x80
+
+#define TOOBIG_PRINT "inode %u is %u bytes, more than the %u a file " \
+                     "can be\n"
+#define BADZONE_PRINT "inode %u points at zones outside the data area\n"
+#define PASTSIZE_PRINT "inode %u points at zones past its size\n"
+#define BADTABLE_PRINT "inode %u has an indirect table that can't be " \
+                       "read\n"
+#define BADENTRY_PRINT "directory inode %u lists inodes that are out " \
+                       "of range or free\n"
+#define BADDOT_PRINT "directory inode %u has a bad \".\" or \"..\" " \
+                     "entry\n"
+#define DIRLINK_PRINT "directory inode %u has more than one name\n"
+#define BADDIR_PRINT "directory inode %u can't be read\n"
+#define IFREE_PRINT "inode %u is in use but free in the inode bitmap\n"
+#define IUNREACH_PRINT "inode %u is marked in use but can't be reached\n"
+#define LINKS_PRINT "inode %u has %u links but %u names\n"
+#define ZFREE_PRINT "zone %u is in use but free in the zone bitmap\n"
+#define ZUNUSED_PRINT "zone %u is marked in use but no file has it\n"
+#define ZDUP_PRINT "zone %u is used %u times\n"
+#define ZOWNER_PRINT "zone %u is used by inode %u\n"
+#define FSCK_PRINT "%u inodes, %u directories, %u zones in use, " \
+                   "%u problems\n"
+
+/* everything the workers share. The tree walk hands out
+   directories from "dirs", the zone scan hands out inodes
+   a chunk at a time from "next". The per inode and per
+   zone counts are guarded by one of "locks", picked by
+   inode or zone bit number, so workers rarely wait */
+struct fsck_state {
+    struct image_handle *img;
+    uint8_t *imap;
+    uint8_t *zmap;
+    uint32_t num_zone_bits;
+    uint32_t *refs;      /* names of every inode, "." and ".." too */
+    uint32_t *parent;    /* of every directory reached */
+    uint8_t *reached;
+    uint8_t *flags;
+    uint8_t *uses;       /* per zone bit, up to MAX_USES */
+    uint32_t *dirs;      /* directories waiting to be walked */
+    uint32_t num_dirs;
+    uint32_t dirs_cap;
+    uint32_t busy;       /* workers walking a directory */
+    uint32_t next;
+    uint32_t num_dirs_walked;
+    int find_dups;       /* print owners instead of counting */
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t more;
+    pthread_mutex_t locks[FSCK_LOCKS];
+};
+
+int run_workers(struct fsck_state *, void *(*)(void *), int);
+void *walk_worker(void *);
+void walk_dir(struct fsck_state *, uint32_t, struct arena *);
+int push_dir(struct fsck_state *, uint32_t, uint32_t);
+void *zone_worker(void *);
+void check_inode(struct fsck_state *, uint32_t, uint32_t *);
+int check_table(struct fsck_state *, uint32_t, uint32_t, uint32_t,
+                uint32_t *);
+void use_zone(struct fsck_state *, uint32_t, uint32_t);
+void set_flag(struct fsck_state *, uint32_t, uint8_t);
+uint32_t report(struct fsck_state *);
+int read_maps(struct fsck_state *);
+
+int main(int argc, char *argv[]) {
+    int option, jobs, part = NO_PART, sub_part = NO_PART, isV = FALSE;
+    extern int optind;
+    extern char *optarg;
+    struct fsck_state state;
+    uint32_t ninodes, problems, ino, inodes_used, zones_used, i;
+    int status = EXIT_SUCCESS;
+
+    memset(&state, 0, sizeof(struct fsck_state));
+    jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs < 1) jobs = 1;
+
+    while ((option = getopt(argc, argv, OPTSTR)) != EOF) {
+        switch (option)
+        {
+        case 'v':
+            isV = TRUE;
+            break;
+        case 'j':
+            jobs = strtol(optarg, NULL, 10);
+            if (jobs < 1) {
+                fprintf(stderr, JOBERR);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'p':
+            part = strtol(optarg, NULL, 10);
+            if (part < 0 || part >= MAX_PART) {
+                fprintf(stderr, PARTERR);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 's':
+            sub_part = strtol(optarg, NULL, 10);
+            if (sub_part < 0 || sub_part >= MAX_PART) {
+                fprintf(stderr, SUBPARTERR);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            fprintf(stderr, USAGE);
+            return EXIT_FAILURE;
+            break;
+        }
+    }
+    if (argc != optind + 1 || (part == NO_PART && sub_part != NO_PART)) {
+        fprintf(stderr, USAGE);
+        return EXIT_FAILURE;
+    }
+
+    /* the whole inode table is read here in one go,
+       nothing after this reads an inode from disk */
+    state.img = image_open(argv[optind], part, sub_part, isV);
+    if (state.img == NULL) {
+        return EXIT_FAILURE;
+    }
+    ninodes = state.img->super->ninodes;
+    state.num_zone_bits = state.img->super->zones -
+                          state.img->super->firstdata + 1;
+    state.refs = calloc(ninodes + 1, sizeof(uint32_t));
+    state.parent = calloc(ninodes + 1, sizeof(uint32_t));
+    state.reached = calloc(ninodes + 1, 1);
+    state.flags = calloc(ninodes + 1, 1);
+    state.uses = calloc(state.num_zone_bits, 1);
+    if (state.refs == NULL || state.parent == NULL || state.reached == NULL ||
+        state.flags == NULL || state.uses == NULL) {
+        perror(MALLOCERR);
+        status = EXIT_FAILURE;
+    }
+    if (status == EXIT_SUCCESS) {
+        status = read_maps(&state);
+    }
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.more, NULL);
+    for (i = 0; i < FSCK_LOCKS; i++) {
+        pthread_mutex_init(&state.locks[i], NULL);
+    }
+
+    /* names first, which says which inodes are reachable,
+       then the zones of every inode that is in use */
+    if (status == EXIT_SUCCESS) {
+        if ((state.img->inode_table[ROOT_INODE - 1].mode & FILE_TYPE_MASK)
+            != DIR_MASK) {
+            fprintf(stderr, "%s\n", DIRERR);
+            status = EXIT_FAILURE;
+        } else {
+            state.reached[ROOT_INODE] = TRUE;
+            status = push_dir(&state, ROOT_INODE, ROOT_INODE);
+        }
+    }
+    if (status == EXIT_SUCCESS) {
+        status = run_workers(&state, walk_worker, jobs);
+    }
+    if (status == EXIT_SUCCESS) {
+        status = run_workers(&state, zone_worker, jobs);
+    }
+    if (status == EXIT_SUCCESS && state.failed) {
+        status = EXIT_FAILURE;
+    }
+
+    if (status == EXIT_SUCCESS) {
+        problems = report(&state);
+        for (ino = 1, inodes_used = 0; ino <= ninodes; ino++) {
+            inodes_used += state.reached[ino] ||
+                           (state.imap[ino / 8] >> (ino % 8) & 1);
+        }
+        for (i = 1, zones_used = 0; i < state.num_zone_bits; i++) {
+            zones_used += state.uses[i] != 0;
+        }
+        printf(FSCK_PRINT, inodes_used, state.num_dirs_walked, zones_used,
+               problems);
+        if (problems > 0) {
+            status = EXIT_FAILURE;
+        }
+    }
+
+    for (i = 0; i < FSCK_LOCKS; i++) {
+        pthread_mutex_destroy(&state.locks[i]);
+    }
+    pthread_cond_destroy(&state.more);
+    pthread_mutex_destroy(&state.lock);
+    free(state.dirs);
+    free(state.uses);
+    free(state.flags);
+    free(state.reached);
+    free(state.parent);
+    free(state.refs);
+    free(state.zmap);
+    free(state.imap);
+    image_close(state.img);
+    return status;
+}
+
+/* runs "jobs" copies of "worker" and waits for all of them.
+   If none can be started it is run on this thread */
+int run_workers(struct fsck_state *state, void *(*worker)(void *),
+                int jobs) {
+    pthread_t *threads;
+    int i, started = 0;
+
+    threads = malloc(sizeof(pthread_t) * jobs);
+    if (threads == NULL) {
+        perror(MALLOCERR);
+        return EXIT_FAILURE;
+    }
+    state->next = 0;
+    for (i = 0; i < jobs; i++) {
+        if (pthread_create(&threads[i], NULL, worker, state) != 0) {
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        worker(state);
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    return EXIT_SUCCESS;
+}
+
+/* reads both bitmaps, each in one read */
+int read_maps(struct fsck_state *state) {
+    struct image_handle *img = state->img;
+    size_t imap_size, zmap_size;
+    off_t start = img->disk_start + (off_t)img->super->blocksize *
+                                    FIRST_BLOCKS;
+
+    imap_size = (size_t)img->super->blocksize * img->super->i_blocks;
+    zmap_size = (size_t)img->super->blocksize * img->super->z_blocks;
+    if (imap_size * 8 <= img->super->ninodes ||
+        zmap_size * 8 < state->num_zone_bits) {
+        fprintf(stderr, "%s\n", SUPERERR);
+        return EXIT_FAILURE;
+    }
+    state->imap = malloc(imap_size);
+    state->zmap = malloc(zmap_size);
+    if (state->imap == NULL || state->zmap == NULL) {
+        perror(MALLOCERR);
+        return EXIT_FAILURE;
+    }
+    if (cimg_pread(img->fd, state->imap, imap_size, start) !=
+        (ssize_t)imap_size ||
+        cimg_pread(img->fd, state->zmap, zmap_size, start + imap_size) !=
+        (ssize_t)zmap_size) {
+        perror(READERR);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* adds directory "ino", named in "parent", to the
+   directories waiting to be walked */
+int push_dir(struct fsck_state *state, uint32_t ino, uint32_t parent) {
+    uint32_t *grown;
+
+    pthread_mutex_lock(&state->lock);
+    if (state->num_dirs == state->dirs_cap) {
+        state->dirs_cap = state->dirs_cap ? state->dirs_cap * 2 : INIT_DIRS;
+        grown = realloc(state->dirs, sizeof(uint32_t) * state->dirs_cap);
+        if (grown == NULL) {
+            perror(MALLOCERR);
+            state->failed = TRUE;
+            pthread_mutex_unlock(&state->lock);
+            return EXIT_FAILURE;
+        }
+        state->dirs = grown;
+    }
+    state->dirs[state->num_dirs++] = ino;
+    state->parent[ino] = parent;
+    pthread_cond_signal(&state->more);
+    pthread_mutex_unlock(&state->lock);
+    return EXIT_SUCCESS;
+}
+
+/* walks directories until there are none left and no other
+   worker is walking one that could add more */
+void *walk_worker(void *arg) {
+    struct fsck_state *state = arg;
+    struct arena arena;
+    uint32_t ino;
+
+    arena_init(&arena);
+    pthread_mutex_lock(&state->lock);
+    while (TRUE) {
+        while (state->num_dirs == 0 && state->busy > 0) {
+            pthread_cond_wait(&state->more, &state->lock);
+        }
+        if (state->num_dirs == 0 || state->failed) {
+            break;
+        }
+        ino = state->dirs[--state->num_dirs];
+        state->busy++;
+        state->num_dirs_walked++;
+        pthread_mutex_unlock(&state->lock);
+
+        walk_dir(state, ino, &arena);
+        arena_reset(&arena);
+
+        pthread_mutex_lock(&state->lock);
+        state->busy--;
+    }
+
+    /* wakes the others, who find nothing left too */
+    pthread_cond_broadcast(&state->more);
+    pthread_mutex_unlock(&state->lock);
+    arena_destroy(&arena);
+    return NULL;
+}
+
+/* counts every name in directory "ino" and queues the
+   directories it is the first to name */
+void walk_dir(struct fsck_state *state, uint32_t ino, struct arena *arena) {
+    struct image_handle *img = state->img;
+    struct dir_iter iter;
+    struct dir_entry *entry;
+    pthread_mutex_t *lock;
+    uint32_t child, found_dots = 0;
+    int first, is_dir;
+
+    if (dir_iter_open(&iter, img->fd, &img->inode_table[ino - 1],
+                      img->super, img->disk_start, arena) == EXIT_FAILURE) {
+        set_flag(state, ino, F_BADDIR);
+        return;
+    }
+    while ((entry = dir_iter_next(&iter)) != NULL) {
+        child = entry->inode;
+        if (child > img->super->ninodes ||
+            img->inode_table[child - 1].mode == 0) {
+            set_flag(state, ino, F_BADENTRY);
+            continue;
+        }
+
+        /* "." names the directory itself and ".." whatever
+           it was reached from, neither reaches anything */
+        if (strncmp((char*)entry->name, DOT, NAME_SIZE) == 0 ||
+            strncmp((char*)entry->name, DOT_DOT, NAME_SIZE) == 0) {
+            if (child != (entry->name[1] == '\0' ? ino :
+                                                   state->parent[ino])) {
+                set_flag(state, ino, F_BADDOT);
+            }
+            found_dots++;
+        }
+
+        is_dir = (img->inode_table[child - 1].mode & FILE_TYPE_MASK) ==
+                 DIR_MASK;
+        lock = &state->locks[child % FSCK_LOCKS];
+        pthread_mutex_lock(lock);
+        state->refs[child]++;
+        first = FALSE;
+        if (strncmp((char*)entry->name, DOT, NAME_SIZE) != 0 &&
+            strncmp((char*)entry->name, DOT_DOT, NAME_SIZE) != 0) {
+            first = !state->reached[child];
+            state->reached[child] = TRUE;
+            if (!first && is_dir) {
+                state->flags[child] |= F_DIRLINK;
+            }
+        }
+        pthread_mutex_unlock(lock);
+
+        if (first && is_dir && push_dir(state, child, ino) == EXIT_FAILURE) {
+            break;
+        }
+    }
+    if (iter.failed) {
+        set_flag(state, ino, F_BADDIR);
+    }
+    if (found_dots != 2) {
+        set_flag(state, ino, F_BADDOT);
+    }
+    dir_iter_close(&iter);
+}
+
+/* checks the zones of every inode in use, a
+   chunk of the inode table at a time */
+void *zone_worker(void *arg) {
+    struct fsck_state *state = arg;
+    uint32_t ninodes = state->img->super->ninodes, start, ino;
+    uint32_t *table;
+
+    table = malloc((size_t)state->img->zone_size * 2);
+    if (table == NULL) {
+        perror(MALLOCERR);
+        pthread_mutex_lock(&state->lock);
+        state->failed = TRUE;
+        pthread_mutex_unlock(&state->lock);
+        return NULL;
+    }
+    while (TRUE) {
+        pthread_mutex_lock(&state->lock);
+        start = state->next;
+        state->next += FSCK_CHUNK;
+        pthread_mutex_unlock(&state->lock);
+        if (start >= ninodes) break;
+
+        for (ino = start + 1; ino <= ninodes && ino <= start + FSCK_CHUNK;
+             ino++) {
+            if (state->reached[ino] ||
+                (state->imap[ino / 8] >> (ino % 8) & 1)) {
+                check_inode(state, ino, table);
+            }
+        }
+    }
+    free(table);
+    return NULL;
+}
+
+/* counts every zone inode "ino" points at, the indirect
+   tables too, using "table" to read two tables into.
+   Pointers past what its size needs are only checked
+   for being 0 */
+void check_inode(struct fsck_state *state, uint32_t ino, uint32_t *table) {
+    struct image_handle *img = state->img;
+    struct inode *node = &img->inode_table[ino - 1];
+    uint32_t per = img->geom.per_table, needed, i, n;
+
+    if (node->mode == 0) {
+        return;
+    }
+    if (node->size > img->super->max_file) {
+        set_flag(state, ino, F_TOOBIG);
+        return;
+    }
+    needed = geom_zone_count(&img->geom, node->size);
+
+    for (i = 0; i < DIRECT_ZONES; i++) {
+        if (i < needed) {
+            use_zone(state, node->zone[i], ino);
+        } else if (node->zone[i] != 0) {
+            set_flag(state, ino, F_PASTSIZE);
+        }
+    }
+    needed = needed > DIRECT_ZONES ? needed - DIRECT_ZONES : 0;
+
+    if (needed == 0) {
+        if (node->indirect != 0 || node->two_indirect != 0) {
+            set_flag(state, ino, F_PASTSIZE);
+        }
+        return;
+    }
+    n = needed < per ? needed : per;
+    if (check_table(state, ino, node->indirect, n, table) == EXIT_FAILURE) {
+        return;
+    }
+    needed -= n;
+
+    if (needed == 0) {
+        if (node->two_indirect != 0) {
+            set_flag(state, ino, F_PASTSIZE);
+        }
+        return;
+    }
+
+    /* the double table is kept in the second half of "table"
+       while each table it lists is read into the first */
+    if (node->two_indirect == 0) {
+        return;
+    }
+    if (check_table(state, ino, node->two_indirect, 0,
+                    table + per) == EXIT_FAILURE) {
+        return;
+    }
+    for (i = 0; needed > 0 && i < per; i++) {
+        n = needed < per ? needed : per;
+        if (check_table(state, ino, table[per + i], n,
+                        table) == EXIT_FAILURE) {
+            return;
+        }
+        needed -= n;
+    }
+}
+
+/* counts the indirect table in zone "zone" and, when
+   "table" is given, the first "count" zones it lists.
+   Returns EXIT_FAILURE if it can't be read */
+int check_table(struct fsck_state *state, uint32_t ino, uint32_t zone,
+                uint32_t count, uint32_t *table) {
+    struct image_handle *img = state->img;
+    uint32_t i;
+
+    /* a missing table is a hole as big as it would list */
+    if (zone == 0) {
+        return EXIT_SUCCESS;
+    }
+    if (zone < img->super->firstdata || zone >= img->super->zones) {
+        set_flag(state, ino, F_BADZONE);
+        return EXIT_FAILURE;
+    }
+    use_zone(state, zone, ino);
+    if (table == NULL) {
+        return EXIT_SUCCESS;
+    }
+    if (read_zone(img->fd, img->disk_start, img->zone_size,
+                  zone, table) == EXIT_FAILURE) {
+        set_flag(state, ino, F_BADTABLE);
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < count; i++) {
+        use_zone(state, table[i], ino);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* counts one more use of "zone" by inode "ino". Once
+   duplicates are being looked for it prints the owners
+   of every zone used more than once instead */
+void use_zone(struct fsck_state *state, uint32_t zone, uint32_t ino) {
+    struct superblock *super = state->img->super;
+    pthread_mutex_t *lock;
+    uint32_t bit;
+
+    if (zone == 0) {
+        return;
+    }
+    if (zone < super->firstdata || zone >= super->zones) {
+        set_flag(state, ino, F_BADZONE);
+        return;
+    }
+    bit = zone - super->firstdata + 1;
+    if (state->find_dups) {
+        if (state->uses[bit] > 1) {
+            printf(ZOWNER_PRINT, zone, ino);
+        }
+        return;
+    }
+    lock = &state->locks[bit % FSCK_LOCKS];
+    pthread_mutex_lock(lock);
+    if (state->uses[bit] < MAX_USES) {
+        state->uses[bit]++;
+    }
+    pthread_mutex_unlock(lock);
+}
+
+void set_flag(struct fsck_state *state, uint32_t ino, uint8_t flag) {
+    pthread_mutex_t *lock = &state->locks[ino % FSCK_LOCKS];
+
+    pthread_mutex_lock(lock);
+    state->flags[ino] |= flag;
+    pthread_mutex_unlock(lock);
+}
+
+/* prints every problem found, inodes then zones, and
+   returns how many there were. The owners of a zone used
+   more than once are only looked for when there is one */
+uint32_t report(struct fsck_state *state) {
+    struct image_handle *img = state->img;
+    struct inode *node;
+    uint32_t ino, bit, zone, problems = 0, dups = 0;
+    int used, set;
+    uint32_t *table;
+
+    for (ino = 1; ino <= img->super->ninodes; ino++) {
+        node = &img->inode_table[ino - 1];
+        used = state->imap[ino / 8] >> (ino % 8) & 1;
+        if (state->flags[ino] & F_TOOBIG) {
+            printf(TOOBIG_PRINT, ino, node->size, img->super->max_file);
+            problems++;
+        }
+        if (state->flags[ino] & F_BADZONE) {
+            printf(BADZONE_PRINT, ino);
+            problems++;
+        }
+        if (state->flags[ino] & F_PASTSIZE) {
+            printf(PASTSIZE_PRINT, ino);
+            problems++;
+        }
+        if (state->flags[ino] & F_BADTABLE) {
+            printf(BADTABLE_PRINT, ino);
+            problems++;
+        }
+        if (state->flags[ino] & F_BADENTRY) {
+            printf(BADENTRY_PRINT, ino);
+            problems++;
+        }
+        if (state->flags[ino] & F_BADDOT) {
+            printf(BADDOT_PRINT, ino);
+            problems++;
+        }
+        if (state->flags[ino] & F_DIRLINK) {
+            printf(DIRLINK_PRINT, ino);
+            problems++;
+        }
+        if (state->flags[ino] & F_BADDIR) {
+            printf(BADDIR_PRINT, ino);
+            problems++;
+        }
+        if (state->reached[ino] && !used) {
+            printf(IFREE_PRINT, ino);
+            problems++;
+        }
+        if (!state->reached[ino] && used) {
+            printf(IUNREACH_PRINT, ino);
+            problems++;
+        }
+        if (state->reached[ino] && node->links != state->refs[ino]) {
+            printf(LINKS_PRINT, ino, node->links, state->refs[ino]);
+            problems++;
+        }
+    }
+
+    for (bit = 1; bit < state->num_zone_bits; bit++) {
+        zone = img->super->firstdata + bit - 1;
+        set = state->zmap[bit / 8] >> (bit % 8) & 1;
+        if (state->uses[bit] && !set) {
+            printf(ZFREE_PRINT, zone);
+            problems++;
+        }
+        if (!state->uses[bit] && set) {
+            printf(ZUNUSED_PRINT, zone);
+            problems++;
+        }
+        if (state->uses[bit] > 1) {
+            printf(ZDUP_PRINT, zone, state->uses[bit]);
+            problems++;
+            dups++;
+        }
+    }
+
+    /* one more pass, on this thread so they print in order */
+    if (dups > 0 && (table = malloc((size_t)img->zone_size * 2)) != NULL) {
+        state->find_dups = TRUE;
+        for (ino = 1; ino <= img->super->ninodes; ino++) {
+            if (state->reached[ino] ||
+                (state->imap[ino / 8] >> (ino % 8) & 1)) {
+                check_inode(state, ino, table);
+            }
+        }
+        free(table);
+    }
+    return problems;
+}
@@ -0,0 +1,424 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/un.h>
+#include "image.h"
+#include "remote.h"
+
+#define OPTSTR "vt:"
+#define USAGE "Usage: [ -v ] [ -t threads ] socketpath imagefile ...\n"
+#define THREADERR "number of threads must be at least 1\n"
+#define BINDERR "couldn't listen on socket"
+#define DEF_THREADS 4
+#define MAX_PART 4
+#define QUEUE_SIZE 64
+#define LISTEN_BACKLOG 64
+#define ZERO_BUF_SIZE 65536
+#define REQERR "malformed request"
+#define GETTYPEERR "not a regular file"
+#define SERVEERR "image not served"
+
+/* accepted connections waiting for a worker */
+struct conn_queue {
+    int fds[QUEUE_SIZE];
+    int head;
+    int count;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+};
+
+/* the images named when the server started, and every
+   image or partition of one opened so far. Handles are
+   kept open for the life of the server, there are at most
+   21 for each image served (the whole image, 4 partitions
+   and 16 subpartitions) */
+struct image_list {
+    char **served;
+    int num_served;
+    struct image_handle **images;
+    int count;
+    pthread_mutex_t lock;
+};
+
+static struct conn_queue queue;
+static struct image_list images;
+static int isV = FALSE;
+static char zeros[ZERO_BUF_SIZE];
+
+void *worker(void *);
+void serve(int);
+struct image_handle *find_image(char *, int, int);
+struct image_handle *listed_image(char *, int, int);
+struct image_handle *add_image(struct image_handle *);
+int send_error(int, char *);
+int send_listing(int, struct image_handle *, uint32_t, char *, int);
+int send_file(int, struct image_handle *, uint32_t);
+
+int main(int argc, char *argv[]) {
+    int option, threads = DEF_THREADS, listen_fd, client, i;
+    extern int optind;
+    extern char *optarg;
+    struct sockaddr_un addr;
+    char full_image[PATH_MAX];
+    pthread_t tid;
+
+    while ((option = getopt(argc, argv, OPTSTR)) != EOF) {
+        switch (option)
+        {
+        case 'v':
+            isV = TRUE;
+            break;
+        case 't':
+            threads = strtol(optarg, NULL, 10);
+            if (threads < 1) {
+                fprintf(stderr, THREADERR);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            fprintf(stderr, USAGE);
+            return EXIT_FAILURE;
+            break;
+        }
+    }
+
+    if (argc <= optind + 1) {
+        fprintf(stderr, USAGE);
+        return EXIT_FAILURE;
+    }
+
+    /* clients hanging up mid reply shouldn't stop the server */
+    signal(SIGPIPE, SIG_IGN);
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.not_empty, NULL);
+    pthread_cond_init(&queue.not_full, NULL);
+    pthread_mutex_init(&images.lock, NULL);
+
+    /* only the images given are served, each image or
+       partition of one is opened on its first request.
+       Clients name images by their full path */
+    images.served = malloc(sizeof(char*) * (argc - optind - 1));
+    if (images.served == NULL) {
+        perror(MALLOCERR);
+        return EXIT_FAILURE;
+    }
+    for (i = optind + 1; i < argc; i++) {
+        if (realpath(argv[i], full_image) == NULL ||
+            access(full_image, R_OK) < 0) {
+            fprintf(stderr, "%s: %s\n", argv[i], FILEERR);
+            return EXIT_FAILURE;
+        }
+        images.served[images.num_served] = strdup(full_image);
+        if (images.served[images.num_served++] == NULL) {
+            perror(MALLOCERR);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        perror(SOCKERR);
+        return EXIT_FAILURE;
+    }
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, argv[optind], sizeof(addr.sun_path) - 1);
+    unlink(addr.sun_path);
+    if (bind(listen_fd, (struct sockaddr*)&addr,
+             sizeof(struct sockaddr_un)) < 0 ||
+        listen(listen_fd, LISTEN_BACKLOG) < 0) {
+        perror(BINDERR);
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&tid, NULL, worker, NULL) != 0) {
+            perror(THREADERR);
+            return EXIT_FAILURE;
+        }
+        pthread_detach(tid);
+    }
+
+    /* hand each connection to the pool,
+       waiting while every slot is taken */
+    while (TRUE) {
+        if ((client = accept(listen_fd, NULL, NULL)) < 0) {
+            continue;
+        }
+        pthread_mutex_lock(&queue.lock);
+        while (queue.count == QUEUE_SIZE) {
+            pthread_cond_wait(&queue.not_full, &queue.lock);
+        }
+        queue.fds[(queue.head + queue.count) % QUEUE_SIZE] = client;
+        queue.count++;
+        pthread_cond_signal(&queue.not_empty);
+        pthread_mutex_unlock(&queue.lock);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/* takes connections off the queue forever */
+void *worker(void *arg) {
+    int client;
+
+    while (TRUE) {
+        pthread_mutex_lock(&queue.lock);
+        while (queue.count == 0) {
+            pthread_cond_wait(&queue.not_empty, &queue.lock);
+        }
+        client = queue.fds[queue.head];
+        queue.head = (queue.head + 1) % QUEUE_SIZE;
+        queue.count--;
+        pthread_cond_signal(&queue.not_full);
+        pthread_mutex_unlock(&queue.lock);
+
+        serve(client);
+        close(client);
+    }
+    return arg;
+}
+
+/* reads one request from the client and answers it */
+void serve(int client) {
+    char fields[REQ_FIELDS][MAX_LINE], *path_name;
+    struct image_handle *img;
+    struct inode node;
+    uint32_t ino, generation;
+    int i;
+
+    for (i = 0; i < REQ_FIELDS; i++) {
+        if (read_line(client, fields[i], MAX_LINE) == EXIT_FAILURE) {
+            send_error(client, REQERR);
+            return;
+        }
+    }
+
+    img = find_image(fields[1], strtol(fields[2], NULL, 10),
+                     strtol(fields[3], NULL, 10));
+    if (img == NULL) {
+        send_error(client, SERVEERR);
+        return;
+    }
+
+    /* name the path the same way minls does */
+    path_name = malloc(strlen(fields[4]) + 2);
+    if (path_name == NULL) {
+        send_error(client, MALLOCERR);
+        return;
+    }
+    strcpy(path_name, fields[4]);
+    canonicalizer(path_name);
+
+    /* nothing the handle gives this request is freed by
+       a reload another request sets off until it's answered */
+    generation = image_enter(img);
+    ino = image_lookup(img, path_name);
+    if (ino == NO_INODE) {
+        send_error(client, FILENOTFOUNDERR);
+    } else if (strcmp(fields[0], REQ_LIST) == 0) {
+        send_listing(client, img, ino, path_name, TRUE);
+    } else if (strcmp(fields[0], REQ_STAT) == 0) {
+        send_listing(client, img, ino, path_name, FALSE);
+    } else if (strcmp(fields[0], REQ_GET) == 0) {
+        if (image_get_inode(img, ino, &node) == EXIT_FAILURE ||
+            (node.mode & FILE_TYPE_MASK) != REG_MASK) {
+            send_error(client, GETTYPEERR);
+        } else {
+            send_file(client, img, ino);
+        }
+    } else {
+        send_error(client, REQERR);
+    }
+    image_leave(img, generation);
+    free(path_name);
+}
+
+/* returns the open handle for the image and partition,
+   opening it if this is the first request for it. Only
+   images named when the server started are served. The
+   image is opened without the lock held, so a slow open
+   doesn't hold up requests for images already open */
+struct image_handle *find_image(char *path, int part, int sub_part) {
+    struct image_handle *img;
+    int i;
+
+    if (part < NO_PART || part >= MAX_PART ||
+        sub_part < NO_PART || sub_part >= MAX_PART ||
+        (part == NO_PART && sub_part != NO_PART)) {
+        return NULL;
+    }
+    for (i = 0; i < images.num_served; i++) {
+        if (strcmp(images.served[i], path) == 0) {
+            break;
+        }
+    }
+    if (i == images.num_served) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&images.lock);
+    img = listed_image(path, part, sub_part);
+    pthread_mutex_unlock(&images.lock);
+    if (img != NULL) {
+        return img;
+    }
+
+    img = image_open(images.served[i], part, sub_part, isV);
+    if (img == NULL) {
+        return NULL;
+    }
+    return add_image(img);
+}
+
+/* returns the open handle for the image and partition or
+   NULL if there isn't one. "images.lock" must be held */
+struct image_handle *listed_image(char *path, int part, int sub_part) {
+    int i;
+
+    for (i = 0; i < images.count; i++) {
+        if (images.images[i]->part == part &&
+            images.images[i]->sub_part == sub_part &&
+            strcmp(images.images[i]->path, path) == 0) {
+            return images.images[i];
+        }
+    }
+    return NULL;
+}
+
+/* keeps "img" open for the life of the server and returns
+   it. If another request opened the same image meanwhile
+   "img" is closed and that one is returned instead.
+   On error closes "img" and returns NULL */
+struct image_handle *add_image(struct image_handle *img) {
+    struct image_handle *found, **grown;
+
+    pthread_mutex_lock(&images.lock);
+    found = listed_image(img->path, img->part, img->sub_part);
+    if (found != NULL) {
+        pthread_mutex_unlock(&images.lock);
+        image_close(img);
+        return found;
+    }
+    grown = realloc(images.images, sizeof(struct image_handle*) *
+                                   (images.count + 1));
+    if (grown == NULL) {
+        pthread_mutex_unlock(&images.lock);
+        perror(MALLOCERR);
+        image_close(img);
+        return NULL;
+    }
+    images.images = grown;
+    images.images[images.count++] = img;
+    pthread_mutex_unlock(&images.lock);
+    return img;
+}
+
+int send_error(int client, char *msg) {
+    char line[MAX_LINE];
+
+    snprintf(line, MAX_LINE, RESP_ERR_FORMAT, msg);
+    return write_all(client, line, strlen(line));
+}
+
+/* sends what minls would print for inode "ino", listing
+   a directory's entries when "list_dir" is set */
+int send_listing(int client, struct image_handle *img, uint32_t ino,
+                 char *path_name, int list_dir) {
+    char line[MAX_LINE], *buf = NULL;
+    size_t len = 0;
+    FILE *out;
+    int status;
+
+    if ((out = open_memstream(&buf, &len)) == NULL) {
+        return send_error(client, MALLOCERR);
+    }
+    if (image_print(img, ino, path_name, list_dir, out) == EXIT_FAILURE) {
+        fclose(out);
+        free(buf);
+        return send_error(client, LS_TYPE_INVAL);
+    }
+    fclose(out);
+
+    snprintf(line, MAX_LINE, RESP_OK_FORMAT, (unsigned int)len);
+    status = write_all(client, line, strlen(line));
+    if (status == EXIT_SUCCESS) {
+        status = write_all(client, buf, len);
+    }
+    free(buf);
+    return status;
+}
+
+/* sends the contents of regular file inode "ino". Runs of
+   contiguous zones go straight from the image to the socket
+   with sendfile, holes are sent from a buffer of zeros */
+int send_file(int client, struct image_handle *img, uint32_t ino) {
+    struct inode node;
+    uint32_t *zones, num_zones, i, run;
+    size_t len, remaining, chunk;
+    char line[MAX_LINE], buf[ZERO_BUF_SIZE];
+    off_t offset;
+    ssize_t r;
+
+    /* sized by the inode the zones were resolved from */
+    zones = image_get_zones(img, ino, &num_zones, &node);
+    if (zones == NULL) {
+        return send_error(client, READERR);
+    }
+
+    snprintf(line, MAX_LINE, RESP_OK_FORMAT, node.size);
+    if (write_all(client, line, strlen(line)) == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+    }
+
+    remaining = node.size;
+    for (i = 0; i < num_zones && remaining > 0; i += run) {
+        run = next_run(zones, i, num_zones, UINT32_MAX);
+        len = (size_t)img->zone_size * run;
+        if (len > remaining) {
+            len = remaining;
+        }
+        remaining -= len;
+
+        if (zones[i] == 0) {
+            while (len > 0) {
+                chunk = len < ZERO_BUF_SIZE ? len : ZERO_BUF_SIZE;
+                if (write_all(client, zeros, chunk) == EXIT_FAILURE) {
+                    return EXIT_FAILURE;
+                }
+                len -= chunk;
+            }
+            continue;
+        }
+
+        /* sendfile takes its own offset, so the image's
+           file offset is never touched. A compressed image's
+           file doesn't hold the zones as they are, so those
+           are decompressed into a buffer and sent from there */
+        offset = img->disk_start + (off_t)img->zone_size * zones[i];
+        while (len > 0 && cimg_is_compressed(img->fd)) {
+            chunk = len < ZERO_BUF_SIZE ? len : ZERO_BUF_SIZE;
+            if (cimg_pread(img->fd, buf, chunk, offset) != (ssize_t)chunk ||
+                write_all(client, buf, chunk) == EXIT_FAILURE) {
+                return EXIT_FAILURE;
+            }
+            offset += chunk;
+            len -= chunk;
+        }
+        while (len > 0) {
+            r = sendfile(client, img->fd, &offset, len);
+            if (r <= 0) {
+                return EXIT_FAILURE;
+            }
+            len -= r;
+        }
+    }
+    return EXIT_SUCCESS;
+}
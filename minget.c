@@ -3,13 +3,25 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdint.h>
+#include <errno.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include "util.h"
+#include "sched.h"
+#include "remote.h"
+#include "hash.h"
+#include "stream.h"
 
-#define OPTSTR "vp:s:"
-#define USAGE "Usage: [ -v ] [ -p part [ -s subpart ] ] " \
-              "imagefile srcpath [ dstpath ]\n"
+#define OPTSTR "vrdDp:s:w:"
+#define USAGE "Usage: [ -v ] [ -r [ -d ] ] [ -D ] [ -p part [ -s subpart ] ] " \
+              "[ -w window ] [ --server socket ] " \
+              "( imagefile | - ) srcpath [ dstpath ]\n"
 #define PARTERR "partition must be between 0-3\n"
 #define SUBPARTERR "subpartition must be between 0-3\n"
+#define WINDOWERR "readahead window must be 0 or more KiB\n"
+#define NODIRECT "direct I/O not supported here, using buffered reads\n"
 #define NO_IMG "an image file must be provided\n"
 #define OPENERR "open error\n"
 #define INITIALDISK 0
@@ -17,26 +29,127 @@
 #define DEF_PATH "/"
 #define PERM_STRING 11
 #define SIZE_STRING 10
+#define DEF_DEST "."
+#define DIR_PERMS 0755
+#define CUR_DIR "."
+#define PARENT_DIR ".."
+#define MKDIRERR "mkdir error"
+#define SERVER_OPT 'S'
+#define FILE_PERMS 0666
+#define LINK_PRINT "%u hard links recreated, %u duplicate files linked\n"
+#define ZERO_BUF_SIZE 65536
+#define INIT_DEDUP 256
+#define STDIN_IMAGE "-"
+
+static struct option long_opts[] = {
+    {"server", required_argument, NULL, SERVER_OPT},
+    {NULL, 0, NULL, 0}
+};
+
+/* a file with the same data as another, made once
+   every file's data has been written */
+struct pending_dup {
+    char *path;
+    uint32_t ino;
+};
+
+/* one regular file looked at by the dedup pass */
+struct dedup_file {
+    uint32_t ino;
+    uint32_t size;
+    uint64_t digest;
+    uint32_t crc;
+};
+
+/* state shared across a whole tree extraction, the
+   scheduler collects the zones of every file found
+   and the output files are kept open until their
+   data has been dispatched.
+   "paths" holds the host path each hard linked or
+   duplicated inode was first written to, by inode
+   number. "dup_of" is only set when deduplicating and
+   gives the inode whose data each file shares, itself
+   for the one that is written, or 0. "visited" marks the
+   directories a walk has been into, so a directory linked
+   into itself in a corrupt image is only walked once */
+struct extract_state {
+    int image;
+    struct superblock *super;
+    struct inode *inode_table;
+    off_t disk_start;
+    struct scheduler sched;
+    struct arena arena;
+    FILE *outs[SCHED_MAX_FILES];
+    uint32_t sizes[SCHED_MAX_FILES];
+    int num_outs;
+    char **paths;
+    uint8_t *visited;
+    uint32_t *dup_of;
+    struct pending_dup *pending;
+    uint32_t num_pending;
+    uint32_t pending_cap;
+    uint32_t num_links;
+    uint32_t num_dups;
+};
+
+static char zeros[ZERO_BUF_SIZE];
+
+int extract_tree(struct extract_state *, uint32_t, char *);
+int extract_file(struct extract_state *, uint32_t, char *);
+int queue_file(struct extract_state *, struct inode *, char *);
+int flush_extract(struct extract_state *);
+int flush_dups(struct extract_state *);
+int clone_file(char *, char *);
+int find_duplicates(struct extract_state *, uint32_t);
+int scan_tree(struct extract_state *, uint32_t,
+              struct dedup_file **, uint32_t *, uint32_t *);
+int hash_extents(struct extract_state *, struct dedup_file *, void *);
+int same_data(struct extract_state *, uint32_t, uint32_t, void *, void *,
+              size_t);
+int read_span(struct extract_state *, uint32_t *, uint32_t, uint32_t,
+              void *);
+int extract_dir(int, off_t, uint32_t, char *, uint32_t,
+                struct dio *, int, int);
+int copy_file(int, off_t, struct superblock *, struct inode *,
+              FILE *, uint32_t, struct dio *);
 
 int main(int argc, char *argv[]) {
     int option, path_len;
     extern int optind;
     extern char *optarg;
-    int isV = FALSE, part = NO_PART, sub_part = NO_PART;
-    char *image = NULL, *src = NULL, *dest_path = NULL;
-    FILE *image_file, *dest;
+    int isV = FALSE, isR = FALSE, isD = FALSE, isDedup = FALSE;
+    int part = NO_PART, sub_part = NO_PART;
+    char *image = NULL, *src = NULL, *dest_path = NULL, *server = NULL;
+    FILE *dest;
+    int image_file;
     uint32_t disk_start, part_size;
     struct inode found_file;
-    void *file_data;
+    uint32_t found_ino;
+    struct superblock *super;
+    uint32_t window = RA_DEF_WINDOW, zone_size;
+    struct dio dio, *data_dio = NULL;
 
     /* parses all options using getopt and returns appropriately,
      * erroring if they are invalid in anyway */
-    while ((option = getopt(argc, argv, OPTSTR)) != EOF) {
+    while ((option = getopt_long(argc, argv, OPTSTR,
+                                 long_opts, NULL)) != EOF) {
         switch (option)
         {
         case 'v':
             isV = TRUE;
             break;
+        case 'r':
+            isR = TRUE;
+            break;
+        case 'd':
+            isDedup = TRUE;
+            break;
+        case 'D':
+            isD = TRUE;
+            break;
+        case SERVER_OPT:
+            server = optarg;
+            break;
         case 'p':
             part = strtol(optarg, NULL, 10);
             if (part < 0 || part >= MAX_PART) {
@@ -51,6 +164,15 @@ int main(int argc, char *argv[]) {
                 return EXIT_FAILURE;
             }
             break;
+        case 'w':
+            /* how far ahead of the reader to hint, 0 for none */
+            option = strtol(optarg, NULL, 10);
+            if (option < 0) {
+                fprintf(stderr, WINDOWERR);
+                return EXIT_FAILURE;
+            }
+            window = (uint32_t)option * RA_KIB;
+            break;
         default:
             fprintf(stderr, USAGE);
             return EXIT_FAILURE;
@@ -93,17 +215,53 @@ int main(int argc, char *argv[]) {
         dest_path = argv[optind];
     }
 
+    /* an image on stdin is read once from front to back, so
+       nothing that reads it again can be used with it. The
+       window is how far back data can still be picked up */
+    if (strcmp(image, STDIN_IMAGE) == 0) {
+        if (server != NULL || isD || isDedup ||
+            (part == NO_PART && sub_part != NO_PART)) {
+            free(src);
+            fprintf(stderr, USAGE);
+            return EXIT_FAILURE;
+        }
+        option = stream_extract(STDIN_FILENO, part, sub_part, src,
+                                dest_path, isR, window, isV);
+        free(src);
+        return option;
+    }
+
+    /* let a running minfsd send the file instead, it
+       already has the image open and cached, so the image
+       only has to be where it runs. Trees are only
+       extracted locally */
+    if (server != NULL) {
+        if (isR) {
+            fprintf(stderr, USAGE);
+            return EXIT_FAILURE;
+        }
+        dest = stdout;
+        if (dest_path != NULL && (dest = fopen(dest_path, "w+")) == NULL) {
+            fprintf(stderr, OPENERR);
+            return EXIT_FAILURE;
+        }
+        option = remote_request(server, REQ_GET, image,
+                                part, sub_part, src, dest);
+        fclose(dest);
+        return option;
+    }
+
     /* open image file and destination file 
        if neccesary, therefore checking if
        they are valid */
-    if ((image_file = fopen(image, "r")) == NULL) {
+    if ((image_file = cimg_open(image)) < 0) {
         fprintf(stderr, OPENERR);
         return EXIT_FAILURE;
     }
 
-    if(dest_path != NULL){
+    if(dest_path != NULL && !isR){
         if ((dest = fopen(dest_path, "w+")) == NULL) {
-            fclose(image_file);
+            cimg_close(image_file);
             fprintf(stderr, OPENERR);
             return EXIT_FAILURE;
         }
@@ -120,7 +278,7 @@ int main(int argc, char *argv[]) {
     if (part != NO_PART) {
         if (partition_finder(image, part, sub_part, 
             &disk_start, &part_size, isV) == EXIT_FAILURE) {
-            fclose(image_file);
+            cimg_close(image_file);
             fclose(dest);
             return EXIT_FAILURE;
         }
@@ -131,7 +289,7 @@ int main(int argc, char *argv[]) {
         } else {
             /* invalid usage */
             
-            fclose(image_file);
+            cimg_close(image_file);
             fclose(dest);
             fprintf(stderr, USAGE);
             return EXIT_FAILURE;
@@ -143,12 +301,14 @@ int main(int argc, char *argv[]) {
        search starting from root by parsing
        path given to get inode of file
     */
-    if (find_file(src, 
-                 image_file,  
-                 disk_start * SECTOR_SIZE, 
-                 &found_file, 
-                 isV) == EXIT_FAILURE) {
-        fclose(image_file);
+    if (find_inode(src, 
+                  image_file,  
+                  disk_start * SECTOR_SIZE, 
+                  &found_file, 
+                  &found_ino,
+                  isV,
+                  NULL) == EXIT_FAILURE) {
+        cimg_close(image_file);
         fclose(dest);
         return EXIT_FAILURE;
     }
@@ -157,37 +317,825 @@ int main(int argc, char *argv[]) {
        reads file from found file inode
        then writes contents to destination path */
 
+    /* file data goes through a second descriptor opened for
+       direct I/O when asked for, metadata stays buffered.
+       Readahead hints only help buffered reads */
+    if (isD) {
+        super = get_superblock(image_file, disk_start * SECTOR_SIZE, FALSE);
+        if (super == NULL) {
+            cimg_close(image_file);
+            fclose(dest);
+            return EXIT_FAILURE;
+        }
+        zone_size = super->blocksize << super->log_zone_size;
+        free(super);
+        if (dio_open(&dio, image, zone_size > SCHED_MAX_RUN ?
+                                  zone_size : SCHED_MAX_RUN) == EXIT_FAILURE) {
+            cimg_close(image_file);
+            fclose(dest);
+            fprintf(stderr, OPENERR);
+            return EXIT_FAILURE;
+        }
+        data_dio = &dio;
+        if (dio.direct) {
+            window = 0;
+        } else if (isV) {
+            fprintf(stderr, NODIRECT);
+        }
+    }
+
+    /* recursive extraction of a directory writes the whole
+       tree under the destination, otherwise a recursive
+       request for a regular file is a normal extraction */
+    if(isR && (found_file.mode & FILE_TYPE_MASK) == DIR_MASK){
+        if(extract_dir(image_file,
+                       disk_start * SECTOR_SIZE,
+                       found_ino,
+                       dest_path != NULL ? dest_path : DEF_DEST,
+                       window, data_dio, isDedup, isV)
+                       == EXIT_FAILURE){
+            if(data_dio != NULL) dio_close(data_dio);
+            cimg_close(image_file);
+            return EXIT_FAILURE;
+        }
+        if(data_dio != NULL) dio_close(data_dio);
+        cimg_close(image_file);
+        if(isV){
+            bufpool_report(stderr);
+        }
+        return EXIT_SUCCESS;
+    }
+    if(isR && dest_path != NULL){
+        if ((dest = fopen(dest_path, "w+")) == NULL) {
+            if (data_dio != NULL) dio_close(data_dio);
+            cimg_close(image_file);
+            fprintf(stderr, OPENERR);
+            return EXIT_FAILURE;
+        }
+    }
+
     /* check if file is a regular file before writing */
     if((found_file.mode & FILE_TYPE_MASK) != REG_MASK){
-        fclose(image_file);
+        if(data_dio != NULL) dio_close(data_dio);
+        cimg_close(image_file);
         fclose(dest);
         fprintf(stderr, LS_TYPE_INVAL);
         return EXIT_FAILURE;
     }
     
-    /* read the file's data from the found
-       file inode */
-    if((file_data = read_file(image_file, 
-                 &found_file, 
-                 get_superblock(image_file, disk_start * SECTOR_SIZE, FALSE),
-                 disk_start * SECTOR_SIZE)) == NULL){
-        fclose(image_file);
+    /* stream the file's data from the found
+       file inode into the opened destination */
+    super = get_superblock(image_file, disk_start * SECTOR_SIZE, FALSE);
+    if(super == NULL){
+        if(data_dio != NULL) dio_close(data_dio);
+        cimg_close(image_file);
         fclose(dest);
         return EXIT_FAILURE;
     }
-
-    /* write the file's data into the opened destination file 
-       from the given size in the file inode */
-    if(fwrite(file_data, 1, found_file.size, dest) != found_file.size){
-        free(file_data);
-        fclose(image_file);
+    if(copy_file(image_file, disk_start * SECTOR_SIZE, super,
+                 &found_file, dest, window, data_dio) == EXIT_FAILURE){
+        free(super);
+        if(data_dio != NULL) dio_close(data_dio);
+        cimg_close(image_file);
         fclose(dest);
         return EXIT_FAILURE;
     }
 
     /* free and close files before exiting */
-    free(file_data);
-    fclose(image_file);
+    free(super);
+    if(data_dio != NULL) dio_close(data_dio);
+    cimg_close(image_file);
     fclose(dest);
+    if(isV){
+        bufpool_report(stderr);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* writes the contents of regular file "node" to "dest",
+   reading runs of zones that follow each other on disk in
+   one read, hinting "window" bytes ahead of the reads and
+   never reading holes. Data is read through "dio" when
+   one is given */
+int copy_file(int image, off_t disk_start, struct superblock *super,
+              struct inode *node, FILE *dest, uint32_t window,
+              struct dio *dio){
+    struct zone_geom geom;
+    struct readahead ra;
+    uint32_t *zones, num_zones, i, run, max_run;
+    size_t len, remaining, buf_size;
+    void *buf, *data;
+
+    geom_select(super, &geom);
+    zones = resolve_zones(image, node, disk_start, &geom,
+                          &num_zones, NULL);
+    if(zones == NULL){
+        return EXIT_FAILURE;
+    }
+    buf_size = geom.zone_size > SCHED_MAX_RUN ? geom.zone_size : SCHED_MAX_RUN;
+    if(dio != NULL){
+        buf = dio_get_buf(dio);
+    }else{
+        buf = bufpool_get(buf_size);
+    }
+    if(buf == NULL){
+        perror(MALLOCERR);
+        free(zones);
+        return EXIT_FAILURE;
+    }
+    ra_init(&ra, image, disk_start, geom.zone_size, window);
+
+    max_run = SCHED_MAX_RUN / geom.zone_size;
+    if(max_run == 0) max_run = 1;
+    remaining = node->size;
+    for(i = 0; i < num_zones && remaining > 0; i += run){
+        ra_zones(&ra, zones, num_zones, i);
+
+        /* count how many zones after this one are
+           contiguous on disk, or are holes in a row */
+        run = next_run(zones, i, num_zones, max_run);
+        len = (size_t)geom.zone_size * run;
+        if(len > remaining){
+            len = remaining;
+        }
+
+        /* direct reads land wherever the rounded
+           read puts them inside the buffer */
+        data = buf;
+        if(zones[i] == 0){
+            memset(buf, 0, len);
+        }else if(dio != NULL){
+            data = dio_read(dio, buf, len, disk_start +
+                            (off_t)geom.zone_size * zones[i]);
+        }else if(cimg_pread(image, buf, len, disk_start +
+                       (off_t)geom.zone_size * zones[i]) != (ssize_t)len){
+            data = NULL;
+        }
+        if(data == NULL){
+            perror(READERR);
+            free(zones);
+            if(dio != NULL){
+                dio_put_buf(dio, buf);
+            }else{
+                bufpool_put(buf, buf_size);
+            }
+            return EXIT_FAILURE;
+        }
+        if(fwrite(data, 1, len, dest) != len){
+            free(zones);
+            if(dio != NULL){
+                dio_put_buf(dio, buf);
+            }else{
+                bufpool_put(buf, buf_size);
+            }
+            return EXIT_FAILURE;
+        }
+        remaining -= len;
+        ra_done(&ra, zones, i + run);
+    }
+
+    free(zones);
+    if(dio != NULL){
+        dio_put_buf(dio, buf);
+    }else{
+        bufpool_put(buf, buf_size);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* extracts directory inode "dir" and everything under it
+   into the host directory "host_path", reading file data
+   through the disk order scheduler. Hard links are made
+   again on the host and, when "isDedup" is set, files with
+   the same data as another are cloned or linked to it
+   rather than written */
+int extract_dir(int image, off_t disk_start,
+                uint32_t dir, char *host_path, uint32_t window,
+                struct dio *dio, int isDedup, int isV){
+    struct extract_state state;
+    uint32_t i;
+    int status;
+
+    memset(&state, 0, sizeof(struct extract_state));
+    state.image = image;
+    state.disk_start = disk_start;
+    state.super = get_superblock(image, disk_start, FALSE);
+    if(state.super == NULL){
+        return EXIT_FAILURE;
+    }
+    state.inode_table = get_inode_table(image, state.super,
+                                        disk_start, NULL);
+    if(state.inode_table == NULL){
+        free(state.super);
+        return EXIT_FAILURE;
+    }
+    state.paths = calloc(state.super->ninodes + 1, sizeof(char*));
+    state.visited = calloc(state.super->ninodes + 1, 1);
+    if(isDedup){
+        state.dup_of = calloc(state.super->ninodes + 1, sizeof(uint32_t));
+    }
+    if(state.paths == NULL || state.visited == NULL ||
+       (isDedup && state.dup_of == NULL)){
+        perror(MALLOCERR);
+        free(state.dup_of);
+        free(state.visited);
+        free(state.paths);
+        free(state.inode_table);
+        free(state.super);
+        return EXIT_FAILURE;
+    }
+    if(sched_init(&state.sched, image, state.super,
+                  disk_start, window, dio) == EXIT_FAILURE){
+        free(state.dup_of);
+        free(state.visited);
+        free(state.paths);
+        free(state.inode_table);
+        free(state.super);
+        return EXIT_FAILURE;
+    }
+
+    /* find duplicates first, walk the tree queueing every
+       file, then dispatch whatever is left over and make the
+       duplicates. Directory buffers come from an arena
+       released level by level */
+    arena_init(&state.arena);
+    status = EXIT_SUCCESS;
+    if(isDedup){
+        status = find_duplicates(&state, dir);
+        memset(state.visited, 0, state.super->ninodes + 1);
+    }
+    if(status == EXIT_SUCCESS){
+        status = extract_tree(&state, dir, host_path);
+    }
+    if(flush_extract(&state) == EXIT_FAILURE){
+        status = EXIT_FAILURE;
+    }
+    if(status == EXIT_SUCCESS){
+        status = flush_dups(&state);
+    }
+    if(isV){
+        fprintf(stderr, LINK_PRINT, state.num_links, state.num_dups);
+    }
+
+    for(i = 0; i <= state.super->ninodes; i++){
+        free(state.paths[i]);
+    }
+    for(i = 0; i < state.num_pending; i++){
+        free(state.pending[i].path);
+    }
+    free(state.pending);
+    free(state.paths);
+    free(state.visited);
+    free(state.dup_of);
+    arena_destroy(&state.arena);
+    sched_free(&state.sched);
+    free(state.inode_table);
+    free(state.super);
+    return status;
+}
+
+/* creates "host_path" as a directory then queues every
+   regular file in directory inode "ino" with the scheduler
+   and recurses into every subdirectory not walked yet */
+int extract_tree(struct extract_state *state,
+                 uint32_t ino,
+                 char *host_path){
+    struct inode *dir = &state->inode_table[ino - 1];
+    struct dir_entry *dir_data, *entry;
+    struct inode *child;
+    char name[NAME_SIZE + 1], *child_path;
+    struct arena_mark mark;
+    off_t num_entries, i;
+
+    if(state->visited[ino]){
+        return EXIT_SUCCESS;
+    }
+    state->visited[ino] = TRUE;
+    if(mkdir(host_path, DIR_PERMS) < 0 && errno != EEXIST){
+        perror(MKDIRERR);
+        return EXIT_FAILURE;
+    }
+
+    arena_save(&state->arena, &mark);
+    dir_data = (struct dir_entry*)read_file(state->image, dir,
+                                            state->super,
+                                            state->disk_start,
+                                            &state->arena);
+    if(dir_data == NULL){
+        arena_restore(&state->arena, &mark);
+        return EXIT_FAILURE;
+    }
+    num_entries = dir->size / sizeof(struct dir_entry);
+    ra_dirs(&state->sched.ra, dir_data, num_entries,
+            state->inode_table, state->super->ninodes);
+
+    for(i = 0; i < num_entries; i++){
+        entry = &dir_data[i];
+
+        /* deleted file */
+        if(entry->inode == 0) continue;
+        if(entry->inode > state->super->ninodes){
+            perror(INODEERR);
+            arena_restore(&state->arena, &mark);
+            return EXIT_FAILURE;
+        }
+
+        /* names are only NULL terminated when shorter than
+           the full name size, so copy into a bigger buffer */
+        memset(name, 0, NAME_SIZE + 1);
+        strncpy(name, (char*)entry->name, NAME_SIZE);
+        if(strcmp(name, CUR_DIR) == 0 || strcmp(name, PARENT_DIR) == 0){
+            continue;
+        }
+        if(!name_is_safe(name)){
+            fprintf(stderr, "%s: %s\n", host_path, UNSAFEERR);
+            continue;
+        }
+
+        child_path = malloc(strlen(host_path) + strlen(name) + 2);
+        if(child_path == NULL){
+            perror(MALLOCERR);
+            arena_restore(&state->arena, &mark);
+            return EXIT_FAILURE;
+        }
+        sprintf(child_path, "%s/%s", host_path, name);
+        child = &state->inode_table[entry->inode - 1];
+
+        if((child->mode & FILE_TYPE_MASK) == DIR_MASK){
+            if(extract_tree(state, entry->inode,
+                            child_path) == EXIT_FAILURE){
+                free(child_path);
+                arena_restore(&state->arena, &mark);
+                return EXIT_FAILURE;
+            }
+        }else if((child->mode & FILE_TYPE_MASK) == REG_MASK){
+            if(extract_file(state, entry->inode,
+                            child_path) == EXIT_FAILURE){
+                free(child_path);
+                arena_restore(&state->arena, &mark);
+                return EXIT_FAILURE;
+            }
+        }
+        free(child_path);
+    }
+
+    arena_restore(&state->arena, &mark);
+    return EXIT_SUCCESS;
+}
+
+/* extracts regular file inode "ino" to "host_path". Another
+   name for an inode already written is linked to it, a
+   duplicate is left until the data it shares is written,
+   anything else is queued with the scheduler */
+int extract_file(struct extract_state *state, uint32_t ino,
+                 char *host_path){
+    struct inode *node = &state->inode_table[ino - 1];
+    struct pending_dup *grown;
+    uint32_t dup = state->dup_of != NULL ? state->dup_of[ino] : 0;
+
+    /* a host that can't link gets another copy */
+    if(node->links > 1 && state->paths[ino] != NULL){
+        unlink(host_path);
+        if(link(state->paths[ino], host_path) == 0){
+            state->num_links++;
+            return EXIT_SUCCESS;
+        }
+        return queue_file(state, node, host_path);
+    }
+
+    if(dup != 0 && dup != ino){
+        if(state->num_pending == state->pending_cap){
+            state->pending_cap = state->pending_cap ?
+                                 state->pending_cap * 2 : INIT_DEDUP;
+            grown = realloc(state->pending, sizeof(struct pending_dup) *
+                                            state->pending_cap);
+            if(grown == NULL){
+                perror(MALLOCERR);
+                return EXIT_FAILURE;
+            }
+            state->pending = grown;
+        }
+        state->pending[state->num_pending].path = strdup(host_path);
+        if(state->pending[state->num_pending].path == NULL){
+            perror(MALLOCERR);
+            return EXIT_FAILURE;
+        }
+        state->pending[state->num_pending].ino = ino;
+        state->num_pending++;
+        return EXIT_SUCCESS;
+    }
+
+    /* remember where the data went for later names */
+    if(node->links > 1 || dup == ino){
+        state->paths[ino] = strdup(host_path);
+        if(state->paths[ino] == NULL){
+            perror(MALLOCERR);
+            return EXIT_FAILURE;
+        }
+    }
+    return queue_file(state, node, host_path);
+}
+
+/* opens "host_path" and queues the data of "node" to be
+   written there */
+int queue_file(struct extract_state *state, struct inode *node,
+               char *host_path){
+    FILE *out;
+
+    /* make room for another open output
+       by dispatching everything queued so far */
+    if(state->num_outs == SCHED_MAX_FILES &&
+       flush_extract(state) == EXIT_FAILURE){
+        return EXIT_FAILURE;
+    }
+    if((out = fopen(host_path, "w+")) == NULL){
+        fprintf(stderr, OPENERR);
+        return EXIT_FAILURE;
+    }
+    state->outs[state->num_outs] = out;
+    state->sizes[state->num_outs] = node->size;
+    state->num_outs++;
+    return sched_add_file(&state->sched, node, sched_file_sink, out);
+}
+
+/* dispatches every queued read then sets each output
+   to its final size, so holes and trailing holes read
+   back as zeros, and closes it */
+int flush_extract(struct extract_state *state){
+    int i, status;
+
+    status = sched_dispatch(&state->sched);
+    for(i = 0; i < state->num_outs; i++){
+        fflush(state->outs[i]);
+        if(ftruncate(fileno(state->outs[i]), state->sizes[i]) < 0){
+            perror(FILEERR);
+            status = EXIT_FAILURE;
+        }
+        fclose(state->outs[i]);
+    }
+    state->num_outs = 0;
+    return status;
+}
+
+/* makes every duplicate left by the walk now that all data
+   is on the host. Hard links of a duplicate are linked to
+   its first name, anything that can't be cloned or linked
+   is extracted after all */
+int flush_dups(struct extract_state *state){
+    struct pending_dup *dup;
+    struct inode *node;
+    uint32_t i;
+    char *src;
+
+    for(i = 0; i < state->num_pending; i++){
+        dup = &state->pending[i];
+        node = &state->inode_table[dup->ino - 1];
+
+        if(state->paths[dup->ino] != NULL){
+            unlink(dup->path);
+            if(link(state->paths[dup->ino], dup->path) == 0){
+                state->num_links++;
+                continue;
+            }
+            src = NULL;
+        }else{
+            src = state->paths[state->dup_of[dup->ino]];
+        }
+
+        if(src != NULL && clone_file(src, dup->path) == EXIT_SUCCESS){
+            state->num_dups++;
+        }else if(queue_file(state, node, dup->path) == EXIT_FAILURE){
+            return EXIT_FAILURE;
+        }
+        if(node->links > 1 && state->paths[dup->ino] == NULL){
+            state->paths[dup->ino] = strdup(dup->path);
+            if(state->paths[dup->ino] == NULL){
+                perror(MALLOCERR);
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    return flush_extract(state);
+}
+
+/* makes "dst" a copy of "src" sharing its blocks when the
+   host file system can reflink, otherwise a hard link */
+int clone_file(char *src, char *dst){
+    int in, out, status = EXIT_FAILURE;
+
+    if((in = open(src, O_RDONLY)) >= 0){
+        if((out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, FILE_PERMS)) >= 0){
+            if(ioctl(out, FICLONE, in) == 0){
+                status = EXIT_SUCCESS;
+            }
+            close(out);
+        }
+        close(in);
+    }
+    if(status == EXIT_SUCCESS){
+        return EXIT_SUCCESS;
+    }
+
+    unlink(dst);
+    return link(src, dst) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int size_cmp(const void *a, const void *b){
+    const struct dedup_file *fa = a, *fb = b;
+
+    if(fa->size != fb->size){
+        return fa->size < fb->size ? -1 : 1;
+    }
+    return 0;
+}
+
+static int digest_cmp(const void *a, const void *b){
+    const struct dedup_file *fa = a, *fb = b;
+
+    if(fa->digest != fb->digest){
+        return fa->digest < fb->digest ? -1 : 1;
+    }
+    if(fa->crc != fb->crc){
+        return fa->crc < fb->crc ? -1 : 1;
+    }
+    return 0;
+}
+
+/* fills in "dup_of" for every regular file under "dir". Only
+   files that share their size with another are read, their
+   data is hashed and files with the same size and hashes
+   are compared byte for byte with the first of them, sharing
+   its data only if they really are the same. Neither hash
+   stops an image from being made to collide on purpose */
+int find_duplicates(struct extract_state *state, uint32_t dir){
+    struct dedup_file *files = NULL;
+    uint32_t num = 0, cap = 0, start, end, i, j, k;
+    size_t buf_size;
+    void *buf, *other;
+    int status, same;
+
+    /* the scan marks each inode in "dup_of" as it is found
+       so hard links are only looked at once */
+    status = scan_tree(state, dir, &files, &num, &cap);
+    memset(state->dup_of, 0, sizeof(uint32_t) * (state->super->ninodes + 1));
+    if(status == EXIT_FAILURE){
+        free(files);
+        return EXIT_FAILURE;
+    }
+
+    buf_size = state->sched.zone_size > SCHED_MAX_RUN ?
+               state->sched.zone_size : SCHED_MAX_RUN;
+    buf = bufpool_get(buf_size);
+    other = bufpool_get(buf_size);
+    if(buf == NULL || other == NULL){
+        perror(MALLOCERR);
+        bufpool_put(buf, buf_size);
+        bufpool_put(other, buf_size);
+        free(files);
+        return EXIT_FAILURE;
+    }
+
+    qsort(files, num, sizeof(struct dedup_file), size_cmp);
+    for(start = 0; start < num; start = end){
+        end = start + 1;
+        while(end < num && files[end].size == files[start].size){
+            end++;
+        }
+        if(end - start < 2 || files[start].size == 0) continue;
+
+        for(i = start; i < end; i++){
+            if(hash_extents(state, &files[i], buf) == EXIT_FAILURE){
+                bufpool_put(buf, buf_size);
+                bufpool_put(other, buf_size);
+                free(files);
+                return EXIT_FAILURE;
+            }
+        }
+        qsort(files + start, end - start, sizeof(struct dedup_file),
+              digest_cmp);
+        for(i = start; i < end; i = j){
+            j = i + 1;
+            while(j < end && digest_cmp(&files[i], &files[j]) == 0){
+                j++;
+            }
+            if(j - i < 2) continue;
+
+            /* one that differs is extracted on its own */
+            for(k = i + 1; k < j; k++){
+                same = same_data(state, files[i].ino, files[k].ino,
+                                 buf, other, buf_size);
+                if(same == -1){
+                    bufpool_put(buf, buf_size);
+                    bufpool_put(other, buf_size);
+                    free(files);
+                    return EXIT_FAILURE;
+                }
+                if(same){
+                    state->dup_of[files[i].ino] = files[i].ino;
+                    state->dup_of[files[k].ino] = files[i].ino;
+                }
+            }
+        }
+    }
+
+    bufpool_put(buf, buf_size);
+    bufpool_put(other, buf_size);
+    free(files);
+    return EXIT_SUCCESS;
+}
+
+/* compares the data of inodes "a" and "b", which are the same
+   size, a buffer of each at a time. Returns TRUE if it is the
+   same, FALSE if not and -1 on error */
+int same_data(struct extract_state *state, uint32_t a, uint32_t b,
+              void *buf_a, void *buf_b, size_t buf_size){
+    struct inode *node = &state->inode_table[a - 1];
+    uint32_t *zones_a, *zones_b, num_a, num_b, i, step, zone_size;
+    struct arena_mark mark;
+    size_t len;
+
+    zone_size = state->sched.zone_size;
+    step = buf_size / zone_size;
+    arena_save(&state->arena, &mark);
+    zones_a = resolve_zones(state->image, node, state->disk_start,
+                            &state->sched.geom, &num_a, &state->arena);
+    zones_b = resolve_zones(state->image, &state->inode_table[b - 1],
+                            state->disk_start, &state->sched.geom,
+                            &num_b, &state->arena);
+    if(zones_a == NULL || zones_b == NULL || num_a != num_b){
+        arena_restore(&state->arena, &mark);
+        return zones_a == NULL || zones_b == NULL ? -1 : FALSE;
+    }
+
+    for(i = 0; i < num_a; i += step){
+        if(num_a - i < step){
+            step = num_a - i;
+        }
+        if(read_span(state, zones_a, i, step, buf_a) == EXIT_FAILURE ||
+           read_span(state, zones_b, i, step, buf_b) == EXIT_FAILURE){
+            arena_restore(&state->arena, &mark);
+            return -1;
+        }
+
+        /* past the size is never compared */
+        len = (size_t)zone_size * step;
+        if((uint64_t)zone_size * i + len > node->size){
+            len = node->size - (uint64_t)zone_size * i;
+        }
+        if(memcmp(buf_a, buf_b, len) != 0){
+            arena_restore(&state->arena, &mark);
+            return FALSE;
+        }
+    }
+    arena_restore(&state->arena, &mark);
+    return TRUE;
+}
+
+/* reads "count" zones of a file from zone "first" of its list
+   "zones" into "buf", one read per run of contiguous zones.
+   Holes read as zeros */
+int read_span(struct extract_state *state, uint32_t *zones,
+              uint32_t first, uint32_t count, void *buf){
+    uint32_t zone_size = state->sched.zone_size, i, run;
+    char *dst = buf;
+    size_t len;
+
+    for(i = first; i < first + count; i += run){
+        run = next_run(zones, i, first + count, UINT32_MAX);
+        len = (size_t)zone_size * run;
+        if(zones[i] == 0){
+            memset(dst + (size_t)zone_size * (i - first), 0, len);
+        }else if(cimg_pread(state->image, dst + (size_t)zone_size *
+                                                (i - first), len,
+                            state->disk_start +
+                            (off_t)zone_size * zones[i]) != (ssize_t)len){
+            perror(READERR);
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/* adds every regular file under directory inode "ino" not
+   seen yet to "files", growing it as needed. Each directory
+   is only scanned once */
+int scan_tree(struct extract_state *state, uint32_t ino,
+              struct dedup_file **files, uint32_t *num, uint32_t *cap){
+    struct inode *dir = &state->inode_table[ino - 1];
+    struct dir_entry *dir_data, *entry;
+    struct dedup_file *grown;
+    struct inode *child;
+    struct arena_mark mark;
+    off_t num_entries, i;
+
+    if(state->visited[ino]){
+        return EXIT_SUCCESS;
+    }
+    state->visited[ino] = TRUE;
+    arena_save(&state->arena, &mark);
+    dir_data = (struct dir_entry*)read_file(state->image, dir,
+                                            state->super,
+                                            state->disk_start,
+                                            &state->arena);
+    if(dir_data == NULL){
+        arena_restore(&state->arena, &mark);
+        return EXIT_FAILURE;
+    }
+    num_entries = dir->size / sizeof(struct dir_entry);
+
+    for(i = 0; i < num_entries; i++){
+        entry = &dir_data[i];
+        if(entry->inode == 0 || entry->inode > state->super->ninodes ||
+           strncmp((char*)entry->name, CUR_DIR, NAME_SIZE) == 0 ||
+           strncmp((char*)entry->name, PARENT_DIR, NAME_SIZE) == 0){
+            continue;
+        }
+        child = &state->inode_table[entry->inode - 1];
+
+        if((child->mode & FILE_TYPE_MASK) == DIR_MASK){
+            if(scan_tree(state, entry->inode, files, num,
+                         cap) == EXIT_FAILURE){
+                arena_restore(&state->arena, &mark);
+                return EXIT_FAILURE;
+            }
+        }else if((child->mode & FILE_TYPE_MASK) == REG_MASK &&
+                 state->dup_of[entry->inode] == 0){
+            if(*num == *cap){
+                *cap = *cap ? *cap * 2 : INIT_DEDUP;
+                grown = realloc(*files, sizeof(struct dedup_file) * *cap);
+                if(grown == NULL){
+                    perror(MALLOCERR);
+                    arena_restore(&state->arena, &mark);
+                    return EXIT_FAILURE;
+                }
+                *files = grown;
+            }
+            memset(&(*files)[*num], 0, sizeof(struct dedup_file));
+            (*files)[*num].ino = entry->inode;
+            (*files)[*num].size = child->size;
+            (*num)++;
+            state->dup_of[entry->inode] = entry->inode;
+        }
+    }
+
+    arena_restore(&state->arena, &mark);
+    return EXIT_SUCCESS;
+}
+
+/* hashes one file's data a run of contiguous zones at a
+   time into both a 64 bit xxHash and a CRC32C. Holes are
+   hashed as zeros without being read */
+int hash_extents(struct extract_state *state, struct dedup_file *file,
+                 void *buf){
+    struct inode *node = &state->inode_table[file->ino - 1];
+    uint32_t *zones, num_zones, i, run, max_run, zone_size;
+    size_t len, remaining, chunk;
+    struct hasher digest, crc;
+    struct arena_mark mark;
+
+    arena_save(&state->arena, &mark);
+    zones = resolve_zones(state->image, node, state->disk_start,
+                          &state->sched.geom, &num_zones, &state->arena);
+    if(zones == NULL){
+        arena_restore(&state->arena, &mark);
+        return EXIT_FAILURE;
+    }
+
+    hash_init(&digest, HASH_XXH64);
+    hash_init(&crc, HASH_CRC32C);
+    zone_size = state->sched.zone_size;
+    max_run = SCHED_MAX_RUN / zone_size;
+    if(max_run == 0) max_run = 1;
+    remaining = node->size;
+    for(i = 0; i < num_zones && remaining > 0; i += run){
+        run = next_run(zones, i, num_zones, max_run);
+        len = (size_t)zone_size * run;
+        if(len > remaining){
+            len = remaining;
+        }
+        remaining -= len;
+
+        if(zones[i] == 0){
+            while(len > 0){
+                chunk = len < ZERO_BUF_SIZE ? len : ZERO_BUF_SIZE;
+                hash_update(&digest, zeros, chunk);
+                hash_update(&crc, zeros, chunk);
+                len -= chunk;
+            }
+            continue;
+        }
+        if(cimg_pread(state->image, buf, len, state->disk_start +
+                 (off_t)zone_size * zones[i]) != (ssize_t)len){
+            perror(READERR);
+            arena_restore(&state->arena, &mark);
+            return EXIT_FAILURE;
+        }
+        hash_update(&digest, buf, len);
+        hash_update(&crc, buf, len);
+    }
+
+    file->digest = hash_final(&digest);
+    file->crc = (uint32_t)hash_final(&crc);
+    arena_restore(&state->arena, &mark);
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,349 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "image.h"
+#include "sched.h"
+#include "bufpool.h"
+#include "search.h"
+
+#define OPTSTR "vlnj:p:s:"
+#define USAGE "Usage: [ -v ] [ -l | -n ] [ -j jobs ] " \
+              "[ -p part [ -s subpart ] ] imagefile pattern [ path ]\n"
+#define PARTERR "partition must be between 0-3\n"
+#define SUBPARTERR "subpartition must be between 0-3\n"
+#define JOBERR "number of jobs must be at least 1\n"
+#define PATERR "pattern must be 1-4096 bytes\n"
+#define MATCH_PRINT "%s:%llu\n"
+#define NAME_PRINT "%s\n"
+#define GREP_ERR_PRINT "%s: %s\n"
+#define MAX_PART 4
+#define MAX_PATTERN 4096
+#define DEF_PATH "/"
+#define GREP_BUF_SIZE (SCHED_MAX_RUN + MAX_PATTERN)
+
+/* one regular file to search. What it printed is
+   kept in "out" until every worker is done */
+struct grep_file {
+    char *path;
+    uint32_t ino;
+    char *out;
+    size_t out_len;
+    int failed;
+};
+
+/* everything the workers share, files are handed out by "next" */
+struct grep_state {
+    struct image_handle *img;
+    struct grep_file *files;
+    uint32_t num_files;
+    uint32_t next;
+    char *pattern;
+    size_t pat_len;
+    int isList;
+    int isLine;
+    pthread_mutex_t lock;
+};
+
+void *worker(void *);
+int grep_file(struct grep_state *, struct grep_file *, unsigned char *,
+              FILE *);
+
+int main(int argc, char *argv[]) {
+    int option, jobs, i, part = NO_PART, sub_part = NO_PART, isV = FALSE;
+    int matched = FALSE, failures = 0;
+    extern int optind;
+    extern char *optarg;
+    struct grep_state state;
+    pthread_t *threads;
+    char *path_name;
+    struct image_file *found;
+    uint32_t ino, j;
+
+    memset(&state, 0, sizeof(struct grep_state));
+    jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs < 1) jobs = 1;
+
+    while ((option = getopt(argc, argv, OPTSTR)) != EOF) {
+        switch (option)
+        {
+        case 'v':
+            isV = TRUE;
+            break;
+        case 'l':
+            state.isList = TRUE;
+            break;
+        case 'n':
+            state.isLine = TRUE;
+            break;
+        case 'j':
+            jobs = strtol(optarg, NULL, 10);
+            if (jobs < 1) {
+                fprintf(stderr, JOBERR);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'p':
+            part = strtol(optarg, NULL, 10);
+            if (part < 0 || part >= MAX_PART) {
+                fprintf(stderr, PARTERR);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 's':
+            sub_part = strtol(optarg, NULL, 10);
+            if (sub_part < 0 || sub_part >= MAX_PART) {
+                fprintf(stderr, SUBPARTERR);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            fprintf(stderr, USAGE);
+            return EXIT_FAILURE;
+            break;
+        }
+    }
+    if ((part == NO_PART && sub_part != NO_PART) ||
+        (state.isList && state.isLine) || argc < optind + 2) {
+        fprintf(stderr, USAGE);
+        return EXIT_FAILURE;
+    }
+    state.pattern = argv[optind + 1];
+    state.pat_len = strlen(state.pattern);
+    if (state.pat_len == 0 || state.pat_len > MAX_PATTERN) {
+        fprintf(stderr, PATERR);
+        return EXIT_FAILURE;
+    }
+
+    /* the image is opened once and shared by every worker */
+    state.img = image_open(argv[optind], part, sub_part, isV);
+    if (state.img == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    path_name = malloc(strlen(argc > optind + 2 ? argv[optind + 2]
+                                                : DEF_PATH) + 2);
+    if (path_name == NULL) {
+        perror(MALLOCERR);
+        image_close(state.img);
+        return EXIT_FAILURE;
+    }
+    strcpy(path_name, argc > optind + 2 ? argv[optind + 2] : DEF_PATH);
+    canonicalizer(path_name);
+
+    ino = image_lookup(state.img, path_name);
+    if (ino == NO_INODE) {
+        fprintf(stderr, "%s\n", FILENOTFOUNDERR);
+        free(path_name);
+        image_close(state.img);
+        return EXIT_FAILURE;
+    }
+
+    /* every regular file at or under the path */
+    if (image_collect(state.img, ino, path_name, &found,
+                      &state.num_files) == EXIT_FAILURE) {
+        free(path_name);
+        image_close(state.img);
+        return EXIT_FAILURE;
+    }
+    free(path_name);
+    state.files = calloc(state.num_files ? state.num_files : 1,
+                         sizeof(struct grep_file));
+    if (state.files == NULL) {
+        perror(MALLOCERR);
+        image_close(state.img);
+        return EXIT_FAILURE;
+    }
+    for (j = 0; j < state.num_files; j++) {
+        state.files[j].path = found[j].path;
+        state.files[j].ino = found[j].ino;
+    }
+    free(found);
+
+    pthread_mutex_init(&state.lock, NULL);
+    if ((uint32_t)jobs > state.num_files) {
+        jobs = state.num_files ? state.num_files : 1;
+    }
+    threads = malloc(sizeof(pthread_t) * jobs);
+    if (threads == NULL) {
+        perror(MALLOCERR);
+        image_close(state.img);
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < jobs; i++) {
+        if (pthread_create(&threads[i], NULL, worker, &state) != 0) {
+            perror(JOBERR);
+            return EXIT_FAILURE;
+        }
+    }
+    for (i = 0; i < jobs; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    /* results come out in the order the files were found */
+    for (j = 0; j < state.num_files; j++) {
+        if (state.files[j].failed) {
+            fprintf(stderr, GREP_ERR_PRINT, state.files[j].path, READERR);
+            failures++;
+        } else if (state.files[j].out_len > 0) {
+            fwrite(state.files[j].out, 1, state.files[j].out_len, stdout);
+            matched = TRUE;
+        }
+        free(state.files[j].out);
+        free(state.files[j].path);
+    }
+    free(state.files);
+    free(threads);
+    image_close(state.img);
+    if (isV) {
+        bufpool_report(stderr);
+    }
+
+    /* like grep, success means something matched */
+    return matched && !failures ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* takes files one at a time until none are left, searching
+   each through a buffer from the shared pool that is reused
+   for every file this worker handles */
+void *worker(void *arg) {
+    struct grep_state *state = arg;
+    struct grep_file *file;
+    unsigned char *buf;
+    uint32_t index;
+    FILE *out;
+
+    buf = bufpool_get(GREP_BUF_SIZE);
+
+    while (TRUE) {
+        pthread_mutex_lock(&state->lock);
+        index = state->next++;
+        pthread_mutex_unlock(&state->lock);
+        if (index >= state->num_files) break;
+        file = &state->files[index];
+
+        out = open_memstream(&file->out, &file->out_len);
+        if (buf == NULL || out == NULL ||
+            grep_file(state, file, buf, out) == EXIT_FAILURE) {
+            file->failed = TRUE;
+        }
+        if (out != NULL) {
+            fclose(out);
+        }
+    }
+
+    bufpool_put(buf, GREP_BUF_SIZE);
+    return NULL;
+}
+
+/* searches one file a run of contiguous zones at a time,
+   printing each match to "out". The last bytes of every read
+   are kept in front of the next one so a match that crosses
+   zones is still found. Holes are never read, a pattern
+   can't contain a zero byte so none can match there */
+int grep_file(struct grep_state *state, struct grep_file *file,
+              unsigned char *buf, FILE *out) {
+    struct image_handle *img = state->img;
+    struct inode node;
+    uint32_t *zones, num_zones, i, run, max_run;
+    size_t carry = 0, len, got, total, pos, run_len, remaining;
+    unsigned long long base, line = 1, last_line = 0, counted = 0;
+    unsigned long long match, resume = 0, file_off;
+    const unsigned char *found, *p;
+    struct searcher search;
+
+    zones = image_get_zones(img, file->ino, &num_zones, &node);
+    if (zones == NULL) {
+        return EXIT_FAILURE;
+    }
+    search_init(&search, state->pattern, state->pat_len);
+
+    max_run = SCHED_MAX_RUN / img->zone_size;
+    if (max_run == 0) max_run = 1;
+    remaining = node.size;
+    for (i = 0; i < num_zones && remaining > 0; i += run) {
+        run = next_run(zones, i, num_zones, max_run);
+        run_len = (size_t)img->zone_size * run;
+        if (run_len > remaining) {
+            run_len = remaining;
+        }
+        remaining -= run_len;
+        file_off = (unsigned long long)img->zone_size * i;
+
+        /* no match crosses a hole, but the newlines in
+           the bytes kept for one still count */
+        if (zones[i] == 0) {
+            p = buf;
+            while (state->isLine &&
+                   (p = memchr(p, '\n', buf + carry - p)) != NULL) {
+                line++;
+                p++;
+            }
+            carry = 0;
+            continue;
+        }
+
+        /* zones larger than the buffer are read in pieces */
+        for (got = 0; got < run_len; got += len) {
+            len = run_len - got;
+            if (len > SCHED_MAX_RUN) {
+                len = SCHED_MAX_RUN;
+            }
+            if (cimg_pread(img->fd, buf + carry, len, img->disk_start +
+                      (off_t)img->zone_size * zones[i] + got)
+                      != (ssize_t)len) {
+                perror(READERR);
+                return EXIT_FAILURE;
+            }
+            total = carry + len;
+            base = file_off + got - carry;
+
+            pos = resume > base ? resume - base : 0;
+            while (pos < total &&
+                   (found = search_find(&search, buf + pos,
+                                        total - pos)) != NULL) {
+                match = base + (found - buf);
+                if (state->isList) {
+                    fprintf(out, NAME_PRINT, file->path);
+                    return EXIT_SUCCESS;
+                }
+                if (state->isLine) {
+                    /* count lines up to the match, each
+                       line is printed once */
+                    p = buf + (counted > base ? counted - base : 0);
+                    while ((p = memchr(p, '\n', found - p)) != NULL) {
+                        line++;
+                        p++;
+                    }
+                    counted = match;
+                    if (line != last_line) {
+                        fprintf(out, MATCH_PRINT, file->path, line);
+                        last_line = line;
+                    }
+                } else {
+                    fprintf(out, MATCH_PRINT, file->path, match);
+                }
+                pos = found - buf + state->pat_len;
+                resume = base + pos;
+            }
+
+            carry = total < state->pat_len - 1 ? total : state->pat_len - 1;
+
+            /* newlines after the last match still count, those
+               kept for the next read are counted with it */
+            if (state->isLine && counted < base + total - carry) {
+                p = buf + (counted > base ? counted - base : 0);
+                while ((p = memchr(p, '\n',
+                                   buf + total - carry - p)) != NULL) {
+                    line++;
+                    p++;
+                }
+                counted = base + total - carry;
+            }
+            memmove(buf, buf + total - carry, carry);
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -3,11 +3,19 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdint.h>
+#include <getopt.h>
+#include <pthread.h>
 #include "util.h"
+#include "remote.h"
+#include "format.h"
+#include "dirsort.h"
 
-#define OPTSTR "vp:s:"
-#define USAGE "Usage: [ -v ] [ -p part [ -s subpart ] ] imagefile [ path ]\n"
-#define DIR_PRINT "%s:\n"
+#define OPTSTR "avStNp:s:"
+#define USAGE "Usage: [ -v ] [ -S | -t | -N ] [ --limit n ] " \
+              "[ -a | -p part [ -s subpart ] ] " \
+              "[ --server socket ] [ --format fmt ] imagefile [ path ]\n"
+#define FORMATERR "format must be " FORMAT_NAMES "\n"
+#define LIMITERR "limit must be at least 1\n"
 #define PARTERR "partition must be between 0-3"
 #define SUBPARTERR "subpartition must be between 0-3"
 #define NO_IMG "an image file must be provided"
@@ -16,37 +24,76 @@
 #define INITIALDISK 0
 #define MAX_PART 4
 #define DEF_PATH "/"
-#define SLASH '/'
-#define PERM_STRING 12
-#define SIZE_STRING 10
+#define SERVER_OPT 'R'
+#define FORMAT_OPT 'F'
+#define LIMIT_OPT 'L'
+#define ALL_PART_PRINT "%d/-:\n"
+#define ALL_SUB_PART_PRINT "%d/%d:\n"
 
-/* defineing all functions used in main before
-   writing later for style purposes*/
-void print_reg_file(struct inode *, char *);
-void print_dir(struct dir_entry *, struct inode *, off_t, char *);
-int canonicalizer(char *);
+static struct option long_opts[] = {
+    {"server", required_argument, NULL, SERVER_OPT},
+    {"format", required_argument, NULL, FORMAT_OPT},
+    {"limit", required_argument, NULL, LIMIT_OPT},
+    {NULL, 0, NULL, 0}
+};
+
+int list_file(int, off_t, char *, char *, int, int, int, uint32_t,
+              struct arena *);
+int list_dir(int, off_t, struct inode *, char *, int, struct fmt_out *,
+             int, uint32_t, struct arena *);
+int list_all(int, char *, char *, int, int, uint32_t);
 
 int main(int argc, char *argv[]) {
     int option, path_len;
     extern int optind;
     extern char *optarg;
-    int isV = FALSE, part = NO_PART, sub_part = NO_PART;
-    char *image = NULL, *min_path = NULL, *path_name;
-    FILE *image_file;
+    int isV = FALSE, isA = FALSE, part = NO_PART, sub_part = NO_PART;
+    int format = FORMAT_TEXT, sort = SORT_NONE;
+    long limit = NO_LIMIT;
+    char *image = NULL, *min_path = NULL, *path_name, *server = NULL;
+    int image_file;
     uint32_t disk_start, part_size;
-    struct superblock *super;
-    struct inode found_file, *inode_table;
-    off_t inode_table_offset, possible_num_entries;
-    struct dir_entry *dir_data;
+    struct arena arena;
+    int status;
 
     /* parses all options using getopt and returns appropriately,
      * erroring if they are invalid in anyway */
-    while ((option = getopt(argc, argv, OPTSTR)) != EOF) {
+    while ((option = getopt_long(argc, argv, OPTSTR,
+                                 long_opts, NULL)) != EOF) {
         switch (option)
         {
         case 'v':
             isV = TRUE;
             break;
+        case 'a':
+            isA = TRUE;
+            break;
+        case 'S':
+            sort = SORT_SIZE;
+            break;
+        case 't':
+            sort = SORT_MTIME;
+            break;
+        case 'N':
+            sort = SORT_NAME;
+            break;
+        case LIMIT_OPT:
+            limit = strtol(optarg, NULL, 10);
+            if (limit < 1 || limit > UINT32_MAX) {
+                fprintf(stderr, LIMITERR);
+                return EXIT_FAILURE;
+            }
+            break;
+        case SERVER_OPT:
+            server = optarg;
+            break;
+        case FORMAT_OPT:
+            format = format_parse(optarg);
+            if (format < 0) {
+                fprintf(stderr, FORMATERR);
+                return EXIT_FAILURE;
+            }
+            break;
         case 'p':
             part = strtol(optarg, NULL, 10);
             if (part < 0 || part >= MAX_PART) {
@@ -107,9 +154,27 @@ int main(int argc, char *argv[]) {
         path_name = DEF_PATH;
     }
 
+    /* scanning every partition can't be combined
+       with picking one or with asking a server, and
+       neither labels partitions nor answers in anything
+       but text. A server only lists in directory order */
+    if ((isA && (part != NO_PART || sub_part != NO_PART || server != NULL)) ||
+        (format != FORMAT_TEXT && (isA || server != NULL)) ||
+        (server != NULL && (sort != SORT_NONE || limit != NO_LIMIT))) {
+        fprintf(stderr, USAGE);
+        return EXIT_FAILURE;
+    }
+
+    /* let a running minfsd answer instead, it
+       already has the image open and cached */
+    if (server != NULL) {
+        return remote_request(server, REQ_LIST, image,
+                              part, sub_part, min_path, stdout);
+    }
+
     /* open image file, therefore checking if it
        is valid */
-    if ((image_file = fopen(image, "r")) == NULL) {
+    if ((image_file = cimg_open(image)) < 0) {
         perror(OPENERR);
         return EXIT_FAILURE;
     }
@@ -134,180 +199,269 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    /* scan every partition and subpartition for
+       file systems and list the path in each one */
+    if (isA) {
+        return list_all(image_file, min_path, path_name, isV,
+                        sort, limit);
+    }
+
+    arena_init(&arena);
+    status = list_file(image_file, disk_start * SECTOR_SIZE,
+                       min_path, path_name, isV, format, sort, limit,
+                       &arena);
+    arena_destroy(&arena);
+    return status;
+}
+
+/* lists "min_path" in the file system starting at
+   "disk_start", printing it under "path_name" in "format".
+   A directory's entries are ordered by "sort" and only the
+   first "limit" of them printed, unless it is NO_LIMIT.
+   Everything the listing reads comes from "arena", which
+   the caller resets once the listing has been printed */
+int list_file(int image_file, off_t disk_start,
+              char *min_path, char *path_name, int isV,
+              int format, int sort, uint32_t limit,
+              struct arena *arena) {
+    struct inode found_file;
+    struct fmt_out out;
+    uint32_t ino;
+
     /*
        search and verify super block, then
        search starting from root by parsing
        path given to get inode of file
     */
-    if (find_file(min_path, 
-                 image_file,  
-                 disk_start * SECTOR_SIZE, 
-                 &found_file, 
-                 isV) == EXIT_FAILURE) {
+    if (find_inode(min_path, 
+                   image_file,  
+                   disk_start, 
+                   &found_file, 
+                   &ino,
+                   isV,
+                   arena) == EXIT_FAILURE) {
         return EXIT_FAILURE;
     }
 
+    /* anything but text goes through one large buffer,
+       after whatever stdout already holds */
+    if (format != FORMAT_TEXT) {
+        fflush(stdout);
+        if (fmt_init(&out, STDOUT_FILENO, format) == EXIT_FAILURE) {
+            return EXIT_FAILURE;
+        }
+    }
+
     /* MINLS SPECIFIC 
        check type of file.
        if it is a directory, print information about each file in it,
        if it isn't print out information of file */
     if ((found_file.mode & FILE_TYPE_MASK) == DIR_MASK) {
         /* directory */
+        if (list_dir(image_file, disk_start, &found_file, path_name,
+                     format, &out, sort, limit, arena) == EXIT_FAILURE) {
+            if (format != FORMAT_TEXT) fmt_free(&out);
+            return EXIT_FAILURE;
+        }
+    } else if ((found_file.mode & FILE_TYPE_MASK) == REG_MASK) {
+        /* regular file */
+        if (format == FORMAT_TEXT) {
+            print_reg_file(stdout, &found_file, path_name);
+        } else {
+            fmt_entry(&out, ino, &found_file, path_name + 1,
+                      strlen(path_name + 1));
+        }
+    } else {
+        if (format != FORMAT_TEXT) fmt_free(&out);
+        perror(LS_TYPE_INVAL);
+        return EXIT_FAILURE;
+    }
+
+    if (format != FORMAT_TEXT) {
+        return fmt_free(&out);
+    }
+    return EXIT_SUCCESS;
+}
 
-        /* get superblock to read file data and inode table*/
-        super = get_superblock(image_file, disk_start * SECTOR_SIZE, FALSE);
+/* lists every regular file and directory in "dir", under
+   "path_name" for text or into "out" for anything else.
+   In directory order each entry is printed as its zone is
+   walked and the walk stops after "limit" entries, sorting
+   needs the whole directory read first */
+int list_dir(int image_file, off_t disk_start, struct inode *dir,
+             char *path_name, int format, struct fmt_out *out,
+             int sort, uint32_t limit, struct arena *arena) {
+    struct superblock *super;
+    struct inode *inode_table, *node;
+    struct dir_entry *dir_data, *sorted, *entry;
+    struct dir_iter iter;
+    off_t possible_num_entries, num_sorted;
+    char name[NAME_SIZE + 1];
+    uint32_t count = 0, ninodes;
+
+    /* get superblock to read file data and inode table*/
+    super = get_superblock(image_file, disk_start, FALSE);
+    if (super == NULL) {
+        return EXIT_FAILURE;
+    }
+    ninodes = super->ninodes;
 
+    /* read the inode table using the superblock */
+    inode_table = get_inode_table(image_file, super, disk_start, arena);
+    if (inode_table == NULL) {
+        free(super);
+        return EXIT_FAILURE;
+    }
+
+    if (sort != SORT_NONE) {
         /* read dir entries using "read_file" function*/
-        dir_data = (struct dir_entry*)read_file(image_file, 
-                                                &found_file, 
-                                                super,
-                                                disk_start * SECTOR_SIZE);
-        if(dir_data == NULL){
+        dir_data = (struct dir_entry*)read_file(image_file, dir, super,
+                                                disk_start, arena);
+        free(super);
+        if (dir_data == NULL) {
             return EXIT_FAILURE;
         }
 
         /* calculates the possible ammount of entires in
            the directory from the file inode size */
-        possible_num_entries = (found_file.size + 
-                                sizeof(struct dir_entry) - 1 ) /  
+        possible_num_entries = (dir->size +
+                                sizeof(struct dir_entry) - 1 ) /
                                 sizeof(struct dir_entry);
 
-        /* get inode table offset from superblock,
-           allocate space for it and read it */
-        inode_table_offset = get_inode_table_start(super, 
-                                                   disk_start * SECTOR_SIZE);
-        inode_table = malloc(sizeof(struct inode) * super->ninodes);
-        if(inode_table == NULL){
-            perror(MALLOCERR);
+        /* the sorted entries are already filtered
+           down to what gets printed */
+        if (dir_sort(dir_data, inode_table, ninodes, possible_num_entries,
+                     sort, limit, arena, &sorted,
+                     &num_sorted) == EXIT_FAILURE) {
             return EXIT_FAILURE;
         }
-        if(fseek(image_file, inode_table_offset, SEEK_SET) < 0){
-            perror(FILEERR);
-            return EXIT_FAILURE;
-        }
-        if(fread((void*)inode_table, 
-                sizeof(struct inode), 
-                super->ninodes, image_file) <= 0){
-            perror(READERR);
-            return EXIT_FAILURE;
+        if (format == FORMAT_TEXT) {
+            print_dir(stdout, sorted, inode_table, num_sorted, path_name);
+        } else {
+            fmt_dir(out, sorted, inode_table, ninodes, num_sorted);
         }
+        return EXIT_SUCCESS;
+    }
 
-        /* pass directory entries and inode table 
-           to print out the inode of each file in
-           the directory */
-        print_dir(dir_data, inode_table, possible_num_entries, path_name);
-    } else if ((found_file.mode & FILE_TYPE_MASK) == REG_MASK) {
-        /* regular file */
-        print_reg_file(&found_file, path_name);
-    } else {
-        perror(LS_TYPE_INVAL);
+    if (dir_iter_open(&iter, image_file, dir, super,
+                      disk_start, arena) == EXIT_FAILURE) {
+        free(super);
         return EXIT_FAILURE;
     }
+    free(super);
 
-    return 0;
-}
+    if (format == FORMAT_TEXT) {
+        printf(DIR_PRINT, path_name);
+    }
+    while ((limit == NO_LIMIT || count < limit) &&
+           (entry = dir_iter_next(&iter)) != NULL) {
+        /* print out information only if it is a
+           regular file or directory, an inode past
+           the table is a corrupt entry and skipped */
+        if (entry->inode > ninodes) {
+            continue;
+        }
+        node = &inode_table[entry->inode - 1];
+        if ((node->mode & FILE_TYPE_MASK) != REG_MASK &&
+            (node->mode & FILE_TYPE_MASK) != DIR_MASK) {
+            continue;
+        }
 
-/* Prints the given file in "[permissions] [size] [filename]" format. 
- * Assumes filename is null terminated */
-void print_reg_file(struct inode *file, char *name) {
-    char perms[PERM_STRING];
-    char size[SIZE_STRING];
-    char name_buf[NAME_SIZE];
-    uint32_t file_size;
-    perms_print(file->mode, perms);
-    memset((void*)size, 0, SIZE_STRING);
-
-    file_size = file->size;
-    sprintf(size, "%9u", file_size);
-
-    /* only copies the 1st 60 characters of name 
-       since filenames are not NULL terminated
-       sometimes */
-    strncpy(name_buf, name, NAME_SIZE);
-    if(name_buf[0] == SLASH){
-        printf(REG_FILE_PRINT, perms, size, &(name[1]));
-    }else{
-        printf(REG_FILE_PRINT, perms, size, name);
+        /* names that fill all 60 characters
+           aren't NULL terminated */
+        memcpy(name, entry->name, NAME_SIZE);
+        name[NAME_SIZE] = '\0';
+        if (format == FORMAT_TEXT) {
+            print_reg_file(stdout, node, name);
+        } else {
+            fmt_entry(out, entry->inode, node, name, strlen(name));
+        }
+        count++;
     }
+    dir_iter_close(&iter);
+    return iter.failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
-/* given the inode table and all entries in a directory,
-   prints out the information of each inode in the directory*/
-void print_dir(struct dir_entry *dir_data, 
-               struct inode *inode_table,
-               off_t num_entries, 
-               char *name){
-    int i;
-    struct dir_entry *cur_entry;
-    struct inode *cur_inode;
-    printf(DIR_PRINT, name);
-
-    /* iterates through DIR entries to get inode number,
-       finds the inode in the inode table,
-       then prints out the information if
-       it is a regular file or directory */
-    for(i = 0; i < num_entries; i++){
-        
-        /* get inode number*/
-        cur_entry = (struct dir_entry*)((intptr_t)dir_data +
-                     (sizeof(struct dir_entry) * i));
-
-        /* deleted file */
-        if(cur_entry->inode == 0) continue;
-
-        /* get inode from inode table */
-        cur_inode = (struct inode*)( (intptr_t)inode_table + 
-                     sizeof(struct inode) * (cur_entry->inode - 1));
-        
-        /* print out information only if it is a regular
-           file or directory, as we aren't printing out
-           all entries in subdirectories */
-        if(((cur_inode->mode & FILE_TYPE_MASK) == REG_MASK) ||
-           ((cur_inode->mode & FILE_TYPE_MASK) == DIR_MASK)){
-            print_reg_file(cur_inode, (char*)cur_entry->name);
-        }
+/* checks one candidate's superblock magic number */
+void *check_candidate(void *arg) {
+    struct fs_candidate *cand = arg;
+    struct superblock super;
+
+    if (cimg_pread(cand->fd, &super, sizeof(struct superblock),
+              (off_t)cand->first_sec * SECTOR_SIZE + SUPEROFF) ==
+              sizeof(struct superblock) &&
+        super.magic == SUPMAGIC) {
+        cand->valid = TRUE;
     }
+    return NULL;
 }
 
-/* Removes duplicate slashes, adds slash at 
- * beginning and removes slash from end */
-int canonicalizer(char *original) {
-    int i = 0, j = 0, length;
-    char *copy, prev;
-    length = strlen(original);
-    copy = (char*)calloc(length + 2, sizeof(char));
-    if(copy == NULL){
-        perror(MALLOCERR);
+/* reads every partition table once, checks every candidate
+   superblock at the same time, then lists the path in each
+   valid file system labeled by its partition/subpartition */
+int list_all(int image_file, char *min_path, char *path_name, int isV,
+             int sort, uint32_t limit) {
+    struct fs_candidate cands[MAX_CANDIDATES];
+    pthread_t threads[MAX_CANDIDATES];
+    int created[MAX_CANDIDATES];
+    int num_cands, i, status = EXIT_SUCCESS, found = FALSE;
+    char *path_copy;
+    struct arena arena;
+
+    num_cands = partition_scan(image_file, cands, isV);
+    if (num_cands < 0) {
         return EXIT_FAILURE;
     }
-    
-    /* ensure copy starts with a slash
-       and both strings start at a point
-       without a slash */
-    copy[j++] = SLASH;
-    if (original[i] == SLASH) {
-        i++;
-    } 
-    
-    /* copy one char at a time, dont copy if its a repeated slash */ 
-    prev = SLASH;
-    while (i < length) {
-        /* only copies character if neither the previous
-           or current character equal slash, therefore 
-           only adding one slash per series of slashes*/
-        if(original[i] != SLASH || prev != SLASH){
-            prev = copy[j++] = original[i];
+
+    /* a candidate whose thread can't be started
+       is checked right away instead */
+    for (i = 0; i < num_cands; i++) {
+        created[i] = pthread_create(&threads[i], NULL,
+                                    check_candidate, &cands[i]) == 0;
+        if (!created[i]) {
+            check_candidate(&cands[i]);
         }
-        i++;
     }
-    
-    /* Remove slash if there, and add null term. */
-    if (j > 1 && copy[j - 1] == SLASH) {
-        j--;
+    for (i = 0; i < num_cands; i++) {
+        if (created[i]) {
+            pthread_join(threads[i], NULL);
+        }
     }
-    copy[j] = '\0';
 
-    strncpy(original, copy, j + 1);
-    free(copy);
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+    /* every file system is listed out of the same
+       arena, reset between listings */
+    arena_init(&arena);
+    for (i = 0; i < num_cands; i++) {
+        if (!cands[i].valid) continue;
+        found = TRUE;
+
+        if (cands[i].sub_part == NO_PART) {
+            printf(ALL_PART_PRINT, cands[i].part);
+        } else {
+            printf(ALL_SUB_PART_PRINT, cands[i].part, cands[i].sub_part);
+        }
+
+        /* "find_file" tokenizes the path it is given */
+        path_copy = strdup(min_path);
+        if (path_copy == NULL) {
+            perror(MALLOCERR);
+            arena_destroy(&arena);
+            return EXIT_FAILURE;
+        }
+        fflush(stdout);
+        arena_reset(&arena);
+        if (list_file(image_file, (off_t)cands[i].first_sec * SECTOR_SIZE,
+                      path_copy, path_name, isV, FORMAT_TEXT,
+                      sort, limit, &arena) == EXIT_FAILURE) {
+            status = EXIT_FAILURE;
+        }
+        free(path_copy);
+    }
+    arena_destroy(&arena);
+
+    if (!found) {
+        fprintf(stderr, SUPERERR "\n");
+        return EXIT_FAILURE;
+    }
+    return status;
+}
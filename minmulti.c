@@ -0,0 +1,405 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <libgen.h>
+#include "image.h"
+#include "sched.h"
+#include "bufpool.h"
+
+#define OPTSTR "vj:p:s:"
+#define USAGE "Usage: [ -v ] [ -j jobs ] [ -p part [ -s subpart ] ] " \
+              "ls imagelist [ path ]\n" \
+              "       [ -v ] [ -j jobs ] [ -p part [ -s subpart ] ] " \
+              "get imagelist srcpath dstdir\n"
+#define PARTERR "partition must be between 0-3\n"
+#define SUBPARTERR "subpartition must be between 0-3\n"
+#define JOBERR "number of jobs must be at least 1\n"
+#define OPENERR "open error\n"
+#define OP_LS "ls"
+#define OP_GET "get"
+#define STDIN_LIST "-"
+#define TAG_PRINT "%s: "
+#define TAG_ERR_PRINT "%s: %s\n"
+#define TASKERR "operation failed"
+#define WRITEERR "write error"
+#define MAX_PART 4
+#define DEF_PATH "/"
+#define INIT_IMAGES 64
+#define LIST_LINE 4096
+
+/* everything the workers share. Images are handed out
+   by "next", one image per task, and finished output is
+   written whole under "out_lock" so lines of different
+   images never interleave */
+struct multi_state {
+    char **images;
+    int num_images;
+    int next;
+    int isGet;
+    int part;
+    int sub_part;
+    char *path;
+    char *dst_dir;
+    int failures;
+    pthread_mutex_t lock;
+    pthread_mutex_t out_lock;
+};
+
+void *worker(void *);
+int run_ls(struct multi_state *, struct image_handle *, FILE *);
+int run_get(struct multi_state *, struct image_handle *, char *, int);
+int read_list(struct multi_state *, char *);
+void write_tagged(struct multi_state *, char *, char *, size_t);
+
+int main(int argc, char *argv[]) {
+    int option, jobs, i, isV = FALSE;
+    extern int optind;
+    extern char *optarg;
+    struct multi_state state;
+    pthread_t *threads;
+    char *op;
+
+    memset(&state, 0, sizeof(struct multi_state));
+    state.part = NO_PART;
+    state.sub_part = NO_PART;
+    jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs < 1) jobs = 1;
+
+    while ((option = getopt(argc, argv, OPTSTR)) != EOF) {
+        switch (option)
+        {
+        case 'v':
+            isV = TRUE;
+            break;
+        case 'j':
+            jobs = strtol(optarg, NULL, 10);
+            if (jobs < 1) {
+                fprintf(stderr, JOBERR);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'p':
+            state.part = strtol(optarg, NULL, 10);
+            if (state.part < 0 || state.part >= MAX_PART) {
+                fprintf(stderr, PARTERR);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 's':
+            state.sub_part = strtol(optarg, NULL, 10);
+            if (state.sub_part < 0 || state.sub_part >= MAX_PART) {
+                fprintf(stderr, SUBPARTERR);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            fprintf(stderr, USAGE);
+            return EXIT_FAILURE;
+            break;
+        }
+    }
+    if (state.part == NO_PART && state.sub_part != NO_PART) {
+        fprintf(stderr, USAGE);
+        return EXIT_FAILURE;
+    }
+
+    /* operation and list of images */
+    if (argc < optind + 2) {
+        fprintf(stderr, USAGE);
+        return EXIT_FAILURE;
+    }
+    op = argv[optind++];
+    if (strcmp(op, OP_GET) == 0) {
+        state.isGet = TRUE;
+    } else if (strcmp(op, OP_LS) != 0) {
+        fprintf(stderr, USAGE);
+        return EXIT_FAILURE;
+    }
+    if (read_list(&state, argv[optind++]) == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+    }
+
+    /* ls takes an optional path, get needs
+       both the file and a destination */
+    state.path = DEF_PATH;
+    if (argc > optind) {
+        state.path = argv[optind++];
+    }
+    if (state.isGet) {
+        if (argc <= optind) {
+            fprintf(stderr, USAGE);
+            return EXIT_FAILURE;
+        }
+        state.dst_dir = argv[optind];
+    }
+
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_mutex_init(&state.out_lock, NULL);
+    if (jobs > state.num_images) {
+        jobs = state.num_images ? state.num_images : 1;
+    }
+    threads = malloc(sizeof(pthread_t) * jobs);
+    if (threads == NULL) {
+        perror(MALLOCERR);
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < jobs; i++) {
+        if (pthread_create(&threads[i], NULL, worker, &state) != 0) {
+            perror(JOBERR);
+            return EXIT_FAILURE;
+        }
+    }
+    for (i = 0; i < jobs; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (i = 0; i < state.num_images; i++) {
+        free(state.images[i]);
+    }
+    free(state.images);
+    free(threads);
+    if (isV) {
+        bufpool_report(stderr);
+    }
+    return state.failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* reads image paths one per line from "list",
+   or from stdin when given "-" */
+int read_list(struct multi_state *state, char *list) {
+    char line[LIST_LINE], **grown;
+    int cap = INIT_IMAGES;
+    FILE *in;
+    size_t len;
+
+    if (strcmp(list, STDIN_LIST) == 0) {
+        in = stdin;
+    } else if ((in = fopen(list, "r")) == NULL) {
+        fprintf(stderr, OPENERR);
+        return EXIT_FAILURE;
+    }
+
+    state->images = malloc(sizeof(char*) * cap);
+    if (state->images == NULL) {
+        perror(MALLOCERR);
+        return EXIT_FAILURE;
+    }
+    while (fgets(line, LIST_LINE, in) != NULL) {
+        len = strlen(line);
+        if (len > 0 && line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        if (len == 0) continue;
+
+        if (state->num_images == cap) {
+            cap *= 2;
+            grown = realloc(state->images, sizeof(char*) * cap);
+            if (grown == NULL) {
+                perror(MALLOCERR);
+                return EXIT_FAILURE;
+            }
+            state->images = grown;
+        }
+        state->images[state->num_images] = strdup(line);
+        if (state->images[state->num_images] == NULL) {
+            perror(MALLOCERR);
+            return EXIT_FAILURE;
+        }
+        state->num_images++;
+    }
+
+    if (in != stdin) {
+        fclose(in);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* takes images one at a time until none are left. The
+   output stream belongs to the worker and is reused for
+   every image it handles */
+void *worker(void *arg) {
+    struct multi_state *state = arg;
+    struct image_handle *img;
+    char *image, *out_buf = NULL;
+    size_t out_len = 0;
+    FILE *out;
+    int index, status;
+
+    out = open_memstream(&out_buf, &out_len);
+    if (out == NULL) {
+        perror(MALLOCERR);
+        pthread_mutex_lock(&state->lock);
+        state->failures++;
+        pthread_mutex_unlock(&state->lock);
+        return NULL;
+    }
+
+    while (TRUE) {
+        pthread_mutex_lock(&state->lock);
+        index = state->next++;
+        pthread_mutex_unlock(&state->lock);
+        if (index >= state->num_images) break;
+        image = state->images[index];
+
+        img = image_open(image, state->part, state->sub_part, FALSE);
+        if (img == NULL) {
+            status = EXIT_FAILURE;
+        } else if (state->isGet) {
+            status = run_get(state, img, image, index);
+        } else {
+            /* rewind the stream so its buffer is reused */
+            fseek(out, 0, SEEK_SET);
+            status = run_ls(state, img, out);
+            fflush(out);
+            if (status == EXIT_SUCCESS) {
+                write_tagged(state, image, out_buf, ftell(out));
+            }
+        }
+        image_close(img);
+
+        if (status == EXIT_FAILURE) {
+            pthread_mutex_lock(&state->out_lock);
+            fprintf(stderr, TAG_ERR_PRINT, image, TASKERR);
+            pthread_mutex_unlock(&state->out_lock);
+            pthread_mutex_lock(&state->lock);
+            state->failures++;
+            pthread_mutex_unlock(&state->lock);
+        }
+    }
+
+    fclose(out);
+    free(out_buf);
+    return NULL;
+}
+
+/* lists the path in one image into "out" the way minls does */
+int run_ls(struct multi_state *state, struct image_handle *img, FILE *out) {
+    char *path_name;
+    uint32_t ino;
+    int status;
+
+    path_name = malloc(strlen(state->path) + 2);
+    if (path_name == NULL) {
+        perror(MALLOCERR);
+        return EXIT_FAILURE;
+    }
+    strcpy(path_name, state->path);
+    canonicalizer(path_name);
+
+    ino = image_lookup(img, path_name);
+    if (ino == NO_INODE) {
+        free(path_name);
+        return EXIT_FAILURE;
+    }
+    status = image_print(img, ino, path_name, TRUE, out);
+    free(path_name);
+    return status;
+}
+
+/* copies the file at the path in one image to
+   "<dstdir>/<index>-<image name>", "index" being the
+   image's place in the list so images of the same name
+   don't overwrite each other. Runs of contiguous zones are
+   read into a buffer from the shared pool with positional
+   reads. A copy that fails part way is removed */
+int run_get(struct multi_state *state, struct image_handle *img,
+            char *image, int index) {
+    struct inode node;
+    uint32_t ino, *zones, num_zones, i, run, max_run;
+    size_t len, remaining, buf_size;
+    char *image_copy, *dst;
+    void *buf;
+    FILE *out;
+
+    ino = image_lookup(img, state->path);
+    if (ino == NO_INODE) {
+        return EXIT_FAILURE;
+    }
+    zones = image_get_zones(img, ino, &num_zones, &node);
+    if (zones == NULL || (node.mode & FILE_TYPE_MASK) != REG_MASK) {
+        return EXIT_FAILURE;
+    }
+
+    /* a zone is the least that is read at once */
+    buf_size = SCHED_MAX_RUN > img->zone_size ? SCHED_MAX_RUN
+                                              : img->zone_size;
+    buf = bufpool_get(buf_size);
+    image_copy = strdup(image);
+    dst = malloc(strlen(state->dst_dir) + strlen(image) + 24);
+    if (buf == NULL || image_copy == NULL || dst == NULL) {
+        perror(MALLOCERR);
+        bufpool_put(buf, buf_size);
+        free(image_copy);
+        free(dst);
+        return EXIT_FAILURE;
+    }
+    sprintf(dst, "%s/%d-%s", state->dst_dir, index, basename(image_copy));
+    free(image_copy);
+    out = fopen(dst, "w");
+    if (out == NULL) {
+        perror(dst);
+        bufpool_put(buf, buf_size);
+        free(dst);
+        return EXIT_FAILURE;
+    }
+
+    max_run = buf_size / img->zone_size;
+    remaining = node.size;
+    for (i = 0; i < num_zones && remaining > 0; i += run) {
+        run = next_run(zones, i, num_zones, max_run);
+        len = (size_t)img->zone_size * run;
+        if (len > remaining) {
+            len = remaining;
+        }
+
+        if (zones[i] == 0) {
+            memset(buf, 0, len);
+        } else if (cimg_pread(img->fd, buf, len, img->disk_start +
+                         (off_t)img->zone_size * zones[i]) != (ssize_t)len) {
+            perror(READERR);
+            fclose(out);
+            unlink(dst);
+            bufpool_put(buf, buf_size);
+            free(dst);
+            return EXIT_FAILURE;
+        }
+        if (fwrite(buf, 1, len, out) != len) {
+            perror(WRITEERR);
+            fclose(out);
+            unlink(dst);
+            bufpool_put(buf, buf_size);
+            free(dst);
+            return EXIT_FAILURE;
+        }
+        remaining -= len;
+    }
+
+    bufpool_put(buf, buf_size);
+    if (fclose(out) != 0) {
+        perror(WRITEERR);
+        unlink(dst);
+        free(dst);
+        return EXIT_FAILURE;
+    }
+    free(dst);
+    return EXIT_SUCCESS;
+}
+
+/* writes "len" bytes of output with every line
+   prefixed by the image it came from */
+void write_tagged(struct multi_state *state, char *image,
+                  char *buf, size_t len) {
+    size_t start, end;
+
+    pthread_mutex_lock(&state->out_lock);
+    for (start = 0; start < len; start = end) {
+        for (end = start; end < len && buf[end] != '\n'; end++);
+        if (end < len) end++;
+        printf(TAG_PRINT, image);
+        fwrite(buf + start, 1, end - start, stdout);
+    }
+    pthread_mutex_unlock(&state->out_lock);
+}
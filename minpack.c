@@ -0,0 +1,279 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <zlib.h>
+#include "cimg.h"
+#include "util.h"
+
+#define OPTSTR "vxc:l:"
+#define USAGE "Usage: [ -v ] [ -x ] [ -c chunk ] [ -l level ] " \
+              "infile outfile\n"
+#define CHUNKERR "chunk size must be a power of two between 4 and 16384 KiB\n"
+#define LEVELERR "level must be between 1-9\n"
+#define NOTCOMPERR "not a compressed image\n"
+#define SAMEERR "input and output are the same file\n"
+#define OPENERR "open error"
+#define WRITEERR "write error"
+#define KIB 1024
+#define INIT_CHUNKS 1024
+#define OUT_PERMS 0666
+#define PACK_PRINT "%llu bytes in %u chunks (%u zero, %u stored), " \
+                   "%llu bytes written\n"
+#define UNPACK_PRINT "%llu bytes written\n"
+
+int pack(int, int, uint32_t, int, int);
+int unpack(int, int, int);
+int write_full(int, void *, size_t);
+
+int main(int argc, char *argv[]) {
+    int option, in, out, status, isV = FALSE, isX = FALSE;
+    struct stat in_st, out_st;
+    int level = Z_DEFAULT_COMPRESSION;
+    long chunk_size = CIMG_DEF_CHUNK;
+    extern int optind;
+    extern char *optarg;
+
+    while ((option = getopt(argc, argv, OPTSTR)) != EOF) {
+        switch (option)
+        {
+        case 'v':
+            isV = TRUE;
+            break;
+        case 'x':
+            isX = TRUE;
+            break;
+        case 'c':
+            chunk_size = strtol(optarg, NULL, 10) * KIB;
+            if (chunk_size < CIMG_MIN_CHUNK || chunk_size > CIMG_MAX_CHUNK ||
+                (chunk_size & (chunk_size - 1)) != 0) {
+                fprintf(stderr, CHUNKERR);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'l':
+            level = strtol(optarg, NULL, 10);
+            if (level < 1 || level > 9) {
+                fprintf(stderr, LEVELERR);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            fprintf(stderr, USAGE);
+            return EXIT_FAILURE;
+            break;
+        }
+    }
+    if (argc != optind + 2) {
+        fprintf(stderr, USAGE);
+        return EXIT_FAILURE;
+    }
+
+    /* unpacking reads through the same code every tool does */
+    in = isX ? cimg_open(argv[optind]) : open(argv[optind], O_RDONLY);
+    if (in < 0) {
+        perror(OPENERR);
+        return EXIT_FAILURE;
+    }
+    /* the input is open before the output is truncated, and
+       an output that is the input is refused outright */
+    if (fstat(in, &in_st) < 0) {
+        perror(OPENERR);
+        cimg_close(in);
+        return EXIT_FAILURE;
+    }
+    if (stat(argv[optind + 1], &out_st) == 0 &&
+        out_st.st_dev == in_st.st_dev && out_st.st_ino == in_st.st_ino) {
+        fprintf(stderr, SAMEERR);
+        cimg_close(in);
+        return EXIT_FAILURE;
+    }
+    out = open(argv[optind + 1], O_WRONLY | O_CREAT | O_TRUNC, OUT_PERMS);
+    if (out < 0) {
+        perror(OPENERR);
+        cimg_close(in);
+        return EXIT_FAILURE;
+    }
+
+    if (isX) {
+        status = unpack(in, out, isV);
+    } else {
+        status = pack(in, out, chunk_size, level, isV);
+    }
+    cimg_close(in);
+    if (close(out) < 0) {
+        perror(WRITEERR);
+        status = EXIT_FAILURE;
+    }
+    return status;
+}
+
+/* writes the raw image read from "in" to "out" as a compressed
+   image of "chunk_size" chunks. Every chunk is compressed on
+   its own so any one can be read without the others, chunks
+   of zeros are only marked in the index and chunks that
+   don't get smaller are stored as they are */
+int pack(int in, int out, uint32_t chunk_size, int level, int isV) {
+    struct cimg_header header;
+    struct cimg_chunk *index = NULL, *grown;
+    uint32_t num_chunks = 0, index_cap = 0, num_zero = 0, num_raw = 0;
+    unsigned char *buf, *comp;
+    uLongf comp_len;
+    uint64_t offset;
+    ssize_t got;
+
+    buf = malloc(chunk_size);
+    comp = malloc(compressBound(chunk_size));
+    if (buf == NULL || comp == NULL) {
+        perror(MALLOCERR);
+        free(buf);
+        free(comp);
+        return EXIT_FAILURE;
+    }
+
+    /* the header is written again once the index is */
+    memset(&header, 0, sizeof(struct cimg_header));
+    memcpy(header.magic, CIMG_MAGIC, CIMG_MAGIC_SIZE);
+    header.version = CIMG_VERSION;
+    header.chunk_size = chunk_size;
+    offset = sizeof(struct cimg_header);
+    if (lseek(out, offset, SEEK_SET) < 0) {
+        perror(WRITEERR);
+        free(buf);
+        free(comp);
+        return EXIT_FAILURE;
+    }
+
+    while ((got = read_full(in, buf, chunk_size)) > 0) {
+        if (num_chunks == index_cap) {
+            index_cap = index_cap ? index_cap * 2 : INIT_CHUNKS;
+            grown = realloc(index, sizeof(struct cimg_chunk) * index_cap);
+            if (grown == NULL) {
+                perror(MALLOCERR);
+                free(index);
+                free(buf);
+                free(comp);
+                return EXIT_FAILURE;
+            }
+            index = grown;
+        }
+
+        index[num_chunks].offset = offset;
+        if (is_zero(buf, got)) {
+            index[num_chunks].kind = CIMG_ZERO;
+            index[num_chunks].len = 0;
+            num_zero++;
+        } else {
+            comp_len = compressBound(chunk_size);
+            if (compress2(comp, &comp_len, buf, got, level) == Z_OK &&
+                comp_len < (uLongf)got) {
+                index[num_chunks].kind = CIMG_ZLIB;
+                index[num_chunks].len = comp_len;
+            } else {
+                index[num_chunks].kind = CIMG_RAW;
+                index[num_chunks].len = got;
+                num_raw++;
+            }
+            if (write_full(out, index[num_chunks].kind == CIMG_ZLIB ?
+                           comp : buf,
+                           index[num_chunks].len) == EXIT_FAILURE) {
+                free(index);
+                free(buf);
+                free(comp);
+                return EXIT_FAILURE;
+            }
+            offset += index[num_chunks].len;
+        }
+        header.image_size += got;
+        num_chunks++;
+    }
+    free(buf);
+    free(comp);
+    if (got < 0) {
+        perror(READERR);
+        free(index);
+        return EXIT_FAILURE;
+    }
+
+    header.index_offset = offset;
+    header.num_chunks = num_chunks;
+    if (write_full(out, index, sizeof(struct cimg_chunk) *
+                               (size_t)num_chunks) == EXIT_FAILURE ||
+        pwrite(out, &header, sizeof(struct cimg_header), 0) !=
+        sizeof(struct cimg_header)) {
+        perror(WRITEERR);
+        free(index);
+        return EXIT_FAILURE;
+    }
+    free(index);
+
+    if (isV) {
+        fprintf(stderr, PACK_PRINT, (unsigned long long)header.image_size,
+                num_chunks, num_zero, num_raw,
+                (unsigned long long)(offset + sizeof(struct cimg_chunk) *
+                                     (uint64_t)num_chunks));
+    }
+    return EXIT_SUCCESS;
+}
+
+/* writes the raw image held by the compressed image "in",
+   opened with cimg_open, to "out". Zeros are skipped over
+   rather than written, so they stay holes in the output */
+int unpack(int in, int out, int isV) {
+    unsigned char *buf;
+    uint64_t offset = 0;
+    ssize_t got;
+
+    if (!cimg_is_compressed(in)) {
+        fprintf(stderr, NOTCOMPERR);
+        return EXIT_FAILURE;
+    }
+    buf = malloc(CIMG_DEF_CHUNK);
+    if (buf == NULL) {
+        perror(MALLOCERR);
+        return EXIT_FAILURE;
+    }
+
+    while ((got = cimg_pread(in, buf, CIMG_DEF_CHUNK, offset)) > 0) {
+        if (!is_zero(buf, got) &&
+            pwrite(out, buf, got, offset) != got) {
+            perror(WRITEERR);
+            free(buf);
+            return EXIT_FAILURE;
+        }
+        offset += got;
+    }
+    free(buf);
+    if (got < 0) {
+        perror(READERR);
+        return EXIT_FAILURE;
+    }
+    if (ftruncate(out, offset) < 0) {
+        perror(WRITEERR);
+        return EXIT_FAILURE;
+    }
+    if (isV) {
+        fprintf(stderr, UNPACK_PRINT, (unsigned long long)offset);
+    }
+    return EXIT_SUCCESS;
+}
+
+int write_full(int fd, void *buf, size_t len) {
+    size_t done = 0;
+    ssize_t put;
+
+    while (done < len) {
+        put = write(fd, (char*)buf + done, len - done);
+        if (put < 0 && errno == EINTR) continue;
+        if (put < 0) {
+            perror(WRITEERR);
+            return EXIT_FAILURE;
+        }
+        done += put;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,890 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "util.h"
+#include "fsalloc.h"
+#include "bufpool.h"
+
+#define OPTSTR "vp:s:"
+#define USAGE "Usage: [ -v ] [ -p part [ -s subpart ] ] " \
+              "imagefile srcpath [ dstpath ]\n"
+#define PARTERR "partition must be between 0-3\n"
+#define SUBPARTERR "subpartition must be between 0-3\n"
+#define OPENERR "open error\n"
+#define COMPERR "compressed images can't be written, " \
+                "unpack it with minpack -x first\n"
+#define EXISTSERR "%s already exists in the image\n"
+#define NOTDIRERR "%s is not a directory in the image\n"
+#define HOSTTYPEERR "%s is not a regular file or directory\n"
+#define HOSTNAMEERR "%s: name is too long for the image\n"
+#define HOSTBIGERR "%s: file is too big for the image\n"
+#define SKIP_PRINT "skipping %s, only regular files and " \
+                   "directories are copied\n"
+#define ADD_PRINT "%s\n"
+#define PUT_PRINT "%u files and %u directories written, " \
+                  "%u zones in %u extents\n"
+#define INITIALDISK 0
+#define MAX_PART 4
+#define DEF_DEST "/"
+#define CUR_DIR "."
+#define PARENT_DIR ".."
+#define INIT_NODES 256
+#define PUT_BUF_SIZE BUFPOOL_SIZE
+#define PERM_MASK 07777
+#define DIR_LINKS 2
+#define DIR_FIXED 2 /* "." and ".." */
+
+/* one host file or directory to be put in the image. The
+   children of a directory are next to each other in the
+   node list. Node 0 is the directory in the image they all
+   go in, which already exists */
+struct put_node {
+    char *path;            /* host path */
+    char *name;            /* last part of "path", its name in the image */
+    struct stat st;
+    uint32_t size;         /* bytes it takes up in the image */
+    uint32_t ino;
+    uint32_t first_child;
+    uint32_t num_children;
+    uint32_t link_of;      /* node whose inode it shares, itself if none */
+};
+
+/* everything for one import. The whole host tree is looked at
+   before anything is written, so a tree that doesn't fit is
+   turned away with the image untouched. "target_zones" is set
+   when the directory everything goes in is rewritten in
+   place, which has to wait until the rest is flushed */
+struct put_state {
+    struct fs_alloc fsa;
+    struct put_node *nodes;
+    uint32_t num_nodes;
+    uint32_t nodes_cap;
+    uint32_t *linked;      /* nodes of host files with more than one link */
+    uint32_t num_linked;
+    uint32_t linked_cap;
+    uint32_t need_inodes;
+    uint64_t need_zones;
+    struct dir_entry *target_data;
+    uint32_t *target_zones;
+    void *target_buf;
+    uint32_t target_count;
+    void *buf;
+    uint32_t buf_zones;
+    uint32_t num_files;
+    uint32_t num_dirs;
+    uint32_t num_zones;
+    uint32_t num_extents;
+    int isV;
+};
+
+int prepare(struct put_state *, char *, char *);
+int add_node(struct put_state *, char *, char *, struct stat *, uint32_t *);
+int scan_dir(struct put_state *, uint32_t);
+int check_target(struct put_state *);
+uint32_t find_name(struct put_state *, uint32_t, char *);
+int put_tree(struct put_state *, uint32_t, uint32_t);
+int put_inodes(struct put_state *, uint32_t);
+int put_dir(struct put_state *, uint32_t, uint32_t);
+int put_file(struct put_state *, uint32_t);
+int put_target(struct put_state *);
+uint32_t *alloc_file(struct put_state *, uint32_t, uint32_t, uint32_t **);
+int cmp_names(const void *, const void *);
+void free_state(struct put_state *);
+
+int main(int argc, char *argv[]) {
+    int option, image_file, status;
+    extern int optind;
+    extern char *optarg;
+    int isV = FALSE, part = NO_PART, sub_part = NO_PART;
+    char *image, *src, *dest = DEF_DEST;
+    char magic[CIMG_MAGIC_SIZE];
+    uint32_t disk_start, part_size;
+    struct put_state state;
+
+    while ((option = getopt(argc, argv, OPTSTR)) != EOF) {
+        switch (option)
+        {
+        case 'v':
+            isV = TRUE;
+            break;
+        case 'p':
+            part = strtol(optarg, NULL, 10);
+            if (part < 0 || part >= MAX_PART) {
+                fprintf(stderr, PARTERR);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 's':
+            sub_part = strtol(optarg, NULL, 10);
+            if (sub_part < 0 || sub_part >= MAX_PART) {
+                fprintf(stderr, SUBPARTERR);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            fprintf(stderr, USAGE);
+            return EXIT_FAILURE;
+            break;
+        }
+    }
+    if (argc < optind + 2 || argc > optind + 3 ||
+        (part == NO_PART && sub_part != NO_PART)) {
+        fprintf(stderr, USAGE);
+        return EXIT_FAILURE;
+    }
+    image = argv[optind];
+    src = argv[optind + 1];
+    if (argc > optind + 2) {
+        dest = argv[optind + 2];
+    }
+
+    disk_start = INITIALDISK;
+    if (part != NO_PART &&
+        partition_finder(image, part, sub_part,
+                         &disk_start, &part_size, isV) == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+    }
+
+    /* the image is changed in place, so a compressed
+       one has to be unpacked first */
+    if ((image_file = open(image, O_RDWR)) < 0) {
+        fprintf(stderr, OPENERR);
+        return EXIT_FAILURE;
+    }
+    if (pread(image_file, magic, CIMG_MAGIC_SIZE, 0) == CIMG_MAGIC_SIZE &&
+        memcmp(magic, CIMG_MAGIC, CIMG_MAGIC_SIZE) == 0) {
+        fprintf(stderr, COMPERR);
+        close(image_file);
+        return EXIT_FAILURE;
+    }
+
+    memset(&state, 0, sizeof(struct put_state));
+    state.isV = isV;
+    if (fsa_open(&state.fsa, image_file,
+                 (off_t)disk_start * SECTOR_SIZE) == EXIT_FAILURE) {
+        close(image_file);
+        return EXIT_FAILURE;
+    }
+
+    /* look at everything first, then write it all */
+    if (prepare(&state, src, dest) == EXIT_FAILURE ||
+        check_target(&state) == EXIT_FAILURE) {
+        free_state(&state);
+        close(image_file);
+        return EXIT_FAILURE;
+    }
+
+    state.buf_zones = PUT_BUF_SIZE / state.fsa.geom.zone_size;
+    if (state.buf_zones == 0) {
+        state.buf_zones = 1;
+    }
+    state.buf = bufpool_get((size_t)state.buf_zones *
+                            state.fsa.geom.zone_size);
+    if (state.buf == NULL) {
+        perror(MALLOCERR);
+        free_state(&state);
+        close(image_file);
+        return EXIT_FAILURE;
+    }
+
+    /* nothing on disk points at the new inodes and zones until
+       the bitmaps, inode table and target directory are written
+       at the very end */
+    status = put_tree(&state, 0, 0);
+    if (status == EXIT_SUCCESS) {
+        status = put_target(&state);
+    }
+    if (status == EXIT_SUCCESS) {
+        status = fsa_flush(&state.fsa);
+    }
+    if (status == EXIT_SUCCESS && state.target_zones != NULL) {
+        status = fsa_write_zones(&state.fsa, state.target_zones,
+                                 state.target_count, state.target_buf);
+    }
+
+    if (status == EXIT_SUCCESS && isV) {
+        fprintf(stderr, PUT_PRINT, state.num_files, state.num_dirs,
+                state.num_zones, state.num_extents);
+    }
+    free_state(&state);
+    if (close(image_file) < 0) {
+        perror(WRITEERR);
+        status = EXIT_FAILURE;
+    }
+    return status;
+}
+
+/* finds the directory in the image "src" goes in and builds
+   the list of host files to put there. When "dest" is an
+   existing directory, a host directory's contents or a host
+   file go in it, otherwise "dest" is the new name and its
+   parent has to exist */
+int prepare(struct put_state *state, char *src, char *dest) {
+    struct inode parent;
+    struct stat st;
+    uint32_t parent_ino, ino, idx;
+    char *path, *name, *src_name;
+    size_t len;
+    int into = FALSE;
+
+    if (stat(src, &st) < 0) {
+        perror(src);
+        return EXIT_FAILURE;
+    }
+    if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, HOSTTYPEERR, src);
+        return EXIT_FAILURE;
+    }
+
+    /* splits the canonical destination into
+       its parent and last name */
+    len = strlen(dest);
+    if ((path = malloc(len + 2)) == NULL) {
+        perror(MALLOCERR);
+        return EXIT_FAILURE;
+    }
+    strcpy(path, dest);
+    if (canonicalizer(path) == EXIT_FAILURE) {
+        free(path);
+        return EXIT_FAILURE;
+    }
+    name = strrchr(path, SLASH);
+    *name++ = '\0';
+    if (strlen(name) > NAME_SIZE) {
+        fprintf(stderr, HOSTNAMEERR, dest);
+        free(path);
+        return EXIT_FAILURE;
+    }
+
+    if (find_inode(path, state->fsa.image, state->fsa.disk_start, &parent,
+                   &parent_ino, FALSE, NULL) == EXIT_FAILURE) {
+        free(path);
+        return EXIT_FAILURE;
+    }
+    if ((parent.mode & FILE_TYPE_MASK) != DIR_MASK) {
+        fprintf(stderr, NOTDIRERR, dest);
+        free(path);
+        return EXIT_FAILURE;
+    }
+
+    /* an empty name is the root itself */
+    ino = parent_ino;
+    if (*name == '\0') {
+        into = TRUE;
+    } else if ((ino = find_name(state, parent_ino, name)) != 0) {
+        if ((state->fsa.inodes[ino - 1].mode & FILE_TYPE_MASK) != DIR_MASK) {
+            fprintf(stderr, EXISTSERR, dest);
+            free(path);
+            return EXIT_FAILURE;
+        }
+        into = TRUE;
+    } else if (errno != 0) {
+        free(path);
+        return EXIT_FAILURE;
+    } else {
+        ino = parent_ino;
+    }
+
+    /* node 0 is the directory in the image */
+    if (add_node(state, NULL, NULL, &st, &idx) == EXIT_FAILURE) {
+        free(path);
+        return EXIT_FAILURE;
+    }
+    state->nodes[0].ino = ino;
+
+    /* a directory put into one that exists
+       brings its contents, not itself */
+    if (into && S_ISDIR(st.st_mode)) {
+        free(path);
+        if ((state->nodes[0].path = strdup(src)) == NULL) {
+            perror(MALLOCERR);
+            return EXIT_FAILURE;
+        }
+        return scan_dir(state, 0);
+    }
+
+    /* a file keeps its host name when it goes into a directory */
+    if (into) {
+        src_name = strrchr(src, SLASH);
+        name = src_name == NULL ? src : src_name + 1;
+    }
+    len = strlen(src);
+    if ((src_name = malloc(len + 1 + strlen(name) + 1)) == NULL) {
+        perror(MALLOCERR);
+        free(path);
+        return EXIT_FAILURE;
+    }
+
+    /* the name it gets is kept after the
+       host path, in the same allocation */
+    strcpy(src_name, src);
+    strcpy(src_name + len + 1, name);
+    free(path);
+    if (add_node(state, src_name, src_name + len + 1, &st, &idx)
+        == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+    }
+    state->nodes[0].first_child = idx;
+    state->nodes[0].num_children = 1;
+    if (S_ISDIR(st.st_mode)) {
+        return scan_dir(state, idx);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* adds a node for host "path", which it takes over, and
+   counts the inodes and zones it needs. It is named "name",
+   or the last part of "path" when that is NULL. Its number
+   is written to "idx" */
+int add_node(struct put_state *state, char *path, char *name,
+             struct stat *st, uint32_t *idx) {
+    struct put_node *node, *grown;
+    uint32_t *grown_linked, num_data, i;
+    char *slash;
+
+    if (state->num_nodes == state->nodes_cap) {
+        state->nodes_cap = state->nodes_cap ? state->nodes_cap * 2 :
+                                              INIT_NODES;
+        grown = realloc(state->nodes,
+                        sizeof(struct put_node) * state->nodes_cap);
+        if (grown == NULL) {
+            perror(MALLOCERR);
+            free(path);
+            return EXIT_FAILURE;
+        }
+        state->nodes = grown;
+    }
+    *idx = state->num_nodes;
+    node = &state->nodes[*idx];
+    memset(node, 0, sizeof(struct put_node));
+    node->path = path;
+    node->st = *st;
+    node->link_of = *idx;
+    state->num_nodes++;
+    if (path == NULL) {
+        return EXIT_SUCCESS;
+    }
+
+    slash = strrchr(path, SLASH);
+    node->name = name != NULL ? name : slash == NULL ? path : slash + 1;
+    if (strlen(node->name) > NAME_SIZE) {
+        fprintf(stderr, HOSTNAMEERR, path);
+        return EXIT_FAILURE;
+    }
+
+    /* every name of a hard linked host file
+       shares the first one's inode */
+    if (S_ISREG(st->st_mode) && st->st_nlink > 1) {
+        for (i = 0; i < state->num_linked; i++) {
+            if (state->nodes[state->linked[i]].st.st_ino == st->st_ino &&
+                state->nodes[state->linked[i]].st.st_dev == st->st_dev) {
+                node->link_of = state->linked[i];
+                return EXIT_SUCCESS;
+            }
+        }
+        if (state->num_linked == state->linked_cap) {
+            state->linked_cap = state->linked_cap ? state->linked_cap * 2 :
+                                                    INIT_NODES;
+            grown_linked = realloc(state->linked, sizeof(uint32_t) *
+                                                  state->linked_cap);
+            if (grown_linked == NULL) {
+                perror(MALLOCERR);
+                return EXIT_FAILURE;
+            }
+            state->linked = grown_linked;
+        }
+        state->linked[state->num_linked++] = *idx;
+    }
+
+    state->need_inodes++;
+    if (S_ISREG(st->st_mode)) {
+        if ((uint64_t)st->st_size > state->fsa.geom.max_file) {
+            fprintf(stderr, HOSTBIGERR, path);
+            return EXIT_FAILURE;
+        }
+        node->size = st->st_size;
+        num_data = geom_zone_count(&state->fsa.geom, node->size);
+        state->need_zones += num_data +
+                             fsa_table_count(&state->fsa, num_data);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* adds the contents of the host directory of node "idx",
+   sorted by name, then the contents of each directory in it */
+int scan_dir(struct put_state *state, uint32_t idx) {
+    struct dirent *ent;
+    struct stat st;
+    char **names = NULL, **grown, *path, *dir_path;
+    uint32_t num_names = 0, names_cap = 0, first, count = 0, i, child;
+    uint32_t num_data;
+    DIR *dir;
+
+    dir_path = state->nodes[idx].path;
+    if ((dir = opendir(dir_path)) == NULL) {
+        perror(dir_path);
+        return EXIT_FAILURE;
+    }
+    while ((ent = readdir(dir)) != NULL) {
+        if (strcmp(ent->d_name, CUR_DIR) == 0 ||
+            strcmp(ent->d_name, PARENT_DIR) == 0) {
+            continue;
+        }
+        if (num_names == names_cap) {
+            names_cap = names_cap ? names_cap * 2 : INIT_NODES;
+            grown = realloc(names, sizeof(char*) * names_cap);
+            if (grown == NULL) {
+                perror(MALLOCERR);
+                break;
+            }
+            names = grown;
+        }
+        if ((names[num_names] = strdup(ent->d_name)) == NULL) {
+            perror(MALLOCERR);
+            break;
+        }
+        num_names++;
+    }
+    closedir(dir);
+    if (ent != NULL) {
+        for (i = 0; i < num_names; i++) free(names[i]);
+        free(names);
+        return EXIT_FAILURE;
+    }
+    if (num_names > 1) {
+        qsort(names, num_names, sizeof(char*), cmp_names);
+    }
+
+    /* every child is added before any is scanned,
+       so they sit next to each other */
+    first = state->num_nodes;
+    for (i = 0; i < num_names; i++) {
+        path = malloc(strlen(dir_path) + 1 + strlen(names[i]) + 1);
+        if (path == NULL) {
+            perror(MALLOCERR);
+            break;
+        }
+        sprintf(path, "%s/%s", dir_path, names[i]);
+        if (lstat(path, &st) < 0) {
+            perror(path);
+            free(path);
+            break;
+        }
+        if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+            fprintf(stderr, SKIP_PRINT, path);
+            free(path);
+            continue;
+        }
+        if (add_node(state, path, NULL, &st, &child) == EXIT_FAILURE) {
+            break;
+        }
+        count++;
+    }
+    for (child = 0; child < num_names; child++) free(names[child]);
+    free(names);
+    if (i < num_names) {
+        return EXIT_FAILURE;
+    }
+
+    state->nodes[idx].first_child = first;
+    state->nodes[idx].num_children = count;
+
+    /* the directory that already exists is
+       sized once its entries are merged */
+    if (idx != 0) {
+        state->nodes[idx].size = sizeof(struct dir_entry) *
+                                 (DIR_FIXED + count);
+        if (state->nodes[idx].size > state->fsa.geom.max_file) {
+            fprintf(stderr, HOSTBIGERR, dir_path);
+            return EXIT_FAILURE;
+        }
+        num_data = geom_zone_count(&state->fsa.geom, state->nodes[idx].size);
+        state->need_zones += num_data +
+                             fsa_table_count(&state->fsa, num_data);
+    }
+
+    for (child = first; child < first + count; child++) {
+        if (S_ISDIR(state->nodes[child].st.st_mode) &&
+            scan_dir(state, child) == EXIT_FAILURE) {
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/* reads the directory everything goes in, turns away names it
+   already has and checks that the whole tree fits */
+int check_target(struct put_state *state) {
+    struct put_node *target = &state->nodes[0];
+    struct inode *dir = &state->fsa.inodes[target->ino - 1];
+    uint32_t num_entries, i, j, num_data, grown;
+
+    state->target_data = read_file(state->fsa.image, dir, &state->fsa.super,
+                                   state->fsa.disk_start, NULL);
+    if (state->target_data == NULL) {
+        return EXIT_FAILURE;
+    }
+    num_entries = dir->size / sizeof(struct dir_entry);
+    for (i = 0; i < target->num_children; i++) {
+        for (j = 0; j < num_entries; j++) {
+            if (state->target_data[j].inode != 0 &&
+                strncmp(state->nodes[target->first_child + i].name,
+                        (char*)state->target_data[j].name,
+                        NAME_SIZE) == 0) {
+                fprintf(stderr, EXISTSERR,
+                        state->nodes[target->first_child + i].path);
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    /* at worst the directory grows by every new entry
+       and is moved whole */
+    grown = dir->size + sizeof(struct dir_entry) * target->num_children;
+    if (grown > state->fsa.geom.max_file) {
+        fprintf(stderr, FSA_NOSPACE);
+        return EXIT_FAILURE;
+    }
+    num_data = geom_zone_count(&state->fsa.geom, grown);
+    if (state->need_inodes > state->fsa.free_inodes) {
+        fprintf(stderr, FSA_NOINODES);
+        return EXIT_FAILURE;
+    }
+    if (state->need_zones + num_data + fsa_table_count(&state->fsa, num_data)
+        > state->fsa.free_zones) {
+        fprintf(stderr, FSA_NOSPACE);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* returns the inode "name" has in directory "dir_ino", or 0
+   with errno set to 0 when it isn't there. On error returns
+   0 with errno set */
+uint32_t find_name(struct put_state *state, uint32_t dir_ino, char *name) {
+    struct dir_iter iter;
+    struct dir_entry *entry;
+    uint32_t ino = 0;
+
+    if (dir_iter_open(&iter, state->fsa.image,
+                      &state->fsa.inodes[dir_ino - 1], &state->fsa.super,
+                      state->fsa.disk_start, NULL) == EXIT_FAILURE) {
+        return 0;
+    }
+    while ((entry = dir_iter_next(&iter)) != NULL) {
+        if (strncmp(name, (char*)entry->name, NAME_SIZE) == 0) {
+            ino = entry->inode;
+            break;
+        }
+    }
+    dir_iter_close(&iter);
+    errno = iter.failed ? EIO : 0;
+    return iter.failed ? 0 : ino;
+}
+
+/* puts the children of node "idx" in the image, each directory
+   right before the files in it, then the directories below it
+   the same way. "parent_ino" is the inode of its parent */
+int put_tree(struct put_state *state, uint32_t idx, uint32_t parent_ino) {
+    struct put_node *child;
+    uint32_t i;
+
+    if (put_inodes(state, idx) == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+    }
+    if (idx != 0 && put_dir(state, idx, parent_ino) == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < state->nodes[idx].num_children; i++) {
+        child = &state->nodes[state->nodes[idx].first_child + i];
+        if (S_ISREG(child->st.st_mode) &&
+            child->link_of == state->nodes[idx].first_child + i &&
+            put_file(state, state->nodes[idx].first_child + i)
+            == EXIT_FAILURE) {
+            return EXIT_FAILURE;
+        }
+    }
+    for (i = 0; i < state->nodes[idx].num_children; i++) {
+        child = &state->nodes[state->nodes[idx].first_child + i];
+        if (S_ISDIR(child->st.st_mode) &&
+            put_tree(state, state->nodes[idx].first_child + i,
+                     state->nodes[idx].ino) == EXIT_FAILURE) {
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/* gives every child of node "idx" an inode, taken one after
+   another so the inode table changes in one stretch */
+int put_inodes(struct put_state *state, uint32_t idx) {
+    struct put_node *node;
+    struct inode *res;
+    uint32_t i;
+
+    for (i = 0; i < state->nodes[idx].num_children; i++) {
+        node = &state->nodes[state->nodes[idx].first_child + i];
+        if (node->link_of != state->nodes[idx].first_child + i) {
+            node->ino = state->nodes[node->link_of].ino;
+            fsa_inode(&state->fsa, node->ino)->links++;
+            continue;
+        }
+        if ((node->ino = fsa_new_inode(&state->fsa)) == 0) {
+            return EXIT_FAILURE;
+        }
+        res = fsa_inode(&state->fsa, node->ino);
+        res->mode = node->st.st_mode & PERM_MASK;
+        res->mode |= S_ISDIR(node->st.st_mode) ? DIR_MASK : REG_MASK;
+        res->links = S_ISDIR(node->st.st_mode) ? DIR_LINKS : 1;
+        res->uid = node->st.st_uid;
+        res->gid = node->st.st_gid;
+        res->size = node->size;
+        res->atime = node->st.st_atime;
+        res->mtime = node->st.st_mtime;
+        res->ctime = node->st.st_ctime;
+
+        /* a new directory's ".." links to its parent */
+        if (S_ISDIR(node->st.st_mode)) {
+            fsa_inode(&state->fsa, state->nodes[idx].ino)->links++;
+            state->num_dirs++;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/* writes the entries of new directory node "idx" */
+int put_dir(struct put_state *state, uint32_t idx, uint32_t parent_ino) {
+    struct put_node *node = &state->nodes[idx], *child;
+    struct dir_entry *entries;
+    uint32_t *zones, *data, num_data, i;
+
+    num_data = geom_zone_count(&state->fsa.geom, node->size);
+    entries = calloc(num_data, state->fsa.geom.zone_size);
+    if (entries == NULL) {
+        perror(MALLOCERR);
+        return EXIT_FAILURE;
+    }
+    entries[0].inode = node->ino;
+    strcpy((char*)entries[0].name, CUR_DIR);
+    entries[1].inode = parent_ino;
+    strcpy((char*)entries[1].name, PARENT_DIR);
+    for (i = 0; i < node->num_children; i++) {
+        child = &state->nodes[node->first_child + i];
+        entries[DIR_FIXED + i].inode = child->ino;
+        strncpy((char*)entries[DIR_FIXED + i].name, child->name, NAME_SIZE);
+    }
+
+    zones = alloc_file(state, node->ino, num_data, &data);
+    if (zones == NULL) {
+        free(entries);
+        return EXIT_FAILURE;
+    }
+    if (fsa_write_zones(&state->fsa, data, num_data, entries)
+        == EXIT_FAILURE) {
+        free(zones);
+        free(entries);
+        return EXIT_FAILURE;
+    }
+    free(zones);
+    free(entries);
+    if (state->isV) {
+        fprintf(stderr, ADD_PRINT, node->path);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* copies host file node "idx" into zones taken for it, one
+   write for each run of contiguous zones that fits the
+   buffer. A file that shrank since it was looked at is
+   padded with zeros to the size it had */
+int put_file(struct put_state *state, uint32_t idx) {
+    struct put_node *node = &state->nodes[idx];
+    uint32_t *zones, *data, num_data, i, run;
+    size_t len, remaining = node->size, want;
+    ssize_t got;
+    int fd;
+
+    if ((fd = open(node->path, O_RDONLY)) < 0) {
+        perror(node->path);
+        return EXIT_FAILURE;
+    }
+    num_data = geom_zone_count(&state->fsa.geom, node->size);
+    zones = alloc_file(state, node->ino, num_data, &data);
+    if (zones == NULL) {
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < num_data; i += run) {
+        run = 1;
+        while (i + run < num_data && run < state->buf_zones &&
+               data[i + run] == data[i] + run) {
+            run++;
+        }
+        len = (size_t)state->fsa.geom.zone_size * run;
+        want = len < remaining ? len : remaining;
+        if ((got = read_full(fd, state->buf, want)) < 0) {
+            perror(node->path);
+            free(zones);
+            close(fd);
+            return EXIT_FAILURE;
+        }
+        memset((char*)state->buf + got, 0, len - got);
+        if (fsa_write_zones(&state->fsa, &data[i], run, state->buf)
+            == EXIT_FAILURE) {
+            free(zones);
+            close(fd);
+            return EXIT_FAILURE;
+        }
+        remaining -= want;
+    }
+    free(zones);
+    close(fd);
+    state->num_files++;
+    if (state->isV) {
+        fprintf(stderr, ADD_PRINT, node->path);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* adds the new entries to the directory that was already in
+   the image, reusing the slots of deleted entries first. When
+   it still fits the zones it has it is rewritten in place after
+   everything else is flushed, otherwise it is copied whole to
+   new zones and the old ones are freed */
+int put_target(struct put_state *state) {
+    struct put_node *target = &state->nodes[0], *child;
+    struct inode *dir, old;
+    struct dir_entry *entries;
+    uint32_t *zones, *data, num_entries, num_old, num_data, slot, end, i;
+
+    dir = fsa_inode(&state->fsa, target->ino);
+    old = *dir;
+    num_entries = dir->size / sizeof(struct dir_entry);
+    num_old = geom_zone_count(&state->fsa.geom, dir->size);
+    num_data = geom_zone_count(&state->fsa.geom, dir->size +
+                               sizeof(struct dir_entry) *
+                               target->num_children);
+    entries = calloc(num_data ? num_data : 1, state->fsa.geom.zone_size);
+    if (entries == NULL) {
+        perror(MALLOCERR);
+        return EXIT_FAILURE;
+    }
+    memcpy(entries, state->target_data, dir->size);
+
+    slot = 0;
+    end = num_entries;
+    for (i = 0; i < target->num_children; i++) {
+        child = &state->nodes[target->first_child + i];
+        while (slot < num_entries && entries[slot].inode != 0) {
+            slot++;
+        }
+        if (slot < num_entries) {
+            entries[slot].inode = child->ino;
+            strncpy((char*)entries[slot++].name, child->name, NAME_SIZE);
+        } else {
+            entries[end].inode = child->ino;
+            strncpy((char*)entries[end++].name, child->name, NAME_SIZE);
+        }
+    }
+    dir->size = sizeof(struct dir_entry) * end;
+    dir->mtime = dir->ctime = time(NULL);
+    num_data = geom_zone_count(&state->fsa.geom, dir->size);
+
+    /* same zones and no holes, so only the data changes */
+    if (num_data == num_old) {
+        zones = resolve_zones(state->fsa.image, &old, state->fsa.disk_start,
+                              &state->fsa.geom, &num_old, NULL);
+        if (zones == NULL) {
+            free(entries);
+            return EXIT_FAILURE;
+        }
+        for (i = 0; i < num_old && zones[i] != 0; i++);
+        if (i == num_old) {
+            state->target_zones = zones;
+            state->target_buf = entries;
+            state->target_count = num_data;
+            return EXIT_SUCCESS;
+        }
+        free(zones);
+    }
+
+    /* the old zones are freed only once the new ones are
+       taken, so the two copies never share a zone */
+    zones = alloc_file(state, target->ino, num_data, &data);
+    if (zones == NULL) {
+        free(entries);
+        return EXIT_FAILURE;
+    }
+    if (fsa_write_zones(&state->fsa, data, num_data, entries)
+        == EXIT_FAILURE || fsa_free_file(&state->fsa, &old) == EXIT_FAILURE) {
+        free(zones);
+        free(entries);
+        return EXIT_FAILURE;
+    }
+    free(zones);
+    free(entries);
+    return EXIT_SUCCESS;
+}
+
+/* takes the zones for "num_data" zones of data of inode "ino"
+   and its indirect tables, then points the inode at them.
+   Returns every zone taken, which the caller frees, with the
+   data zones at "data". On error returns NULL */
+uint32_t *alloc_file(struct put_state *state, uint32_t ino,
+                     uint32_t num_data, uint32_t **data) {
+    uint32_t num_tables = fsa_table_count(&state->fsa, num_data);
+    uint32_t *zones, i;
+
+    zones = malloc(sizeof(uint32_t) * (num_tables + num_data + 1));
+    if (zones == NULL) {
+        perror(MALLOCERR);
+        return NULL;
+    }
+    if (fsa_alloc_zones(&state->fsa, num_tables + num_data, zones)
+        == EXIT_FAILURE) {
+        free(zones);
+        return NULL;
+    }
+    if (fsa_map_file(&state->fsa, fsa_inode(&state->fsa, ino),
+                     zones, num_data) == EXIT_FAILURE) {
+        for (i = 0; i < num_tables + num_data; i++) {
+            fsa_free_zone(&state->fsa, zones[i]);
+        }
+        free(zones);
+        return NULL;
+    }
+    *data = zones + num_tables;
+    state->num_zones += num_data;
+    state->num_extents += fsa_count_extents(*data, num_data);
+    return zones;
+}
+
+int cmp_names(const void *a, const void *b) {
+    return strcmp(*(char**)a, *(char**)b);
+}
+
+void free_state(struct put_state *state) {
+    uint32_t i;
+
+    for (i = 0; i < state->num_nodes; i++) {
+        free(state->nodes[i].path);
+    }
+    free(state->nodes);
+    free(state->linked);
+    free(state->target_data);
+    free(state->target_zones);
+    free(state->target_buf);
+    if (state->buf != NULL) {
+        bufpool_put(state->buf, (size_t)state->buf_zones *
+                                state->fsa.geom.zone_size);
+    }
+    fsa_close(&state->fsa);
+}
@@ -0,0 +1,278 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "image.h"
+#include "sched.h"
+#include "bufpool.h"
+#include "hash.h"
+
+#define OPTSTR "vxj:p:s:"
+#define USAGE "Usage: [ -v ] [ -x ] [ -j jobs ] [ -p part [ -s subpart ] ] " \
+              "imagefile [ path ]\n"
+#define PARTERR "partition must be between 0-3\n"
+#define SUBPARTERR "subpartition must be between 0-3\n"
+#define JOBERR "number of jobs must be at least 1\n"
+#define SUM_PRINT "%0*llx  %s\n"
+#define SUM_ERR_PRINT "%s: %s\n"
+#define MAX_PART 4
+#define DEF_PATH "/"
+#define ZERO_BUF_SIZE 65536
+
+/* one regular file to hash, "digest" is
+   filled in by whichever worker takes it */
+struct sum_file {
+    char *path;
+    uint32_t ino;
+    uint64_t digest;
+    int failed;
+};
+
+/* everything the workers share. Files are handed out
+   by "next" and each one's digest is kept until every
+   worker is done, so lines print in the order found */
+struct sum_state {
+    struct image_handle *img;
+    struct sum_file *files;
+    uint32_t num_files;
+    uint32_t next;
+    int algo;
+    pthread_mutex_t lock;
+};
+
+static char zeros[ZERO_BUF_SIZE];
+
+void *worker(void *);
+int sum_file(struct sum_state *, struct sum_file *, void *);
+
+int main(int argc, char *argv[]) {
+    int option, jobs, i, part = NO_PART, sub_part = NO_PART, isV = FALSE;
+    int failures = 0;
+    extern int optind;
+    extern char *optarg;
+    struct sum_state state;
+    pthread_t *threads;
+    char *path_name;
+    struct image_file *found;
+    uint32_t ino, j;
+
+    memset(&state, 0, sizeof(struct sum_state));
+    state.algo = HASH_CRC32C;
+    jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs < 1) jobs = 1;
+
+    while ((option = getopt(argc, argv, OPTSTR)) != EOF) {
+        switch (option)
+        {
+        case 'v':
+            isV = TRUE;
+            break;
+        case 'x':
+            state.algo = HASH_XXH64;
+            break;
+        case 'j':
+            jobs = strtol(optarg, NULL, 10);
+            if (jobs < 1) {
+                fprintf(stderr, JOBERR);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'p':
+            part = strtol(optarg, NULL, 10);
+            if (part < 0 || part >= MAX_PART) {
+                fprintf(stderr, PARTERR);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 's':
+            sub_part = strtol(optarg, NULL, 10);
+            if (sub_part < 0 || sub_part >= MAX_PART) {
+                fprintf(stderr, SUBPARTERR);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            fprintf(stderr, USAGE);
+            return EXIT_FAILURE;
+            break;
+        }
+    }
+    if (part == NO_PART && sub_part != NO_PART) {
+        fprintf(stderr, USAGE);
+        return EXIT_FAILURE;
+    }
+    if (argc <= optind) {
+        fprintf(stderr, USAGE);
+        return EXIT_FAILURE;
+    }
+
+    /* the image is opened once and shared by every worker */
+    state.img = image_open(argv[optind], part, sub_part, isV);
+    if (state.img == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    path_name = malloc(strlen(argc > optind + 1 ? argv[optind + 1]
+                                                : DEF_PATH) + 2);
+    if (path_name == NULL) {
+        perror(MALLOCERR);
+        image_close(state.img);
+        return EXIT_FAILURE;
+    }
+    strcpy(path_name, argc > optind + 1 ? argv[optind + 1] : DEF_PATH);
+    canonicalizer(path_name);
+
+    ino = image_lookup(state.img, path_name);
+    if (ino == NO_INODE) {
+        fprintf(stderr, "%s\n", FILENOTFOUNDERR);
+        free(path_name);
+        image_close(state.img);
+        return EXIT_FAILURE;
+    }
+
+    /* every regular file at or under the path */
+    if (image_collect(state.img, ino, path_name, &found,
+                      &state.num_files) == EXIT_FAILURE) {
+        free(path_name);
+        image_close(state.img);
+        return EXIT_FAILURE;
+    }
+    free(path_name);
+    state.files = calloc(state.num_files ? state.num_files : 1,
+                         sizeof(struct sum_file));
+    if (state.files == NULL) {
+        perror(MALLOCERR);
+        image_close(state.img);
+        return EXIT_FAILURE;
+    }
+    for (j = 0; j < state.num_files; j++) {
+        state.files[j].path = found[j].path;
+        state.files[j].ino = found[j].ino;
+    }
+    free(found);
+
+    pthread_mutex_init(&state.lock, NULL);
+    if ((uint32_t)jobs > state.num_files) {
+        jobs = state.num_files ? state.num_files : 1;
+    }
+    threads = malloc(sizeof(pthread_t) * jobs);
+    if (threads == NULL) {
+        perror(MALLOCERR);
+        image_close(state.img);
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < jobs; i++) {
+        if (pthread_create(&threads[i], NULL, worker, &state) != 0) {
+            perror(JOBERR);
+            return EXIT_FAILURE;
+        }
+    }
+    for (i = 0; i < jobs; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (j = 0; j < state.num_files; j++) {
+        if (state.files[j].failed) {
+            fprintf(stderr, SUM_ERR_PRINT, state.files[j].path, READERR);
+            failures++;
+        } else {
+            printf(SUM_PRINT, hash_digits(state.algo),
+                   (unsigned long long)state.files[j].digest,
+                   state.files[j].path);
+        }
+        free(state.files[j].path);
+    }
+    free(state.files);
+    free(threads);
+    image_close(state.img);
+    if (isV) {
+        bufpool_report(stderr);
+    }
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* takes files one at a time until none are left, reading
+   into a buffer from the shared pool that is reused for
+   every file this worker hashes */
+void *worker(void *arg) {
+    struct sum_state *state = arg;
+    struct sum_file *file;
+    uint32_t index;
+    void *buf;
+
+    buf = bufpool_get(SCHED_MAX_RUN > state->img->zone_size ?
+                      SCHED_MAX_RUN : state->img->zone_size);
+
+    while (TRUE) {
+        pthread_mutex_lock(&state->lock);
+        index = state->next++;
+        pthread_mutex_unlock(&state->lock);
+        if (index >= state->num_files) break;
+        file = &state->files[index];
+
+        if (buf == NULL || sum_file(state, file, buf) == EXIT_FAILURE) {
+            file->failed = TRUE;
+        }
+    }
+
+    bufpool_put(buf, SCHED_MAX_RUN > state->img->zone_size ?
+                     SCHED_MAX_RUN : state->img->zone_size);
+    return NULL;
+}
+
+/* streams one file's data into its digest, a run of
+   contiguous zones per positional read. Holes are never
+   read, they are fed to the hash as zeros */
+int sum_file(struct sum_state *state, struct sum_file *file, void *buf) {
+    struct image_handle *img = state->img;
+    struct inode node;
+    uint32_t *zones, num_zones, i, run, max_run;
+    size_t len, remaining, chunk;
+    struct hasher hash;
+
+    zones = image_get_zones(img, file->ino, &num_zones, &node);
+    if (zones == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    hash_init(&hash, state->algo);
+    max_run = SCHED_MAX_RUN / img->zone_size;
+    if (max_run == 0) max_run = 1;
+    remaining = node.size;
+    for (i = 0; i < num_zones && remaining > 0; i += run) {
+        run = next_run(zones, i, num_zones, max_run);
+        len = (size_t)img->zone_size * run;
+        if (len > remaining) {
+            len = remaining;
+        }
+        remaining -= len;
+
+        if (zones[i] == 0) {
+            while (len > 0) {
+                chunk = len < ZERO_BUF_SIZE ? len : ZERO_BUF_SIZE;
+                hash_update(&hash, zeros, chunk);
+                len -= chunk;
+            }
+            continue;
+        }
+
+        if (cimg_pread(img->fd, buf, len, img->disk_start +
+                  (off_t)img->zone_size * zones[i]) != (ssize_t)len) {
+            perror(READERR);
+            return EXIT_FAILURE;
+        }
+        hash_update(&hash, buf, len);
+    }
+
+    /* a size past the last zone reads back as zeros */
+    while (remaining > 0) {
+        chunk = remaining < ZERO_BUF_SIZE ? remaining : ZERO_BUF_SIZE;
+        hash_update(&hash, zeros, chunk);
+        remaining -= chunk;
+    }
+
+    file->digest = hash_final(&hash);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,661 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include "util.h"
+#include "sched.h"
+
+#define OPTSTR "vDp:s:w:"
+#define USAGE "Usage: [ -v ] [ -D ] [ -p part [ -s subpart ] ] " \
+              "[ -w window ] imagefile [ path ]\n"
+#define PARTERR "partition must be between 0-3\n"
+#define SUBPARTERR "subpartition must be between 0-3\n"
+#define WINDOWERR "readahead window must be 0 or more KiB\n"
+#define NODIRECT "direct I/O not supported here, using buffered reads\n"
+#define OPENERR "open error\n"
+#define WRITEERR "write error"
+#define INITIALDISK 0
+#define MAX_PART 4
+#define DEF_PATH "/"
+#define CUR_DIR "."
+#define PARENT_DIR ".."
+#define INIT_ENTRIES 64
+#define OUT_BUF_SIZE (1024 * 1024)
+
+#define TAR_BLOCK 512
+#define TAR_END_BLOCKS 2
+#define TAR_NAME_SIZE 100
+#define TAR_PREFIX_SIZE 155
+#define TAR_MAGIC "ustar"
+#define TAR_VERSION "00"
+#define TAR_REG '0'
+#define TAR_LINK '1'
+#define TAR_DIR '5'
+#define TAR_PAX 'x'
+#define TAR_PAX_NAME "PaxHeader"
+#define TAR_PAX_PATH "path"
+#define TAR_PAX_LINK "linkpath"
+#define TAR_PERM_MASK 07777
+#define TAR_CHKSUM_BLANK ' '
+
+/* on-disk layout of a POSIX ustar header block */
+struct tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+/* a file waiting to be written, ordered
+   by where its data starts on disk */
+struct tar_entry {
+    char *path;
+    uint32_t ino;
+    uint32_t first_zone;
+};
+
+struct tar_state {
+    int image;
+    struct superblock *super;
+    struct inode *inode_table;
+    off_t disk_start;
+    uint32_t zone_size;
+    struct zone_geom geom;
+    struct tar_entry *files;
+    uint32_t num_files;
+    uint32_t files_cap;
+    uint8_t *visited;   /* directories walked, by inode number */
+    uint32_t *written;  /* 1 + index in "files" of the first name
+                           written, by inode number */
+    void *run_buf;
+    struct arena arena;
+    struct readahead ra;
+    struct dio *dio;    /* reads file data directly when not NULL */
+};
+
+int walk_tree(struct tar_state *, uint32_t, char *);
+int write_header(char *, struct inode *, char, char *, uint32_t);
+uint32_t pax_len(char *, char *);
+int write_data(struct tar_state *, struct inode *);
+int write_padding(uint32_t);
+int entry_cmp(const void *, const void *);
+
+int main(int argc, char *argv[]) {
+    int option, path_len, status = EXIT_SUCCESS;
+    extern int optind;
+    extern char *optarg;
+    int isV = FALSE, isD = FALSE, part = NO_PART, sub_part = NO_PART;
+    char *image = NULL, *min_path = NULL, *path_name, *tar_name;
+    uint32_t disk_start, part_size, i, j, window = RA_DEF_WINDOW;
+    struct inode found_file, *node;
+    uint32_t found_ino;
+    struct tar_state state;
+    struct dio dio;
+    char zero[TAR_BLOCK];
+
+    /* parses all options using getopt and returns appropriately,
+     * erroring if they are invalid in anyway */
+    while ((option = getopt(argc, argv, OPTSTR)) != EOF) {
+        switch (option)
+        {
+        case 'v':
+            isV = TRUE;
+            break;
+        case 'D':
+            isD = TRUE;
+            break;
+        case 'p':
+            part = strtol(optarg, NULL, 10);
+            if (part < 0 || part >= MAX_PART) {
+                fprintf(stderr, PARTERR);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 's':
+            sub_part = strtol(optarg, NULL, 10);
+            if (sub_part < 0 || sub_part >= MAX_PART) {
+                fprintf(stderr, SUBPARTERR);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'w':
+            /* how far ahead of the reader to hint, 0 for none */
+            option = strtol(optarg, NULL, 10);
+            if (option < 0) {
+                fprintf(stderr, WINDOWERR);
+                return EXIT_FAILURE;
+            }
+            window = (uint32_t)option * RA_KIB;
+            break;
+        default:
+            fprintf(stderr, USAGE);
+            return EXIT_FAILURE;
+            break;
+        }
+    }
+
+    /* gets image file, exiting if not provided*/
+    if (argc > optind) {
+        image = argv[optind];
+        optind++;
+    } else {
+        fprintf(stderr, USAGE);
+        return EXIT_FAILURE;
+    }
+
+    /* gets the subtree to export, keeping one copy
+       for "find_file" to use strtok on and one
+       canonicalized copy to name the entries with */
+    if (argc > optind) {
+        path_len = strlen(argv[optind]);
+        min_path = (char*)calloc(path_len + 1, sizeof(char));
+        path_name = (char*)calloc(path_len + 2, sizeof(char));
+        if (min_path == NULL || path_name == NULL) {
+            perror(MALLOCERR);
+            return EXIT_FAILURE;
+        }
+        strncpy(min_path, argv[optind], path_len);
+        strncpy(path_name, argv[optind], path_len);
+        if(canonicalizer(path_name) == EXIT_FAILURE){
+            return EXIT_FAILURE;
+        }
+    } else {
+        min_path = DEF_PATH;
+        path_name = DEF_PATH;
+    }
+
+    /* open image file, therefore checking if it
+       is valid */
+    if ((state.image = cimg_open(image)) < 0) {
+        fprintf(stderr, OPENERR);
+        return EXIT_FAILURE;
+    }
+
+    /* check if partitioning is required,
+       if it is then find and verify if it
+       exists and set the start of disk to that,
+       otherwise set the start of disk as the start
+       of the opened image file */
+    if (part != NO_PART) {
+        if (partition_finder(image, part, sub_part,
+            &disk_start, &part_size, isV) == EXIT_FAILURE) {
+            return EXIT_FAILURE;
+        }
+    } else {
+        if (sub_part == NO_PART) {
+            disk_start = INITIALDISK;
+            part_size = INITIALDISK;
+        } else {
+            fprintf(stderr, USAGE);
+            return EXIT_FAILURE;
+        }
+    }
+    state.disk_start = (off_t)disk_start * SECTOR_SIZE;
+
+    /* directory buffers and zone lists all come from one
+       arena, released level by level during the walk and
+       per file while streaming data */
+    arena_init(&state.arena);
+    if (find_inode(min_path, state.image, state.disk_start,
+                   &found_file, &found_ino, isV,
+                   &state.arena) == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+    }
+
+    /* read everything needed to walk the tree once */
+    state.super = get_superblock(state.image, state.disk_start, FALSE);
+    if(state.super == NULL){
+        return EXIT_FAILURE;
+    }
+    state.inode_table = get_inode_table(state.image, state.super,
+                                        state.disk_start, NULL);
+    state.zone_size = state.super->blocksize << state.super->log_zone_size;
+    geom_select(state.super, &state.geom);
+    ra_init(&state.ra, state.image, state.disk_start,
+            state.zone_size, window);
+
+    /* file data goes through a second descriptor opened for
+       direct I/O when asked for, metadata stays buffered.
+       Readahead hints only help buffered reads */
+    state.dio = NULL;
+    if(isD){
+        if(dio_open(&dio, image, state.zone_size > SCHED_MAX_RUN ?
+                                 state.zone_size : SCHED_MAX_RUN)
+                                 == EXIT_FAILURE){
+            fprintf(stderr, OPENERR);
+            return EXIT_FAILURE;
+        }
+        state.dio = &dio;
+        if(dio.direct){
+            state.ra.window = 0;
+        }else if(isV){
+            fprintf(stderr, NODIRECT);
+        }
+        state.run_buf = dio_get_buf(&dio);
+    }else{
+        state.run_buf = bufpool_get(state.zone_size > SCHED_MAX_RUN ?
+                                    state.zone_size : SCHED_MAX_RUN);
+    }
+    state.files = malloc(sizeof(struct tar_entry) * INIT_ENTRIES);
+    state.files_cap = INIT_ENTRIES;
+    state.num_files = 0;
+    state.visited = calloc(state.super->ninodes + 1, 1);
+    state.written = calloc(state.super->ninodes + 1, sizeof(uint32_t));
+    if(state.inode_table == NULL || state.run_buf == NULL ||
+       state.files == NULL || state.visited == NULL ||
+       state.written == NULL){
+        perror(MALLOCERR);
+        return EXIT_FAILURE;
+    }
+
+    /* one large buffer so headers and zones
+       leave in few large writes */
+    setvbuf(stdout, NULL, _IOFBF, OUT_BUF_SIZE);
+
+    /* entries are named relative to the parent of the
+       requested path, the root exports its children */
+    tar_name = strrchr(path_name, SLASH) + 1;
+
+    if((found_file.mode & FILE_TYPE_MASK) == DIR_MASK){
+        /* directories are written as they are
+           found, files are queued */
+        status = walk_tree(&state, found_ino, tar_name);
+    }else if((found_file.mode & FILE_TYPE_MASK) == REG_MASK){
+        status = write_header(tar_name, &found_file, TAR_REG, NULL,
+                              found_file.size);
+        if(status == EXIT_SUCCESS){
+            status = write_data(&state, &found_file);
+        }
+    }else{
+        fprintf(stderr, LS_TYPE_INVAL);
+        status = EXIT_FAILURE;
+    }
+
+    /* the order of members in a tar stream is free,
+       so send file data sorted by physical location */
+    qsort(state.files, state.num_files, sizeof(struct tar_entry), entry_cmp);
+    for(i = 0; status == EXIT_SUCCESS && i < state.num_files; i++){
+        node = &state.inode_table[state.files[i].ino - 1];
+
+        /* later names of an inode that has already been
+           written become hard links to the first one */
+        j = state.written[state.files[i].ino];
+        if(node->links > 1 && j != 0){
+            status = write_header(state.files[i].path, node, TAR_LINK,
+                                  state.files[j - 1].path, 0);
+            continue;
+        }
+        state.written[state.files[i].ino] = i + 1;
+
+        status = write_header(state.files[i].path, node, TAR_REG, NULL,
+                              node->size);
+        if(status == EXIT_SUCCESS){
+            status = write_data(&state, node);
+        }
+    }
+
+    /* end of archive */
+    memset(zero, 0, TAR_BLOCK);
+    for(i = 0; status == EXIT_SUCCESS && i < TAR_END_BLOCKS; i++){
+        if(fwrite(zero, TAR_BLOCK, 1, stdout) != 1){
+            perror(WRITEERR);
+            status = EXIT_FAILURE;
+        }
+    }
+    if(fflush(stdout) != 0){
+        perror(WRITEERR);
+        status = EXIT_FAILURE;
+    }
+
+    for(i = 0; i < state.num_files; i++){
+        free(state.files[i].path);
+    }
+    free(state.files);
+    free(state.visited);
+    free(state.written);
+    if(state.dio != NULL){
+        dio_put_buf(state.dio, state.run_buf);
+        dio_close(state.dio);
+    }else{
+        bufpool_put(state.run_buf, state.zone_size > SCHED_MAX_RUN ?
+                                   state.zone_size : SCHED_MAX_RUN);
+    }
+    arena_destroy(&state.arena);
+    free(state.inode_table);
+    free(state.super);
+    cimg_close(state.image);
+    if(isV){
+        bufpool_report(stderr);
+    }
+    return status;
+}
+
+/* writes a header for directory inode "ino" named "path"
+   then walks its entries, writing subdirectories and
+   queueing regular files to be written later. A directory
+   already walked, linked into itself in a corrupt image,
+   is left out */
+int walk_tree(struct tar_state *state, uint32_t ino, char *path){
+    struct inode *dir = &state->inode_table[ino - 1];
+    struct dir_entry *dir_data, *entry;
+    struct inode *child;
+    struct tar_entry *grown;
+    char name[NAME_SIZE + 1], *child_path, *dir_name;
+    struct arena_mark mark;
+    off_t num_entries, i;
+
+    if(state->visited[ino]){
+        return EXIT_SUCCESS;
+    }
+    state->visited[ino] = TRUE;
+
+    /* the root itself has no name of its own */
+    if(path[0] != '\0'){
+        dir_name = malloc(strlen(path) + 2);
+        if(dir_name == NULL){
+            perror(MALLOCERR);
+            return EXIT_FAILURE;
+        }
+        sprintf(dir_name, "%s/", path);
+        if(write_header(dir_name, dir, TAR_DIR, NULL, 0) == EXIT_FAILURE){
+            free(dir_name);
+            return EXIT_FAILURE;
+        }
+        free(dir_name);
+    }
+
+    arena_save(&state->arena, &mark);
+    dir_data = (struct dir_entry*)read_file(state->image, dir,
+                                            state->super,
+                                            state->disk_start,
+                                            &state->arena);
+    if(dir_data == NULL){
+        arena_restore(&state->arena, &mark);
+        return EXIT_FAILURE;
+    }
+    num_entries = dir->size / sizeof(struct dir_entry);
+    ra_dirs(&state->ra, dir_data, num_entries,
+            state->inode_table, state->super->ninodes);
+
+    for(i = 0; i < num_entries; i++){
+        entry = &dir_data[i];
+
+        /* deleted file */
+        if(entry->inode == 0) continue;
+        if(entry->inode > state->super->ninodes){
+            perror(INODEERR);
+            arena_restore(&state->arena, &mark);
+            return EXIT_FAILURE;
+        }
+
+        memset(name, 0, NAME_SIZE + 1);
+        strncpy(name, (char*)entry->name, NAME_SIZE);
+        if(strcmp(name, CUR_DIR) == 0 || strcmp(name, PARENT_DIR) == 0){
+            continue;
+        }
+
+        /* a name that is empty or has a slash would put the
+           member somewhere other than the directory it is in */
+        if(!name_is_safe(name)){
+            fprintf(stderr, "%s/%s: %s\n", path, name, UNSAFEERR);
+            continue;
+        }
+
+        child_path = malloc(strlen(path) + strlen(name) + 2);
+        if(child_path == NULL){
+            perror(MALLOCERR);
+            arena_restore(&state->arena, &mark);
+            return EXIT_FAILURE;
+        }
+        if(path[0] != '\0'){
+            sprintf(child_path, "%s/%s", path, name);
+        }else{
+            strcpy(child_path, name);
+        }
+        child = &state->inode_table[entry->inode - 1];
+
+        if((child->mode & FILE_TYPE_MASK) == DIR_MASK){
+            if(walk_tree(state, entry->inode, child_path) == EXIT_FAILURE){
+                free(child_path);
+                arena_restore(&state->arena, &mark);
+                return EXIT_FAILURE;
+            }
+            free(child_path);
+        }else if((child->mode & FILE_TYPE_MASK) == REG_MASK){
+            if(state->num_files == state->files_cap){
+                grown = realloc(state->files, sizeof(struct tar_entry) *
+                                              state->files_cap * 2);
+                if(grown == NULL){
+                    perror(MALLOCERR);
+                    free(child_path);
+                    arena_restore(&state->arena, &mark);
+                    return EXIT_FAILURE;
+                }
+                state->files = grown;
+                state->files_cap *= 2;
+            }
+
+            /* files without data sort first, the
+               order between them doesn't matter */
+            state->files[state->num_files].path = child_path;
+            state->files[state->num_files].ino = entry->inode;
+            state->files[state->num_files].first_zone =
+                child->size ? child->zone[0] : 0;
+            state->num_files++;
+        }else{
+            free(child_path);
+        }
+    }
+
+    arena_restore(&state->arena, &mark);
+    return EXIT_SUCCESS;
+}
+
+/* writes a ustar header for "path" built from the inode.
+   Paths that fit in neither the name nor the name and
+   prefix fields, and links too long for the linkname
+   field, are sent in a pax extended header first */
+int write_header(char *path, struct inode *node, char type,
+                 char *link, uint32_t size){
+    struct tar_header header;
+    unsigned char *raw;
+    char *split;
+    uint32_t chksum, i, path_len, pax_size;
+    int long_path = FALSE, long_link = FALSE;
+    int32_t mtime;
+
+    memset(&header, 0, sizeof(struct tar_header));
+    path_len = strlen(path);
+
+    if(path_len <= TAR_NAME_SIZE){
+        memcpy(header.name, path, path_len);
+    }else{
+        /* split at the last slash that leaves a
+           name and a prefix that both fit */
+        split = NULL;
+        for(i = path_len - 1; i > 0; i--){
+            if(path[i] == SLASH && i <= TAR_PREFIX_SIZE &&
+               path_len - i - 1 <= TAR_NAME_SIZE &&
+               path_len - i - 1 > 0){
+                split = &path[i];
+                break;
+            }
+        }
+        if(split != NULL){
+            memcpy(header.prefix, path, split - path);
+            memcpy(header.name, split + 1, path_len - (split - path) - 1);
+        }else{
+            long_path = TRUE;
+            memcpy(header.name, path, TAR_NAME_SIZE);
+        }
+    }
+    if(link != NULL){
+        strncpy(header.linkname, link, TAR_NAME_SIZE);
+        long_link = strlen(link) > TAR_NAME_SIZE;
+    }
+
+    /* whatever didn't fit is cut short in the ustar
+       fields and sent whole in pax records before them */
+    pax_size = (long_path ? pax_len(TAR_PAX_PATH, path) : 0) +
+               (long_link ? pax_len(TAR_PAX_LINK, link) : 0);
+    if(pax_size > 0){
+        if(write_header(TAR_PAX_NAME, node, TAR_PAX, NULL,
+                        pax_size) == EXIT_FAILURE){
+            return EXIT_FAILURE;
+        }
+        if((long_path && fprintf(stdout, "%u %s=%s\n",
+                                 pax_len(TAR_PAX_PATH, path),
+                                 TAR_PAX_PATH, path) < 0) ||
+           (long_link && fprintf(stdout, "%u %s=%s\n",
+                                 pax_len(TAR_PAX_LINK, link),
+                                 TAR_PAX_LINK, link) < 0) ||
+           write_padding(pax_size) == EXIT_FAILURE){
+            perror(WRITEERR);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* negative times can't be represented in
+       the octal field, so clamp them to the epoch */
+    mtime = node->mtime < 0 ? 0 : node->mtime;
+    sprintf(header.mode, "%07o", node->mode & TAR_PERM_MASK);
+    sprintf(header.uid, "%07o", node->uid);
+    sprintf(header.gid, "%07o", node->gid);
+    sprintf(header.size, "%011o", size);
+    sprintf(header.mtime, "%011o", (uint32_t)mtime);
+    header.typeflag = type;
+    memcpy(header.magic, TAR_MAGIC, strlen(TAR_MAGIC) + 1);
+    memcpy(header.version, TAR_VERSION, strlen(TAR_VERSION));
+    sprintf(header.devmajor, "%07o", 0);
+    sprintf(header.devminor, "%07o", 0);
+
+    /* checksum is computed with the field itself blank */
+    memset(header.chksum, TAR_CHKSUM_BLANK, sizeof(header.chksum));
+    raw = (unsigned char*)&header;
+    chksum = 0;
+    for(i = 0; i < sizeof(struct tar_header); i++){
+        chksum += raw[i];
+    }
+    sprintf(header.chksum, "%06o", chksum);
+
+    if(fwrite(&header, sizeof(struct tar_header), 1, stdout) != 1){
+        perror(WRITEERR);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* returns the length of the pax record "<len> <key>=<value>\n",
+   where the length counts its own digits */
+uint32_t pax_len(char *key, char *value){
+    uint32_t rec_len, digits, total, d;
+
+    rec_len = strlen(key) + strlen(value) + strlen(" =\n");
+    for(digits = 1; ; digits++){
+        for(total = rec_len + digits, d = 0; total; total /= 10){
+            d++;
+        }
+        if(d == digits) break;
+    }
+    return rec_len + digits;
+}
+
+/* streams the file's data to stdout zone by zone, reading
+   runs of zones that follow each other on disk in one read,
+   hinting the readahead window ahead of the reads and
+   never reading holes */
+int write_data(struct tar_state *state, struct inode *node){
+    uint32_t *zones, num_zones, i, run, max_run, len, remaining;
+    void *data;
+
+    arena_reset(&state->arena);
+    zones = resolve_zones(state->image, node, state->disk_start,
+                          &state->geom, &num_zones, &state->arena);
+    if(zones == NULL){
+        return EXIT_FAILURE;
+    }
+
+    max_run = SCHED_MAX_RUN / state->zone_size;
+    if(max_run == 0) max_run = 1;
+    remaining = node->size;
+    ra_start(&state->ra);
+
+    for(i = 0; i < num_zones; i += run){
+        ra_zones(&state->ra, zones, num_zones, i);
+
+        /* count how many zones after this one are
+           contiguous on disk, or are holes in a row */
+        run = next_run(zones, i, num_zones, max_run);
+
+        /* direct reads land wherever the rounded
+           read puts them inside the buffer */
+        data = state->run_buf;
+        if(zones[i] == 0){
+            memset(state->run_buf, 0, (size_t)state->zone_size * run);
+        }else if(state->dio != NULL){
+            data = dio_read(state->dio, state->run_buf,
+                            (size_t)state->zone_size * run,
+                            state->disk_start +
+                            (off_t)state->zone_size * zones[i]);
+        }else if(cimg_pread(state->image, state->run_buf,
+                       (size_t)state->zone_size * run,
+                       state->disk_start + (off_t)state->zone_size * zones[i])
+                       != (ssize_t)state->zone_size * run){
+            data = NULL;
+        }
+        if(data == NULL){
+            perror(READERR);
+            return EXIT_FAILURE;
+        }
+
+        len = state->zone_size * run;
+        if(len > remaining){
+            len = remaining;
+        }
+        if(fwrite(data, 1, len, stdout) != len){
+            perror(WRITEERR);
+            return EXIT_FAILURE;
+        }
+        remaining -= len;
+        ra_done(&state->ra, zones, i + run);
+    }
+
+    return write_padding(node->size);
+}
+
+/* pads the data written so far out to a whole tar block */
+int write_padding(uint32_t size){
+    char zero[TAR_BLOCK];
+    uint32_t pad = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+
+    memset(zero, 0, TAR_BLOCK);
+    if(pad && fwrite(zero, 1, pad, stdout) != pad){
+        perror(WRITEERR);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* sorts queued files by the first zone of their data */
+int entry_cmp(const void *a, const void *b){
+    const struct tar_entry *ea = a, *eb = b;
+
+    if(ea->first_zone != eb->first_zone){
+        return ea->first_zone < eb->first_zone ? -1 : 1;
+    }
+    return 0;
+}
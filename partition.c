@@ -30,25 +30,34 @@ uint32_t uint32_convert(uint8_t *p) {
    respectivley */
 int partition_finder(char *img, int part_num, int sub_part, 
                      uint32_t *offset, uint32_t *p_size, int isV) {
-    uint8_t mbr[MBR_SIZE];
-    uint8_t sub_mbr[MBR_SIZE];
-    uint8_t part_type, sub_type;
-    uint32_t first_sec, psize, sub_first_sec, sub_psize;
     int fd, r;
-    size_t base;
-    off_t location;
 
     /* opens disk image, returns if 
        image path is invalid */
-    fd = open(img, O_RDONLY);
+    fd = cimg_open(img);
     if (fd < 0) {
         return EXIT_FAILURE;
     }
-    
+
+    r = partition_finder_fd(fd, part_num, sub_part, offset, p_size, isV);
+    cimg_close(fd);
+    return r;
+}
+
+/* same as "partition_finder" but for an image that is
+   already open. Only positional reads are used, so the
+   descriptor's offset is never moved */
+int partition_finder_fd(int fd, int part_num, int sub_part,
+                        uint32_t *offset, uint32_t *p_size, int isV) {
+    uint8_t mbr[MBR_SIZE];
+    uint8_t sub_mbr[MBR_SIZE];
+    uint32_t first_sec, psize, sub_first_sec, sub_psize;
+    int r;
+    off_t location;
+
     /* read 1st 512 bytes into buffer */
-    r = read(fd, mbr, MBR_SIZE);
+    r = cimg_pread(fd, mbr, MBR_SIZE, 0);
     if (r != MBR_SIZE) {
-        close(fd);
         fprintf(stderr, READ_ERR);
         return EXIT_FAILURE;
     }
@@ -59,41 +68,14 @@ int partition_finder(char *img, int part_num, int sub_part,
     }
 
 
-    /* check if partition table has valid signature */
-    if (mbr[PART_TABLE_SIG_OFFSET] != VALID_PART_BYTE_ONE || 
-        mbr[PART_TABLE_SIG_OFFSET + 1] != VALID_PART_BYTE_TWO) {
-        close(fd);
-        fprintf(stderr, PSIG_INVAL);
-        return EXIT_FAILURE;
-    }
-
     /* check validity of partition number
        parameter */
     if (part_num < 0 || part_num > 3) {
-        close(fd);
         fprintf(stderr, PNUM_INVAL);
         return EXIT_FAILURE;
     }
-    
-    /* find base of given partition */
-    base = PART_TABLE_OFFSET + (part_num * PART_ENTRY_SIZE);
-    /* this finds type field in partition struct */
-    part_type = mbr[base + PART_TYPE_OFFSET];
-    
-    if (part_type != MINIX_TYPE) {
-        close(fd);
-        fprintf(stderr, TYPE_INVAL);
-        return EXIT_FAILURE;
-    }
-    
-    /* converting 32 bit ints from partition struct 
-       returns with error if part size is 0 */ 
-    first_sec = uint32_convert(&mbr[base + PART_LFIRST_OFFSET]);
-    psize = uint32_convert(&mbr[base + PART_SIZE_OFFSET]);
-
-    if (psize == 0) {
-        close(fd);
-        fprintf(stderr, SIZE_INVAL);
+    if (part_entry(mbr, part_num, PSIG_INVAL,
+                   &first_sec, &psize) == EXIT_FAILURE) {
         return EXIT_FAILURE;
     }
 
@@ -105,26 +87,19 @@ int partition_finder(char *img, int part_num, int sub_part,
            is valid, since a MINIX file system
            is only partitioned in 4 partitions*/
         if (sub_part < 0 || sub_part > 3) {
-            close(fd);
             fprintf(stderr, SPNUM_INVAL);
             return EXIT_FAILURE;
         }
         
-        /* seek to subpartition's partition table
+        /* read subpartition's partition table
            from found partition table */ 
         location = (off_t)first_sec * SECTOR_SIZE;
-        r = lseek(fd, location, SEEK_SET);
-        
-        if (r == (off_t)-1) {
-            close(fd);
+        r = cimg_pread(fd, sub_mbr, MBR_SIZE, location);
+        if (r < 0) {
             fprintf(stderr, SP_TABLE_ERR);
             return EXIT_FAILURE;
         }
-        
-        /* read subpartition table */
-        r = read(fd, sub_mbr, MBR_SIZE);
         if (r != MBR_SIZE) {
-            close(fd);
             fprintf(stderr, READ_ERR);
             return EXIT_FAILURE;
         }
@@ -137,28 +112,8 @@ int partition_finder(char *img, int part_num, int sub_part,
         
         /* repeat steps to check validity of subpartition
            table and find start of disk and part size*/
-        if (sub_mbr[PART_TABLE_SIG_OFFSET] != VALID_PART_BYTE_ONE || 
-            sub_mbr[PART_TABLE_SIG_OFFSET + 1] != VALID_PART_BYTE_TWO) {
-            close(fd);
-            fprintf(stderr, SUB_MBR_INVAL);
-            return EXIT_FAILURE;
-        }
-
-        base = PART_TABLE_OFFSET + sub_part * PART_ENTRY_SIZE;
-
-        sub_type = sub_mbr[base + PART_TYPE_OFFSET];
-        sub_first_sec = uint32_convert(&sub_mbr[base + PART_LFIRST_OFFSET]);
-        sub_psize = uint32_convert(&sub_mbr[base + PART_SIZE_OFFSET]);
-        
-        if (sub_type != MINIX_TYPE) {
-            close(fd);
-            fprintf(stderr, TYPE_INVAL);
-            return EXIT_FAILURE;
-        }
-
-        if (sub_psize == 0) {
-            close(fd);
-            fprintf(stderr, SIZE_INVAL);
+        if (part_entry(sub_mbr, sub_part, SUB_MBR_INVAL,
+                       &sub_first_sec, &sub_psize) == EXIT_FAILURE) {
             return EXIT_FAILURE;
         }
 
@@ -167,7 +122,6 @@ int partition_finder(char *img, int part_num, int sub_part,
         *p_size = sub_psize;
 
 
-        close(fd);
         return EXIT_SUCCESS;
     }
 
@@ -175,23 +129,124 @@ int partition_finder(char *img, int part_num, int sub_part,
     *offset = first_sec;
     *p_size = psize;
 
-    close(fd); 
     return EXIT_SUCCESS;
 }
 
+/* checks the signature of the partition table in "mbr", printing
+   "sig_err" if it is invalid, then checks that entry "num" is a
+   MINIX partition and gives its first sector and size. Works on
+   a table already in memory, so it doesn't matter how it was read */
+int part_entry(uint8_t *mbr, int num, char *sig_err,
+               uint32_t *first_sec, uint32_t *psize) {
+    size_t base;
+
+    /* check if partition table has valid signature */
+    if (mbr[PART_TABLE_SIG_OFFSET] != VALID_PART_BYTE_ONE || 
+        mbr[PART_TABLE_SIG_OFFSET + 1] != VALID_PART_BYTE_TWO) {
+        fprintf(stderr, "%s", sig_err);
+        return EXIT_FAILURE;
+    }
+
+    /* find base of given partition, then
+       the type field in partition struct */
+    base = PART_TABLE_OFFSET + (num * PART_ENTRY_SIZE);
+    if (mbr[base + PART_TYPE_OFFSET] != MINIX_TYPE) {
+        fprintf(stderr, TYPE_INVAL);
+        return EXIT_FAILURE;
+    }
+    
+    /* converting 32 bit ints from partition struct 
+       returns with error if part size is 0 */ 
+    *first_sec = uint32_convert(&mbr[base + PART_LFIRST_OFFSET]);
+    *psize = uint32_convert(&mbr[base + PART_SIZE_OFFSET]);
+    if (*psize == 0) {
+        fprintf(stderr, SIZE_INVAL);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* reads the partition table once and the subpartition table
+   of every MINIX partition once, filling "cands" with every
+   MINIX partition and subpartition found. Returns how many
+   were found or -1 on error */
+int partition_scan(int fd, struct fs_candidate *cands, int isV) {
+    uint8_t mbr[MBR_SIZE];
+    uint8_t sub_mbr[MBR_SIZE];
+    uint32_t first_sec, sub_first_sec;
+    int part, sub_part, count = 0;
+    size_t base, sub_base;
+
+    if (cimg_pread(fd, mbr, MBR_SIZE, 0) != MBR_SIZE) {
+        fprintf(stderr, READ_ERR);
+        return -1;
+    }
+    if(isV){
+        print_part_table(fd, PART_TABLE_OFFSET, NO_PART, NO_PART);
+    }
+    if (mbr[PART_TABLE_SIG_OFFSET] != VALID_PART_BYTE_ONE ||
+        mbr[PART_TABLE_SIG_OFFSET + 1] != VALID_PART_BYTE_TWO) {
+        fprintf(stderr, PSIG_INVAL);
+        return -1;
+    }
+
+    for (part = 0; part < PART_ENTRIES; part++) {
+        base = PART_TABLE_OFFSET + (part * PART_ENTRY_SIZE);
+        if (mbr[base + PART_TYPE_OFFSET] != MINIX_TYPE ||
+            uint32_convert(&mbr[base + PART_SIZE_OFFSET]) == 0) {
+            continue;
+        }
+        first_sec = uint32_convert(&mbr[base + PART_LFIRST_OFFSET]);
+
+        /* the partition itself may hold a file system */
+        cands[count].part = part;
+        cands[count].sub_part = NO_PART;
+        cands[count].first_sec = first_sec;
+        cands[count].fd = fd;
+        cands[count].valid = FALSE;
+        count++;
+
+        /* a partition without a valid subpartition
+           table simply has no subpartitions */
+        if (cimg_pread(fd, sub_mbr, MBR_SIZE,
+                  (off_t)first_sec * SECTOR_SIZE) != MBR_SIZE ||
+            sub_mbr[PART_TABLE_SIG_OFFSET] != VALID_PART_BYTE_ONE ||
+            sub_mbr[PART_TABLE_SIG_OFFSET + 1] != VALID_PART_BYTE_TWO) {
+            continue;
+        }
+        if(isV){
+            print_part_table(fd, (off_t)first_sec * SECTOR_SIZE +
+                             PART_TABLE_OFFSET, NO_PART, part);
+        }
+
+        for (sub_part = 0; sub_part < PART_ENTRIES; sub_part++) {
+            sub_base = PART_TABLE_OFFSET + sub_part * PART_ENTRY_SIZE;
+            if (sub_mbr[sub_base + PART_TYPE_OFFSET] != MINIX_TYPE ||
+                uint32_convert(&sub_mbr[sub_base + PART_SIZE_OFFSET]) == 0) {
+                continue;
+            }
+            sub_first_sec = uint32_convert(
+                                &sub_mbr[sub_base + PART_LFIRST_OFFSET]);
+            cands[count].part = part;
+            cands[count].sub_part = sub_part;
+            cands[count].first_sec = sub_first_sec;
+            cands[count].fd = fd;
+            cands[count].valid = FALSE;
+            count++;
+        }
+    }
+    return count;
+}
+
 /* prints partition table or subpartition table
    depending on values of "part" and "subPart" */
 void print_part_table(int fd, off_t table_offset, int part, int subPart){
     struct partition_entry buf[NUM_PART];
     int i;
 
-    /* seek to table_offset given and read
-       whole partition table */
-    if(lseek(fd, table_offset, SEEK_SET) < 0){
-        fprintf(stderr, FILEERR);
-        return;
-    }
-    if(read(fd, &buf, sizeof(struct partition_entry) * NUM_PART) < 0){
+    /* read whole partition table at table_offset given */
+    if(cimg_pread(fd, &buf, sizeof(struct partition_entry) * NUM_PART,
+             table_offset) < 0){
         fprintf(stderr, FILEERR);
         return;
     }
@@ -1,8 +1,12 @@
+#ifndef PARTITION_H
+#define PARTITION_H
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdint.h>
+#include "cimg.h"
 
 #define MBR_SIZE 512
 #define PART_TABLE_OFFSET 0x1BE
@@ -23,6 +27,24 @@ struct partition_entry {
     uint32_t size; 
 };
 
+#define PART_ENTRIES 4
+#define MAX_CANDIDATES (PART_ENTRIES + PART_ENTRIES * PART_ENTRIES)
+
+/* a partition or subpartition that may hold a file system,
+   "valid" is set once its superblock has been checked */
+struct fs_candidate {
+    int part;
+    int sub_part;
+    uint32_t first_sec;
+    int fd;
+    int valid;
+};
+
 uint32_t uint32_convert(uint8_t *);
 int partition_finder(char *, int, int, uint32_t *, uint32_t *, int);
+int partition_finder_fd(int, int, int, uint32_t *, uint32_t *, int);
+int part_entry(uint8_t *, int, char *, uint32_t *, uint32_t *);
+int partition_scan(int, struct fs_candidate *, int);
 void print_part_table(int, off_t, int, int);
+
+#endif
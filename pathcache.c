@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "pathcache.h"
+#include "hash.h"
+#include "util.h"
+
+static void lru_remove(struct path_cache *, struct pcache_entry *);
+static void lru_push(struct path_cache *, struct pcache_entry *);
+static void pcache_unlink(struct path_cache *, struct pcache_entry *);
+static void pcache_drop_all(struct path_cache *);
+
+/* sets up an empty cache of at most "max_bytes" for the
+   image open at "fd". On error returns EXIT_FAILURE */
+int pcache_init(struct path_cache *pc, int fd, size_t max_bytes){
+    struct timespec now;
+    struct stat st;
+
+    memset(pc, 0, sizeof(struct path_cache));
+    pc->max_bytes = max_bytes;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    pc->checked = now.tv_sec;
+    if(fstat(fd, &st) == 0){
+        pc->mtime = st.st_mtim;
+    }
+    pc->buckets = calloc(PCACHE_BUCKETS, sizeof(struct pcache_entry*));
+    if(pc->buckets == NULL){
+        return EXIT_FAILURE;
+    }
+    pthread_mutex_init(&pc->lock, NULL);
+    return EXIT_SUCCESS;
+}
+
+void pcache_free(struct path_cache *pc){
+    if(pc->buckets == NULL) return;
+    pcache_drop_all(pc);
+    pthread_mutex_destroy(&pc->lock);
+    free(pc->buckets);
+    pc->buckets = NULL;
+}
+
+/* returns TRUE the first time it sees that the image open
+   at "fd" has been written since the cache was filled. The
+   entries stay until "pcache_reset" */
+int pcache_check(struct path_cache *pc, int fd){
+    struct timespec now;
+    struct stat st;
+    int changed = FALSE;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    pthread_mutex_lock(&pc->lock);
+    if(now.tv_sec - pc->checked < PCACHE_CHECK_SECS){
+        pthread_mutex_unlock(&pc->lock);
+        return FALSE;
+    }
+    pc->checked = now.tv_sec;
+    pthread_mutex_unlock(&pc->lock);
+
+    if(fstat(fd, &st) < 0){
+        return FALSE;
+    }
+    pthread_mutex_lock(&pc->lock);
+    if(st.st_mtim.tv_sec != pc->mtime.tv_sec ||
+       st.st_mtim.tv_nsec != pc->mtime.tv_nsec){
+        pc->mtime = st.st_mtim;
+        changed = TRUE;
+    }
+    pthread_mutex_unlock(&pc->lock);
+    return changed;
+}
+
+/* drops every entry, only keeping paths looked up in
+   "generation" from now on */
+void pcache_reset(struct path_cache *pc, uint32_t generation){
+    pthread_mutex_lock(&pc->lock);
+    pcache_drop_all(pc);
+    pc->generation = generation;
+    pthread_mutex_unlock(&pc->lock);
+}
+
+uint32_t pcache_generation(struct path_cache *pc){
+    uint32_t generation;
+
+    pthread_mutex_lock(&pc->lock);
+    generation = pc->generation;
+    pthread_mutex_unlock(&pc->lock);
+    return generation;
+}
+
+/* finds the first "len" bytes of "path" in the cache, setting
+   "ino" and making it the most recently used. Returns TRUE
+   if it was there */
+int pcache_get(struct path_cache *pc, char *path, size_t len,
+               uint32_t *ino){
+    struct pcache_entry *e;
+    uint32_t hash = crc32c_update(0, path, len);
+
+    pthread_mutex_lock(&pc->lock);
+    for(e = pc->buckets[hash & (PCACHE_BUCKETS - 1)];
+        e != NULL; e = e->next){
+        if(e->hash == hash && e->len == len &&
+           memcmp(e->path, path, len) == 0){
+            break;
+        }
+    }
+    if(e == NULL){
+        pthread_mutex_unlock(&pc->lock);
+        return FALSE;
+    }
+    lru_remove(pc, e);
+    lru_push(pc, e);
+    *ino = e->ino;
+    pthread_mutex_unlock(&pc->lock);
+    return TRUE;
+}
+
+/* remembers that the first "len" bytes of "path" name inode
+   "ino", dropping the least recently used entries if that
+   takes the cache over its size. A path looked up in any
+   but the current "generation", or running out of memory,
+   only means the path isn't kept */
+void pcache_put(struct path_cache *pc, char *path, size_t len, uint32_t ino,
+                uint32_t generation){
+    struct pcache_entry *e, **bucket;
+    uint32_t hash = crc32c_update(0, path, len);
+    size_t size = sizeof(struct pcache_entry) + len + 1;
+
+    if(size > pc->max_bytes){
+        return;
+    }
+
+    pthread_mutex_lock(&pc->lock);
+    if(generation != pc->generation){
+        pthread_mutex_unlock(&pc->lock);
+        return;
+    }
+    bucket = &pc->buckets[hash & (PCACHE_BUCKETS - 1)];
+    for(e = *bucket; e != NULL; e = e->next){
+        if(e->hash == hash && e->len == len &&
+           memcmp(e->path, path, len) == 0){
+            e->ino = ino;
+            pthread_mutex_unlock(&pc->lock);
+            return;
+        }
+    }
+
+    while(pc->oldest != NULL && pc->bytes + size > pc->max_bytes){
+        e = pc->oldest;
+        pcache_unlink(pc, e);
+        free(e);
+    }
+    e = malloc(size);
+    if(e == NULL){
+        pthread_mutex_unlock(&pc->lock);
+        return;
+    }
+    e->path = (char*)(e + 1);
+    memcpy(e->path, path, len);
+    e->path[len] = '\0';
+    e->len = len;
+    e->hash = hash;
+    e->ino = ino;
+
+    e->next = *bucket;
+    *bucket = e;
+    lru_push(pc, e);
+    pc->bytes += size;
+    pthread_mutex_unlock(&pc->lock);
+}
+
+/* takes "e" out of the use order */
+static void lru_remove(struct path_cache *pc, struct pcache_entry *e){
+    if(e->newer != NULL){
+        e->newer->older = e->older;
+    }else{
+        pc->newest = e->older;
+    }
+    if(e->older != NULL){
+        e->older->newer = e->newer;
+    }else{
+        pc->oldest = e->newer;
+    }
+}
+
+/* makes "e" the most recently used */
+static void lru_push(struct path_cache *pc, struct pcache_entry *e){
+    e->older = pc->newest;
+    e->newer = NULL;
+    if(pc->newest != NULL){
+        pc->newest->newer = e;
+    }
+    pc->newest = e;
+    if(pc->oldest == NULL){
+        pc->oldest = e;
+    }
+}
+
+/* takes "e" out of its bucket and the use order,
+   with the lock held. Doesn't free it */
+static void pcache_unlink(struct path_cache *pc, struct pcache_entry *e){
+    struct pcache_entry **link;
+
+    for(link = &pc->buckets[e->hash & (PCACHE_BUCKETS - 1)];
+        *link != e; link = &(*link)->next);
+    *link = e->next;
+    lru_remove(pc, e);
+    pc->bytes -= sizeof(struct pcache_entry) + e->len + 1;
+}
+
+static void pcache_drop_all(struct path_cache *pc){
+    struct pcache_entry *e, *older;
+
+    for(e = pc->newest; e != NULL; e = older){
+        older = e->older;
+        free(e);
+    }
+    memset(pc->buckets, 0, sizeof(struct pcache_entry*) * PCACHE_BUCKETS);
+    pc->newest = pc->oldest = NULL;
+    pc->bytes = 0;
+}
@@ -0,0 +1,55 @@
+#ifndef PATHCACHE_H
+#define PATHCACHE_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#define PCACHE_BUCKETS 16384 /* a power of two */
+#define PCACHE_MAX_BYTES (4 * 1024 * 1024)
+#define PCACHE_CHECK_SECS 1
+
+/* one canonical path and the inode it names, 0 if it names
+   nothing. The path is stored right after the entry */
+struct pcache_entry {
+    struct pcache_entry *next;  /* in the same bucket */
+    struct pcache_entry *newer; /* in use order */
+    struct pcache_entry *older;
+    uint32_t hash;
+    uint32_t ino;
+    size_t len;
+    char *path;
+};
+
+/* paths already looked up, so looking one up again is a hash
+   probe with no reads. Missing paths are kept too. Entries
+   are dropped least recently used first once they take more
+   than "max_bytes", and all of them are dropped when the
+   image handle reloads. Only paths looked up in the handle's
+   current "generation" are kept, so a walk that raced a
+   reload can't put back what it dropped. The image's mtime
+   is looked at no more than once every PCACHE_CHECK_SECS,
+   the stat would otherwise cost more than the probe. One
+   lock guards all of it */
+struct path_cache {
+    struct pcache_entry **buckets;
+    struct pcache_entry *newest;
+    struct pcache_entry *oldest;
+    size_t bytes;
+    size_t max_bytes;
+    uint32_t generation;
+    struct timespec mtime;
+    time_t checked;             /* monotonic seconds of the last look */
+    pthread_mutex_t lock;
+};
+
+int pcache_init(struct path_cache *, int, size_t);
+void pcache_free(struct path_cache *);
+int pcache_check(struct path_cache *, int);
+void pcache_reset(struct path_cache *, uint32_t);
+uint32_t pcache_generation(struct path_cache *);
+int pcache_get(struct path_cache *, char *, size_t, uint32_t *);
+void pcache_put(struct path_cache *, char *, size_t, uint32_t, uint32_t);
+
+#endif
@@ -0,0 +1,117 @@
+#include <fcntl.h>
+#include "readahead.h"
+
+/* sets up hints for the image starting at "disk_start",
+   covering "window" bytes ahead of the reader */
+void ra_init(struct readahead *ra, int image, off_t disk_start,
+             uint32_t zone_size, uint32_t window){
+    ra->image = image;
+    ra->disk_start = disk_start;
+    ra->zone_size = zone_size;
+    /* hints about a compressed image's zones would
+       name the wrong bytes of the file */
+    if(cimg_is_compressed(image)){
+        window = 0;
+    }
+    ra->window = window / zone_size;
+    if(window > 0 && ra->window == 0){
+        ra->window = 1;
+    }
+    ra->consumed = 0;
+    ra_start(ra);
+}
+
+/* starts over on a new zone list */
+void ra_start(struct readahead *ra){
+    ra->next = 0;
+    ra->dropped = 0;
+}
+
+/* gives "advice" for "span" zones starting at "zone". Hints
+   are only hints, so failures are ignored */
+void ra_extent(struct readahead *ra, uint32_t zone, uint32_t span,
+               int advice){
+    if(ra->window == 0 || zone == 0 || span == 0) return;
+    posix_fadvise(ra->image,
+                  ra->disk_start + (off_t)ra->zone_size * zone,
+                  (off_t)ra->zone_size * span, advice);
+}
+
+/* hints every zone of "zones" from "pos" up to the window
+   ahead that hasn't been hinted yet, one extent per run of
+   zones next to each other on disk. Holes are skipped */
+void ra_zones(struct readahead *ra, uint32_t *zones, uint32_t num_zones,
+              uint32_t pos){
+    uint32_t i, run, end;
+
+    if(ra->window == 0) return;
+
+    end = pos + ra->window;
+    if(end > num_zones || end < pos){
+        end = num_zones;
+    }
+    i = ra->next > pos ? ra->next : pos;
+    for(; i < end; i += run){
+        run = 1;
+        if(zones[i] == 0) continue;
+        while(i + run < end && zones[i + run] == zones[i] + run){
+            run++;
+        }
+        ra_extent(ra, zones[i], run, POSIX_FADV_WILLNEED);
+    }
+    if(end > ra->next){
+        ra->next = end;
+    }
+}
+
+/* counts "span" zones starting at "zone" as read, dropping
+   them from the page cache once this reader has gone through
+   enough data to count as a large extraction */
+void ra_consume(struct readahead *ra, uint32_t zone, uint32_t span){
+    ra->consumed += (uint64_t)ra->zone_size * span;
+    if(ra->consumed > RA_DROP_AFTER){
+        ra_extent(ra, zone, span, POSIX_FADV_DONTNEED);
+    }
+}
+
+/* marks every zone of "zones" before "upto" as consumed,
+   one extent per run of zones next to each other on disk */
+void ra_done(struct readahead *ra, uint32_t *zones, uint32_t upto){
+    uint32_t i, run;
+
+    for(i = ra->dropped; i < upto; i += run){
+        run = 1;
+        if(zones[i] == 0) continue;
+        while(i + run < upto && zones[i + run] == zones[i] + run){
+            run++;
+        }
+        ra_consume(ra, zones[i], run);
+    }
+    if(upto > ra->dropped){
+        ra->dropped = upto;
+    }
+}
+
+/* hints the first zone of every directory listed in "dir"
+   other than itself and its parent, so a walk finds the
+   next level already on its way in */
+void ra_dirs(struct readahead *ra, struct dir_entry *dir,
+             uint32_t num_entries, struct inode *inode_table,
+             uint32_t ninodes){
+    struct inode *child;
+    uint32_t i;
+
+    if(ra->window == 0) return;
+
+    for(i = 0; i < num_entries; i++){
+        if(dir[i].inode == 0 || dir[i].inode > ninodes) continue;
+        if(dir[i].name[0] == '.' && (dir[i].name[1] == '\0' ||
+           (dir[i].name[1] == '.' && dir[i].name[2] == '\0'))){
+            continue;
+        }
+        child = &inode_table[dir[i].inode - 1];
+        if((child->mode & FILE_TYPE_MASK) == DIR_MASK){
+            ra_extent(ra, child->zone[0], 1, POSIX_FADV_WILLNEED);
+        }
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include "util.h"
+
+#define RA_DEF_WINDOW (4 * 1024 * 1024)
+#define RA_DROP_AFTER (64 * 1024 * 1024)
+#define RA_KIB 1024
+
+/* tells the kernel which parts of the image are about to be
+   read, from zone lists we already have, and which parts are
+   done with. Hints cover "window" zones ahead of the reader,
+   consumed ranges are only dropped from the page cache once
+   more than RA_DROP_AFTER bytes have gone through, so small
+   reads leave the cache warm for the next run */
+struct readahead {
+    int image;
+    off_t disk_start;
+    uint32_t zone_size;
+    uint32_t window;   /* zones to hint ahead, 0 turns hints off */
+    uint32_t next;     /* first zone of the list not hinted yet */
+    uint32_t dropped;  /* first consumed zone not dropped yet */
+    uint64_t consumed;
+};
+
+void ra_init(struct readahead *, int, off_t, uint32_t, uint32_t);
+void ra_start(struct readahead *);
+void ra_extent(struct readahead *, uint32_t, uint32_t, int);
+void ra_zones(struct readahead *, uint32_t *, uint32_t, uint32_t);
+void ra_consume(struct readahead *, uint32_t, uint32_t);
+void ra_done(struct readahead *, uint32_t *, uint32_t);
+void ra_dirs(struct readahead *, struct dir_entry *, uint32_t,
+             struct inode *, uint32_t);
+
+#endif
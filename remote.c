@@ -0,0 +1,122 @@
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <limits.h>
+#include "remote.h"
+
+/* reads one newline terminated line from "fd" into "buf",
+   one byte at a time so nothing past the line is consumed.
+   The newline is replaced with a NULL terminator */
+int read_line(int fd, char *buf, int size){
+    int len = 0;
+    char c;
+
+    while(len < size - 1){
+        if(read(fd, &c, 1) != 1){
+            return EXIT_FAILURE;
+        }
+        if(c == '\n'){
+            buf[len] = '\0';
+            return EXIT_SUCCESS;
+        }
+        buf[len++] = c;
+    }
+    return EXIT_FAILURE;
+}
+
+/* writes all "len" bytes of "buf" to "fd",
+   retrying short writes */
+int write_all(int fd, void *buf, size_t len){
+    ssize_t r;
+    uintptr_t cur = (uintptr_t)buf;
+
+    while(len > 0){
+        r = write(fd, (void*)cur, len);
+        if(r <= 0){
+            return EXIT_FAILURE;
+        }
+        cur += r;
+        len -= r;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* sends one request to the minfsd listening on "sock_path"
+   and copies the reply's payload into "out". An error
+   reply is printed to stderr */
+int remote_request(char *sock_path, char *op, char *image,
+                   int part, int sub_part, char *path, FILE *out){
+    struct sockaddr_un addr;
+    char line[MAX_LINE], request[REQ_FIELDS * MAX_LINE];
+    char full_image[PATH_MAX], *buf;
+    unsigned int size;
+    ssize_t r;
+    int fd;
+
+    /* the server may run from another directory,
+       so always name the image by its full path */
+    if(realpath(image, full_image) == NULL){
+        perror(FILEERR);
+        return EXIT_FAILURE;
+    }
+
+    if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0){
+        perror(SOCKERR);
+        return EXIT_FAILURE;
+    }
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, sock_path, sizeof(addr.sun_path) - 1);
+    if(connect(fd, (struct sockaddr*)&addr,
+               sizeof(struct sockaddr_un)) < 0){
+        perror(CONNERR);
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    if(snprintf(request, sizeof(request), REQ_FORMAT, op, full_image,
+                part, sub_part, path) >= (int)sizeof(request)){
+        fprintf(stderr, NAMEERR "\n");
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    if(write_all(fd, request, strlen(request)) == EXIT_FAILURE ||
+       read_line(fd, line, MAX_LINE) == EXIT_FAILURE){
+        fprintf(stderr, PROTOERR);
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    if(strncmp(line, RESP_ERR, strlen(RESP_ERR)) == 0){
+        fprintf(stderr, "%s\n", line + strlen(RESP_ERR) + 1);
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    if(sscanf(line, RESP_OK_FORMAT, &size) != 1){
+        fprintf(stderr, PROTOERR);
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    buf = malloc(COPY_BUF_SIZE);
+    if(buf == NULL){
+        perror(MALLOCERR);
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    /* copy exactly "size" bytes of payload */
+    while(size > 0){
+        r = read(fd, buf, size < COPY_BUF_SIZE ? size : COPY_BUF_SIZE);
+        if(r <= 0 || fwrite(buf, 1, r, out) != (size_t)r){
+            fprintf(stderr, PROTOERR);
+            free(buf);
+            close(fd);
+            return EXIT_FAILURE;
+        }
+        size -= r;
+    }
+
+    free(buf);
+    close(fd);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,29 @@
+#ifndef REMOTE_H
+#define REMOTE_H
+
+#include "util.h"
+
+/* requests are five newline terminated fields:
+   operation, image path, partition, subpartition and path.
+   Replies are either "OK <size>" followed by exactly
+   size bytes of payload, or "ERR <message>" */
+#define REQ_LIST "LIST"
+#define REQ_STAT "STAT"
+#define REQ_GET "GET"
+#define REQ_FORMAT "%s\n%s\n%d\n%d\n%s\n"
+#define RESP_OK "OK"
+#define RESP_ERR "ERR"
+#define RESP_OK_FORMAT "OK %u\n"
+#define RESP_ERR_FORMAT "ERR %s\n"
+#define REQ_FIELDS 5
+#define MAX_LINE 4096
+#define COPY_BUF_SIZE 65536
+#define SOCKERR "socket error"
+#define CONNERR "couldn't connect to server"
+#define PROTOERR "bad reply from server\n"
+
+int remote_request(char *, char *, char *, int, int, char *, FILE *);
+int read_line(int, char *, int);
+int write_all(int, void *, size_t);
+
+#endif
@@ -0,0 +1,242 @@
+#include "sched.h"
+
+/* orders requests by physical zone so one dispatch
+   is a single sweep across the disk */
+static int request_cmp(const void *a, const void *b){
+    const struct sched_request *ra = a, *rb = b;
+
+    if(ra->zone != rb->zone){
+        return ra->zone < rb->zone ? -1 : 1;
+    }
+    return 0;
+}
+
+/* sets up an empty scheduler reading from the
+   given image, partition start and superblock,
+   hinting "window" bytes ahead of every read.
+   File data is read through "dio" if one is given,
+   which must allow reads of a whole run */
+int sched_init(struct scheduler *sched,
+               int image,
+               struct superblock *super,
+               off_t disk_start,
+               uint32_t window,
+               struct dio *dio){
+    sched->image = image;
+    sched->super = super;
+    sched->disk_start = disk_start;
+    sched->zone_size = super->blocksize << super->log_zone_size;
+    geom_select(super, &sched->geom);
+    ra_init(&sched->ra, image, disk_start, sched->zone_size, window);
+    sched->num_files = 0;
+    sched->num_reqs = 0;
+    sched->reqs_cap = SCHED_INIT_REQS;
+    sched->dio = dio;
+    arena_init(&sched->arena);
+
+    /* a run is at least one zone, even when zones
+       are larger than the preferred run size */
+    sched->files = malloc(sizeof(struct sched_file) * SCHED_MAX_FILES);
+    sched->reqs = malloc(sizeof(struct sched_request) * sched->reqs_cap);
+    if(dio != NULL){
+        sched->run_buf = dio_get_buf(dio);
+    }else{
+        sched->run_buf = bufpool_get(sched->zone_size > SCHED_MAX_RUN ?
+                                     sched->zone_size : SCHED_MAX_RUN);
+    }
+    if(sched->files == NULL || sched->reqs == NULL ||
+       sched->run_buf == NULL){
+        perror(MALLOCERR);
+        sched_free(sched);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* resolves every zone of the given file and queues a
+   request for each one that isn't a hole. The sink is
+   called with the file's data once dispatched.
+   Dispatches on its own if the file table is full */
+int sched_add_file(struct scheduler *sched,
+                   struct inode *node,
+                   sched_sink sink,
+                   void *arg){
+    uint32_t *zones, num_zones, i;
+    struct sched_request *grown;
+
+    if(sched->num_files == SCHED_MAX_FILES){
+        if(sched_dispatch(sched) == EXIT_FAILURE){
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* the zone list only lives until its requests are
+       queued, so it comes from an arena reset per file */
+    arena_reset(&sched->arena);
+    zones = resolve_zones(sched->image, node, sched->disk_start,
+                          &sched->geom, &num_zones, &sched->arena);
+    if(zones == NULL){
+        return EXIT_FAILURE;
+    }
+
+    /* grow request list to fit every zone of this file */
+    if(sched->num_reqs + num_zones > sched->reqs_cap){
+        while(sched->num_reqs + num_zones > sched->reqs_cap){
+            sched->reqs_cap *= 2;
+        }
+        grown = realloc(sched->reqs,
+                        sizeof(struct sched_request) * sched->reqs_cap);
+        if(grown == NULL){
+            perror(MALLOCERR);
+            return EXIT_FAILURE;
+        }
+        sched->reqs = grown;
+    }
+
+    for(i = 0; i < num_zones; i++){
+        /* holes are never read, the sink's
+           file already reads back as zeros there */
+        if(zones[i] == 0) continue;
+
+        sched->reqs[sched->num_reqs].zone = zones[i];
+        sched->reqs[sched->num_reqs].file = sched->num_files;
+        sched->reqs[sched->num_reqs].file_zone = i;
+        sched->num_reqs++;
+    }
+
+    sched->files[sched->num_files].sink = sink;
+    sched->files[sched->num_files].arg = arg;
+    sched->files[sched->num_files].size = node->size;
+    sched->num_files++;
+    return EXIT_SUCCESS;
+}
+
+/* sorts every queued request by zone, merges requests
+   that are next to each other on disk (even across files,
+   and reading through small gaps) into one large read,
+   then hands each zone to the sink of the file it belongs
+   to. Requests up to the readahead window past each run
+   are hinted before it is read. Empties the scheduler
+   afterwards */
+int sched_dispatch(struct scheduler *sched){
+    uint32_t start, end, i, first_zone, span, max_span, offset, len;
+    uint32_t ahead = 0, hint_start;
+    struct sched_request *req;
+    struct sched_file *file;
+    uintptr_t zone_data;
+    void *run_data;
+
+    qsort(sched->reqs, sched->num_reqs,
+          sizeof(struct sched_request), request_cmp);
+
+    max_span = SCHED_MAX_RUN / sched->zone_size;
+    if(max_span == 0) max_span = 1;
+
+    for(start = 0; start < sched->num_reqs; start = end){
+        /* extend run while the next zone is close enough
+           and the run still fits in the run buffer */
+        first_zone = sched->reqs[start].zone;
+        end = start + 1;
+        while(end < sched->num_reqs &&
+              sched->reqs[end].zone - sched->reqs[end - 1].zone
+                <= SCHED_MAX_GAP &&
+              sched->reqs[end].zone - first_zone < max_span){
+            end++;
+        }
+        span = sched->reqs[end - 1].zone - first_zone + 1;
+
+        /* hint every request not hinted yet that is within
+           the window, one extent per run of zones. Anything
+           before this run has already been read */
+        if(ahead < start){
+            ahead = start;
+        }
+        while(sched->ra.window > 0 && ahead < sched->num_reqs &&
+              sched->reqs[ahead].zone - first_zone < sched->ra.window){
+            hint_start = ahead;
+            while(ahead + 1 < sched->num_reqs &&
+                  sched->reqs[ahead + 1].zone ==
+                    sched->reqs[ahead].zone + 1){
+                ahead++;
+            }
+            ra_extent(&sched->ra, sched->reqs[hint_start].zone,
+                      sched->reqs[ahead].zone -
+                        sched->reqs[hint_start].zone + 1,
+                      POSIX_FADV_WILLNEED);
+            ahead++;
+        }
+
+        /* one sequential read for the whole run */
+        if(sched->dio != NULL){
+            run_data = dio_read(sched->dio, sched->run_buf,
+                                (size_t)sched->zone_size * span,
+                                sched->disk_start +
+                                (off_t)sched->zone_size * first_zone);
+        }else if(cimg_pread(sched->image, sched->run_buf,
+                       (size_t)sched->zone_size * span,
+                       sched->disk_start +
+                       (off_t)sched->zone_size * first_zone)
+                       == (ssize_t)sched->zone_size * span){
+            run_data = sched->run_buf;
+        }else{
+            run_data = NULL;
+        }
+        if(run_data == NULL){
+            perror(READERR);
+            return EXIT_FAILURE;
+        }
+
+        /* route each zone in the run to its file */
+        for(i = start; i < end; i++){
+            req = &sched->reqs[i];
+            file = &sched->files[req->file];
+            offset = req->file_zone * sched->zone_size;
+            len = file->size - offset;
+            if(len > sched->zone_size){
+                len = sched->zone_size;
+            }
+            zone_data = (uintptr_t)run_data +
+                        (uintptr_t)sched->zone_size *
+                        (req->zone - first_zone);
+            if(file->sink(file->arg, offset,
+                          (void*)zone_data, len) == EXIT_FAILURE){
+                return EXIT_FAILURE;
+            }
+        }
+        ra_consume(&sched->ra, first_zone, span);
+    }
+
+    sched->num_reqs = 0;
+    sched->num_files = 0;
+    return EXIT_SUCCESS;
+}
+
+/* frees everything the scheduler allocated */
+void sched_free(struct scheduler *sched){
+    free(sched->files);
+    free(sched->reqs);
+    if(sched->dio != NULL){
+        dio_put_buf(sched->dio, sched->run_buf);
+    }else{
+        bufpool_put(sched->run_buf, sched->zone_size > SCHED_MAX_RUN ?
+                                    sched->zone_size : SCHED_MAX_RUN);
+    }
+    arena_destroy(&sched->arena);
+    sched->files = NULL;
+    sched->reqs = NULL;
+    sched->run_buf = NULL;
+}
+
+/* sink that writes zone data at its offset into a seekable
+   FILE given as the argument. The write goes straight to its
+   descriptor, with no seek and no copy through the FILE's
+   buffer, so nothing else may be written through the FILE */
+int sched_file_sink(void *arg, uint32_t offset, void *data, uint32_t len){
+    FILE *out = (FILE*)arg;
+
+    if(pwrite(fileno(out), data, len, offset) != (ssize_t)len){
+        perror(FILEERR);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,55 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include "util.h"
+#include "readahead.h"
+#include "dio.h"
+#include "bufpool.h"
+
+#define SCHED_MAX_RUN (1024 * 1024)
+#define SCHED_MAX_GAP 8
+#define SCHED_MAX_FILES 256
+#define SCHED_INIT_REQS 1024
+
+/* called once for every zone of a scheduled file with
+   the offset into that file, the data and how many
+   bytes of it belong to the file */
+typedef int (*sched_sink)(void *, uint32_t, void *, uint32_t);
+
+struct sched_file {
+    sched_sink sink;
+    void *arg;
+    uint32_t size;
+};
+
+struct sched_request {
+    uint32_t zone;      /* physical zone number on disk */
+    uint32_t file;      /* index into the scheduler's files */
+    uint32_t file_zone; /* zone index inside that file */
+};
+
+struct scheduler {
+    int image;
+    struct superblock *super;
+    off_t disk_start;
+    uint32_t zone_size;
+    struct zone_geom geom;
+    struct sched_file *files;
+    uint32_t num_files;
+    struct sched_request *reqs;
+    uint32_t num_reqs;
+    uint32_t reqs_cap;
+    void *run_buf;
+    struct arena arena;
+    struct readahead ra;
+    struct dio *dio;    /* reads runs directly when not NULL */
+};
+
+int sched_init(struct scheduler *, int, struct superblock *, off_t,
+               uint32_t, struct dio *);
+int sched_add_file(struct scheduler *, struct inode *, sched_sink, void *);
+int sched_dispatch(struct scheduler *);
+void sched_free(struct scheduler *);
+int sched_file_sink(void *, uint32_t, void *, uint32_t);
+
+#endif
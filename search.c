@@ -0,0 +1,118 @@
+#include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "search.h"
+
+static pthread_once_t search_once = PTHREAD_ONCE_INIT;
+static int search_avx2;
+
+static void search_setup(void){
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    search_avx2 = __builtin_cpu_supports("avx2");
+#endif
+}
+
+void search_init(struct searcher *s, const char *pat, size_t len){
+    pthread_once(&search_once, search_setup);
+    s->pat = (const unsigned char*)pat;
+    s->len = len;
+}
+
+/* checks every start position from "i" on one at a time,
+   used for whatever is left after the vector loops */
+static const unsigned char *find_tail(struct searcher *s,
+                                      const unsigned char *buf,
+                                      size_t i, size_t n){
+    const unsigned char *p;
+
+    while(i + s->len <= n){
+        p = memchr(buf + i, s->pat[0], n - s->len + 1 - i);
+        if(p == NULL){
+            return NULL;
+        }
+        if(memcmp(p, s->pat, s->len) == 0){
+            return p;
+        }
+        i = p - buf + 1;
+    }
+    return NULL;
+}
+
+#if defined(__x86_64__)
+/* compares the first and last byte of the pattern against
+   16 start positions at once and only checks the whole
+   pattern where both match */
+static const unsigned char *find_sse2(struct searcher *s,
+                                      const unsigned char *buf, size_t n){
+    __m128i first = _mm_set1_epi8(s->pat[0]);
+    __m128i last = _mm_set1_epi8(s->pat[s->len - 1]);
+    __m128i a, b;
+    uint32_t mask, bit;
+    size_t i;
+
+    for(i = 0; i + s->len - 1 + 16 <= n; i += 16){
+        a = _mm_loadu_si128((const __m128i*)(buf + i));
+        b = _mm_loadu_si128((const __m128i*)(buf + i + s->len - 1));
+        mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                               _mm_cmpeq_epi8(b, last)));
+        while(mask != 0){
+            bit = __builtin_ctz(mask);
+            if(memcmp(buf + i + bit + 1, s->pat + 1, s->len - 2) == 0){
+                return buf + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return find_tail(s, buf, i, n);
+}
+
+/* the same filter 32 start positions at a time */
+__attribute__((target("avx2")))
+static const unsigned char *find_avx2(struct searcher *s,
+                                      const unsigned char *buf, size_t n){
+    __m256i first = _mm256_set1_epi8(s->pat[0]);
+    __m256i last = _mm256_set1_epi8(s->pat[s->len - 1]);
+    __m256i a, b;
+    uint32_t mask, bit;
+    size_t i;
+
+    for(i = 0; i + s->len - 1 + 32 <= n; i += 32){
+        a = _mm256_loadu_si256((const __m256i*)(buf + i));
+        b = _mm256_loadu_si256((const __m256i*)(buf + i + s->len - 1));
+        mask = _mm256_movemask_epi8(
+                   _mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                                    _mm256_cmpeq_epi8(b, last)));
+        while(mask != 0){
+            bit = __builtin_ctz(mask);
+            if(memcmp(buf + i + bit + 1, s->pat + 1, s->len - 2) == 0){
+                return buf + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return find_tail(s, buf, i, n);
+}
+#endif
+
+/* returns where the pattern first starts in the "n" bytes
+   of "buf", or NULL if it doesn't occur there */
+const unsigned char *search_find(struct searcher *s,
+                                 const unsigned char *buf, size_t n){
+    if(s->len == 0 || s->len > n){
+        return NULL;
+    }
+    if(s->len == 1){
+        return memchr(buf, s->pat[0], n);
+    }
+#if defined(__x86_64__)
+    if(search_avx2){
+        return find_avx2(s, buf, n);
+    }
+    return find_sse2(s, buf, n);
+#else
+    return find_tail(s, buf, 0, n);
+#endif
+}
@@ -0,0 +1,18 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/* a fixed string to look for, "pat" is
+   borrowed and must outlive the searcher */
+struct searcher {
+    const unsigned char *pat;
+    size_t len;
+};
+
+void search_init(struct searcher *, const char *, size_t);
+const unsigned char *search_find(struct searcher *, const unsigned char *,
+                                 size_t);
+
+#endif
@@ -0,0 +1,796 @@
+#include "stream.h"
+
+/* an image read front to back exactly once, through a
+   buffer so skipping ahead costs no more than reading */
+struct stream_in {
+    int fd;
+    off_t pos; /* bytes of the image used up */
+    unsigned char *buf;
+    size_t len;
+    size_t off;
+};
+
+/* everything one pass over the image needs. Zones still
+   wanted are kept in a heap by zone number, so the next
+   one to come is always on top. The last "ring_slots"
+   zones to pass are kept in a ring, indexed by zone
+   number, for anything found to be needed just after it
+   went by */
+struct stream_state {
+    struct stream_in in;
+    off_t disk_start;
+    struct superblock super;
+    struct zone_geom geom;
+    struct inode *inode_table;
+    struct stream_node *nodes;
+    struct stream_req *heap;
+    uint32_t num_reqs;
+    uint32_t reqs_cap;
+    unsigned char *ring;
+    uint32_t *ring_zones;
+    uint32_t ring_slots;
+    uint32_t next_zone;   /* first zone that hasn't passed */
+    char **tokens;        /* source path components */
+    int num_tokens;
+    char *target_path;
+    int isR;
+    uint32_t outstanding; /* wanted directories and data still to come */
+    FILE *spool;          /* the single file to stdout, until the end */
+    int cache_fd;
+    uint32_t cache_ino;
+    uint32_t num_written;
+    uint32_t num_late;
+};
+
+static int add_req(struct stream_state *, uint32_t, uint32_t,
+                   uint32_t, uint32_t);
+static int want(struct stream_state *, uint32_t, int, char *);
+
+/* copies "len" bytes found "at" bytes into the image to "dst",
+   skipping everything before them. Nothing before what has
+   already been read can be read again */
+static int in_read(struct stream_in *in, off_t at, void *dst, size_t len){
+    unsigned char *out = dst;
+    ssize_t got;
+    size_t chunk;
+
+    if(at < in->pos){
+        fprintf(stderr, "%s\n", STREAM_BACKERR);
+        return EXIT_FAILURE;
+    }
+    while(in->pos < at || len > 0){
+        if(in->off == in->len){
+            got = read(in->fd, in->buf, STREAM_BUF_SIZE);
+            if(got < 0 && errno == EINTR) continue;
+            if(got < 0){
+                perror(READERR);
+                return EXIT_FAILURE;
+            }
+            if(got == 0){
+                fprintf(stderr, "%s\n", STREAM_SHORTERR);
+                return EXIT_FAILURE;
+            }
+            in->len = got;
+            in->off = 0;
+        }
+
+        chunk = in->len - in->off;
+        if(in->pos < at){
+            if((off_t)chunk > at - in->pos){
+                chunk = at - in->pos;
+            }
+        }else{
+            if(chunk > len){
+                chunk = len;
+            }
+            memcpy(out, in->buf + in->off, chunk);
+            out += chunk;
+            len -= chunk;
+        }
+        in->off += chunk;
+        in->pos += chunk;
+    }
+    return EXIT_SUCCESS;
+}
+
+static void heap_push(struct stream_state *state, struct stream_req *req){
+    struct stream_req *heap = state->heap;
+    uint32_t pos = state->num_reqs++, parent;
+
+    while(pos > 0){
+        parent = (pos - 1) / 2;
+        if(heap[parent].zone <= req->zone) break;
+        heap[pos] = heap[parent];
+        pos = parent;
+    }
+    heap[pos] = *req;
+}
+
+static void heap_pop(struct stream_state *state, struct stream_req *res){
+    struct stream_req *heap = state->heap, last;
+    uint32_t pos = 0, child, size;
+
+    *res = heap[0];
+    size = --state->num_reqs;
+    last = heap[size];
+    while((child = pos * 2 + 1) < size){
+        if(child + 1 < size && heap[child + 1].zone < heap[child].zone){
+            child++;
+        }
+        if(last.zone <= heap[child].zone) break;
+        heap[pos] = heap[child];
+        pos = child;
+    }
+    heap[pos] = last;
+}
+
+/* one more zone or table "ino" waits on. A wanted
+   file can't be finished until its tables pass */
+static void node_wait(struct stream_state *state, uint32_t ino){
+    struct inode *node = &state->inode_table[ino - 1];
+
+    state->nodes[ino].pending++;
+    if(state->nodes[ino].wanted &&
+       (node->mode & FILE_TYPE_MASK) == REG_MASK){
+        state->outstanding++;
+    }
+}
+
+/* adds every wanted entry of directory "ino" now that all of
+   it has passed. On the source path only the next component
+   is wanted, past the end of it everything is */
+static int parse_dir(struct stream_state *state, uint32_t ino){
+    struct stream_node *node = &state->nodes[ino];
+    struct dir_entry *entry = node->data;
+    char name[NAME_SIZE + 1], *child_path;
+    uint32_t num_entries, i;
+    int found = FALSE, status = EXIT_SUCCESS;
+
+    num_entries = state->inode_table[ino - 1].size /
+                  sizeof(struct dir_entry);
+    for(i = 0; i < num_entries; i++, entry++){
+        if(entry->inode == 0) continue;
+        if(entry->inode > state->super.ninodes){
+            perror(INODEERR);
+            return EXIT_FAILURE;
+        }
+
+        /* names are only NULL terminated when shorter
+           than the full name size */
+        memcpy(name, entry->name, NAME_SIZE);
+        name[NAME_SIZE] = '\0';
+
+        if(node->depth < state->num_tokens){
+            if(strcmp(name, state->tokens[node->depth]) != 0) continue;
+            found = TRUE;
+            status = want(state, entry->inode, node->depth + 1,
+                          node->depth + 1 == state->num_tokens ?
+                          state->target_path : NULL);
+            break;
+        }
+
+        if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+        if(!name_is_safe(name)){
+            fprintf(stderr, "%s: %s\n", node->path, UNSAFEERR);
+            continue;
+        }
+        child_path = malloc(strlen(node->path) + strlen(name) + 2);
+        if(child_path == NULL){
+            perror(MALLOCERR);
+            return EXIT_FAILURE;
+        }
+        sprintf(child_path, "%s/%s", node->path, name);
+        status = want(state, entry->inode, state->num_tokens + 1,
+                      child_path);
+        free(child_path);
+        if(status == EXIT_FAILURE){
+            return EXIT_FAILURE;
+        }
+    }
+
+    if(node->depth < state->num_tokens){
+        if(!found){
+            perror(FILENOTFOUNDERR);
+            return EXIT_FAILURE;
+        }
+        if(status == EXIT_FAILURE){
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* a directory is only parsed once */
+    free(node->data);
+    node->data = NULL;
+    state->outstanding--;
+    return EXIT_SUCCESS;
+}
+
+/* one zone or table "ino" waited on has passed. A
+   wanted directory is parsed once all of it has */
+static int node_done(struct stream_state *state, uint32_t ino){
+    struct stream_node *node = &state->nodes[ino];
+    struct inode *inode = &state->inode_table[ino - 1];
+
+    node->pending--;
+    if(!node->wanted){
+        return EXIT_SUCCESS;
+    }
+    if((inode->mode & FILE_TYPE_MASK) == REG_MASK){
+        state->outstanding--;
+        return EXIT_SUCCESS;
+    }
+    if(node->pending == 0){
+        return parse_dir(state, ino);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* zone "index" of "ino" is "zone", known now that the table
+   listing it has passed. A directory waits for it, a wanted
+   file writes it when it comes */
+static int learn_zone(struct stream_state *state, uint32_t ino,
+                      uint32_t index, uint32_t zone){
+    struct inode *inode = &state->inode_table[ino - 1];
+
+    state->nodes[ino].zones[index - DIRECT_ZONES] = zone;
+    if(zone == 0){
+        return EXIT_SUCCESS;
+    }
+    if((inode->mode & FILE_TYPE_MASK) == DIR_MASK){
+        node_wait(state, ino);
+        return add_req(state, zone, ino, index, STREAM_DIR);
+    }
+    if(state->nodes[ino].wanted){
+        return add_req(state, zone, ino, index, STREAM_DATA);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* learns every zone number in an indirect table, or waits
+   for every table a double indirect table lists */
+static int learn_table(struct stream_state *state, struct stream_req *req,
+                       uint32_t *table){
+    struct inode *inode = &state->inode_table[req->ino - 1];
+    uint32_t count, per_table = state->geom.per_table, first, i;
+
+    count = geom_zone_count(&state->geom, inode->size);
+    if(req->index == 1){
+        for(i = 0; i < per_table &&
+                   DIRECT_ZONES + per_table * (i + 1) < count; i++){
+            if(table[i] == 0) continue;
+            node_wait(state, req->ino);
+            if(add_req(state, table[i], req->ino, i + 2,
+                       STREAM_TABLE) == EXIT_FAILURE){
+                return EXIT_FAILURE;
+            }
+        }
+        return EXIT_SUCCESS;
+    }
+
+    first = DIRECT_ZONES;
+    if(req->index > 0){
+        first += per_table * (req->index - 1);
+    }
+    for(i = 0; i < per_table && first + i < count; i++){
+        if(learn_zone(state, req->ino, first + i,
+                      table[i]) == EXIT_FAILURE){
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/* writes one zone of a wanted file at its place in the file.
+   The file last written to is kept open, a file's zones
+   mostly come one after another */
+static int write_zone(struct stream_state *state, struct stream_req *req,
+                      void *data){
+    struct stream_node *node = &state->nodes[req->ino];
+    struct inode *inode = &state->inode_table[req->ino - 1];
+    off_t offset = (off_t)req->index * state->geom.zone_size;
+    size_t len = state->geom.zone_size;
+    int fd;
+
+    state->outstanding--;
+    if(offset >= inode->size){
+        return EXIT_SUCCESS;
+    }
+    if((size_t)(inode->size - offset) < len){
+        len = inode->size - offset;
+    }
+
+    if(node->path == NULL){
+        fd = fileno(state->spool);
+    }else if(state->cache_fd >= 0 && state->cache_ino == req->ino){
+        fd = state->cache_fd;
+    }else{
+        if(state->cache_fd >= 0){
+            close(state->cache_fd);
+        }
+        state->cache_fd = open(node->path, O_WRONLY);
+        state->cache_ino = req->ino;
+        if(state->cache_fd < 0){
+            perror(FILEERR);
+            return EXIT_FAILURE;
+        }
+        fd = state->cache_fd;
+    }
+
+    if(pwrite(fd, data, len, offset) != (ssize_t)len){
+        perror(FILEERR);
+        return EXIT_FAILURE;
+    }
+    state->num_written++;
+    return EXIT_SUCCESS;
+}
+
+/* does whatever "req" was queued for with its zone's data */
+static int handle(struct stream_state *state, struct stream_req *req,
+                  void *data){
+    struct stream_node *node = &state->nodes[req->ino];
+
+    switch(req->kind){
+    case STREAM_DIR:
+        memcpy((unsigned char*)node->data +
+               (size_t)req->index * state->geom.zone_size,
+               data, state->geom.zone_size);
+        return node_done(state, req->ino);
+    case STREAM_TABLE:
+        if(learn_table(state, req, data) == EXIT_FAILURE){
+            return EXIT_FAILURE;
+        }
+        return node_done(state, req->ino);
+    default:
+        return write_zone(state, req, data);
+    }
+}
+
+/* waits for "zone" to pass, for "kind" of use. A zone that
+   has already passed is taken from the window if it is still
+   there, there is no going back for it otherwise */
+static int add_req(struct stream_state *state, uint32_t zone,
+                   uint32_t ino, uint32_t index, uint32_t kind){
+    struct stream_req req, *grown;
+    uint32_t slot;
+
+    if(zone >= state->super.zones){
+        fprintf(stderr, "%s\n", STREAM_ZONEERR);
+        return EXIT_FAILURE;
+    }
+    req.zone = zone;
+    req.ino = ino;
+    req.index = index;
+    req.kind = kind;
+    if(kind == STREAM_DATA){
+        state->outstanding++;
+    }
+
+    if(zone < state->next_zone){
+        slot = zone % state->ring_slots;
+        if(state->ring_zones[slot] != zone){
+            fprintf(stderr, STREAM_MISSERR, zone);
+            return EXIT_FAILURE;
+        }
+        state->num_late++;
+        return handle(state, &req, state->ring +
+                      (size_t)slot * state->geom.zone_size);
+    }
+
+    if(state->num_reqs == state->reqs_cap){
+        state->reqs_cap *= 2;
+        grown = realloc(state->heap,
+                        sizeof(struct stream_req) * state->reqs_cap);
+        if(grown == NULL){
+            perror(MALLOCERR);
+            return EXIT_FAILURE;
+        }
+        state->heap = grown;
+    }
+    heap_push(state, &req);
+    return EXIT_SUCCESS;
+}
+
+/* inode "ino" is wanted, "depth" components down the source
+   path or past its end. The end of the path goes to "path",
+   which for a file may be NULL to mean stdout, and everything
+   below it goes to a path made from it */
+static int want(struct stream_state *state, uint32_t ino, int depth,
+                char *path){
+    struct stream_node *node = &state->nodes[ino];
+    struct inode *inode = &state->inode_table[ino - 1];
+    uint32_t count, i, zone;
+    int fd;
+
+    if((inode->mode & FILE_TYPE_MASK) == DIR_MASK){
+        /* its contents are freed once parsed. Below the
+           path a second name for it, in a corrupt image,
+           is left out the way a loop is */
+        if(node->wanted){
+            if(depth > state->num_tokens){
+                return EXIT_SUCCESS;
+            }
+            fprintf(stderr, "%s\n", STREAM_LOOPERR);
+            return EXIT_FAILURE;
+        }
+        if(depth >= state->num_tokens){
+            if(depth == state->num_tokens && !state->isR){
+                fprintf(stderr, LS_TYPE_INVAL);
+                return EXIT_FAILURE;
+            }
+            if(path == NULL){
+                path = STREAM_DEF_DEST;
+            }
+            if(mkdir(path, STREAM_DIR_PERMS) < 0 && errno != EEXIST){
+                perror(STREAM_MKDIRERR);
+                return EXIT_FAILURE;
+            }
+            node->path = strdup(path);
+            if(node->path == NULL){
+                perror(MALLOCERR);
+                return EXIT_FAILURE;
+            }
+        }
+        node->wanted = TRUE;
+        node->depth = depth;
+        state->outstanding++;
+        if(node->pending == 0){
+            return parse_dir(state, ino);
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if((inode->mode & FILE_TYPE_MASK) != REG_MASK){
+        /* other types below the path are skipped quietly */
+        if(depth > state->num_tokens){
+            return EXIT_SUCCESS;
+        }
+        fprintf(stderr, LS_TYPE_INVAL);
+        return EXIT_FAILURE;
+    }
+    if(depth < state->num_tokens){
+        perror(DIRERR);
+        return EXIT_FAILURE;
+    }
+
+    /* another name for a file already wanted */
+    if(node->wanted){
+        unlink(path);
+        if(link(node->path, path) < 0){
+            perror(FILEERR);
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    /* the file is made at its full size straight away,
+       holes and anything past the last zone are zeros */
+    if(path == NULL){
+        state->spool = tmpfile();
+        if(state->spool == NULL){
+            perror(FILEERR);
+            return EXIT_FAILURE;
+        }
+        fd = fileno(state->spool);
+    }else{
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, STREAM_FILE_PERMS);
+        node->path = strdup(path);
+        if(fd < 0 || node->path == NULL){
+            perror(FILEERR);
+            if(fd >= 0) close(fd);
+            return EXIT_FAILURE;
+        }
+    }
+    if(ftruncate(fd, inode->size) < 0){
+        perror(FILEERR);
+        if(path != NULL) close(fd);
+        return EXIT_FAILURE;
+    }
+    if(path != NULL){
+        close(fd);
+    }
+
+    /* every zone already known is waited for now,
+       the rest as their tables pass */
+    node->wanted = TRUE;
+    node->depth = depth;
+    state->outstanding += node->pending;
+    count = geom_zone_count(&state->geom, inode->size);
+    for(i = 0; i < count; i++){
+        if(i < DIRECT_ZONES){
+            zone = inode->zone[i];
+        }else{
+            zone = node->zones[i - DIRECT_ZONES];
+        }
+        if(zone != 0 &&
+           add_req(state, zone, ino, i, STREAM_DATA) == EXIT_FAILURE){
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/* waits for every directory zone and every table of inode
+   "ino" as metadata, whether it turns out to be wanted or
+   not, so where a directory or table sits in the image
+   never matters */
+static int add_node(struct stream_state *state, uint32_t ino){
+    struct stream_node *node = &state->nodes[ino];
+    struct inode *inode = &state->inode_table[ino - 1];
+    uint32_t count, i;
+    int isDir;
+
+    isDir = (inode->mode & FILE_TYPE_MASK) == DIR_MASK;
+    if(inode->links == 0 ||
+       (!isDir && (inode->mode & FILE_TYPE_MASK) != REG_MASK)){
+        return EXIT_SUCCESS;
+    }
+    if(inode->size > state->geom.max_file){
+        perror(TOOBIG);
+        return EXIT_FAILURE;
+    }
+
+    count = geom_zone_count(&state->geom, inode->size);
+    if(count > DIRECT_ZONES){
+        node->zones = calloc(count - DIRECT_ZONES, sizeof(uint32_t));
+        if(node->zones == NULL){
+            perror(MALLOCERR);
+            return EXIT_FAILURE;
+        }
+    }
+    if(isDir){
+        node->data = calloc(count ? count : 1, state->geom.zone_size);
+        if(node->data == NULL){
+            perror(MALLOCERR);
+            return EXIT_FAILURE;
+        }
+        for(i = 0; i < count && i < DIRECT_ZONES; i++){
+            if(inode->zone[i] == 0) continue;
+            node->pending++;
+            if(add_req(state, inode->zone[i], ino, i,
+                       STREAM_DIR) == EXIT_FAILURE){
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    /* a missing table means every zone it would hold is a hole */
+    if(count > DIRECT_ZONES && inode->indirect != 0){
+        node->pending++;
+        if(add_req(state, inode->indirect, ino, 0,
+                   STREAM_TABLE) == EXIT_FAILURE){
+            return EXIT_FAILURE;
+        }
+    }
+    if(count > DIRECT_ZONES + state->geom.per_table &&
+       inode->two_indirect != 0){
+        node->pending++;
+        if(add_req(state, inode->two_indirect, ino, 1,
+                   STREAM_TABLE) == EXIT_FAILURE){
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/* reads the partition tables, superblock and inode table
+   as they pass, then waits on every directory and table */
+static int stream_start(struct stream_state *state, int part, int sub_part,
+                        uint32_t window, int isV){
+    uint8_t mbr[MBR_SIZE];
+    uint32_t first_sec, psize, ino;
+    size_t table_size;
+
+    if(part != NO_PART){
+        if(in_read(&state->in, 0, mbr, MBR_SIZE) == EXIT_FAILURE ||
+           part_entry(mbr, part, PSIG_INVAL,
+                      &first_sec, &psize) == EXIT_FAILURE){
+            return EXIT_FAILURE;
+        }
+        if(sub_part != NO_PART){
+            if(in_read(&state->in, (off_t)first_sec * SECTOR_SIZE,
+                       mbr, MBR_SIZE) == EXIT_FAILURE ||
+               part_entry(mbr, sub_part, SUB_MBR_INVAL,
+                          &first_sec, &psize) == EXIT_FAILURE){
+                return EXIT_FAILURE;
+            }
+        }
+        state->disk_start = (off_t)first_sec * SECTOR_SIZE;
+    }
+
+    if(in_read(&state->in, state->disk_start + SUPEROFF, &state->super,
+               sizeof(struct superblock)) == EXIT_FAILURE){
+        return EXIT_FAILURE;
+    }
+    if(state->super.magic != SUPMAGIC){
+        perror(SUPERERR);
+        return EXIT_FAILURE;
+    }
+    if(isV){
+        print_superblock(&state->super);
+    }
+    geom_select(&state->super, &state->geom);
+
+    table_size = sizeof(struct inode) * state->super.ninodes;
+    state->inode_table = malloc(table_size);
+    state->nodes = calloc(state->super.ninodes + 1,
+                          sizeof(struct stream_node));
+    if(state->inode_table == NULL || state->nodes == NULL){
+        perror(MALLOCERR);
+        return EXIT_FAILURE;
+    }
+    if(in_read(&state->in, get_inode_table_start(&state->super,
+                                                 state->disk_start),
+               state->inode_table, table_size) == EXIT_FAILURE){
+        return EXIT_FAILURE;
+    }
+
+    /* zones only start being kept after the inode table */
+    state->next_zone = (state->in.pos - state->disk_start +
+                        state->geom.zone_size - 1) / state->geom.zone_size;
+    state->ring_slots = window / state->geom.zone_size;
+    if(state->ring_slots == 0){
+        state->ring_slots = 1;
+    }
+    state->ring = malloc((size_t)state->ring_slots * state->geom.zone_size);
+    state->ring_zones = calloc(state->ring_slots, sizeof(uint32_t));
+    if(state->ring == NULL || state->ring_zones == NULL){
+        perror(MALLOCERR);
+        return EXIT_FAILURE;
+    }
+
+    for(ino = 1; ino <= state->super.ninodes; ino++){
+        if(add_node(state, ino) == EXIT_FAILURE){
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/* reads on until nothing wanted is left, keeping the last
+   zones to pass in the window */
+static int stream_run(struct stream_state *state){
+    struct stream_req req;
+    uint32_t zone, slot, zone_size = state->geom.zone_size;
+
+    while(state->outstanding > 0){
+        if(state->num_reqs == 0){
+            fprintf(stderr, "%s\n", STREAM_SHORTERR);
+            return EXIT_FAILURE;
+        }
+        zone = state->heap[0].zone;
+
+        /* zones too far back to stay in the window are skipped */
+        if(zone - state->next_zone >= state->ring_slots){
+            state->next_zone = zone - state->ring_slots + 1;
+        }
+        while(state->next_zone <= zone){
+            slot = state->next_zone % state->ring_slots;
+            if(in_read(&state->in, state->disk_start +
+                       (off_t)zone_size * state->next_zone,
+                       state->ring + (size_t)slot * zone_size,
+                       zone_size) == EXIT_FAILURE){
+                return EXIT_FAILURE;
+            }
+            state->ring_zones[slot] = state->next_zone++;
+        }
+
+        slot = zone % state->ring_slots;
+        while(state->num_reqs > 0 && state->heap[0].zone == zone){
+            heap_pop(state, &req);
+            if(handle(state, &req, state->ring +
+                      (size_t)slot * zone_size) == EXIT_FAILURE){
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/* copies the spooled file to stdout once all of it is there */
+static int stream_spool_out(FILE *spool){
+    char buf[STREAM_COPY_SIZE];
+    size_t got;
+
+    rewind(spool);
+    while((got = fread(buf, 1, STREAM_COPY_SIZE, spool)) > 0){
+        if(fwrite(buf, 1, got, stdout) != got){
+            perror(FILEERR);
+            return EXIT_FAILURE;
+        }
+    }
+    if(ferror(spool) || fflush(stdout) != 0){
+        perror(FILEERR);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* extracts "src" from an image read once, in order, from
+   "fd", as a pipe or decompressor gives it. A regular file
+   goes to "dest_path" or stdout, a directory is extracted
+   under "dest_path" when "isR" is set. Every directory and
+   table is kept as it passes and file data is written as it
+   comes, so only data needed after it has passed has to be
+   within the last "window" bytes */
+int stream_extract(int fd, int part, int sub_part, char *src,
+                   char *dest_path, int isR, uint32_t window, int isV){
+    struct stream_state state;
+    char *save, *token;
+    uint32_t i;
+    int status;
+
+    memset(&state, 0, sizeof(struct stream_state));
+    state.in.fd = fd;
+    state.isR = isR;
+    state.target_path = dest_path;
+    state.cache_fd = -1;
+    state.reqs_cap = STREAM_INIT_REQS;
+    state.in.buf = malloc(STREAM_BUF_SIZE);
+    state.heap = malloc(sizeof(struct stream_req) * state.reqs_cap);
+    state.tokens = malloc(sizeof(char*) * (strlen(src) / 2 + 1));
+    if(state.in.buf == NULL || state.heap == NULL || state.tokens == NULL){
+        perror(MALLOCERR);
+        free(state.in.buf);
+        free(state.heap);
+        free(state.tokens);
+        return EXIT_FAILURE;
+    }
+
+    /* every component of the path, which "src" is split into.
+       A directory can't be gone back to once it has passed,
+       so "." and ".." are resolved here rather than looked up */
+    status = EXIT_SUCCESS;
+    for(token = strtok_r(src, PATH_DELIM, &save); token != NULL;
+        token = strtok_r(NULL, PATH_DELIM, &save)){
+        if(strcmp(token, ".") == 0) continue;
+        if(strcmp(token, "..") == 0){
+            if(state.num_tokens > 0) state.num_tokens--;
+            continue;
+        }
+        if(strlen(token) > NAME_SIZE){
+            perror(NAMEERR);
+            status = EXIT_FAILURE;
+        }
+        state.tokens[state.num_tokens++] = token;
+    }
+
+    if(status == EXIT_SUCCESS){
+        status = stream_start(&state, part, sub_part, window, isV);
+    }
+    if(status == EXIT_SUCCESS){
+        status = want(&state, 1, 0, state.num_tokens == 0 ?
+                                    dest_path : NULL);
+    }
+    if(status == EXIT_SUCCESS){
+        status = stream_run(&state);
+    }
+    if(state.cache_fd >= 0){
+        close(state.cache_fd);
+    }
+    if(status == EXIT_SUCCESS && state.spool != NULL){
+        status = stream_spool_out(state.spool);
+    }
+    if(isV){
+        fprintf(stderr, STREAM_PRINT, (unsigned long long)state.in.pos,
+                state.num_written, state.num_late);
+    }
+
+    if(state.spool != NULL){
+        fclose(state.spool);
+    }
+    if(state.nodes != NULL){
+        for(i = 0; i <= state.super.ninodes; i++){
+            free(state.nodes[i].path);
+            free(state.nodes[i].zones);
+            free(state.nodes[i].data);
+        }
+    }
+    free(state.nodes);
+    free(state.inode_table);
+    free(state.ring);
+    free(state.ring_zones);
+    free(state.in.buf);
+    free(state.heap);
+    free(state.tokens);
+    return status;
+}
@@ -0,0 +1,57 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include "util.h"
+#include "partition.h"
+
+#define STREAM_BUF_SIZE (1024 * 1024)
+#define STREAM_INIT_REQS 1024
+#define STREAM_DIR_PERMS 0755
+#define STREAM_FILE_PERMS 0666
+#define STREAM_COPY_SIZE 65536
+#define STREAM_DEF_DEST "."
+#define STREAM_BACKERR "image stream needs data it has already passed"
+#define STREAM_SHORTERR "image stream ended early"
+#define STREAM_ZONEERR "zone number out of range"
+#define STREAM_MISSERR "zone %u was needed after it passed, " \
+                       "try a larger window with -w\n"
+#define STREAM_MKDIRERR "mkdir error"
+#define STREAM_LOOPERR "source path reaches a directory twice"
+#define STREAM_PRINT "%llu bytes read, %u zones written, " \
+                     "%u from the reorder window\n"
+
+/* what a queued zone is for */
+#define STREAM_DIR 0   /* part of a directory, kept until parsed */
+#define STREAM_TABLE 1 /* an indirect table of a file or directory */
+#define STREAM_DATA 2  /* file data, written out as it passes */
+
+/* a zone wanted from further along the stream. For data
+   and directories "index" is the zone's place in its
+   file. For tables 0 is the indirect table, 1 the double
+   indirect table and 2 and up the tables it lists */
+struct stream_req {
+    uint32_t zone;
+    uint32_t ino;
+    uint32_t index;
+    uint32_t kind;
+};
+
+/* what is known about one inode so far. Every directory's
+   contents and every table are kept as they pass, they are
+   metadata. "zones" holds zone numbers past the direct ones
+   once their tables have passed */
+struct stream_node {
+    char *path;       /* host path, NULL for the single file to stdout */
+    uint32_t *zones;
+    void *data;       /* a directory's contents */
+    uint32_t pending; /* zones and tables of a directory still to pass */
+    int depth;        /* source path components matched to reach it */
+    int wanted;       /* a directory only ever is once */
+};
+
+int stream_extract(int, int, int, char *, char *, int, uint32_t, int);
+
+#endif
@@ -0,0 +1,342 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "image.h"
+#include "hash.h"
+
+#define OPTSTR "j:n:p:s:"
+#define USAGE "Usage: [ -j threads ] [ -n rounds ] [ -p part [ -s subpart ] ] " \
+              "imagefile\n"
+#define PARTERR "partition must be between 0-3\n"
+#define SUBPARTERR "subpartition must be between 0-3\n"
+#define JOBERR "number of threads must be at least 1\n"
+#define ROUNDERR "number of rounds must be at least 1\n"
+#define MISMATCH_PRINT "%s: %s differs from the single threaded pass\n"
+#define STRESS_PRINT "%u paths, %d threads, %d rounds, %u mismatches\n"
+#define MAX_PART 4
+#define DEF_THREADS 8
+#define DEF_ROUNDS 4
+#define INIT_ITEMS 256
+
+/* what a single thread found for one path, the
+   reference every thread's answer is checked against */
+struct stress_item {
+    char *path;
+    uint32_t ino;
+    uint32_t zones_crc;
+    uint32_t dir_crc;
+    uint32_t data_crc;  /* through the zone cache */
+    uint32_t raw_crc;   /* straight from the image */
+};
+
+struct stress_state {
+    struct image_handle *img;
+    struct stress_item *items;
+    uint32_t num_items;
+    uint32_t items_cap;
+    uint8_t *visited;
+    int rounds;
+    int num_threads;
+    int next_thread;
+    uint32_t mismatches;
+    pthread_mutex_t lock;
+};
+
+void *worker(void *);
+int collect(struct stress_state *, struct image_handle *, uint32_t, char *);
+int check_item(struct image_handle *, struct stress_item *, void *);
+void mismatch(struct stress_state *, char *, char *);
+
+int main(int argc, char *argv[]) {
+    int option, i, part = NO_PART, sub_part = NO_PART;
+    extern int optind;
+    extern char *optarg;
+    struct stress_state state;
+    struct image_handle *ref;
+    pthread_t *threads;
+    uint32_t j;
+    void *buf;
+
+    memset(&state, 0, sizeof(struct stress_state));
+    state.num_threads = DEF_THREADS;
+    state.rounds = DEF_ROUNDS;
+
+    while ((option = getopt(argc, argv, OPTSTR)) != EOF) {
+        switch (option)
+        {
+        case 'j':
+            state.num_threads = strtol(optarg, NULL, 10);
+            if (state.num_threads < 1) {
+                fprintf(stderr, JOBERR);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'n':
+            state.rounds = strtol(optarg, NULL, 10);
+            if (state.rounds < 1) {
+                fprintf(stderr, ROUNDERR);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'p':
+            part = strtol(optarg, NULL, 10);
+            if (part < 0 || part >= MAX_PART) {
+                fprintf(stderr, PARTERR);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 's':
+            sub_part = strtol(optarg, NULL, 10);
+            if (sub_part < 0 || sub_part >= MAX_PART) {
+                fprintf(stderr, SUBPARTERR);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            fprintf(stderr, USAGE);
+            return EXIT_FAILURE;
+            break;
+        }
+    }
+    if (argc != optind + 1 || (part == NO_PART && sub_part != NO_PART)) {
+        fprintf(stderr, USAGE);
+        return EXIT_FAILURE;
+    }
+
+    /* the reference pass gets a handle of its own, so the
+       threads start from caches as cold as a fresh open */
+    ref = image_open(argv[optind], part, sub_part, FALSE);
+    state.img = image_open(argv[optind], part, sub_part, FALSE);
+    if (ref == NULL || state.img == NULL) {
+        image_close(ref);
+        image_close(state.img);
+        return EXIT_FAILURE;
+    }
+    state.visited = calloc(ref->super->ninodes + 1, 1);
+    buf = malloc(ref->zone_size);
+    if (state.visited == NULL || buf == NULL) {
+        perror(MALLOCERR);
+        free(state.visited);
+        free(buf);
+        image_close(ref);
+        image_close(state.img);
+        return EXIT_FAILURE;
+    }
+
+    state.visited[ROOT_INODE] = TRUE;
+    option = collect(&state, ref, ROOT_INODE, "/");
+    free(state.visited);
+    for (j = 0; option == EXIT_SUCCESS && j < state.num_items; j++) {
+        state.items[j].ino = image_lookup(ref, state.items[j].path);
+        option = check_item(ref, &state.items[j], buf);
+    }
+    free(buf);
+    image_close(ref);
+
+    pthread_mutex_init(&state.lock, NULL);
+    threads = malloc(sizeof(pthread_t) * state.num_threads);
+    if (option == EXIT_SUCCESS && threads == NULL) {
+        perror(MALLOCERR);
+        option = EXIT_FAILURE;
+    }
+    for (i = 0; option == EXIT_SUCCESS && i < state.num_threads; i++) {
+        if (pthread_create(&threads[i], NULL, worker, &state) != 0) {
+            perror(JOBERR);
+            state.num_threads = i;
+            option = EXIT_FAILURE;
+        }
+    }
+    for (i = 0; threads != NULL && i < state.num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (option == EXIT_SUCCESS) {
+        printf(STRESS_PRINT, state.num_items, state.num_threads,
+               state.rounds, state.mismatches);
+        if (state.mismatches > 0) {
+            option = EXIT_FAILURE;
+        }
+    }
+    for (j = 0; j < state.num_items; j++) {
+        free(state.items[j].path);
+    }
+    free(state.items);
+    free(threads);
+    pthread_mutex_destroy(&state.lock);
+    image_close(state.img);
+    return option;
+}
+
+/* adds "path_name", inode "ino" of "img", and everything
+   under it to the paths to check. A directory is only walked
+   once, so a loop in a corrupt image ends */
+int collect(struct stress_state *state, struct image_handle *img,
+            uint32_t ino, char *path_name) {
+    struct inode *node = &img->inode_table[ino - 1];
+    struct stress_item *grown;
+    struct dir_entry *dir;
+    uint32_t num_entries, i, child_ino;
+    char name[NAME_SIZE + 1], *child;
+
+    if (state->num_items == state->items_cap) {
+        state->items_cap = state->items_cap ? state->items_cap * 2
+                                            : INIT_ITEMS;
+        grown = realloc(state->items,
+                        sizeof(struct stress_item) * state->items_cap);
+        if (grown == NULL) {
+            perror(MALLOCERR);
+            return EXIT_FAILURE;
+        }
+        state->items = grown;
+    }
+    memset(&state->items[state->num_items], 0, sizeof(struct stress_item));
+    state->items[state->num_items].path = strdup(path_name);
+    if (state->items[state->num_items].path == NULL) {
+        perror(MALLOCERR);
+        return EXIT_FAILURE;
+    }
+    state->num_items++;
+
+    if ((node->mode & FILE_TYPE_MASK) != DIR_MASK) {
+        return EXIT_SUCCESS;
+    }
+    dir = image_get_dir(img, ino, NULL);
+    if (dir == NULL) {
+        return EXIT_FAILURE;
+    }
+    num_entries = node->size / sizeof(struct dir_entry);
+    for (i = 0; i < num_entries; i++) {
+        child_ino = dir[i].inode;
+        if (child_ino == 0 || child_ino > img->super->ninodes) {
+            continue;
+        }
+        memcpy(name, dir[i].name, NAME_SIZE);
+        name[NAME_SIZE] = '\0';
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+            !name_is_safe(name)) {
+            continue;
+        }
+        node = &img->inode_table[child_ino - 1];
+        if ((node->mode & FILE_TYPE_MASK) == DIR_MASK) {
+            if (state->visited[child_ino]) continue;
+            state->visited[child_ino] = TRUE;
+        }
+
+        child = malloc(strlen(path_name) + strlen(name) + 2);
+        if (child == NULL) {
+            perror(MALLOCERR);
+            return EXIT_FAILURE;
+        }
+        sprintf(child, "%s%s%s", path_name,
+                path_name[strlen(path_name) - 1] == SLASH ? "" : "/", name);
+        if (collect(state, img, child_ino, child) == EXIT_FAILURE) {
+            free(child);
+            return EXIT_FAILURE;
+        }
+        free(child);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* fills in every checksum of "item" from "img". Every zone is
+   read both through the zone cache and straight from the
+   image, so both paths are hammered at once */
+int check_item(struct image_handle *img, struct stress_item *item,
+               void *buf) {
+    struct inode node;
+    struct dir_entry *dir;
+    uint32_t *zones, num_zones, i, len, remaining;
+
+    if (item->ino == NO_INODE) {
+        return EXIT_FAILURE;
+    }
+    zones = image_get_zones(img, item->ino, &num_zones, &node);
+    if (zones == NULL) {
+        return EXIT_FAILURE;
+    }
+    item->zones_crc = crc32c_update(0, zones, sizeof(uint32_t) * num_zones);
+
+    item->dir_crc = 0;
+    if ((node.mode & FILE_TYPE_MASK) == DIR_MASK) {
+        dir = image_get_dir(img, item->ino, &node);
+        if (dir == NULL) {
+            return EXIT_FAILURE;
+        }
+        item->dir_crc = crc32c_update(0, dir, node.size);
+    }
+
+    item->data_crc = item->raw_crc = 0;
+    remaining = node.size;
+    for (i = 0; i < num_zones && remaining > 0; i++) {
+        len = remaining < img->zone_size ? remaining : img->zone_size;
+        remaining -= len;
+        if (image_read_zone(img, zones[i], buf) == EXIT_FAILURE) {
+            return EXIT_FAILURE;
+        }
+        item->data_crc = crc32c_update(item->data_crc, buf, len);
+        if (zones[i] != 0 &&
+            cimg_pread(img->fd, buf, img->zone_size, img->disk_start +
+                       (off_t)img->zone_size * zones[i]) !=
+            (ssize_t)img->zone_size) {
+            return EXIT_FAILURE;
+        }
+        item->raw_crc = crc32c_update(item->raw_crc, buf, len);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* checks every path "rounds" times, each thread starting
+   at a different place so they collide on different
+   directories and zones */
+void *worker(void *arg) {
+    struct stress_state *state = arg;
+    struct stress_item got, *want;
+    uint32_t i, start, generation;
+    int round;
+    void *buf;
+
+    pthread_mutex_lock(&state->lock);
+    start = state->num_items ? state->num_items / state->num_threads *
+                               state->next_thread++ : 0;
+    pthread_mutex_unlock(&state->lock);
+
+    buf = malloc(state->img->zone_size);
+    if (buf == NULL) {
+        perror(MALLOCERR);
+        mismatch(state, "", MALLOCERR);
+        return NULL;
+    }
+    for (round = 0; round < state->rounds; round++) {
+        for (i = 0; i < state->num_items; i++) {
+            want = &state->items[(start + i) % state->num_items];
+            got = *want;
+            generation = image_enter(state->img);
+            got.ino = image_lookup(state->img, want->path);
+            if (got.ino != want->ino) {
+                mismatch(state, want->path, "inode");
+            } else if (check_item(state->img, &got, buf) == EXIT_FAILURE) {
+                mismatch(state, want->path, READERR);
+            } else if (got.zones_crc != want->zones_crc) {
+                mismatch(state, want->path, "zone list");
+            } else if (got.dir_crc != want->dir_crc) {
+                mismatch(state, want->path, "directory");
+            } else if (got.data_crc != want->data_crc ||
+                       got.raw_crc != want->raw_crc) {
+                mismatch(state, want->path, "data");
+            }
+            image_leave(state->img, generation);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+void mismatch(struct stress_state *state, char *path, char *what) {
+    pthread_mutex_lock(&state->lock);
+    fprintf(stderr, MISMATCH_PRINT, path, what);
+    state->mismatches++;
+    pthread_mutex_unlock(&state->lock);
+}
@@ -1,12 +1,15 @@
 
+#include <errno.h>
 #include "util.h"
 
 
-/* seeks and reads one zone of a file
-   given the start of the whole disk,
-   the zone size and index into the given
-   buffer. */
-int read_zone(FILE *image, 
+/* reads one zone of a file given the
+   start of the whole disk, the zone size
+   and index into the given buffer.
+   Uses a positional read, so the image's
+   file offset is never moved and many
+   threads can read the same image at once */
+int read_zone(int image, 
               off_t disk_start, 
               uint32_t zone_size, 
               uint32_t zone_index, 
@@ -19,15 +22,11 @@ int read_zone(FILE *image,
         return EXIT_SUCCESS;
     }
 
-    /* seek to correct zone from given information*/
-    if(fseek(image, disk_start + (zone_size * zone_index), SEEK_SET) < 0){
-        perror(FILEERR);
-        return EXIT_FAILURE;
-    }
-
-    /* read into the buffer given assuming 
-       it has at least zone_size space in it*/
-    if(fread((void*)buf, zone_size, 1, image) <= 0){
+    /* read correct zone from given information into the
+       buffer given assuming it has at least zone_size
+       space in it*/
+    if(cimg_pread(image, buf, zone_size,
+             disk_start + (off_t)zone_size * zone_index) != (ssize_t)zone_size){
         perror(READERR);
         return EXIT_FAILURE;
     }
@@ -35,21 +34,147 @@ int read_zone(FILE *image,
     return EXIT_SUCCESS;
 }
 
+/* resolves every zone of "node" past the direct ones into "res"
+   one indirect table at a time, copying whole tables at once
+   so no zone needs a division to find its table. "PER_TABLE"
+   is the number of zone numbers in an indirect table, a
+   constant in the specialized kernels so every full table
+   is a fixed size copy and the loops have fixed bounds */
+#define DEFINE_RESOLVE(name, PER_TABLE)                                  \
+static int name(int image, struct inode *node, off_t disk_start,        \
+                struct zone_geom *geom, uint32_t count, uint32_t *res,  \
+                uint32_t *table, uint32_t *double_table){               \
+    uint32_t i = DIRECT_ZONES, j, n;                                     \
+                                                                         \
+    /* indirect zones, a missing table means                             \
+       every zone it would hold is a hole */                             \
+    if(i < count){                                                       \
+        if(read_zone(image, disk_start, geom->zone_size,                 \
+                     node->indirect, table) == EXIT_FAILURE){            \
+            return EXIT_FAILURE;                                         \
+        }                                                                \
+        if(count - i >= (PER_TABLE)){                                    \
+            memcpy(&res[i], table, sizeof(uint32_t) * (PER_TABLE));      \
+            i += (PER_TABLE);                                            \
+        }else{                                                           \
+            n = count - i;                                               \
+            memcpy(&res[i], table, sizeof(uint32_t) * n);                \
+            i += n;                                                      \
+        }                                                                \
+    }                                                                    \
+                                                                         \
+    /* double indirect zones, one indirect table                         \
+       from the double indirect table at a time */                       \
+    if(i < count){                                                       \
+        if(read_zone(image, disk_start, geom->zone_size,                 \
+                     node->two_indirect, double_table) == EXIT_FAILURE){ \
+            return EXIT_FAILURE;                                         \
+        }                                                                \
+        for(j = 0; i < count; j++){                                      \
+            if(j >= (PER_TABLE)){                                        \
+                perror(TOOBIG);                                          \
+                return EXIT_FAILURE;                                     \
+            }                                                            \
+            if(read_zone(image, disk_start, geom->zone_size,             \
+                         double_table[j], table) == EXIT_FAILURE){       \
+                return EXIT_FAILURE;                                     \
+            }                                                            \
+            if(count - i >= (PER_TABLE)){                                \
+                memcpy(&res[i], table, sizeof(uint32_t) * (PER_TABLE));  \
+                i += (PER_TABLE);                                        \
+            }else{                                                       \
+                n = count - i;                                           \
+                memcpy(&res[i], table, sizeof(uint32_t) * n);            \
+                i += n;                                                  \
+            }                                                            \
+        }                                                                \
+    }                                                                    \
+    return EXIT_SUCCESS;                                                 \
+}
+
+DEFINE_RESOLVE(resolve_1k, 1024 / sizeof(uint32_t))
+DEFINE_RESOLVE(resolve_4k, 4096 / sizeof(uint32_t))
+DEFINE_RESOLVE(resolve_8k, 8192 / sizeof(uint32_t))
+DEFINE_RESOLVE(resolve_generic, geom->per_table)
+
+/* picks the zone geometry of a file system once, using a
+   kernel built for its block size when zones are one block
+   and the generic kernel for anything else */
+void geom_select(struct superblock *super, struct zone_geom *geom){
+    uint32_t shift;
+
+    geom->zone_size = super->blocksize << super->log_zone_size;
+    geom->per_table = super->blocksize / sizeof(uint32_t);
+    geom->max_file = super->max_file;
+
+    /* zone sizes are powers of two on any real file system,
+       but fall back to dividing if one isn't */
+    geom->zone_shift = NO_SHIFT;
+    for(shift = 0; shift < 32; shift++){
+        if(((uint32_t)1 << shift) == geom->zone_size){
+            geom->zone_shift = shift;
+            break;
+        }
+    }
+
+    geom->resolve = resolve_generic;
+    if(super->log_zone_size == 0 && geom->zone_shift != NO_SHIFT){
+        switch(super->blocksize){
+        case 1024:
+            geom->resolve = resolve_1k;
+            break;
+        case 4096:
+            geom->resolve = resolve_4k;
+            break;
+        case 8192:
+            geom->resolve = resolve_8k;
+            break;
+        }
+    }
+}
+
+/* returns how many zones a file of "size" bytes spans */
+uint32_t geom_zone_count(struct zone_geom *geom, uint32_t size){
+    if(geom->zone_shift != NO_SHIFT){
+        return ((uint64_t)size + geom->zone_size - 1) >> geom->zone_shift;
+    }
+    return ((uint64_t)size + geom->zone_size - 1) / geom->zone_size;
+}
+
+/* returns how many zones of "zones" from "i" on, before
+   "num_zones" and no more than "max_run", are either
+   contiguous on disk or holes in a row, so they can be read
+   (or zeroed) at once. Always at least 1 */
+uint32_t next_run(uint32_t *zones, uint32_t i, uint32_t num_zones,
+                  uint32_t max_run){
+    uint32_t run = 1;
+
+    while(i + run < num_zones && run < max_run &&
+          ((zones[i] == 0 && zones[i + run] == 0) ||
+           (zones[i] != 0 && zones[i + run] == zones[i] + run))){
+        run++;
+    }
+    return run;
+}
+
 /* given an inode and neccessary information to traverse
    the MINIX file system, it creates and returns a pointer
    to an allocated block of all data in said file with
    some extra space if the size isn't a multiple
    of the zone size.
+   The block comes from "arena" when one is given and is
+   released with it, otherwise the caller frees it.
    On error returns NULL */
-void *read_file(FILE *image, 
+void *read_file(int image, 
                 struct inode *node, 
                 struct superblock *super, 
-                off_t disk_start){
-    int num_zones, i, cur_zone, indirect_num_zones, double_table_index;
-    intptr_t res_offset;
+                off_t disk_start,
+                struct arena *arena){
+    struct zone_geom geom;
+    struct arena_mark mark;
+    uint32_t *zones, num_zones, i;
+    uintptr_t res_offset;
     void *res;
-    uint32_t *indirect_zone_table = NULL, *double_indirect_table = NULL;
-    uint32_t zone_size = super->blocksize << super->log_zone_size;
 
     /* checks if file has a valid size before trying to read it*/
     if(node->size > super->max_file){
@@ -57,166 +182,280 @@ void *read_file(FILE *image,
         return NULL;
     }
 
-    /* calculates how many zone numbers an indirect zone block
-       holds from the blocksize, rounding down */
-    indirect_num_zones = super->blocksize / sizeof(uint32_t);
-
-    /* calculates zones allocated to file from given size
-       by doing floor division on zone_size, rounding up*/
-    num_zones = (node->size + zone_size - 1) / zone_size;
-
     /* allocates resulting pointer with full 
        possible file size allocated */
-    res = malloc((size_t)zone_size * num_zones);
+    geom_select(super, &geom);
+    num_zones = geom_zone_count(&geom, node->size);
+    res = op_alloc(arena, (size_t)geom.zone_size * num_zones);
     if(res == NULL){
         perror(MALLOCERR);
         return NULL;
     }
 
-    /* iterate through each zone, reading into the
-       resulting pointer one zone index at a time
+    /* resolve every zone number up front, so the read
+       loop below never has to work out which table a
+       zone is in. The list is only needed until then */
+    if(arena != NULL){
+        arena_save(arena, &mark);
+    }
+    zones = resolve_zones(image, node, disk_start, &geom,
+                          &num_zones, arena);
+    if(zones == NULL){
+        op_free(arena, res);
+        return NULL;
+    }
+
+    /* read each zone into the result in file order
        using the "read_zone" function */
+    res_offset = (uintptr_t)res;
     for(i = 0; i < num_zones; i++){
-        /* check for which zone number to take from, being either
-           from the direct, indirect or double_indirect zones*/
-        if(i < DIRECT_ZONES){
-            /* direct */
-            cur_zone = node->zone[i];
-        }else if(i < indirect_num_zones + DIRECT_ZONES){
-            /* indirect */
-
-            /* checks if the indirect table zone has been read yet
-               then reads it if it hasn't before continuing*/
-            if(indirect_zone_table == NULL){
-                indirect_zone_table = malloc(zone_size);
-                if(indirect_zone_table == NULL){
-                    free(res);
-                    perror(MALLOCERR);
-                    return NULL;
-                }
+        if(read_zone(image,
+                     disk_start, 
+                     geom.zone_size,
+                     zones[i], 
+                     (void*)res_offset) == EXIT_FAILURE){
+            op_free(arena, zones);
+            op_free(arena, res);
+            return NULL;
+        }
+        res_offset += geom.zone_size;
+    }
 
-                if(read_zone(image,
-                        disk_start, 
-                        zone_size,
-                        node->indirect, 
-                        indirect_zone_table) == EXIT_FAILURE){
-                    free(res);
-                    free(indirect_zone_table);
-                    return NULL;
-                }
-            }
+    op_free(arena, zones);
+    if(arena != NULL){
+        arena_restore(arena, &mark);
+    }
+    return res;
+}
 
-            cur_zone = indirect_zone_table[i - DIRECT_ZONES];
-        }else{
-            /* two_indirect */
-
-            /* if double_indirect table hasn't been read,
-               read it and initialize index */
-            if(double_indirect_table == NULL){
-                double_indirect_table = malloc(zone_size);
-                if(double_indirect_table == NULL){
-                    free(res);
-                    free(indirect_zone_table);
-                    perror(MALLOCERR);
-                    return NULL;
-                }
+/* given an inode, resolves every zone of the file
+   (direct, indirect and double indirect) into one
+   allocated array of physical zone numbers in file order,
+   with 0 marking a hole, using the kernel picked for
+   "geom". The number of entries is written to "num_zones".
+   The array comes from "arena" when one is given,
+   otherwise the caller frees it.
+   On error returns NULL */
+uint32_t *resolve_zones(int image,
+                        struct inode *node,
+                        off_t disk_start,
+                        struct zone_geom *geom,
+                        uint32_t *num_zones,
+                        struct arena *arena){
+    uint32_t i, count;
+    uint32_t *res, *indirect_zone_table, *double_indirect_table;
+
+    /* checks if file has a valid size before resolving it */
+    if(node->size > geom->max_file){
+        perror(TOOBIG);
+        return NULL;
+    }
+    count = geom_zone_count(geom, node->size);
 
-                if(read_zone(image,
-                        disk_start, 
-                        zone_size,
-                        node->two_indirect, 
-                        double_indirect_table) == EXIT_FAILURE){
-                    free(res);
-                    free(indirect_zone_table);
-                    free(double_indirect_table);
-                    return NULL;
-                }
+    /* allocate at least one entry so an empty file
+       still returns a valid pointer */
+    res = op_alloc(arena, sizeof(uint32_t) * (count ? count : 1));
+    if(res == NULL){
+        perror(MALLOCERR);
+        return NULL;
+    }
 
-                double_table_index = 0;
-            }
+    /* direct zones */
+    for(i = 0; i < count && i < DIRECT_ZONES; i++){
+        res[i] = node->zone[i];
+    }
 
-            /* if needed, read new table from zone in double indirect table*/
-            if((i - DIRECT_ZONES) % indirect_num_zones == 0){
-
-                /* free previous table, then check if the index is too large*/
-                free(indirect_zone_table);
-                if(double_table_index >= indirect_num_zones){
-                    /* should realistically never happen
-                       due to the max_file in the superblock*/
-                    perror(TOOBIG);
-                    free(res);
-                    free(double_indirect_table);
-                    return NULL;
-                }
+    /* tables are only needed past the direct zones */
+    if(i < count){
+        indirect_zone_table = arena_get_table(arena, geom->zone_size);
+        double_indirect_table = arena_get_table(arena, geom->zone_size);
+        if(indirect_zone_table == NULL || double_indirect_table == NULL){
+            perror(MALLOCERR);
+            op_free(arena, res);
+            arena_put_table(arena, indirect_zone_table, geom->zone_size);
+            arena_put_table(arena, double_indirect_table, geom->zone_size);
+            return NULL;
+        }
+        if(geom->resolve(image, node, disk_start, geom, count, res,
+                         indirect_zone_table,
+                         double_indirect_table) == EXIT_FAILURE){
+            op_free(arena, res);
+            arena_put_table(arena, indirect_zone_table, geom->zone_size);
+            arena_put_table(arena, double_indirect_table, geom->zone_size);
+            return NULL;
+        }
+        arena_put_table(arena, indirect_zone_table, geom->zone_size);
+        arena_put_table(arena, double_indirect_table, geom->zone_size);
+    }
 
-                /* allocate zone to read indirect table 
-                   into then read it using the value in
-                   the double indirect table index */
-                indirect_zone_table = malloc(zone_size);
-                if(indirect_zone_table == NULL){
-                    free(res);
-                    free(double_indirect_table);
-                    perror(MALLOCERR);
-                    return NULL;
-                }
-                if(read_zone(image,
-                        disk_start, 
-                        zone_size,
-                        double_indirect_table[double_table_index], 
-                        indirect_zone_table) == EXIT_FAILURE){
-                    free(res);
-                    free(indirect_zone_table);
-                    free(double_indirect_table);
-                    return NULL;
-                }
+    *num_zones = count;
+    return res;
+}
 
-                /* increment double indirect table index for next iteration */
-                double_table_index++;
+/* resolves every zone of the file the same as
+   "resolve_zones", picking the geometry from the
+   superblock first.
+   On error returns NULL */
+uint32_t *get_zone_list(int image,
+                        struct inode *node,
+                        struct superblock *super,
+                        off_t disk_start,
+                        uint32_t *num_zones,
+                        struct arena *arena){
+    struct zone_geom geom;
+
+    geom_select(super, &geom);
+    return resolve_zones(image, node, disk_start, &geom, num_zones, arena);
+}
+
+/* sets "it" up to walk the entries of directory "dir". Its
+   zone and table buffers come from "arena" when one is given
+   and go back to it on "dir_iter_close", which must be called
+   even when the walk stops early */
+int dir_iter_open(struct dir_iter *it,
+                  int image,
+                  struct inode *dir,
+                  struct superblock *super,
+                  off_t disk_start,
+                  struct arena *arena){
+    memset(it, 0, sizeof(struct dir_iter));
+
+    /* checks if file has a valid size before walking it */
+    if(dir->size > super->max_file){
+        perror(TOOBIG);
+        return EXIT_FAILURE;
+    }
+
+    it->image = image;
+    it->disk_start = disk_start;
+    it->node = *dir;
+    it->arena = arena;
+    geom_select(super, &it->geom);
+    it->num_zones = geom_zone_count(&it->geom, dir->size);
+    it->remaining = dir->size;
+
+    it->buf = arena_get_table(arena, it->geom.zone_size);
+    it->table = arena_get_table(arena, it->geom.zone_size);
+    it->double_table = arena_get_table(arena, it->geom.zone_size);
+    if(it->buf == NULL || it->table == NULL || it->double_table == NULL){
+        perror(MALLOCERR);
+        dir_iter_close(it);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* finds physical zone "index" of the directory, reading the
+   indirect table it is listed in only when that isn't the
+   table already held. Zones are walked in order, so every
+   table is read once */
+static int dir_iter_zone(struct dir_iter *it, uint32_t index,
+                         uint32_t *zone){
+    uint32_t per_table = it->geom.per_table, table_zone;
+
+    if(index < DIRECT_ZONES){
+        *zone = it->node.zone[index];
+        return EXIT_SUCCESS;
+    }
+    index -= DIRECT_ZONES;
+
+    if(index < per_table){
+        table_zone = it->node.indirect;
+    }else{
+        index -= per_table;
+        if(index / per_table >= per_table){
+            perror(TOOBIG);
+            return EXIT_FAILURE;
+        }
+
+        /* the double indirect table is read with the first
+           zone past the indirect ones */
+        if(!it->has_double){
+            if(read_zone(it->image, it->disk_start, it->geom.zone_size,
+                         it->node.two_indirect,
+                         it->double_table) == EXIT_FAILURE){
+                return EXIT_FAILURE;
             }
+            it->has_double = TRUE;
+        }
+        table_zone = it->double_table[index / per_table];
+        index %= per_table;
+    }
 
-            /* calculate index in current indirect table
-               from increasing value for i that goes over 
-               "indirect_num_zones" */
-            cur_zone = indirect_zone_table[(i - DIRECT_ZONES) %
-                                            indirect_num_zones];
+    /* a missing table means every zone it would hold is a hole */
+    if(table_zone == 0){
+        *zone = 0;
+        return EXIT_SUCCESS;
+    }
+    if(table_zone != it->table_zone){
+        if(read_zone(it->image, it->disk_start, it->geom.zone_size,
+                     table_zone, it->table) == EXIT_FAILURE){
+            return EXIT_FAILURE;
         }
+        it->table_zone = table_zone;
+    }
+    *zone = it->table[index];
+    return EXIT_SUCCESS;
+}
 
-        /* calculate full offset to the current zone 
-           to read into result then read zone */
-        res_offset = (intptr_t)res + zone_size * i;
-        if(read_zone(image,
-                     disk_start, 
-                     zone_size,
-                     cur_zone, 
-                     (void*)res_offset) == EXIT_FAILURE){
-            free(res);
-            free(indirect_zone_table);
-            free(double_indirect_table);
+/* returns the next entry of the directory that isn't deleted,
+   reading the next zone once the current one is used up. The
+   entry is only valid until the next call. Returns NULL at the
+   end of the directory, or on error with "failed" set */
+struct dir_entry *dir_iter_next(struct dir_iter *it){
+    struct dir_entry *entry;
+    uint32_t zone, len;
+
+    while(TRUE){
+        while(it->next_entry < it->num_entries){
+            entry = &it->buf[it->next_entry++];
+            if(entry->inode != 0){
+                return entry;
+            }
+        }
+        if(it->failed || it->next_zone >= it->num_zones){
+            return NULL;
+        }
+
+        if(dir_iter_zone(it, it->next_zone, &zone) == EXIT_FAILURE){
+            it->failed = TRUE;
+            return NULL;
+        }
+        it->next_zone++;
+        len = it->remaining < it->geom.zone_size ? it->remaining
+                                                 : it->geom.zone_size;
+        it->remaining -= len;
+        it->next_entry = 0;
+        it->num_entries = 0;
+
+        /* a hole holds no entries, so isn't read */
+        if(zone == 0) continue;
+        if(read_zone(it->image, it->disk_start, it->geom.zone_size,
+                     zone, it->buf) == EXIT_FAILURE){
+            it->failed = TRUE;
             return NULL;
         }
+        it->num_entries = (len + sizeof(struct dir_entry) - 1) /
+                          sizeof(struct dir_entry);
     }
+}
 
-    /* frees both indirect and double indirect tables
-       regardless if they've been allocated and return 
-       resulting pointer */
-    free(indirect_zone_table);
-    free(double_indirect_table);
-    return res;
+/* gives back the iterator's buffers */
+void dir_iter_close(struct dir_iter *it){
+    arena_put_table(it->arena, it->buf, it->geom.zone_size);
+    arena_put_table(it->arena, it->table, it->geom.zone_size);
+    arena_put_table(it->arena, it->double_table, it->geom.zone_size);
+    it->buf = NULL;
+    it->table = NULL;
+    it->double_table = NULL;
 }
 
 /* given the start position of the disk and the image file,
    returns an allocated struct of the superblock if it is valid,
    otherwise it errors and returns NULL*/
-struct superblock *get_superblock(FILE *image, off_t disk_start, int isV){
+struct superblock *get_superblock(int image, off_t disk_start, int isV){
     struct superblock *super;
 
-    /* set file ptr to start of disk plus the offset to
-       the superblock to get ready to read it */  
-    if(fseek(image, disk_start + SUPEROFF, SEEK_SET) < 0){
-        perror(FILEERR);
-        return NULL;
-    }
-
     /* allocate struct for superblock */
     super = (struct superblock*) malloc(sizeof(struct superblock));
     if(super == NULL){
@@ -224,9 +463,12 @@ struct superblock *get_superblock(FILE *image, off_t disk_start, int isV){
         return NULL;
     }
 
-    /* read superblock from image */
-    if(fread((void*)super, sizeof(struct superblock), NUM_SUP, image) <= 0){
+    /* read superblock from start of disk plus
+       the offset to the superblock */
+    if(cimg_pread(image, super, sizeof(struct superblock) * NUM_SUP,
+             disk_start + SUPEROFF) != sizeof(struct superblock) * NUM_SUP){
         perror(READERR);
+        free(super);
         return NULL;
     }
 
@@ -264,24 +506,90 @@ off_t get_inode_table_start(struct superblock *super, off_t disk_start){
 }
 
 
+/* given the superblock and start of disk, reads
+   and returns an allocated copy of the whole inode table.
+   The copy comes from "arena" when one is given,
+   otherwise the caller frees it.
+   On error returns NULL */
+struct inode *get_inode_table(int image,
+                              struct superblock *super,
+                              off_t disk_start,
+                              struct arena *arena){
+    struct inode *inode_table;
+    size_t table_size = sizeof(struct inode) * super->ninodes;
+
+    inode_table = op_alloc(arena, table_size);
+    if(inode_table == NULL){
+        perror(MALLOCERR);
+        return NULL;
+    }
+    if(cimg_pread(image, inode_table, table_size,
+             get_inode_table_start(super, disk_start)) != (ssize_t)table_size){
+        perror(READERR);
+        op_free(arena, inode_table);
+        return NULL;
+    }
+    return inode_table;
+}
+
+/* reads the single inode numbered "ino" into "res"
+   without reading the rest of the inode table */
+int get_inode(int image,
+              struct superblock *super,
+              off_t disk_start,
+              uint32_t ino,
+              struct inode *res){
+    if(ino == 0 || ino > super->ninodes){
+        perror(INODEERR);
+        return EXIT_FAILURE;
+    }
+    if(cimg_pread(image, res, sizeof(struct inode),
+             get_inode_table_start(super, disk_start) +
+             (off_t)sizeof(struct inode) * (ino - 1))
+             != sizeof(struct inode)){
+        perror(READERR);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+
 /* given a path to a file in a MINIX file system
    given by the image file and start of disk, 
    starting from the root search through the
    directories of the path given and populate
    the "res" buffer with the inode representing
-   that file */
+   that file.
+   Only the inodes along the path are read, and each
+   directory only up to the zone its entry is found in.
+   Directory buffers come from "arena" when one is given
+   and are given back as soon as each one has been searched */
 int find_file(char *path, 
-              FILE *image, 
+              int image, 
               off_t disk_start,
               struct inode *res, 
-              int isV){
+              int isV,
+              struct arena *arena){
+    return find_inode(path, image, disk_start, res, NULL, isV, arena);
+}
+
+/* "find_file" that also sets "ino" to the inode
+   number found, when "ino" isn't NULL */
+int find_inode(char *path,
+               int image,
+               off_t disk_start,
+               struct inode *res,
+               uint32_t *ino,
+               int isV,
+               struct arena *arena){
     struct superblock *super;
-    struct inode *inode_table, *cur_inode;
+    struct inode cur_inode;
     struct dir_entry *entry;
-    off_t inode_offset, token_len;
-    void *file_zones;
-    int potential_dir_entries, i, found_entry;
-    char *token;
+    struct dir_iter iter;
+    off_t token_len;
+    int found_entry;
+    uint32_t cur_ino = 1;
+    char *token, *save;
 
     /* invalid usage */
     if(res == NULL) return EXIT_FAILURE;
@@ -292,42 +600,24 @@ int find_file(char *path,
         return EXIT_FAILURE;
     }
 
-    /* get inode table offset from superblock
-       then read it to getinode table */
-    inode_offset = get_inode_table_start(super, disk_start);
-    inode_table = malloc(sizeof(struct inode) * super->ninodes);
-    if(inode_table == NULL){
-        perror(MALLOCERR);
-        free(super);
-        return EXIT_FAILURE;
-    }
-    if(fseek(image, inode_offset, SEEK_SET) < 0){
-        perror(FILEERR);
-        free(super);
-        return EXIT_FAILURE;
-    }
-    if(fread((void*)inode_table, 
-             sizeof(struct inode), 
-             super->ninodes, image) <= 0){
-        perror(READERR);
-        free(super);
-        return EXIT_FAILURE;
-    }
-
     /* initialize 1st inode as root,
        since that is how we will always 
        start from */
-    cur_inode = inode_table;
+    if(get_inode(image, super, disk_start, 1, &cur_inode) == EXIT_FAILURE){
+        free(super);
+        return EXIT_FAILURE;
+    }
 
     /* search through each token/dir in path
        until the last token is found, erroring
-       otherwise */
-    token = strtok(path, PATH_DELIM);
+       otherwise. strtok_r keeps lookups on
+       different threads apart */
+    token = strtok_r(path, PATH_DELIM, &save);
     while(token != NULL){
         /* extra slash case, so go onto next token*/
         token_len = strlen(token);
         if(token_len == 0){
-            token = strtok(NULL, PATH_DELIM);
+            token = strtok_r(NULL, PATH_DELIM, &save);
             continue;
         }
 
@@ -336,81 +626,214 @@ int find_file(char *path,
         if(token_len > NAME_SIZE){
             perror(NAMEERR);
             free(super);
-            free(inode_table);
             return EXIT_FAILURE;
         }
 
         /* check if cur_inode is a DIR to continue search */
-        if((cur_inode->mode & FILE_TYPE_MASK) != DIR_MASK){
+        if((cur_inode.mode & FILE_TYPE_MASK) != DIR_MASK){
             perror(DIRERR);
             free(super);
-            free(inode_table);
             return EXIT_FAILURE;
         }
 
-        /* read current file/inode, knowing it is a DIR*/
-        file_zones = read_file(image, cur_inode, super, disk_start);
-        if(file_zones == NULL){
+        /* walk current file/inode, knowing it is a DIR*/
+        if(dir_iter_open(&iter, image, &cur_inode, super,
+                         disk_start, arena) == EXIT_FAILURE){
             free(super);
-            free(inode_table);
             return EXIT_FAILURE;
         }
 
         /* start searching through each DIR entry and check if the name
-           is the same as the token*/
-        potential_dir_entries = (cur_inode->size + 
-                                    sizeof(struct dir_entry) - 1 ) /  
-                                    sizeof(struct dir_entry);
+           is the same as the token, deleted ones are never returned */
         found_entry = FALSE;
-        for(i = 0; i < potential_dir_entries; i++){
-            entry = (struct dir_entry*)((intptr_t)file_zones +
-                     (sizeof(struct dir_entry) * i));
-
-            /* deleted file*/
-            if(entry->inode == 0){
-                continue;
-            }
-            
+        while((entry = dir_iter_next(&iter)) != NULL){
             /* inode that is too large */
             if(entry->inode > super->ninodes){
                 perror(INODEERR);
-                free(file_zones);
+                dir_iter_close(&iter);
                 free(super);
-                free(inode_table);
                 return EXIT_FAILURE;
 
             }
 
             /* inode with same name as token */
             if (strncmp(token, (char*)entry->name, NAME_SIZE) == 0) {
-                cur_inode = (struct inode*)((intptr_t)inode_table + 
-                        sizeof(struct inode) * (entry->inode - 1));
-                found_entry = TRUE;
-                free(file_zones);
+                found_entry = get_inode(image, super, disk_start,
+                                        entry->inode, &cur_inode)
+                                        == EXIT_SUCCESS;
+                if(!found_entry){
+                    dir_iter_close(&iter);
+                    free(super);
+                    return EXIT_FAILURE;
+                }
+                cur_ino = entry->inode;
                 break;
             }
         }
 
+        /* the directory is done with either way */
+        dir_iter_close(&iter);
+        if(iter.failed){
+            free(super);
+            return EXIT_FAILURE;
+        }
+
         /* after search, if a file in the path
            hasn't been found, error*/
         if(!found_entry){
             perror(FILENOTFOUNDERR);
-            free(file_zones);
             free(super);
-            free(inode_table);
             return EXIT_FAILURE;
         }
-        token = strtok(NULL, PATH_DELIM);
+        token = strtok_r(NULL, PATH_DELIM, &save);
     }
 
     /* sets result to res and print out verbose option*/
     if(isV){
-        print_inode(*cur_inode);
+        print_inode(cur_inode);
+    }
+    *res = cur_inode;
+    if(ino != NULL){
+        *ino = cur_ino;
     }
-    *res = *cur_inode;
 
     free(super);
-    free(inode_table);
+    return EXIT_SUCCESS;
+}
+
+/* Prints the given file to "out" in "[permissions] [size] [filename]" format. 
+ * Assumes filename is null terminated */
+void print_reg_file(FILE *out, struct inode *file, char *name) {
+    char perms[MODE_PRINT_SIZE];
+    char size[SIZE_PRINT_SIZE];
+    char name_buf[NAME_SIZE];
+    uint32_t file_size;
+    perms_print(file->mode, perms);
+    memset((void*)size, 0, SIZE_PRINT_SIZE);
+
+    file_size = file->size;
+    sprintf(size, "%9u", file_size);
+
+    /* only copies the 1st 60 characters of name 
+       since filenames are not NULL terminated
+       sometimes */
+    strncpy(name_buf, name, NAME_SIZE);
+    if(name_buf[0] == SLASH){
+        fprintf(out, REG_FILE_PRINT, perms, size, &(name[1]));
+    }else{
+        fprintf(out, REG_FILE_PRINT, perms, size, name);
+    }
+}
+
+/* given the inode table and all entries in a directory,
+   prints out the information of each inode in the directory
+   to "out" */
+void print_dir(FILE *out,
+               struct dir_entry *dir_data, 
+               struct inode *inode_table,
+               off_t num_entries, 
+               char *name){
+    int i;
+    struct dir_entry *cur_entry;
+    struct inode *cur_inode;
+    fprintf(out, DIR_PRINT, name);
+
+    /* iterates through DIR entries to get inode number,
+       finds the inode in the inode table,
+       then prints out the information if
+       it is a regular file or directory */
+    for(i = 0; i < num_entries; i++){
+        
+        /* get inode number*/
+        cur_entry = (struct dir_entry*)((intptr_t)dir_data +
+                     (sizeof(struct dir_entry) * i));
+
+        /* deleted file */
+        if(cur_entry->inode == 0) continue;
+
+        /* get inode from inode table */
+        cur_inode = (struct inode*)( (intptr_t)inode_table + 
+                     sizeof(struct inode) * (cur_entry->inode - 1));
+        
+        /* print out information only if it is a regular
+           file or directory, as we aren't printing out
+           all entries in subdirectories */
+        if(((cur_inode->mode & FILE_TYPE_MASK) == REG_MASK) ||
+           ((cur_inode->mode & FILE_TYPE_MASK) == DIR_MASK)){
+            print_reg_file(out, cur_inode, (char*)cur_entry->name);
+        }
+    }
+}
+
+/* TRUE if entry name "name" can be joined onto a host
+   path as one component, it can't be empty or hold a
+   slash that would lead out of the directory */
+int name_is_safe(char *name){
+    return name[0] != '\0' && strchr(name, SLASH) == NULL;
+}
+
+/* reads until "len" bytes or the end of the input,
+   pipes hand data over in smaller pieces. Returns the
+   bytes read or -1 */
+ssize_t read_full(int fd, void *buf, size_t len){
+    size_t done = 0;
+    ssize_t got;
+
+    while(done < len){
+        got = read(fd, (char*)buf + done, len - done);
+        if(got < 0 && errno == EINTR) continue;
+        if(got < 0) return -1;
+        if(got == 0) break;
+        done += got;
+    }
+    return done;
+}
+
+/* TRUE if every byte of "buf" is 0 */
+int is_zero(unsigned char *buf, size_t len){
+    return len == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0);
+}
+
+/* Removes duplicate slashes, adds slash at 
+ * beginning and removes slash from end */
+int canonicalizer(char *original) {
+    int i = 0, j = 0, length;
+    char *copy, prev;
+    length = strlen(original);
+    copy = (char*)calloc(length + 2, sizeof(char));
+    if(copy == NULL){
+        perror(MALLOCERR);
+        return EXIT_FAILURE;
+    }
+    
+    /* ensure copy starts with a slash
+       and both strings start at a point
+       without a slash */
+    copy[j++] = SLASH;
+    if (original[i] == SLASH) {
+        i++;
+    } 
+    
+    /* copy one char at a time, dont copy if its a repeated slash */ 
+    prev = SLASH;
+    while (i < length) {
+        /* only copies character if neither the previous
+           or current character equal slash, therefore 
+           only adding one slash per series of slashes*/
+        if(original[i] != SLASH || prev != SLASH){
+            prev = copy[j++] = original[i];
+        }
+        i++;
+    }
+    
+    /* Remove slash if there, and add null term. */
+    if (j > 1 && copy[j - 1] == SLASH) {
+        j--;
+    }
+    copy[j] = '\0';
+
+    strncpy(original, copy, j + 1);
+    free(copy);
     return EXIT_SUCCESS;
 }
 
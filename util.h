@@ -1,3 +1,6 @@
+#ifndef UTIL_H
+#define UTIL_H
+
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -6,6 +9,7 @@
 #include <string.h>
 #include <time.h>
 #include "partition.h"
+#include "arena.h"
 
 #define SUPMAGIC 0x4D5A
 #define SUPEROFF 1024
@@ -14,6 +18,7 @@
 #define NUM_PART 4
 #define DIRECT_ZONES 7
 #define MODE_PRINT_SIZE 12
+#define SIZE_PRINT_SIZE 10
 #define NAME_SIZE 60
 #define FIRST_BLOCKS 2
 #define MALLOCERR "Malloc error"
@@ -26,7 +31,9 @@
 #define TOOBIG "File has a size greater than the max possible size"
 #define FILENOTFOUNDERR "File couldn't be found"
 #define NAMEERR "File name is too long in path"
+#define UNSAFEERR "skipping entry whose name is empty or has a slash"
 #define NO_PART -1
+#define NO_SHIFT 0xFFFFFFFF
 
 #define SUB_PART_PRINT "Subparition table %d: \n"
 #define PART_PRINT "partion table:\n"
@@ -42,8 +49,10 @@
 #define ZONE_NAME "%s zones:\n"
 #define INODE_NAME "File inode:\n"
 #define PATH_DELIM "/"
+#define SLASH '/'
 #define NEW_LINE "\n"
 #define REG_FILE_PRINT "%s %s %s\n"
+#define DIR_PRINT "%s:\n"
 
 #define TYPE_INVAL "Invalid partition type\n"
 #define SIZE_INVAL "Invalid partition size\n"
@@ -119,11 +128,70 @@ struct dir_entry {
     unsigned char name[60];
 };
 
-int read_zone(FILE *, off_t, uint32_t, uint32_t, void*);
-void *read_file(FILE *, struct inode *, struct superblock *, off_t);
-struct superblock *get_superblock(FILE *, off_t, int);
+/* how zone numbers are laid out for one block and zone size,
+   picked once per file system by "geom_select". "resolve" is
+   a kernel specialized for the block size when there is one */
+struct zone_geom {
+    uint32_t zone_size;
+    uint32_t zone_shift; /* log2 of zone_size, or NO_SHIFT */
+    uint32_t per_table;  /* zone numbers in one indirect table */
+    uint32_t max_file;
+    int (*resolve)(int, struct inode *, off_t, struct zone_geom *,
+                   uint32_t, uint32_t *, uint32_t *, uint32_t *);
+};
+
+/* walks the entries of one directory a zone at a time, so
+   only one zone and the indirect tables leading to it are
+   ever held. "failed" tells an error apart from the end */
+struct dir_iter {
+    int image;
+    off_t disk_start;
+    struct inode node;
+    struct zone_geom geom;
+    struct arena *arena;
+    uint32_t next_zone;    /* index in the file of the zone to read next */
+    uint32_t num_zones;
+    uint32_t remaining;    /* bytes of the directory not read yet */
+    struct dir_entry *buf; /* entries of the zone being walked */
+    uint32_t num_entries;
+    uint32_t next_entry;
+    uint32_t *table;       /* indirect table holding the next zone */
+    uint32_t table_zone;   /* zone "table" was read from, 0 if none */
+    uint32_t *double_table;
+    int has_double;        /* if "double_table" has been read */
+    int failed;
+};
+
+int read_zone(int, off_t, uint32_t, uint32_t, void*);
+void *read_file(int, struct inode *, struct superblock *, off_t,
+                struct arena *);
+struct superblock *get_superblock(int, off_t, int);
 off_t get_inode_table_start(struct superblock *, off_t);
-int find_file(char *, FILE *, off_t , struct inode *, int);
+struct inode *get_inode_table(int, struct superblock *, off_t,
+                              struct arena *);
+int get_inode(int, struct superblock *, off_t, uint32_t, struct inode *);
+void geom_select(struct superblock *, struct zone_geom *);
+uint32_t geom_zone_count(struct zone_geom *, uint32_t);
+uint32_t next_run(uint32_t *, uint32_t, uint32_t, uint32_t);
+uint32_t *resolve_zones(int, struct inode *, off_t, struct zone_geom *,
+                        uint32_t *, struct arena *);
+uint32_t *get_zone_list(int, struct inode *, struct superblock *,
+                        off_t, uint32_t *, struct arena *);
+int dir_iter_open(struct dir_iter *, int, struct inode *,
+                  struct superblock *, off_t, struct arena *);
+struct dir_entry *dir_iter_next(struct dir_iter *);
+void dir_iter_close(struct dir_iter *);
+int find_file(char *, int, off_t , struct inode *, int, struct arena *);
+int find_inode(char *, int, off_t, struct inode *, uint32_t *, int,
+               struct arena *);
+void print_reg_file(FILE *, struct inode *, char *);
+void print_dir(FILE *, struct dir_entry *, struct inode *, off_t, char *);
+int canonicalizer(char *);
+int name_is_safe(char *);
+ssize_t read_full(int, void *, size_t);
+int is_zero(unsigned char *, size_t);
 void print_superblock(struct superblock *);
 void print_inode(struct inode);
-void perms_print(uint16_t, char *);
\ No newline at end of file
+void perms_print(uint16_t, char *);
+
+#endif